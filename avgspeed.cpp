@@ -6,7 +6,7 @@
  *  Copyright 2009 Delft University of Technology. All rights reserved.
  *
  */
-#include "avgspeed.h"
+#include "swift.h"
 
 using namespace swift;
 
@@ -14,7 +14,8 @@ MovingAverageSpeed::MovingAverageSpeed(tint speed_interval, tint fudge)
 {
     speed_interval_ = speed_interval;
     fudge_ = fudge;
-	t_start_ = usec_time() - fudge_;
+	// Fresh read: may be created before the event loop ran
+	t_start_ = Channel::Time() - fudge_;
 	t_end_ = t_start_;
 	speed_ = 0.0;
 	resetstate_ = false;
@@ -27,14 +28,15 @@ void MovingAverageSpeed::AddPoint(uint64_t amount)
 	// points for a few seconds after the reset, to accomodate the case
 	// of going from high speed to low speed and content still coming in.
 	//
+	// Called per datagram, so use the clock cached by the event loop
+	tint t = NOW;
 	if (resetstate_) {
-		if ((t_start_ + speed_interval_/2) > usec_time()) {
+		if ((t_start_ + speed_interval_/2) > t) {
 			return;
 		}
 		resetstate_ = false;
 	}
 
-    tint t = usec_time();
     speed_ = (speed_ * ((double)(t_end_ - t_start_)/((double)TINT_SEC)) + (double)amount) / ((t - t_start_)/((double)TINT_SEC) + 0.0001);
     t_end_ = t;
     if (t_start_ < t - speed_interval_)
@@ -58,7 +60,7 @@ double MovingAverageSpeed::GetSpeedNeutral()
 void MovingAverageSpeed::Reset()
 {
 	resetstate_ = true;
-	t_start_ = usec_time() - fudge_;
+	t_start_ = Channel::Time() - fudge_;
 	t_end_ = t_start_;
 	speed_ = 0.0;
 }
@@ -30,6 +30,42 @@ inline int gen_peaks(uint64_t length, bin_t * peaks) {
 }
 
 
+/**
+ * Index of the highest set bit of v (v != 0)
+ */
+inline int bin_highest_bit(uint64_t v) {
+#ifdef __GNUC__
+    return 63 - __builtin_clzll(v);
+#else
+    int r = 0;
+    for (int s = 32; s; s >>= 1) {
+        if (v >> s) {
+            v >>= s;
+            r += s;
+        }
+    }
+    return r;
+#endif
+}
+
+
+/**
+ * Finding the peak bin containing pos for the given length, in O(1).
+ * Same as searching gen_peaks(length): the peak for a chunk offset is
+ * at the highest bit where offset and length differ.
+ */
+inline bin_t peak_for_length(uint64_t length, const bin_t & pos) {
+    if (pos.is_all() || pos.is_none())
+        return bin_t::NONE;
+    const uint64_t offset = pos.base_offset();
+    if (offset >= length)
+        return bin_t::NONE;
+    const int layer = bin_highest_bit(length ^ offset);
+    const bin_t peak(layer, offset >> layer);
+    return peak.contains(pos) ? peak : bin_t::NONE;
+}
+
+
 /**
  * Checking for that the bin value is fit to uint32_t
  */
@@ -769,44 +769,39 @@ bin_t binmap_t::find_empty(bin_t start) const
 
 	if (is_empty(cur_bin))
 		return cur_bin;
-	do
+	if (is_filled(cur_bin))
 	{
-		// Move up till we find ancestor that is not filled.
-		cur_bin = cur_bin.parent();
-		if (!is_filled(cur_bin))
+		// Move up till we find an ancestor whose right child is right of
+		// start and not filled. Holes left of start don't count.
+		do
 		{
-			// Ancestor is not filled
-			break;
-		}
-		if (cur_bin == root_bin_)
-		{
-			// Hit top, full tree, sort of. For some reason root_bin_ not
-			// set to real top (but to ALL), so we may actually return a
-			// bin that is outside the size of the content here.
-			return bin_t::NONE;
+			if (cur_bin == root_bin_ || cur_bin.is_all())
+			{
+				// Hit top, full tree, sort of. For some reason root_bin_ not
+				// set to real top (but to ALL), so we may actually return a
+				// bin that is outside the size of the content here.
+				return bin_t::NONE;
+			}
+			bool isleft = cur_bin.is_left();
+			cur_bin.to_parent();
+			if (isleft && !is_filled(cur_bin.right()))
+			{
+				cur_bin.to_right();
+				break;
+			}
 		}
+		while (true);
 	}
-	while (true);
 
-	// Move down
-	do
+	// Move down to leftmost empty base bin
+	while (!cur_bin.is_base())
 	{
 		if (!is_filled(cur_bin.left()))
-		{
 			cur_bin.to_left();
-		}
-		else if (!is_filled(cur_bin.right()))
-		{
+		else
 			cur_bin.to_right();
-		}
-		if (cur_bin.is_base())
-		{
-			// Found empty bin
-			return cur_bin;
-		}
-	} while(!cur_bin.is_base()); // safety catch
-
-	return bin_t::NONE;
+	}
+	return cur_bin;
 }
 
 
@@ -1483,6 +1478,31 @@ void binmap_t::clear()
 }
 
 
+/**
+ * Repack the cells. Cells are never given back on reset, so a binmap
+ * that was once fragmented keeps its largest buffer otherwise.
+ */
+void binmap_t::compact()
+{
+    if (allocated_cells_number_ * 2 > cells_number_) {
+        return;
+    }
+
+    binmap_t packed;
+    copy(packed, *this);
+    if (packed.cells_number_ >= cells_number_) {
+        return;
+    }
+
+    cell_t* const cell = cell_;
+    cell_ = packed.cell_;
+    packed.cell_ = cell;
+    cells_number_ = packed.cells_number_;
+    allocated_cells_number_ = packed.allocated_cells_number_;
+    free_top_ = packed.free_top_;
+}
+
+
 /**
  * Fill the binmap. Creates a new filled binmap. Size is given by the source root
  */
@@ -2183,3 +2203,63 @@ int binmap_t::deserialize(FILE *fp)
 	 }
 	 return 0;
 }
+
+
+/* Header of the binary image, followed by cells_number cells */
+typedef struct {
+    uint64_t root_bin;
+    uint64_t cells_number;
+    uint64_t allocated_cells_number;
+    uint32_t free_top;
+    uint32_t cell_size;
+} image_header_t;
+
+
+size_t binmap_t::image_size() const
+{
+    return sizeof(image_header_t) + cells_number_ * sizeof(cell_t);
+}
+
+
+void binmap_t::write_image(char* buf) const
+{
+    image_header_t hdr;
+    hdr.root_bin = root_bin_.toUInt();
+    hdr.cells_number = cells_number_;
+    hdr.allocated_cells_number = allocated_cells_number_;
+    hdr.free_top = free_top_;
+    hdr.cell_size = sizeof(cell_t);
+    memcpy(buf, &hdr, sizeof(hdr));
+    memcpy(buf + sizeof(hdr), cell_, cells_number_ * sizeof(cell_t));
+}
+
+
+int binmap_t::read_image(const char* buf, size_t len)
+{
+    image_header_t hdr;
+    if (len < sizeof(hdr)) {
+        return -1;
+    }
+    memcpy(&hdr, buf, sizeof(hdr));
+    if (hdr.cell_size != sizeof(cell_t) || hdr.cells_number == 0 ||
+        hdr.cells_number > static_cast<ref_t>(-1) ||
+        hdr.allocated_cells_number > hdr.cells_number ||
+        hdr.free_top > hdr.cells_number ||
+        (len - sizeof(hdr)) / sizeof(cell_t) < hdr.cells_number) {
+        return -1;
+    }
+
+    cell_t* const cell = static_cast<cell_t*>(malloc(hdr.cells_number * sizeof(cell_t)));
+    if (cell == NULL) {
+        return -1;
+    }
+    memcpy(cell, buf + sizeof(hdr), hdr.cells_number * sizeof(cell_t));
+
+    free(cell_);
+    cell_ = cell;
+    cells_number_ = hdr.cells_number;
+    allocated_cells_number_ = hdr.allocated_cells_number;
+    free_top_ = hdr.free_top;
+    root_bin_ = bin_t(hdr.root_bin);
+    return 0;
+}
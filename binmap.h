@@ -49,6 +49,12 @@ public:
     void clear();
 
 
+    /**
+     * Repack the cells into the smallest buffer that holds them
+     */
+    void compact();
+
+
     /**
      * Ric: Fill all bins, size is given by the source's root
      */
@@ -146,6 +152,25 @@ public:
     // Arno, 2011-10-20: Persistent storage
     int serialize(FILE *fp);
     int deserialize(FILE *fp);
+
+
+    /**
+     * Size of the binary image: a fixed header and the raw cells
+     */
+    size_t image_size() const;
+
+
+    /**
+     * Write the binary image to buf, which holds image_size() bytes
+     */
+    void write_image(char* buf) const;
+
+
+    /**
+     * Load a binary image with a single copy of the cells. Returns -1 if
+     * it is truncated or from a build with another cell layout.
+     */
+    int read_image(const char* buf, size_t len);
 private:
     #pragma pack(push, 1)
 
@@ -27,19 +27,27 @@ tint Channel::epoch = now_t::now/360000000LL*360000000LL; // make logs mergeable
 uint64_t Channel::global_dgrams_up=0, Channel::global_dgrams_down=0,
          Channel::global_raw_bytes_up=0, Channel::global_raw_bytes_down=0,
          Channel::global_bytes_up=0, Channel::global_bytes_down=0;
+LatencyHistogram Channel::send_latency, Channel::recv_latency,
+         Channel::read_latency, Channel::verify_latency, Channel::timer_lateness;
 sckrwecb_t Channel::sock_open[] = {};
 int Channel::sock_count = 0;
 swift::tint Channel::last_tick = 0;
 int Channel::MAX_REORDERING = 4;
+int Channel::ACK_AGGREGATE_MAX = 8;
+swift::tint Channel::ACK_DELAY = TINT_MSEC*10;
 bool Channel::SELF_CONN_OK = false;
 swift::tint Channel::TIMEOUT = TINT_SEC*60;
 channels_t Channel::channels(1);
 Address Channel::tracker;
 //tbheap Channel::send_queue;
+tbheap Channel::keepalive_queue;
+struct event Channel::evkeepalive;
 FILE* Channel::debug_file = NULL;
 #include "ext/simple_selector.cpp"
 //PeerSelector* Channel::peer_selector = new SimpleSelector();
 tint Channel::MIN_PEX_REQUEST_INTERVAL = TINT_SEC;
+Channel::sendto_hook_t Channel::sendto_hook = NULL;
+Channel::recvfrom_hook_t Channel::recvfrom_hook = NULL;
 
 
 /*
@@ -48,43 +56,43 @@ tint Channel::MIN_PEX_REQUEST_INTERVAL = TINT_SEC;
 
 Channel::Channel    (FileTransfer* transfer, int socket, Address peer_addr) :
 	// Arno, 2011-10-03: Reordered to avoid g++ Wall warning
-	peer_(peer_addr), socket_(socket==INVALID_SOCKET?default_socket():socket), // FIXME
-    transfer_(transfer), peer_channel_id_(0), own_id_mentioned_(false),
-    data_in_(TINT_NEVER,bin_t::NONE), data_in_dbl_(bin_t::NONE),
-    data_out_cap_(bin_t::ALL),hint_out_size_(0),
-    // Gertjan fix 996e21e8abfc7d88db3f3f8158f2a2c4fc8a8d3f
-    // "Changed PEX rate limiting to per channel limiting"
-    last_pex_request_time_(0), next_pex_request_time_(0),
-    pex_request_outstanding_(false), pex_requested_(false),  // Ric: init var that wasn't initialiazed
-    useless_pex_count_(0),
+	peer_channel_id_(0), socket_(socket==INVALID_SOCKET?default_socket():socket), // FIXME
+    own_id_mentioned_(false),
+    lastrecvwaskeepalive_(false), lastsendwaskeepalive_(false), // Arno: nap bug fix
+    direct_sending_(false), transfer_(transfer), peer_(peer_addr),
+    send_control_(PING_PONG_CONTROL), sent_since_recv_(0), cwnd_(1),
+    cwnd_count1_(0), send_interval_(TINT_SEC),
     rtt_avg_(TINT_SEC), dev_avg_(0), dip_avg_(TINT_SEC),
     last_send_time_(0), last_recv_time_(0), last_data_out_time_(0), last_data_in_time_(0),
-    last_loss_time_(0), next_send_time_(0), open_time_(NOW), cwnd_(1),
-    cwnd_count1_(0), send_interval_(TINT_SEC),
-    send_control_(PING_PONG_CONTROL), sent_since_recv_(0),
-    lastrecvwaskeepalive_(false), lastsendwaskeepalive_(false), // Arno: nap bug fix
-    ack_rcvd_recent_(0),
-    ack_not_rcvd_recent_(0), owd_min_bin_(0), owd_min_bin_start_(NOW),
-    owd_cur_bin_(0), dgrams_sent_(0), dgrams_rcvd_(0),
+    next_send_time_(0), ack_rcvd_recent_(0), ack_not_rcvd_recent_(0),
+    hint_out_size_(0), data_in_(TINT_NEVER,bin_t::NONE), data_in_dbl_(bin_t::NONE),
+    data_out_cap_(bin_t::ALL), dgrams_sent_(0), dgrams_rcvd_(0),
     raw_bytes_up_(0), raw_bytes_down_(0), bytes_up_(0), bytes_down_(0),
-    scheduled4close_(false),
-	direct_sending_(false)
+    act_(new active_t()), idle_(NULL),
+    cap_in_(0), have_out_offset_(0), have_out_synced_(false),
+    have_bitmap_offset_(0), have_bitmap_done_(false), live_peaks_out_(0),
+    // Gertjan fix 996e21e8abfc7d88db3f3f8158f2a2c4fc8a8d3f
+    // "Changed PEX rate limiting to per channel limiting"
+    pex_requested_(false),  // Ric: init var that wasn't initialiazed
+    last_pex_request_time_(0), next_pex_request_time_(0),
+    pex_request_outstanding_(false), useless_pex_count_(0),
+    last_loss_time_(0), open_time_(NOW),
+    retransmits_(0), hash_fails_(0), peer_complete_(false),
+    scheduled4close_(false)
 {
     if (peer_==Address())
         peer_ = tracker;
     this->id_ = channels.size();
     channels.push_back(this);
     transfer_->hs_in_.push_back(bin_t(id_));
-    for(int i=0; i<4; i++) {
-        owd_min_bins_[i] = TINT_NEVER;
-        owd_current_[i] = TINT_NEVER;
-    }
     evsend_ptr_ = new struct event;
     evtimer_assign(evsend_ptr_,evbase,&Channel::LibeventSendCallback,this);
     evtimer_add(evsend_ptr_,tint2tv(next_send_time_));
 
     // RATELIMIT
 	transfer->mychannels_.push_back(this);
+	rate_bucket_[DDIR_UPLOAD].SetParent(transfer->GetRateBucket(DDIR_UPLOAD));
+	rate_bucket_[DDIR_DOWNLOAD].SetParent(transfer->GetRateBucket(DDIR_DOWNLOAD));
 
 	dprintf("%s #%u init channel %s transfer %d\n",tintstr(),id_,peer_.str(), transfer_->fd() );
 	//fprintf(stderr,"new Channel %d %s\n", id_, peer_.str() );
@@ -95,6 +103,8 @@ Channel::~Channel () {
 	dprintf("%s #%u dealloc channel\n",tintstr(),id_);
     channels[id_] = NULL;
     ClearEvents();
+    delete act_;
+    delete idle_;
 
     // RATELIMIT
     if (transfer_ != NULL)
@@ -106,6 +116,8 @@ Channel::~Channel () {
 				break;
 		}
     	transfer_->mychannels_.erase(iter);
+    	if (peer_complete_)
+    		transfer_->numseeders_--;
     }
 }
 
@@ -130,13 +142,133 @@ bool Channel::IsComplete() {
 
     for(int i=0; i<hashtree()->peak_count(); i++) {
         bin_t peak = hashtree()->peak(i);
-        if (!ack_in_.is_filled(peak))
+        if (!IsAcked(peak))
             return false;
     }
  	return true;
 }
 
 
+bool Channel::IsAcked(bin_t pos) {
+    if (act_ != NULL)
+        return act_->ack_in_.is_filled(pos);
+    // The summary has the largest filled bins, one contains pos if acked
+    for (uint32_t i=0; idle_ != NULL && i<idle_->ack_in_count_; i++)
+        if (idle_->bins_[i].contains(pos))
+            return true;
+    return false;
+}
+
+
+
+void Channel::UpdatePeerComplete() {
+	// ack_in_ only grows, so once complete stays complete. Before the
+	// peaks are known IsComplete() is false; FileTransfer recounts then.
+	if (peer_complete_ || hashtree()->peak_count() != transfer().numseeders_peaks_)
+		return;
+	if (IsComplete()) {
+		peer_complete_ = true;
+		transfer().numseeders_++;
+	}
+}
+
+
+Channel::active_t::active_t () : owd_min_bin_(0), owd_min_bin_start_(NOW),
+    owd_cur_bin_(0)
+{
+    for(int i=0; i<4; i++) {
+        owd_min_bins_[i] = TINT_NEVER;
+        owd_current_[i] = TINT_NEVER;
+    }
+}
+
+
+/** Appends the largest filled bins of bm within pos to bins, in order.
+ *  Returns false when that takes more than max_bins. */
+static bool FilledBins(const binmap_t &bm, bin_t pos, std::vector<bin_t> &bins, size_t max_bins) {
+    if (bm.is_empty(pos))
+        return true;
+    if (bm.is_filled(pos)) {
+        bins.push_back(pos);
+        return bins.size() <= max_bins;
+    }
+    return FilledBins(bm,pos.left(),bins,max_bins) && FilledBins(bm,pos.right(),bins,max_bins);
+}
+
+
+void Channel::Reactivate() {
+    act_ = new active_t();
+    if (idle_ != NULL) {
+        for (uint32_t i=0; i<idle_->bins_.size(); i++) {
+            if (i < idle_->ack_in_count_)
+                act_->ack_in_.set(idle_->bins_[i]);
+            else
+                act_->have_out_.set(idle_->bins_[i]);
+        }
+        delete idle_;
+        idle_ = NULL;
+    }
+    // A closed channel gets no timer back
+    if (evsend_ptr_ == NULL && send_control_ != CLOSE_CONTROL) {
+        evsend_ptr_ = new struct event;
+        evtimer_assign(evsend_ptr_,evbase,&Channel::LibeventSendCallback,this);
+    }
+}
+
+
+void Channel::Deflate() {
+    if (act_==NULL || send_control_!=KEEP_ALIVE_CONTROL)
+        return;
+    if (last_data_out_time_>NOW-IDLE_TIMEOUT || last_data_in_time_>NOW-IDLE_TIMEOUT)
+        return;
+    if (!act_->ack_pending_.empty() || !act_->data_out_.empty() ||
+        !act_->data_out_tmo_.empty() || !act_->hint_in_.empty() ||
+        !act_->hashes_in_.empty() || !act_->reverse_pex_out_.empty())
+        return;
+    // Once complete AddHint is no longer called to expire hints sent
+    if (!act_->hint_out_.empty() && !hashtree()->is_complete())
+        return;
+    // Only if the binmaps' filled bins take less room than the binmaps
+    size_t max_bins = (act_->ack_in_.total_size() + act_->have_out_.total_size()) / sizeof(bin_t);
+    std::vector<bin_t> bins;
+    if (!FilledBins(act_->ack_in_,bin_t::ALL,bins,max_bins))
+        return;
+    uint32_t ack_in_count = bins.size();
+    if (!FilledBins(act_->have_out_,bin_t::ALL,bins,max_bins))
+        return;
+    dprintf("%s #%u lightweight, %u bins\n",tintstr(),id_,(unsigned)bins.size());
+    delete act_;
+    act_ = NULL;
+    hint_out_size_ = 0;
+    idle_ = new idle_t();
+    idle_->bins_.assign(bins.begin(),bins.end());
+    idle_->ack_in_count_ = ack_in_count;
+    // The shared keep-alive timer takes over
+    ClearEvents();
+    ScheduleKeepAlive();
+}
+
+
+size_t Channel::memory_usage() {
+    size_t mem = sizeof(*this);
+    if (act_ != NULL) {
+        mem += sizeof(active_t);
+        mem += act_->ack_pending_.heap_bytes() + act_->data_out_.heap_bytes() +
+               act_->data_out_tmo_.heap_bytes() + act_->hint_in_.heap_bytes() +
+               act_->hint_out_.heap_bytes() + act_->reverse_pex_out_.heap_bytes();
+        mem += act_->hashes_in_.capacity() * sizeof(binhashes_t::value_type);
+        mem += act_->ack_in_.total_size() - sizeof(binmap_t);
+        mem += act_->have_out_.total_size() - sizeof(binmap_t);
+    }
+    if (idle_ != NULL) {
+        // plus its entry in the keep-alive queue
+        mem += sizeof(idle_t) + idle_->bins_.capacity() * sizeof(bin_t) + sizeof(tintbin);
+    }
+    if (evsend_ptr_ != NULL)
+        mem += sizeof(struct event);
+    return mem;
+}
+
 
 uint16_t Channel::GetMyPort() {
 	struct sockaddr_in mysin = {};
@@ -214,10 +346,7 @@ bool Channel::IsDiffSenderOrDuplicate(Address addr, uint32_t chid)
  * Class methods
  */
 tint Channel::Time () {
-    //HiResTimeOfDay* tod = HiResTimeOfDay::Instance();
-    //tint ret = tod->getTimeUSec();
-    //DLOG(INFO)<<"now is "<<ret;
-    return now_t::now = usec_time();
+    return now_t::now = usec_mono_time();
 }
 
 // SOCKMGMT
@@ -264,7 +393,11 @@ Address swift::BoundAddress(evutil_socket_t sock) {
 int Channel::SendTo (evutil_socket_t sock, const Address& addr, struct evbuffer *evb) {
 
     int length = evbuffer_get_length(evb);
-    int r = sendto(sock,(const char *)evbuffer_pullup(evb, length),length,0,
+    int r;
+    if (sendto_hook != NULL)
+    	r = sendto_hook(sock,addr,(const char *)evbuffer_pullup(evb, length),length);
+    else
+    	r = sendto(sock,(const char *)evbuffer_pullup(evb, length),length,0,
                    (struct sockaddr*)&(addr.addr),sizeof(struct sockaddr_in));
     if (r<0) {
         print_error("can't send");
@@ -274,7 +407,6 @@ int Channel::SendTo (evutil_socket_t sock, const Address& addr, struct evbuffer
     	evbuffer_drain(evb,r);
     global_dgrams_up++;
     global_raw_bytes_up+=length;
-    Time();
     return r;
 }
 
@@ -285,7 +417,11 @@ int Channel::RecvFrom (evutil_socket_t sock, Address& addr, struct evbuffer *evb
     	print_error("error on evbuffer_reserve_space");
     	return 0;
     }
-    int length = recvfrom (sock, (char *)vec.iov_base, SWIFT_MAX_RECV_DGRAM_SIZE, 0,
+    int length;
+    if (recvfrom_hook != NULL)
+    	length = recvfrom_hook(sock,addr,(char *)vec.iov_base,SWIFT_MAX_RECV_DGRAM_SIZE);
+    else
+    	length = recvfrom (sock, (char *)vec.iov_base, SWIFT_MAX_RECV_DGRAM_SIZE, 0,
 			   (struct sockaddr*)&(addr.addr), &addrlen);
     if (length<0) {
         length = 0;
@@ -312,7 +448,6 @@ int Channel::RecvFrom (evutil_socket_t sock, Address& addr, struct evbuffer *evb
     }
     global_dgrams_down++;
     global_raw_bytes_down+=length;
-    Time();
     return length;
 }
 
@@ -328,6 +463,8 @@ void Channel::CloseSocket(evutil_socket_t sock) {
 void Channel::Shutdown () {
     while (sock_count--)
         CloseSocket(sock_open[sock_count].sock);
+    if (event_initialized(&evkeepalive))
+        evtimer_del(&evkeepalive);
 }
 
 void     swift::SetTracker(const Address& tracker) {
@@ -443,6 +580,7 @@ int     swift::Listen (Address addr) {
 }
 
 void    swift::Shutdown (int sock_des) {
+    Checkpointer::Stop();
     Channel::Shutdown();
 }
 
@@ -463,9 +601,47 @@ int      swift::Open (std::string filename, const Sha1Hash& roothash, Address tr
 }
 
 
+int      swift::LiveCreate (std::string filename, const Sha1Hash& swarmid, uint64_t window, uint32_t chunk_size) {
+    FileTransfer* ft = new FileTransfer(filename, swarmid, false, true, chunk_size, false, window, true);
+    if (ft->fd() && ft->IsOperational())
+        return ft->fd();
+    delete ft;
+    return -1;
+}
+
+
+int      swift::LiveWrite (int fd, const void *buf, size_t nbyte) {
+    FileTransfer *ft = FileTransfer::file(fd);
+    if (ft == NULL || !ft->IsLive() || !ft->hashtree()->is_complete())
+        return -1;
+    MmapHashTree *ht = (MmapHashTree *)ft->hashtree();
+    uint64_t oldsizec = ht->size_in_chunks();
+    int added = ht->AppendData((char *)buf,nbyte);
+    if (added < 0)
+        return -1;
+    for (uint64_t c=oldsizec; c<oldsizec+added; c++)
+        ft->OnDataIn(bin_t(0,c));
+    return added;
+}
+
+
+int      swift::LiveOpen (std::string filename, const Sha1Hash& swarmid, Address tracker, uint64_t window, uint32_t chunk_size) {
+    FileTransfer* ft = new FileTransfer(filename, swarmid, false, true, chunk_size, false, window, false);
+    if (ft->fd() && ft->IsOperational()) {
+        ft->SetTracker(tracker);
+        ft->ConnectToTracker();
+        return ft->fd();
+    }
+    delete ft;
+    return -1;
+}
+
+
 void    swift::Close (int fd) {
-    if (fd<FileTransfer::files.size() && FileTransfer::files[fd])
+    if (fd<FileTransfer::files.size() && FileTransfer::files[fd]) {
+        Checkpointer::Wait(fd);
         delete FileTransfer::files[fd];
+    }
 }
 
 
@@ -482,6 +658,14 @@ ssize_t  swift::Read(int fdes, void *buf, size_t nbyte, int64_t offset)
         return -1;
 }
 
+ssize_t  swift::ReadToEvbuffer(int fdes, struct evbuffer *evb, size_t nbyte, int64_t offset)
+{
+    if (FileTransfer::files.size()>fdes && FileTransfer::files[fdes])
+        return FileTransfer::files[fdes]->GetStorage()->ReadToEvbuffer(evb,nbyte,offset);
+    else
+        return -1;
+}
+
 ssize_t  swift::Write(int fdes, const void *buf, size_t nbyte, int64_t offset)
 {
     if (FileTransfer::files.size()>fdes && FileTransfer::files[fdes])
@@ -541,40 +725,14 @@ uint32_t	  swift::ChunkSize(int fdes)
 }
 
 
-// CHECKPOINT
-int swift::Checkpoint(int transfer) {
-	// Save transfer's binmap for zero-hashcheck restart
-	FileTransfer *ft = FileTransfer::file(transfer);
-	if (ft == NULL)
-            return -1;
-	if (ft->IsZeroState())
-	    return -1;
-
-    MmapHashTree *ht = (MmapHashTree *)ft->hashtree();
-    if (ht == NULL)
-    {
-         fprintf(stderr,"swift: checkpointing: ht is NULL\n");
-	     return -1;
-    }
-
-	std::string binmap_filename = ft->GetStorage()->GetOSPathName();
-	binmap_filename.append(".mbinmap");
-	//fprintf(stderr,"swift: HACK checkpointing %s at %lli\n", binmap_filename.c_str(), Complete(transfer));
-	FILE *fp = fopen_utf8(binmap_filename.c_str(),"wb");
-	if (!fp) {
-        print_error("cannot open mbinmap for writing");
-        return -1;
-	}
-
-	int ret = ht->serialize(fp);
-  	if (ret < 0)
-        print_error("writing to mbinmap");
-	fclose(fp);
-	return ret;
+// SEEK
+static bin_t OffsetToBin(FileTransfer *ft, int64_t offset)
+{
+	int64_t coff = offset - (offset % ft->hashtree()->chunk_size()); // ceil to chunk
+	return bin_t(0,coff/ft->hashtree()->chunk_size());
 }
 
 
-// SEEK
 int swift::Seek(int fd, int64_t offset, int whence)
 {
 	dprintf("%s F%i Seek: to %lld\n",tintstr(), fd, offset );
@@ -589,8 +747,7 @@ int swift::Seek(int fd, int64_t offset, int whence)
 			return -1; // seek beyond end of content
 
 		// Which bin to seek to?
-		int64_t coff = offset - (offset % ft->hashtree()->chunk_size()); // ceil to chunk
-		bin_t offbin = bin_t(0,coff/ft->hashtree()->chunk_size());
+		bin_t offbin = OffsetToBin(ft,offset);
 
 		char binstr[32];
 		dprintf("%s F%i Seek: to bin %s\n",tintstr(), fd, offbin.str(binstr) );
@@ -602,6 +759,28 @@ int swift::Seek(int fd, int64_t offset, int whence)
 }
 
 
+int swift::SeekMulti(int fd, bytewindows_t windows)
+{
+	FileTransfer *ft = FileTransfer::file(fd);
+	if (ft == NULL)
+		return -1;
+
+	binwindows_t binwindows;
+	for (int i=0; i<windows.size(); i++)
+	{
+		if (windows[i].first >= swift::Size(fd))
+			continue; // consumer at end of content
+		int64_t last = std::min(windows[i].second,(int64_t)swift::Size(fd)-1);
+		binwindows.push_back(std::make_pair(OffsetToBin(ft,windows[i].first),OffsetToBin(ft,last)));
+	}
+	dprintf("%s F%i Seek: to %d windows\n",tintstr(), fd, (int)binwindows.size() );
+	if (binwindows.empty())
+		return -1;
+
+	return ft->picker().SeekMulti(binwindows);
+}
+
+
 /*
  * Utility methods 2
  */
@@ -635,6 +814,20 @@ int swift::evbuffer_add_hash(struct evbuffer *evb, const Sha1Hash& hash)  {
     return evbuffer_add(evb, hash.bits, Sha1Hash::SIZE);
 }
 
+// 7 bits per byte, least significant first, high bit set if more follow
+int swift::evbuffer_add_varint(struct evbuffer *evb, uint64_t v) {
+    uint8_t buf[10];
+    int len = 0;
+    do {
+        buf[len] = v & 0x7f;
+        v >>= 7;
+        if (v)
+            buf[len] |= 0x80;
+        len++;
+    } while (v);
+    return evbuffer_add(evb, buf, len);
+}
+
 uint8_t swift::evbuffer_remove_8(struct evbuffer *evb) {
     uint8_t b;
     if (evbuffer_remove(evb, &b, 1) < 1)
@@ -0,0 +1,259 @@
+/*
+ *  checkpoint.cpp
+ *  Checkpoint policy and the background checkpointer, see checkpoint.h.
+ *
+ *  Copyright 2009-2012 TECHNISCHE UNIVERSITEIT DELFT. All rights reserved.
+ *
+ */
+#include "swift.h"
+
+using namespace swift;
+
+const tint Checkpointer::TICK;
+const size_t Checkpointer::SLICE_BYTES;
+const int Checkpointer::SLICE_TRANSFERS;
+const tint Checkpointer::RETRY_INTERVAL;
+
+LatencyHistogram Checkpointer::latency;
+uint64_t Checkpointer::bytes_written = 0;
+uint64_t Checkpointer::written = 0;
+uint64_t Checkpointer::failed = 0;
+bool Checkpointer::running_ = false;
+int Checkpointer::cursor_ = 0;
+std::set<int> Checkpointer::inflight_;
+std::map<int,tint> Checkpointer::retry_;
+struct event Checkpointer::evtick_;
+WorkQueue *Checkpointer::queue_ = NULL;
+
+
+// CHECKPOINT
+static uint64_t checkpoint_bytes = SWIFT_CHECKPOINT_DEFAULT_BYTES;
+static tint checkpoint_interval = SWIFT_CHECKPOINT_DEFAULT_INTERVAL;
+
+
+static MmapHashTree *CheckpointableTree(FileTransfer *ft) {
+	if (ft == NULL || ft->IsZeroState() || ft->IsLive())
+	    return NULL;
+    MmapHashTree *ht = (MmapHashTree *)ft->hashtree();
+    if (ht == NULL)
+         fprintf(stderr,"swift: checkpointing: ht is NULL\n");
+    return ht;
+}
+
+
+static std::string CheckpointFilename(FileTransfer *ft) {
+	std::string binmap_filename = ft->GetStorage()->GetOSPathName();
+	binmap_filename.append(".mbinmap");
+	return binmap_filename;
+}
+
+
+static bool CheckpointDue(MmapHashTree *ht) {
+    uint64_t unsaved = ht->checkpoint_unsaved();
+    if (unsaved == 0)
+        return false;
+    return ht->is_complete() ||
+        (checkpoint_bytes != 0 && unsaved >= checkpoint_bytes) ||
+        (checkpoint_interval != 0 && NOW-ht->checkpoint_time() >= checkpoint_interval);
+}
+
+
+int swift::Checkpoint(int transfer) {
+	// Save transfer's binmap for zero-hashcheck restart
+	FileTransfer *ft = FileTransfer::file(transfer);
+    MmapHashTree *ht = CheckpointableTree(ft);
+    if (ht == NULL)
+	     return -1;
+
+	// Not while the worker writes the same file
+	Checkpointer::Wait(transfer);
+
+	LatencyTimer t(Checkpointer::latency);
+	uint64_t before = ht->checkpoint_written();
+	int ret = ht->Checkpoint(CheckpointFilename(ft));
+  	if (ret < 0) {
+        print_error("writing to mbinmap");
+        Checkpointer::failed++;
+  	} else {
+  	    Checkpointer::written++;
+  	    Checkpointer::bytes_written += ht->checkpoint_written()-before;
+  	}
+	return ret;
+}
+
+
+void swift::SetCheckpointPolicy(uint64_t bytes, tint interval) {
+    checkpoint_bytes = bytes;
+    checkpoint_interval = interval;
+}
+
+
+int swift::CheckpointIfDue(int transfer) {
+	FileTransfer *ft = FileTransfer::file(transfer);
+    MmapHashTree *ht = CheckpointableTree(ft);
+    if (ht == NULL)
+	     return -1;
+    if (!CheckpointDue(ht))
+        return 0;
+    return swift::Checkpoint(transfer) < 0 ? -1 : 1;
+}
+
+
+void swift::StartCheckpointing() {
+    Checkpointer::Start();
+}
+
+
+void swift::StopCheckpointing() {
+    Checkpointer::Stop();
+}
+
+
+/*
+ * Background checkpointer
+ */
+
+struct swift::checkpoint_job_t {
+    int         transfer;
+    Sha1Hash    root_hash;
+    std::string filename;
+    std::string image;
+    uint64_t    complete;
+    tint        time;       // NOW at snapshot
+    tint        start;      // usec_mono_time() at snapshot
+    int         hash_fd;    // dup of the .mhash fd, -1 if none
+    int         ret;
+    tint        latency;
+};
+
+
+static void CheckpointWrite(void *arg)
+{
+    checkpoint_job_t *job = (checkpoint_job_t *)arg;
+    job->ret = 0;
+    if (job->hash_fd >= 0) {
+        if (file_sync(job->hash_fd) < 0)
+            job->ret = -1;
+        close(job->hash_fd);
+        job->hash_fd = -1;
+    }
+    if (job->ret == 0)
+        job->ret = write_atomic_utf8(job->filename,job->image.data(),job->image.size());
+    job->latency = usec_mono_time()-job->start;
+}
+
+
+void Checkpointer::Start()
+{
+    if (running_)
+        return;
+    queue_ = new WorkQueue(CheckpointWrite,1);
+    running_ = true;
+    evtimer_assign(&evtick_,Channel::evbase,TickCallback,NULL);
+    evtimer_add(&evtick_,tint2tv(TICK));
+}
+
+
+void Checkpointer::Stop()
+{
+    if (!running_)
+        return;
+    evtimer_del(&evtick_);
+    queue_->Finish();
+    running_ = false;
+    Reap();
+    delete queue_;
+    queue_ = NULL;
+}
+
+
+void Checkpointer::TickCallback(int fd, short event, void *arg)
+{
+    Channel::Time();
+    Tick();
+    evtimer_add(&evtick_,tint2tv(TICK));
+}
+
+
+void Checkpointer::Tick()
+{
+    Reap();
+
+    size_t budget = SLICE_BYTES;
+    int count = FileTransfer::files.size();
+    for (int i=0; i<count && i<SLICE_TRANSFERS && budget>0; i++, cursor_++)
+    {
+        if (cursor_ >= count)
+            cursor_ = 0;
+        int td = cursor_;
+        if (inflight_.count(td))
+            continue;
+        FileTransfer *ft = FileTransfer::file(td);
+        MmapHashTree *ht = CheckpointableTree(ft);
+        if (ht == NULL || !CheckpointDue(ht))
+            continue;
+        std::map<int,tint>::iterator ri = retry_.find(td);
+        if (ri != retry_.end()) {
+            if (NOW < ri->second)
+                continue;
+            retry_.erase(ri);
+        }
+
+        checkpoint_job_t *job = new checkpoint_job_t();
+        job->transfer = td;
+        job->root_hash = ht->root_hash();
+        job->filename = CheckpointFilename(ft);
+        job->start = usec_mono_time();
+        ht->CheckpointImage(job->image);
+        job->complete = ht->complete();
+        job->time = NOW;
+        job->hash_fd = ht->hash_fd() >= 0 ? dup(ht->hash_fd()) : -1;
+        budget -= std::min(budget,job->image.size());
+
+        inflight_.insert(td);
+        if (queue_ != NULL)
+            queue_->Push(job);
+        else {
+            CheckpointWrite(job);
+            Finished(job);
+        }
+    }
+}
+
+
+void Checkpointer::Reap()
+{
+    checkpoint_job_t *job;
+    while (queue_ != NULL && (job = (checkpoint_job_t *)queue_->Pop()) != NULL)
+        Finished(job);
+}
+
+
+void Checkpointer::Finished(checkpoint_job_t *job)
+{
+    inflight_.erase(job->transfer);
+    latency.Record(job->latency);
+    if (job->ret < 0) {
+        print_error("checkpoint: writing to mbinmap");
+        failed++;
+        retry_[job->transfer] = NOW+RETRY_INTERVAL;
+    } else {
+        written++;
+        bytes_written += job->image.size();
+    }
+    // The transfer may have been closed and its descriptor reused
+    FileTransfer *ft = FileTransfer::file(job->transfer);
+    MmapHashTree *ht = CheckpointableTree(ft);
+    if (job->ret == 0 && ht != NULL && ht->root_hash() == job->root_hash)
+        ht->CheckpointDone(job->complete,job->time,job->image.size());
+    delete job;
+}
+
+
+void Checkpointer::Wait(int transfer)
+{
+    checkpoint_job_t *job;
+    while (inflight_.count(transfer) && queue_ != NULL &&
+           (job = (checkpoint_job_t *)queue_->WaitPop()) != NULL)
+        Finished(job);
+}
@@ -0,0 +1,77 @@
+/*
+ *  checkpoint.h
+ *  Background checkpointing of all transfers. A timer on the event loop
+ *  walks the transfers and takes an in-memory .mbinmap image of each one
+ *  the checkpoint policy says is due, up to SLICE_BYTES of images per
+ *  tick. A worker thread syncs the .mhash file, so the peak hashes the
+ *  image relies on are on disk, and writes the image atomically. Results
+ *  are collected on the next tick: hash trees are only touched by the
+ *  event loop thread.
+ *
+ *  Copyright 2009-2012 TECHNISCHE UNIVERSITEIT DELFT. All rights reserved.
+ *
+ */
+#ifndef SWIFT_CHECKPOINT_H
+#define SWIFT_CHECKPOINT_H
+
+#include "compat.h"
+#include "histogram.h"
+#include "workqueue.h"
+#include <event2/event_struct.h>
+#include <set>
+#include <map>
+
+namespace swift {
+
+
+struct checkpoint_job_t;
+
+
+class Checkpointer
+{
+    public:
+        /** Scheduler period */
+        static const tint TICK = TINT_SEC/4;
+        /** Image bytes snapshotted per tick. At least one transfer is
+         *  taken per tick, however large its image. */
+        static const size_t SLICE_BYTES = 1<<20;
+        /** Transfers looked at per tick */
+        static const int SLICE_TRANSFERS = 256;
+        /** Wait before retrying a transfer whose checkpoint failed */
+        static const tint RETRY_INTERVAL = 10*TINT_SEC;
+
+        /** Starts the worker and the scheduler timer on Channel::evbase */
+        static void Start();
+        /** Writes what is queued, then stops */
+        static void Stop();
+        static bool running() { return running_; }
+
+        /** One scheduler round: collect finished writes, snapshot due transfers */
+        static void Tick();
+        /** Returns when no write for transfer is queued or in progress */
+        static void Wait(int transfer);
+        /** Writes queued or in progress */
+        static size_t pending() { return inflight_.size(); }
+
+        /** Snapshot to checkpoint on disk */
+        static LatencyHistogram latency;
+        static uint64_t bytes_written;
+        static uint64_t written;
+        static uint64_t failed;
+
+    protected:
+        static void TickCallback(int fd, short event, void *arg);
+        static void Reap();
+        static void Finished(checkpoint_job_t *job);
+
+        static bool running_;
+        static int cursor_;
+        static std::set<int> inflight_;
+        static std::map<int,tint> retry_;
+        static struct event evtick_;
+        static WorkQueue *queue_;
+};
+
+}
+
+#endif
@@ -7,6 +7,7 @@
  *
  */
 #include <math.h>
+#include <float.h>
 #include <iostream>
 #include <sstream>
 
@@ -40,18 +41,37 @@ using namespace swift;
 #define ERROR_BAD_ARG		-3
 #define ERROR_BAD_SWARM		-4
 
+// Levels of the rate limiter tree for MAXSPEED
+#define CMDGW_RATE_TRANSFER		0
+#define CMDGW_RATE_PROCESS		1
+#define CMDGW_RATE_CLASS		2
+#define CMDGW_RATE_CHANNEL		3
+
 #define CMDGW_MAX_CLIENT 1024   // Arno: == maximum number of swarms per proc
 
+// INFO is only sent when a swarm's state changed, or at least this often
+#define CMDGW_MAX_INFO_SILENCE	(10*TINT_SEC)
+// Time for replies to a closed connection to go out before shutdown
+#define CMDGW_CLOSE_FLUSH_TIME	(TINT_SEC)
+
 struct cmd_gw_t {
     int      id;
     evutil_socket_t   cmdsock;
     int		 transfer; 			 // swift FD
+    bool	activated;		  // transfer from swift::Activate, to Release
     bool	moreinfo;		  // whether to report detailed stats (see SETMOREINFO cmd)
     tint 	startt;			  // ARNOSMPTODO: debug speed measurements, remove
     std::string mfspecname;	  // MULTIFILE
     uint64_t startoff;   // MULTIFILE: starting offset in content range of desired file
     uint64_t endoff;     // MULTIFILE: ending offset (careful, for an e.g. 100 byte interval this is 99)
 
+    // Last INFO reported, to send only changes. last_report 0 = force
+    tint	last_report;
+    int		last_dlstatus;
+    uint64_t last_complete, last_size;
+    uint32_t last_numleech, last_numseeds;
+    std::string last_speeds;	  // as on the wire, speeds decay without reaching 0
+
 } cmd_requests[CMDGW_MAX_CLIENT];
 
 
@@ -62,6 +82,43 @@ int cmd_gw_conns_open = 0;
 struct evconnlistener *cmd_evlistener = NULL;
 struct evbuffer *cmd_evbuffer = NULL; // Data received on cmd socket : WARNING: one for all cmd sockets
 
+// All output goes through the connection's bufferevent, so replies and
+// batched INFO reports stay in order and never block.
+typedef std::map<evutil_socket_t,struct bufferevent *> cmdbevs_t;
+cmdbevs_t cmd_gw_bevs;
+
+/*
+ * Binary framing. After the text command "BINARY\r\n" a connection speaks
+ * length-prefixed frames, big endian like the swift wire protocol:
+ *
+ *   uint32 length (of what follows) | uint8 op | uint32 corrid | payload
+ *
+ * Requests are executed in order as they come in, any number per read, and
+ * each is answered with op|CMDGW_BIN_REPLY, the same corrid and an int8
+ * ERROR_* status. Text output (INFO, PLAY, ERROR, ...) is sent as
+ * CMDGW_BIN_EVENT frames with corrid 0.
+ *
+ * Payloads:
+ *   START:      hash[20] ipv4 uint32 port uint16 chunksize uint32 (0 = default)
+ *               mfspeclen uint16 mfspec pathlen uint16 storagepath
+ *   REMOVE:     hash[20] flags uint8 (1 = remove state, 2 = remove content)
+ *   MAXSPEED:   hash[20] dir uint8 (0 = down, 1 = up) bytes/s uint64 (~0 = unlimited)
+ *               optionally level uint8 (CMDGW_RATE_*) class-or-ipv4 uint32,
+ *               plus port uint16 for CMDGW_RATE_CHANNEL
+ *   CHECKPOINT: hash[20]
+ */
+#define CMDGW_BIN_START			0x01
+#define CMDGW_BIN_REMOVE		0x02
+#define CMDGW_BIN_MAXSPEED		0x03
+#define CMDGW_BIN_CHECKPOINT	0x04
+#define CMDGW_BIN_EVENT			0x7f
+#define CMDGW_BIN_REPLY			0x80
+
+#define CMDGW_BIN_HDR_SIZE		5			// op + corrid
+#define CMDGW_BIN_MAX_FRAME		(64*1024)
+
+std::set<evutil_socket_t> cmd_gw_binary_socks;
+
 /*
  * SOCKTUNNEL
  * We added the ability for a process to tunnel data over swift's UDP socket.
@@ -90,21 +147,80 @@ tint cmd_gw_last_open=0;
 
 // Fwd defs
 void CmdGwDataCameInCallback(struct bufferevent *bev, void *ctx);
+void CmdGwFlushedCallback(struct bufferevent *bev, void *ctx);
+void CmdGwFlushEventCallback(struct bufferevent *bev, short events, void *ctx);
 bool CmdGwReadLine(evutil_socket_t cmdsock);
+bool CmdGwReadFrame(evutil_socket_t cmdsock);
+int CmdGwGotSTART(evutil_socket_t cmdsock, Sha1Hash &root_hash, Address trackaddr, uint32_t chunksize, std::string mfstr, std::string storagepath);
 void CmdGwNewRequestCallback(evutil_socket_t cmdsock, char *line);
 void CmdGwProcessData(evutil_socket_t cmdsock);
 
 
+void CmdGwCloseTransfer(cmd_gw_t* req)
+{
+	FileTransfer *ft = FileTransfer::file(req->transfer);
+	if (req->activated && ft != NULL)
+		swift::Release(ft->root_hash());
+	swift::Close(req->transfer);
+}
+
+
 void CmdGwFreeRequest(cmd_gw_t* req)
 {
     req->id = -1;
     req->cmdsock = -1;
     req->transfer = -1;
+    req->activated = false;
     req->moreinfo = false;
     req->startt = 0;
     req->mfspecname = "";
     req->startoff = -1;
     req->endoff = -1;
+    req->last_report = 0;
+}
+
+
+void CmdGwSendBufferBySocket(evutil_socket_t cmdsock, struct evbuffer *evb);
+
+void CmdGwSendBySocket(evutil_socket_t cmdsock, const char *data, size_t len)
+{
+	if (cmd_gw_binary_socks.count(cmdsock))
+	{
+		struct evbuffer *evb = evbuffer_new();
+		evbuffer_add(evb,data,len);
+		CmdGwSendBufferBySocket(cmdsock,evb);
+		evbuffer_free(evb);
+		return;
+	}
+	cmdbevs_t::iterator iter = cmd_gw_bevs.find(cmdsock);
+	if (iter != cmd_gw_bevs.end())
+		bufferevent_write(iter->second,data,len);
+	else
+		send(cmdsock,data,len,0);
+}
+
+
+void CmdGwSendBufferBySocket(evutil_socket_t cmdsock, struct evbuffer *evb)
+{
+	if (cmd_gw_binary_socks.count(cmdsock))
+	{
+		// Wrap text output as an event frame
+		struct evbuffer *hdr = evbuffer_new();
+		evbuffer_add_32be(hdr,CMDGW_BIN_HDR_SIZE+evbuffer_get_length(evb));
+		evbuffer_add_8(hdr,CMDGW_BIN_EVENT);
+		evbuffer_add_32be(hdr,0);
+		evbuffer_prepend_buffer(evb,hdr);
+		evbuffer_free(hdr);
+	}
+	cmdbevs_t::iterator iter = cmd_gw_bevs.find(cmdsock);
+	if (iter != cmd_gw_bevs.end())
+		bufferevent_write_buffer(iter->second,evb);
+	else
+	{
+		size_t len = evbuffer_get_length(evb);
+		send(cmdsock,(const char *)evbuffer_pullup(evb,len),len,0);
+		evbuffer_drain(evb,len);
+	}
 }
 
 
@@ -126,7 +242,7 @@ void CmdGwCloseConnection(evutil_socket_t sock)
 	        if (req->cmdsock==sock)
 	        {
                 dprintf("%s @%i stopping-on-close transfer %i\n",tintstr(),req->id,req->transfer);
-                swift::Close(req->transfer);
+                CmdGwCloseTransfer(req);
 
                 // Remove from list and reiterate over it
                 CmdGwFreeRequest(req);
@@ -137,15 +253,58 @@ void CmdGwCloseConnection(evutil_socket_t sock)
 	    }
 	}
 
-	// Arno, 2012-07-06: Close
-	swift::close_socket(sock);
+	// Flush pending replies (e.g. ERROR) before closing. The bufferevent
+	// owns the socket and closes it when freed.
+	bool flushing = false;
+	cmdbevs_t::iterator iter = cmd_gw_bevs.find(sock);
+	if (iter != cmd_gw_bevs.end())
+	{
+		struct bufferevent *bev = iter->second;
+		cmd_gw_bevs.erase(iter);
+		bufferevent_disable(bev,EV_READ);
+		struct evbuffer *outevb = bufferevent_get_output(bev);
+		if (evbuffer_get_length(outevb) > 0)
+			evbuffer_write(outevb,sock);
+		if (evbuffer_get_length(outevb) > 0)
+		{
+			// Rest goes when the socket is writable
+			bufferevent_setcb(bev,NULL,CmdGwFlushedCallback,CmdGwFlushEventCallback,NULL);
+			flushing = true;
+		}
+		else
+			bufferevent_free(bev);
+	}
+	else
+	{
+		// Arno, 2012-07-06: Close
+		swift::close_socket(sock);
+	}
+	cmd_gw_binary_socks.erase(sock);
 
 	cmd_gw_conns_open--;
 
 	// Arno, 2012-10-11: New policy Immediate shutdown on connection close,
 	// see CmdGwUpdateDLStatesCallback()
 	fprintf(stderr,"cmd: Shutting down on CMD connection close\n");
-	event_base_loopexit(Channel::evbase, NULL);
+	if (flushing)
+		event_base_loopexit(Channel::evbase, tint2tv(CMDGW_CLOSE_FLUSH_TIME));
+	else
+		event_base_loopexit(Channel::evbase, NULL);
+}
+
+
+void CmdGwFlushedCallback(struct bufferevent *bev, void *ctx)
+{
+	// Output of a closed cmd connection is empty
+	bufferevent_free(bev);
+}
+
+
+void CmdGwFlushEventCallback(struct bufferevent *bev, short events, void *ctx)
+{
+	// Peer went away before its output was flushed
+	if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR))
+		bufferevent_free(bev);
 }
 
 
@@ -173,7 +332,7 @@ cmd_gw_t* CmdGwFindRequestByRootHash(Sha1Hash &want_hash)
 }
 
 
-void CmdGwGotCHECKPOINT(Sha1Hash &want_hash)
+int CmdGwGotCHECKPOINT(Sha1Hash &want_hash)
 {
     // Checkpoint the specified download
     if (cmd_gw_debug)
@@ -181,13 +340,14 @@ void CmdGwGotCHECKPOINT(Sha1Hash &want_hash)
 
     cmd_gw_t* req = CmdGwFindRequestByRootHash(want_hash);
     if (req == NULL)
-    	return;
+    	return ERROR_BAD_SWARM;
 
     swift::Checkpoint(req->transfer);
+    return ERROR_NO_ERROR;
 }
 
 
-void CmdGwGotREMOVE(Sha1Hash &want_hash, bool removestate, bool removecontent)
+int CmdGwGotREMOVE(Sha1Hash &want_hash, bool removestate, bool removecontent)
 {
 	// Remove the specified download
 	if (cmd_gw_debug)
@@ -198,11 +358,11 @@ void CmdGwGotREMOVE(Sha1Hash &want_hash, bool removestate, bool removecontent)
 	{
 		if (cmd_gw_debug)
 			fprintf(stderr,"cmd: GotREMOVE: %s not found, bad swarm?\n",want_hash.hex().c_str());
-    	return;
+    	return ERROR_BAD_SWARM;
 	}
     FileTransfer *ft = FileTransfer::file(req->transfer);
     if (ft == NULL)
-    	return;
+    	return ERROR_BAD_SWARM;
 
 	dprintf("%s @%i remove transfer %i\n",tintstr(),req->id,req->transfer);
 
@@ -240,7 +400,7 @@ void CmdGwGotREMOVE(Sha1Hash &want_hash, bool removestate, bool removecontent)
 		}
 	}
 
-	swift::Close(req->transfer);
+	CmdGwCloseTransfer(req);
 	ft = NULL;
 	// All ft info now invalid
 
@@ -260,19 +420,49 @@ void CmdGwGotREMOVE(Sha1Hash &want_hash, bool removestate, bool removecontent)
 
 	CmdGwFreeRequest(req);
 	*req = cmd_requests[--cmd_gw_reqs_open];
+    return ERROR_NO_ERROR;
 }
 
 
-void CmdGwGotMAXSPEED(Sha1Hash &want_hash, data_direction_t ddir, double speed)
+int CmdGwGotMAXSPEED(Sha1Hash &want_hash, data_direction_t ddir, double speed, int level, int cls, Address peer)
 {
-	// Set maximum speed on the specified download
+	// Set maximum speed on the specified download, or on another level
+	// of the rate limiter tree
 	//fprintf(stderr,"cmd: GotMAXSPEED: %s %d %lf\n",want_hash.hex().c_str(),ddir,speed);
 
+	if (level == CMDGW_RATE_PROCESS)
+	{
+		FileTransfer::GetProcessRateBucket(ddir)->SetRate(speed);
+		return ERROR_NO_ERROR;
+	}
+	else if (level == CMDGW_RATE_CLASS)
+	{
+		FileTransfer::GetClassRateBucket(cls,ddir)->SetRate(speed);
+		return ERROR_NO_ERROR;
+	}
+	else if (level != CMDGW_RATE_TRANSFER && level != CMDGW_RATE_CHANNEL)
+		return ERROR_BAD_ARG;
+
 	cmd_gw_t* req = CmdGwFindRequestByRootHash(want_hash);
 	if (req == NULL)
-    	return;
+    	return ERROR_BAD_SWARM;
     FileTransfer *ft = FileTransfer::file(req->transfer);
 
+    if (level == CMDGW_RATE_CHANNEL)
+    {
+    	// Only the current channel to peer, a reconnect starts unlimited
+    	const channels_t &chans = ft->GetChannels();
+    	for (channels_t::const_iterator iter=chans.begin(); iter!=chans.end(); iter++)
+    	{
+    		if ((*iter)->peer() == peer)
+    		{
+    			(*iter)->GetRateBucket(ddir)->SetRate(speed);
+    			return ERROR_NO_ERROR;
+    		}
+    	}
+    	return ERROR_BAD_ARG;
+    }
+
     // Arno, 2012-05-25: SetMaxSpeed resets the current speed history, so
     // be careful here.
     double curmax = ft->GetMaxSpeed(ddir);
@@ -282,6 +472,17 @@ void CmdGwGotMAXSPEED(Sha1Hash &want_hash, data_direction_t ddir, double speed)
     		fprintf(stderr,"cmd: CmdGwGotMAXSPEED: %s was %lf want %lf, setting\n", want_hash.hex().c_str(), curmax, speed );
     	ft->SetMaxSpeed(ddir,speed);
     }
+    return ERROR_NO_ERROR;
+}
+
+
+int CmdGwGotSETRATECLASS(Sha1Hash &want_hash, int cls)
+{
+	cmd_gw_t* req = CmdGwFindRequestByRootHash(want_hash);
+	if (req == NULL)
+    	return ERROR_BAD_SWARM;
+    FileTransfer::file(req->transfer)->SetRateClass(cls);
+    return ERROR_NO_ERROR;
 }
 
 
@@ -291,6 +492,7 @@ void CmdGwGotSETMOREINFO(Sha1Hash &want_hash, bool enable)
 	if (req == NULL)
     	return;
 	req->moreinfo = enable;
+	req->last_report = 0;
 }
 
 void CmdGwGotPEERADDR(Sha1Hash &want_hash, Address &peer)
@@ -315,24 +517,22 @@ void CmdGwSendINFOHashChecking(evutil_socket_t cmdsock, Sha1Hash root_hash)
 	sprintf(cmd,"INFO %s %d %lli/%lli %lf %lf %u %u\r\n",root_hash.hex().c_str(),DLSTATUS_HASHCHECKING,(uint64_t)0,(uint64_t)0,0.0,3.14,0,0);
 
     //fprintf(stderr,"cmd: SendINFO: %s", cmd);
-    send(cmdsock,cmd,strlen(cmd),0);
+    CmdGwSendBySocket(cmdsock,cmd,strlen(cmd));
 }
 
 
-void CmdGwSendINFO(cmd_gw_t* req, int dlstatus)
+/*
+ * Append INFO (and MOREINFO) for req to evb, if its state changed since the
+ * last report, CMDGW_MAX_INFO_SILENCE passed, or force. Returns whether
+ * anything was added.
+ */
+bool CmdGwAddINFO(cmd_gw_t* req, int dlstatus, struct evbuffer *evb, bool force)
 {
-	// Send INFO message.
-	if (cmd_gw_debug)
-		fprintf(stderr,"cmd: SendINFO: F%d initdlstatus %d\n", req->transfer, dlstatus );
-
 	FileTransfer *ft = FileTransfer::file(req->transfer);
 	if (ft == NULL)
 		// Download was removed or closed somehow.
-		return;
-
-    Sha1Hash root_hash = ft->root_hash();
+		return false;
 
-    char cmd[MAX_CMD_MESSAGE];
     uint64_t size = swift::Size(req->transfer);
     uint64_t complete = swift::Complete(req->transfer);
     if (size > 0 && size == complete)
@@ -345,54 +545,73 @@ void CmdGwSendINFO(cmd_gw_t* req, int dlstatus)
 
     double dlspeed = ft->GetCurrentSpeed(DDIR_DOWNLOAD);
     double ulspeed = ft->GetCurrentSpeed(DDIR_UPLOAD);
-    sprintf(cmd,"INFO %s %d %lli/%lli %lf %lf %u %u\r\n",root_hash.hex().c_str(),dlstatus,complete,size,dlspeed,ulspeed,numleech,numseeds);
+    char speeds[128];
+    sprintf(speeds,"%lf %lf",dlspeed,ulspeed);
 
-    send(req->cmdsock,cmd,strlen(cmd),0);
+    if (!force && req->last_report != 0 && req->last_report+CMDGW_MAX_INFO_SILENCE > NOW &&
+    	dlstatus == req->last_dlstatus && complete == req->last_complete && size == req->last_size &&
+    	numleech == req->last_numleech && numseeds == req->last_numseeds &&
+    	req->last_speeds == speeds)
+    	return false;
+
+    req->last_report = NOW;
+    req->last_dlstatus = dlstatus;
+    req->last_complete = complete;
+    req->last_size = size;
+    req->last_numleech = numleech;
+    req->last_numseeds = numseeds;
+    req->last_speeds = speeds;
+
+    std::string hex = ft->root_hash().hex();
+    evbuffer_add_printf(evb,"INFO %s %d %lli/%lli %s %u %u\r\n",hex.c_str(),dlstatus,complete,size,speeds,numleech,numseeds);
 
     // MORESTATS
     if (req->moreinfo) {
     	// Send detailed ul/dl stats in JSON format.
-
-    	std::ostringstream oss;
-    	oss.setf(std::ios::fixed,std::ios::floatfield);
-    	oss.precision(5);
-    	channels_t::iterator iter;
-    	channels_t peerchans = ft->GetChannels();
-
-        oss << "MOREINFO" << " " << root_hash.hex() << " ";
+    	const channels_t &peerchans = ft->GetChannels();
+    	channels_t::const_iterator iter;
 
         double tss = (double)Channel::Time() / 1000000.0L;
-        oss << "{\"timestamp\":\"" << tss << "\", ";
-        oss << "\"channels\":";
-        oss << "[";
+        evbuffer_add_printf(evb,"MOREINFO %s {\"timestamp\":\"%.5f\", \"channels\":[",hex.c_str(),tss);
         for (iter=peerchans.begin(); iter!=peerchans.end(); iter++) {
     		Channel *c = *iter;
     		if (c != NULL) {
-    			if (iter!=peerchans.begin())
-    				oss << ", ";
-    			oss << "{";
-    			oss << "\"ip\": \"" << c->peer().ipv4str() << "\", ";
-    			oss << "\"port\": " << c->peer().port() << ", ";
-    			oss << "\"raw_bytes_up\": " << c->raw_bytes_up() << ", ";
-    			oss << "\"raw_bytes_down\": " << c->raw_bytes_down() << ", ";
-    			oss << "\"bytes_up\": " << c->bytes_up() << ", ";
-    			oss << "\"bytes_down\": " << c->bytes_down() << " ";
-    			oss << "}";
+    			evbuffer_add_printf(evb,"%s{\"ip\": \"%s\", \"port\": %u, ",iter!=peerchans.begin() ? ", " : "",c->peer().ipv4str(),c->peer().port());
+    			evbuffer_add_printf(evb,"\"raw_bytes_up\": %llu, \"raw_bytes_down\": %llu, \"bytes_up\": %llu, \"bytes_down\": %llu }",
+    				(unsigned long long)c->raw_bytes_up(),(unsigned long long)c->raw_bytes_down(),
+    				(unsigned long long)c->bytes_up(),(unsigned long long)c->bytes_down());
     		}
         }
-        oss << "], ";
-        oss << "\"raw_bytes_up\": " << Channel::global_raw_bytes_up << ", ";
-        oss << "\"raw_bytes_down\": " << Channel::global_raw_bytes_down << ", ";
-        oss << "\"bytes_up\": " << Channel::global_bytes_up << ", ";
-        oss << "\"bytes_down\": " << Channel::global_bytes_down << " ";
-        oss << "}";
-
-        oss << "\r\n";
-
-        std::stringbuf *pbuf=oss.rdbuf();
-        size_t slen = strlen(pbuf->str().c_str());
-        send(req->cmdsock,pbuf->str().c_str(),slen,0);
+        evbuffer_add_printf(evb,"], \"raw_bytes_up\": %llu, \"raw_bytes_down\": %llu, \"bytes_up\": %llu, \"bytes_down\": %llu, ",
+        	(unsigned long long)Channel::global_raw_bytes_up,(unsigned long long)Channel::global_raw_bytes_down,
+        	(unsigned long long)Channel::global_bytes_up,(unsigned long long)Channel::global_bytes_down);
+        // Latency percentiles of the hot paths, usec, process-wide
+        const char *latnames[] = { "send", "recv", "read", "verify", "timer" };
+        LatencyHistogram *lats[] = { &Channel::send_latency, &Channel::recv_latency,
+            &Channel::read_latency, &Channel::verify_latency, &Channel::timer_lateness };
+        evbuffer_add_printf(evb,"\"latency\": {");
+        for (int i=0; i<5; i++) {
+            evbuffer_add_printf(evb,"%s\"%s\": {\"count\": %llu, \"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"max\": %llu}",
+            	i > 0 ? ", " : "",latnames[i],(unsigned long long)lats[i]->count(),
+            	(unsigned long long)lats[i]->Percentile(50),(unsigned long long)lats[i]->Percentile(90),
+            	(unsigned long long)lats[i]->Percentile(99),(unsigned long long)lats[i]->max());
+        }
+        evbuffer_add_printf(evb,"} }\r\n");
     }
+    return true;
+}
+
+
+void CmdGwSendINFO(cmd_gw_t* req, int dlstatus)
+{
+	// Send INFO message now, regardless of changes.
+	if (cmd_gw_debug)
+		fprintf(stderr,"cmd: SendINFO: F%d initdlstatus %d\n", req->transfer, dlstatus );
+
+	struct evbuffer *evb = evbuffer_new();
+	if (CmdGwAddINFO(req,dlstatus,evb,true))
+		CmdGwSendBufferBySocket(req->cmdsock,evb);
+	evbuffer_free(evb);
 }
 
 
@@ -414,7 +633,7 @@ void CmdGwSendPLAY(cmd_gw_t *req)
     if (cmd_gw_debug)
         fprintf(stderr,"cmd: SendPlay: %s", cmd);
 
-    send(req->cmdsock,cmd,strlen(cmd),0);
+    CmdGwSendBySocket(req->cmdsock,cmd,strlen(cmd));
 }
 
 
@@ -429,9 +648,7 @@ void CmdGwSendERRORBySocket(evutil_socket_t cmdsock, std::string msg, const Sha1
 	if (cmd_gw_debug)
 		fprintf(stderr,"cmd: SendERROR: %s\n", cmd.c_str() );
 
-	char *wire = strdup(cmd.c_str());
-	send(cmdsock,wire,strlen(wire),0);
-	free(wire);
+	CmdGwSendBySocket(cmdsock,cmd.c_str(),cmd.length());
 }
 
 
@@ -559,7 +776,7 @@ void CmdGwSwiftErrorCallback (evutil_socket_t cmdsock)
 	// Error on swift socket callback
 
 	const char *response = "ERROR Swift Engine Problem\r\n";
-	send(cmdsock,response,strlen(response),0);
+	CmdGwSendBySocket(cmdsock,response,strlen(response));
 
 	//swift::close_socket(sock);
 }
@@ -579,15 +796,15 @@ void CmdGwSwiftAllocatingDiskspaceCallback (int transfer, bin_t bin)
 
 
 
-void CmdGwUpdateDLStateCallback(cmd_gw_t* req)
+void CmdGwUpdateDLStateCallback(cmd_gw_t* req, struct evbuffer *evb)
 {
-	// Periodic callback, tell user INFO
-	CmdGwSendINFO(req,DLSTATUS_DOWNLOADING);
-
-	// Update speed measurements such that they decrease when DL/UL stops
+	// Periodic callback, tell user INFO if changed
 	FileTransfer *ft = FileTransfer::file(req->transfer);
 	if (ft == NULL) // Concurrency between ERROR_BAD_SWARM and this periodic callback
 		return;
+	CmdGwAddINFO(req,DLSTATUS_DOWNLOADING,evb,false);
+
+	// Update speed measurements such that they decrease when DL/UL stops
 	ft->OnRecvData(0);
 	ft->OnSendData(0);
 
@@ -596,9 +813,9 @@ void CmdGwUpdateDLStateCallback(cmd_gw_t* req)
 		// DEBUG download speed rate limit
 		double dlspeed = ft->GetCurrentSpeed(DDIR_DOWNLOAD);
 #ifdef WIN32
-		double dt = max(0.000001,(double)(usec_time() - req->startt)/TINT_SEC);
+		double dt = max(0.000001,(double)(usec_mono_time() - req->startt)/TINT_SEC);
 #else
-		double dt = std::max(0.000001,(double)(usec_time() - req->startt)/TINT_SEC);
+		double dt = std::max(0.000001,(double)(usec_mono_time() - req->startt)/TINT_SEC);
 #endif
 		double exspeed = (double)(swift::Complete(req->transfer)) / dt;
 		fprintf(stderr,"cmd: UpdateDLStateCallback: SPEED %lf == %lf\n", dlspeed, exspeed );
@@ -611,11 +828,23 @@ int icount=0;
 void CmdGwUpdateDLStatesCallback()
 {
 	// Called by swift main approximately every second
-	// Loop over all swarms
+	// Loop over all swarms, collecting the changed ones into one write per
+	// connection.
+	std::map<evutil_socket_t,struct evbuffer *> batches;
+	std::map<evutil_socket_t,struct evbuffer *>::iterator iter;
     for(int i=0; i<cmd_gw_reqs_open; i++)
     {
     	cmd_gw_t* req = &cmd_requests[i];
-    	CmdGwUpdateDLStateCallback(req);
+    	iter = batches.find(req->cmdsock);
+    	if (iter == batches.end())
+    		iter = batches.insert(std::make_pair(req->cmdsock,evbuffer_new())).first;
+    	CmdGwUpdateDLStateCallback(req,iter->second);
+    }
+    for (iter=batches.begin(); iter!=batches.end(); iter++)
+    {
+    	if (evbuffer_get_length(iter->second) > 0)
+    		CmdGwSendBufferBySocket(iter->first,iter->second);
+    	evbuffer_free(iter->second);
     }
 
     // Arno, 2012-05-24: Autoclose if CMD *connection* not *re*established soon
@@ -644,6 +873,7 @@ void CmdGwUpdateDLStatesCallback()
 void CmdGwDataCameInCallback(struct bufferevent *bev, void *ctx)
 {
 	// Turn TCP stream into lines deliniated by \r\n
+	Channel::Time();
 
 	evutil_socket_t cmdsock = bufferevent_getfd(bev);
 	if (cmd_gw_debug)
@@ -672,16 +902,23 @@ void CmdGwProcessData(evutil_socket_t cmdsock)
 {
 	// Process CMD data in the cmd_evbuffer
 
-	if (cmd_tunnel_state == CMDGW_TUNNEL_SCAN4CRLF)
+	if (cmd_tunnel_state == CMDGW_TUNNEL_SCAN4CRLF && !cmd_gw_binary_socks.count(cmdsock))
 	{
 		bool ok=false;
 		do
 		{
 			ok = CmdGwReadLine(cmdsock);
-			if (ok && cmd_tunnel_state == CMDGW_TUNNEL_READTUNNEL)
+			if (ok && (cmd_tunnel_state != CMDGW_TUNNEL_SCAN4CRLF || cmd_gw_binary_socks.count(cmdsock)))
 				break;
 		} while (ok);
 	}
+	if (cmd_gw_binary_socks.count(cmdsock))
+	{
+		// After BINARY cmd, see CmdGwReadFrame()
+		while (CmdGwReadFrame(cmdsock))
+			;
+		return;
+	}
 	// Not else!
 	if (cmd_tunnel_state == CMDGW_TUNNEL_READTUNNEL)
 	{
@@ -719,6 +956,197 @@ bool CmdGwReadLine(evutil_socket_t cmdsock)
     	return false;
 }
 
+
+int CmdGwHandleFrame(evutil_socket_t cmdsock, uint8_t op, struct evbuffer *frame)
+{
+	// Execute one binary request, see CMDGW_BIN_*. No string parsing.
+	size_t len = evbuffer_get_length(frame);
+	if (len < 20)
+		return ERROR_MISS_ARG;
+	Sha1Hash root_hash = evbuffer_remove_hash(frame);
+	len -= 20;
+
+	if (op == CMDGW_BIN_START)
+	{
+		if (len < 4+2+4+2)
+			return ERROR_MISS_ARG;
+		uint32_t ipv4 = evbuffer_remove_32be(frame);
+		uint16_t port = evbuffer_remove_16be(frame);
+		uint32_t chunksize = evbuffer_remove_32be(frame);
+		if (chunksize == 0)
+			chunksize = SWIFT_DEFAULT_CHUNK_SIZE;
+		std::string strs[2];
+		for (int i=0; i<2; i++)
+		{
+			if (evbuffer_get_length(frame) < 2)
+				return ERROR_MISS_ARG;
+			uint16_t slen = evbuffer_remove_16be(frame);
+			if (evbuffer_get_length(frame) < slen)
+				return ERROR_MISS_ARG;
+			strs[i].assign((const char *)evbuffer_pullup(frame,slen),slen);
+			evbuffer_drain(frame,slen);
+		}
+		Address trackaddr(ipv4,port);
+		if (trackaddr==Address())
+			return ERROR_BAD_ARG;
+		return CmdGwGotSTART(cmdsock,root_hash,trackaddr,chunksize,strs[0],strs[1]);
+	}
+	else if (op == CMDGW_BIN_REMOVE)
+	{
+		if (len < 1)
+			return ERROR_MISS_ARG;
+		uint8_t flags = evbuffer_remove_8(frame);
+		return CmdGwGotREMOVE(root_hash,(flags & 1) != 0,(flags & 2) != 0);
+	}
+	else if (op == CMDGW_BIN_MAXSPEED)
+	{
+		if (len < 1+8)
+			return ERROR_MISS_ARG;
+		data_direction_t ddir = evbuffer_remove_8(frame) ? DDIR_UPLOAD : DDIR_DOWNLOAD;
+		uint64_t speed = evbuffer_remove_64be(frame);
+		int level = CMDGW_RATE_TRANSFER;
+		uint32_t arg = 0;
+		uint16_t port = 0;
+		if (evbuffer_get_length(frame) >= 1+4)
+		{
+			level = evbuffer_remove_8(frame);
+			arg = evbuffer_remove_32be(frame);
+			if (level == CMDGW_RATE_CHANNEL)
+			{
+				if (evbuffer_get_length(frame) < 2)
+					return ERROR_MISS_ARG;
+				port = evbuffer_remove_16be(frame);
+			}
+		}
+		return CmdGwGotMAXSPEED(root_hash,ddir,speed == (uint64_t)-1 ? DBL_MAX : (double)speed,
+				level,(int)arg,Address(arg,port));
+	}
+	else if (op == CMDGW_BIN_CHECKPOINT)
+		return CmdGwGotCHECKPOINT(root_hash);
+	else
+		return ERROR_UNKNOWN_CMD;
+}
+
+
+bool CmdGwReadFrame(evutil_socket_t cmdsock)
+{
+	// Parse cmd_evbuffer for a complete frame, execute it and reply
+	size_t avail = evbuffer_get_length(cmd_evbuffer);
+	if (avail < 4)
+		return false;
+	uint32_t flen;
+	evbuffer_copyout(cmd_evbuffer,&flen,4);
+	flen = ntohl(flen);
+	if (flen < CMDGW_BIN_HDR_SIZE || flen > CMDGW_BIN_MAX_FRAME)
+	{
+		dprintf("cmd: bad frame length %u\n", flen );
+		CmdGwCloseConnection(cmdsock);
+		return false;
+	}
+	if (avail < 4+flen)
+		return false;
+
+	evbuffer_drain(cmd_evbuffer,4);
+	struct evbuffer *frame = evbuffer_new();
+	evbuffer_remove_buffer(cmd_evbuffer,frame,flen);
+	uint8_t op = evbuffer_remove_8(frame);
+	uint32_t corrid = evbuffer_remove_32be(frame);
+
+	int ret = CmdGwHandleFrame(cmdsock,op,frame);
+	if (cmd_gw_debug)
+		fprintf(stderr,"cmd: frame op %d corrid %u: %d\n", op, corrid, ret );
+	evbuffer_free(frame);
+
+	// Reply goes around CmdGwSendBufferBySocket's event wrapping
+	struct evbuffer *reply = evbuffer_new();
+	evbuffer_add_32be(reply,CMDGW_BIN_HDR_SIZE+1);
+	evbuffer_add_8(reply,op|CMDGW_BIN_REPLY);
+	evbuffer_add_32be(reply,corrid);
+	evbuffer_add_8(reply,(uint8_t)(int8_t)ret);
+	cmdbevs_t::iterator iter = cmd_gw_bevs.find(cmdsock);
+	if (iter != cmd_gw_bevs.end())
+		bufferevent_write_buffer(iter->second,reply);
+	evbuffer_free(reply);
+	return true;
+}
+
+/*
+ * Start downloading/seeding root_hash for the given cmd connection.
+ * Shared by the text START command and the binary CMDGW_BIN_START frame.
+ */
+int CmdGwGotSTART(evutil_socket_t cmdsock, Sha1Hash &root_hash, Address trackaddr, uint32_t chunksize, std::string mfstr, std::string storagepath)
+{
+    // Arno, 2012-06-12: Check for duplicate requests
+    cmd_gw_t* req = CmdGwFindRequestByRootHash(root_hash);
+    if (req != NULL)
+    {
+    	dprintf("cmd: START: request for given root hash already exists\n");
+    	return ERROR_BAD_ARG;
+    }
+
+    // Send INFO DLSTATUS_HASHCHECKING
+	CmdGwSendINFOHashChecking(cmdsock,root_hash);
+
+	// ARNOSMPTODO: disable/interleave hashchecking at startup
+    int transfer = swift::Activate(root_hash);
+    bool activated = transfer != -1;
+    if (transfer==-1) {
+    	std::string filename;
+    	if (storagepath != "")
+    		filename = storagepath;
+    	else
+    		filename = root_hash.hex();
+        transfer = swift::Open(filename,root_hash,trackaddr,false,true,chunksize);
+        if (transfer == -1)
+        {
+        	CmdGwSendERRORBySocket(cmdsock,"bad swarm",root_hash);
+        	return ERROR_BAD_SWARM;
+        }
+    }
+
+    // All is well, register req
+    req = cmd_requests + cmd_gw_reqs_open++;
+    req->id = ++cmd_gw_reqs_count;
+    req->cmdsock = cmdsock;
+    req->transfer = transfer;
+    req->activated = activated;
+    req->startt = usec_mono_time();
+    req->mfspecname = mfstr;
+
+    dprintf("%s @%i start transfer %i\n",tintstr(),req->id,req->transfer);
+
+    // RATELIMIT
+    //FileTransfer::file(transfer)->SetMaxSpeed(DDIR_DOWNLOAD,512*1024);
+
+    if (cmd_gw_debug)
+    	fprintf(stderr,"cmd: Already on disk is %lli/%lli\n", swift::Complete(transfer), swift::Size(transfer));
+
+    // MULTIFILE
+    int64_t minsize=CMDGW_MAX_PREBUF_BYTES;
+    FileTransfer *ft = FileTransfer::file(transfer);
+    if (ft == NULL)
+    	return ERROR_BAD_ARG;
+	storage_files_t sfs = ft->GetStorage()->GetStorageFiles();
+	if (sfs.size() > 0)
+		minsize = sfs[0]->GetSize();
+
+    // Wait for prebuffering and then send PLAY to user
+    if (swift::SeqComplete(transfer) >= minsize)
+    {
+        CmdGwSwiftFirstProgressCallback(transfer,bin_t(0,0));
+        CmdGwSendINFO(req, DLSTATUS_DOWNLOADING);
+    }
+    else
+    {
+        swift::AddProgressCallback(transfer,&CmdGwSwiftFirstProgressCallback,CMDGW_FIRST_PROGRESS_BYTE_INTERVAL_AS_LAYER);
+    }
+
+    ft->GetStorage()->AddOneTimeAllocationCallback(CmdGwSwiftAllocatingDiskspaceCallback);
+
+    return ERROR_NO_ERROR;
+}
+
+
 int CmdGwHandleCommand(evutil_socket_t cmdsock, char *copyline);
 
 
@@ -831,71 +1259,7 @@ int CmdGwHandleCommand(evutil_socket_t cmdsock, char *copyline)
 
         // initiate transmission
         Sha1Hash root_hash = Sha1Hash(true,hashstr.c_str());
-
-        // Arno, 2012-06-12: Check for duplicate requests
-        cmd_gw_t* req = CmdGwFindRequestByRootHash(root_hash);
-        if (req != NULL)
-        {
-        	dprintf("cmd: START: request for given root hash already exists\n");
-        	return ERROR_BAD_ARG;
-        }
-
-        // Send INFO DLSTATUS_HASHCHECKING
-		CmdGwSendINFOHashChecking(cmdsock,root_hash);
-
-		// ARNOSMPTODO: disable/interleave hashchecking at startup
-        int transfer = swift::Find(root_hash);
-        if (transfer==-1) {
-        	std::string filename;
-        	if (storagepath != "")
-        		filename = storagepath;
-        	else
-        		filename = hashstr;
-            transfer = swift::Open(filename,root_hash,trackaddr,false,true,chunksize);
-            if (transfer == -1)
-            {
-            	CmdGwSendERRORBySocket(cmdsock,"bad swarm",root_hash);
-            	return ERROR_BAD_SWARM;
-            }
-        }
-
-        // All is well, register req
-        req = cmd_requests + cmd_gw_reqs_open++;
-        req->id = ++cmd_gw_reqs_count;
-        req->cmdsock = cmdsock;
-        req->transfer = transfer;
-        req->startt = usec_time();
-        req->mfspecname = mfstr;
-
-        dprintf("%s @%i start transfer %i\n",tintstr(),req->id,req->transfer);
-
-        // RATELIMIT
-        //FileTransfer::file(transfer)->SetMaxSpeed(DDIR_DOWNLOAD,512*1024);
-
-        if (cmd_gw_debug)
-        	fprintf(stderr,"cmd: Already on disk is %lli/%lli\n", swift::Complete(transfer), swift::Size(transfer));
-
-        // MULTIFILE
-        int64_t minsize=CMDGW_MAX_PREBUF_BYTES;
-        FileTransfer *ft = FileTransfer::file(transfer);
-        if (ft == NULL)
-        	return ERROR_BAD_ARG;
-		storage_files_t sfs = ft->GetStorage()->GetStorageFiles();
-		if (sfs.size() > 0)
-			minsize = sfs[0]->GetSize();
-
-        // Wait for prebuffering and then send PLAY to user
-        if (swift::SeqComplete(transfer) >= minsize)
-        {
-            CmdGwSwiftFirstProgressCallback(transfer,bin_t(0,0));
-            CmdGwSendINFO(req, DLSTATUS_DOWNLOADING);
-        }
-        else
-        {
-            swift::AddProgressCallback(transfer,&CmdGwSwiftFirstProgressCallback,CMDGW_FIRST_PROGRESS_BYTE_INTERVAL_AS_LAYER);
-        }
-
-        ft->GetStorage()->AddOneTimeAllocationCallback(CmdGwSwiftAllocatingDiskspaceCallback);
+        return CmdGwGotSTART(cmdsock,root_hash,trackaddr,chunksize,mfstr,storagepath);
     }
     else if (!strcmp(method,"REMOVE"))
     {
@@ -920,7 +1284,8 @@ int CmdGwHandleCommand(evutil_socket_t cmdsock, char *copyline)
     }
     else if (!strcmp(method,"MAXSPEED"))
     {
-    	// MAXSPEED roothash direction speed-float-kb/s\r\n
+    	// MAXSPEED roothash direction speed-float-kb/s [peer-ip:port]\r\n
+    	// MAXSPEED PROCESS|CLASS:n direction speed-float-kb/s\r\n
     	data_direction_t ddir;
     	double speed;
 
@@ -932,7 +1297,7 @@ int CmdGwHandleCommand(evutil_socket_t cmdsock, char *copyline)
         if (token == NULL)
         	return ERROR_MISS_ARG;
         ddir = !strcmp(token,"DOWNLOAD") ? DDIR_DOWNLOAD : DDIR_UPLOAD;
-        token = strtok_r(NULL,"",&savetok);       // speed
+        token = strtok_r(NULL," ",&savetok);      // speed
         if (token == NULL)
         	return ERROR_MISS_ARG;
         int n = sscanf(token,"%lf",&speed);
@@ -940,8 +1305,31 @@ int CmdGwHandleCommand(evutil_socket_t cmdsock, char *copyline)
         	dprintf("cmd: MAXSPEED: speed is not a float\n");
 			return ERROR_MISS_ARG;
         }
-    	Sha1Hash root_hash = Sha1Hash(true,hashstr);
-    	CmdGwGotMAXSPEED(root_hash,ddir,speed*1024.0);
+        token = strtok_r(NULL,"",&savetok);       // optional peer
+
+        int level = CMDGW_RATE_TRANSFER, cls = 0;
+        Address peer;
+        Sha1Hash root_hash;
+        if (!strcmp(hashstr,"PROCESS"))
+        	level = CMDGW_RATE_PROCESS;
+        else if (!strncmp(hashstr,"CLASS:",6))
+        {
+        	level = CMDGW_RATE_CLASS;
+        	if (sscanf(hashstr+6,"%d",&cls) != 1)
+        		return ERROR_BAD_ARG;
+        }
+        else
+        {
+        	root_hash = Sha1Hash(true,hashstr);
+        	if (token != NULL)
+        	{
+        		level = CMDGW_RATE_CHANNEL;
+        		peer = Address(token);
+        		if (peer == Address())
+        			return ERROR_BAD_ARG;
+        	}
+        }
+    	CmdGwGotMAXSPEED(root_hash,ddir,speed*1024.0,level,cls,peer);
     }
     else if (!strcmp(method,"CHECKPOINT"))
     {
@@ -963,6 +1351,46 @@ int CmdGwHandleCommand(evutil_socket_t cmdsock, char *copyline)
     	Sha1Hash root_hash = Sha1Hash(true,hashstr);
     	CmdGwGotSETMOREINFO(root_hash,enable);
     }
+    else if (!strcmp(method,"TRACEDUMP"))
+    {
+    	// TRACEDUMP path\r\n
+    	// Writes the binary trace ring to path (see trace.h, tracedecode)
+    	if (strlen(paramstr) == 0)
+    		return ERROR_MISS_ARG;
+    	int64_t count = TraceRing::Dump(paramstr,Channel::epoch);
+    	if (count < 0)
+    	{
+    		// Not fatal, like bad swarm
+    		CmdGwSendERRORBySocket(cmdsock,"cannot write trace dump");
+    		return ERROR_NO_ERROR;
+    	}
+    	char reply[1024];
+    	snprintf(reply,sizeof(reply),"TRACEDUMP %lld %s\r\n",(long long)count,paramstr);
+    	CmdGwSendBySocket(cmdsock,reply,strlen(reply));
+    }
+    else if (!strcmp(method,"SETRATECLASS"))
+    {
+    	// SETRATECLASS roothash class\r\n
+    	// Moves the transfer under the MAXSPEED CLASS:class bucket
+        token = strtok_r(paramstr," ",&savetok); //
+        if (token == NULL)
+        	return ERROR_MISS_ARG;
+        char *hashstr = token;
+        token = strtok_r(NULL,"",&savetok);       // class
+        if (token == NULL)
+        	return ERROR_MISS_ARG;
+        int cls = 0;
+        if (sscanf(token,"%d",&cls) != 1)
+        	return ERROR_BAD_ARG;
+    	Sha1Hash root_hash = Sha1Hash(true,hashstr);
+    	CmdGwGotSETRATECLASS(root_hash,cls);
+    }
+    else if (!strcmp(method,"BINARY"))
+    {
+    	// BINARY\r\n
+    	// Rest of the connection uses frames, see CMDGW_BIN_*
+    	cmd_gw_binary_socks.insert(cmdsock);
+    }
     else if (!strcmp(method,"SHUTDOWN"))
     {
     	CmdGwCloseConnection(cmdsock);
@@ -1025,6 +1453,7 @@ int CmdGwHandleCommand(evutil_socket_t cmdsock, char *copyline)
 
 void CmdGwEventCameInCallback(struct bufferevent *bev, short events, void *ctx)
 {
+	Channel::Time();
 	if (events & BEV_EVENT_ERROR)
 		print_error("cmdgw: Error from bufferevent");
     if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR))
@@ -1032,7 +1461,6 @@ void CmdGwEventCameInCallback(struct bufferevent *bev, short events, void *ctx)
     	// Called when error on cmd connection
     	evutil_socket_t cmdsock = bufferevent_getfd(bev);
     	CmdGwCloseConnection(cmdsock);
-		bufferevent_free(bev);
     }
 }
 
@@ -1042,6 +1470,7 @@ void CmdGwNewConnectionCallback(struct evconnlistener *listener,
     void *ctx)
 {
     // New TCP connection on cmd listen socket
+    Channel::Time();
 
     fprintf(stderr,"cmd: Got new cmd connection %i\n",fd);
 
@@ -1050,13 +1479,15 @@ void CmdGwNewConnectionCallback(struct evconnlistener *listener,
 
     bufferevent_setcb(bev, CmdGwDataCameInCallback, NULL, CmdGwEventCameInCallback, NULL);
     bufferevent_enable(bev, EV_READ|EV_WRITE);
-
-    // ARNOTODO: free bufferevent when conn closes.
+    cmd_gw_bevs[fd] = bev;
+    // Text until it sends BINARY, also if fd is reused
+    cmd_gw_binary_socks.erase(fd);
 
     // One buffer for all cmd connections, reset
     if (cmd_evbuffer != NULL)
 	evbuffer_free(cmd_evbuffer);
     cmd_evbuffer = evbuffer_new();
+    cmd_tunnel_state = CMDGW_TUNNEL_SCAN4CRLF;
 
     // SOCKTUNNEL: assume 1 command connection
     cmd_tunnel_sock = fd;
@@ -1130,11 +1561,11 @@ void swift::CmdGwTunnelUDPDataCameIn(Address srcaddr, uint32_t srcchan, struct e
 
 	std::stringbuf *pbuf=oss.rdbuf();
 	size_t slen = strlen(pbuf->str().c_str());
-	send(cmd_tunnel_sock,pbuf->str().c_str(),slen,0);
+	CmdGwSendBySocket(cmd_tunnel_sock,pbuf->str().c_str(),slen);
 
 	slen = evbuffer_get_length(evb);
 	uint8_t *data = evbuffer_pullup(evb,slen);
-	send(cmd_tunnel_sock,(const char *)data,slen,0);
+	CmdGwSendBySocket(cmd_tunnel_sock,(const char *)data,slen);
 
 	evbuffer_drain(evb,slen);
 }
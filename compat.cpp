@@ -21,6 +21,10 @@
 #else
 #include <unistd.h>
 #include <sys/time.h>
+#include <time.h>
+#ifdef __APPLE__
+#include <mach/mach_time.h>
+#endif
 #endif
 #include <iostream>
 #include <sstream>
@@ -74,12 +78,12 @@ void print_error(const char* msg) {
 #endif
 }
 
-void*   memory_map (int fd, size_t size) {
+void*   memory_map (int fd, size_t size, bool readonly) {
     if (!size)
         size = file_size(fd);
     void *mapping;
 #ifndef _WIN32
-    mapping = mmap (NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    mapping = mmap (NULL, size, readonly ? PROT_READ : PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
     if (mapping==MAP_FAILED)
         return NULL;
     return mapping;
@@ -87,7 +91,7 @@ void*   memory_map (int fd, size_t size) {
     HANDLE fhandle = (HANDLE)_get_osfhandle(fd);
     HANDLE maphandle = CreateFileMapping(     fhandle,
                                        NULL,
-                                       PAGE_READWRITE,
+                                       readonly ? PAGE_READONLY : PAGE_READWRITE,
                                        0,
                                        0,
                                        NULL    );
@@ -96,7 +100,7 @@ void*   memory_map (int fd, size_t size) {
     map_handles[fd] = maphandle;
 
     mapping = MapViewOfFile         (  maphandle,
-                                       FILE_MAP_WRITE,
+                                       readonly ? FILE_MAP_READ : FILE_MAP_WRITE,
                                        0,
                                        0,
                                        0  );
@@ -108,7 +112,6 @@ void*   memory_map (int fd, size_t size) {
 void    memory_unmap (int fd, void* mapping, size_t size) {
 #ifndef _WIN32
     munmap(mapping,size);
-    close(fd);
 #else
     UnmapViewOfFile(mapping);
     CloseHandle(map_handles[fd]);
@@ -176,6 +179,42 @@ tint usec_time(void)
 
 #endif
 
+
+#ifdef _WIN32
+
+tint usec_mono_time(void)
+{
+	// QueryPerformanceCounter does not step
+	return usec_time();
+}
+
+#else
+
+/** Raw monotonic clock, arbitrary origin */
+static tint usec_mono_raw(void)
+{
+#ifdef __APPLE__
+    static mach_timebase_info_data_t tb;
+    if (tb.denom == 0)
+        mach_timebase_info(&tb);
+    return (tint)(mach_absolute_time() * tb.numer / tb.denom / 1000);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (tint)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+tint usec_mono_time(void)
+{
+    // Anchored to the wall clock once, so values still look like
+    // usec_time() to logs and peers, but NTP steps no longer move them.
+    static tint offset = usec_time() - usec_mono_raw();
+    return usec_mono_raw() + offset;
+}
+
+#endif
+
 void LibraryInit(void)
 {
 #ifdef _WIN32
@@ -271,6 +310,25 @@ int64_t file_size_by_path_utf8(std::string pathname) {
     	return st.st_size;
 }
 
+int file_stat_utf8(std::string pathname, int64_t *size, int64_t *mtime)
+{
+	int ret = 0;
+#ifdef WIN32
+	struct __stat64 st;
+	wchar_t *utf16c = utf8to16(pathname);
+    ret = _wstat64(utf16c, &st);
+	free(utf16c);
+#else
+    struct stat st;
+    ret = stat(pathname.c_str(), &st);  // TODO: UNIX with locale != UTF-8
+#endif
+    if (ret < 0)
+    	return ret;
+    *size = st.st_size;
+    *mtime = st.st_mtime;
+    return 0;
+}
+
 int file_exists_utf8(std::string pathname)
 {
 	int ret = 0;
@@ -323,6 +381,48 @@ int remove_utf8(std::string pathname)
 }
 
 
+int rename_utf8(std::string oldpathname, std::string newpathname)
+{
+#ifdef WIN32
+	wchar_t *oldutf16c = utf8to16(oldpathname);
+	wchar_t *newutf16c = utf8to16(newpathname);
+	int ret = MoveFileExW(oldutf16c,newutf16c,MOVEFILE_REPLACE_EXISTING) ? 0 : -1;
+	free(oldutf16c);
+	free(newutf16c);
+#else
+	int ret = rename(oldpathname.c_str(),newpathname.c_str()); // TODO: UNIX with locale != UTF-8
+#endif
+	return ret;
+}
+
+
+int     file_sync (int fd)
+{
+#ifdef _WIN32
+	return _commit(fd);
+#else
+	return fsync(fd);
+#endif
+}
+
+
+int write_atomic_utf8(std::string pathname, const void *buf, size_t nbyte)
+{
+	std::string tmppathname = pathname+".part";
+	int fd = open_utf8(tmppathname.c_str(),OPENFLAGS|O_TRUNC,S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+	if (fd < 0)
+		return -1;
+	bool ok = pwrite(fd,buf,nbyte,0) == nbyte;
+	ok = ok && file_sync(fd) == 0;
+	close(fd);
+	if (!ok || rename_utf8(tmppathname,pathname) < 0) {
+		remove_utf8(tmppathname);
+		return -1;
+	}
+	return 0;
+}
+
+
 
 #if _DIR_ENT_HAVE_D_TYPE
 #define TEST_IS_DIR(unixde, st) ((bool)(unixde->d_type & DT_DIR))
@@ -179,12 +179,23 @@ int64_t file_size_by_path_utf8(std::string pathname);
 /* Returns -1 on error, 0 on non-existence, 1 on existence and being a non-dir, 2 on existence and being a dir */
 int file_exists_utf8(std::string pathname);
 
+/* Size and modification time (seconds) of pathname. Returns -1 on error */
+int file_stat_utf8(std::string pathname, int64_t *size, int64_t *mtime);
+
 // mkdir with filename in UTF-8
 int mkdir_utf8(std::string dirname);
 
 // remove with filename in UTF-8
 int remove_utf8(std::string pathname);
 
+// rename with filenames in UTF-8, replacing newpathname if it exists
+int rename_utf8(std::string oldpathname, std::string newpathname);
+
+/* Writes buf to pathname with a single write to a temporary file that is
+ * synced and renamed over pathname, so readers see the old or the new
+ * content, never a partial one. Returns -1 on error. */
+int write_atomic_utf8(std::string pathname, const void *buf, size_t nbyte);
+
 
 // opendir() + readdir() UTF-8 versions
 class DirEntry
@@ -221,7 +232,11 @@ int     file_seek (int fd, int64_t offset);
 
 int     file_resize (int fd, int64_t new_size);
 
-void*   memory_map (int fd, size_t size=0);
+/** fsync(), also flushes changes made through memory_map() */
+int     file_sync (int fd);
+
+void*   memory_map (int fd, size_t size=0, bool readonly=false);
+/** Does not close fd, like on Win32 */
 void    memory_unmap (int fd, void*, size_t size);
 
 void    print_error (const char* msg);
@@ -238,8 +253,12 @@ int     inet_aton(const char *cp, struct in_addr *inp);
 
 #endif
 
+/** Wall clock, for timestamps shown to users */
 tint    usec_time ();
 
+/** Monotonic clock, for all protocol timing (RTT, LEDBAT, timers) */
+tint    usec_mono_time ();
+
 bool    make_socket_nonblocking(evutil_socket_t s);
 
 bool    close_socket (evutil_socket_t sock);
@@ -0,0 +1,196 @@
+/*
+ *  dormant.cpp
+ *  registry of seeded swarms whose transfers are opened on the first
+ *  handshake and closed again when idle, so a large catalogue costs no
+ *  file descriptors or hash trees for content nobody asks for.
+ *
+ *  Copyright 2009-2012 TECHNISCHE UNIVERSITEIT DELFT. All rights reserved.
+ *
+ */
+#include "swift.h"
+#include "compat.h"
+
+using namespace swift;
+
+
+DormantRegistry * DormantRegistry::__singleton = NULL;
+
+const tint DormantRegistry::IDLE_TIMEOUT;
+const tint DormantRegistry::CLEANUP_INTERVAL;
+
+
+DormantRegistry::DormantRegistry()
+{
+	if (__singleton == NULL)
+		__singleton = this;
+
+	evtimer_assign(&evclean_,Channel::evbase,&DormantRegistry::LibeventCleanCallback,this);
+	evtimer_add(&evclean_,tint2tv(CLEANUP_INTERVAL));
+}
+
+
+DormantRegistry::~DormantRegistry()
+{
+	evtimer_del(&evclean_);
+	if (__singleton == this)
+		__singleton = NULL;
+}
+
+
+DormantRegistry * DormantRegistry::GetInstance()
+{
+	if (__singleton == NULL)
+		new DormantRegistry();
+	return __singleton;
+}
+
+
+int DormantRegistry::Add(std::string filename, const Sha1Hash &root_hash, uint32_t chunk_size, Address tracker)
+{
+	// Same requirements as ZeroState: opening must not have to hashcheck
+	if (root_hash == Sha1Hash::ZERO || file_exists_utf8(filename) != 1 ||
+	    file_exists_utf8(filename+".mhash") != 1 || file_exists_utf8(filename+".mbinmap") != 1)
+		return -1;
+
+	std::map<Sha1Hash,dormant_t>::iterator iter = swarms_.find(root_hash);
+	if (iter != swarms_.end()) {
+		iter->second.filename = filename;
+		iter->second.chunk_size = chunk_size;
+		iter->second.tracker = tracker;
+		return 0;
+	}
+	dormant_t d;
+	d.filename = filename;
+	d.chunk_size = chunk_size;
+	d.tracker = tracker;
+	d.fd = -1;
+	d.pins = 0;
+	d.idle_since = 0;
+	swarms_[root_hash] = d;
+	return 0;
+}
+
+
+void DormantRegistry::Remove(const Sha1Hash &root_hash)
+{
+	std::map<Sha1Hash,dormant_t>::iterator iter = swarms_.find(root_hash);
+	if (iter == swarms_.end())
+		return;
+	if (Transfer(iter->second) != NULL)
+		Close(iter->second);
+	active_.erase(root_hash);
+	swarms_.erase(iter);
+}
+
+
+/** The open transfer, NULL if dormant. It may have been closed by others. */
+FileTransfer *DormantRegistry::Transfer(dormant_t &d)
+{
+	if (d.fd < 0)
+		return NULL;
+	FileTransfer *ft = FileTransfer::file(d.fd);
+	if (ft != NULL && !ft->IsZeroState() && FileTransfer::Find(ft->root_hash()) == ft &&
+	    swarms_.count(ft->root_hash()) && &swarms_[ft->root_hash()] == &d)
+		return ft;
+	d.fd = -1;
+	return NULL;
+}
+
+
+void DormantRegistry::Close(dormant_t &d)
+{
+	// Checkpointing keeps progress made while active, if it was a leecher
+	swift::CheckpointIfDue(d.fd);
+	swift::Close(d.fd);
+	d.fd = -1;
+	d.idle_since = 0;
+}
+
+
+FileTransfer *DormantRegistry::Activate(const Sha1Hash &root_hash, bool pin)
+{
+	std::map<Sha1Hash,dormant_t>::iterator iter = swarms_.find(root_hash);
+	if (iter == swarms_.end())
+		return NULL;
+	dormant_t &d = iter->second;
+	if (pin)
+		d.pins++;
+	FileTransfer *ft = Transfer(d);
+	if (ft == NULL) {
+		// Opened elsewhere is not ours to close
+		ft = FileTransfer::Find(root_hash);
+	}
+	if (ft == NULL) {
+		dprintf("%s dormant activate %s\n",tintstr(),root_hash.hex().c_str());
+		d.fd = swift::Open(d.filename,root_hash,d.tracker,false,true,d.chunk_size);
+		ft = FileTransfer::file(d.fd);
+		if (ft == NULL) {
+			d.fd = -1;
+			return NULL;
+		}
+		d.idle_since = 0;
+		active_.insert(root_hash);
+	}
+	return ft;
+}
+
+
+void DormantRegistry::Unpin(const Sha1Hash &root_hash)
+{
+	std::map<Sha1Hash,dormant_t>::iterator iter = swarms_.find(root_hash);
+	if (iter == swarms_.end() || iter->second.pins == 0)
+		return;
+	// Idle from now on, if no channels
+	if (--iter->second.pins == 0)
+		iter->second.idle_since = 0;
+}
+
+
+void DormantRegistry::Deactivate(tint idle_timeout)
+{
+	std::set<Sha1Hash> closeset;
+	std::set<Sha1Hash>::iterator iter;
+	for (iter=active_.begin(); iter!=active_.end(); iter++)
+	{
+		std::map<Sha1Hash,dormant_t>::iterator si = swarms_.find(*iter);
+		if (si == swarms_.end())
+			continue;
+		dormant_t &d = si->second;
+		FileTransfer *ft = Transfer(d);
+		if (ft == NULL || d.pins > 0) {
+			if (ft == NULL)
+				closeset.insert(*iter);
+			continue;
+		}
+		if (ft->GetChannels().size() > 0)
+			d.idle_since = 0;
+		else if (d.idle_since == 0)
+			d.idle_since = NOW;
+		if (d.idle_since != 0 && NOW-d.idle_since >= idle_timeout)
+			closeset.insert(*iter);
+	}
+
+	for (iter=closeset.begin(); iter!=closeset.end(); iter++)
+	{
+		dormant_t &d = swarms_[*iter];
+		if (d.fd >= 0) {
+			dprintf("%s dormant deactivate %s\n",tintstr(),iter->hex().c_str());
+			Close(d);
+		}
+		active_.erase(*iter);
+	}
+}
+
+
+void DormantRegistry::LibeventCleanCallback(int fd, short event, void *arg)
+{
+	// Idle times are measured against NOW
+	Channel::Time();
+
+	DormantRegistry *dr = (DormantRegistry *)arg;
+	if (dr == NULL)
+		return;
+	dr->Deactivate();
+
+	evtimer_add(&(dr->evclean_),tint2tv(CLEANUP_INTERVAL));
+}
@@ -0,0 +1,113 @@
+/*
+ *  live_picker.cpp
+ *  swift
+ *
+ *  Picks pieces of a live stream: joins a few chunks behind the newest
+ *  chunk offered, then goes forward nearly sequentially. Chunks that
+ *  have left the live window are never asked for.
+ *
+ *  Copyright 2009-2012 TECHNISCHE UNIVERSITEIT DELFT. All rights reserved.
+ *
+ */
+
+#include "swift.h"
+#include <cassert>
+
+using namespace swift;
+
+#define LIVE_HOOKIN_LAG     4   // chunks behind the live edge to start at
+#define LIVE_MAX_LAG        4   // lag at most 1/LIVE_MAX_LAG of the window
+
+
+class LivePiecePicker : public PiecePicker {
+
+    /** Hinted or received chunks, plus everything before skip_ */
+    binmap_t        ack_hint_out_;
+    tbqueue         hint_out_;
+    FileTransfer*   transfer_;
+    uint64_t        twist_;
+    bin_t           range_;
+    bool            hooked_;
+    uint64_t        skip_;
+
+public:
+
+    LivePiecePicker (FileTransfer* file_to_pick_from) : ack_hint_out_(),
+           transfer_(file_to_pick_from), twist_(0), range_(bin_t::ALL),
+           hooked_(false), skip_(0) {
+    }
+    virtual ~LivePiecePicker() {}
+
+    HashTree * hashtree() {
+        return transfer_->hashtree();
+    }
+
+    virtual void Randomize (uint64_t twist) {
+        twist_ = twist;
+    }
+
+    virtual void LimitRange (bin_t range) {
+        range_ = range;
+    }
+
+    /** Marks [0,upto) as not wanted, as the aligned bins gen_peaks gives */
+    void SkipTo (uint64_t upto) {
+        bin_t peaks[64];
+        int n = gen_peaks(upto,peaks);
+        for (int i=0; i<n; i++)
+            ack_hint_out_.set(peaks[i]);
+        skip_ = upto;
+    }
+
+    virtual bin_t Pick (binmap_t& offer, uint64_t max_width, tint expires) {
+        if (hashtree()->is_complete())
+            return bin_t::NONE; // live source
+        bool expired = false;
+        while (hint_out_.size() && hint_out_.front().time<NOW-TINT_SEC*3/2) { // FIXME sec
+            binmap_t::copy(ack_hint_out_, *(hashtree()->ack_out()), hint_out_.front().bin);
+            hint_out_.pop_front();
+            expired = true;
+        }
+        if (!hooked_) {
+            bin_t first = offer.find_filled();
+            if (first.is_none())
+                return bin_t::NONE;
+            bin_t edge = offer.find_empty(first);
+            uint64_t e = edge.is_none() ? first.base_right().base_offset()+1 : edge.base_offset();
+            SkipTo(e > LIVE_HOOKIN_LAG ? e-LIVE_HOOKIN_LAG : 0);
+            hooked_ = true;
+        }
+        // Prefer the live edge: rather skip chunks than lag more than
+        // 1/LIVE_MAX_LAG of the window behind
+        uint64_t edge = hashtree()->size_in_chunks();
+        uint64_t maxlag = std::max((uint64_t)LIVE_HOOKIN_LAG,hashtree()->live_window()/LIVE_MAX_LAG);
+        uint64_t want = std::max(hashtree()->live_start(),edge>maxlag ? edge-maxlag : 0);
+        if (want > skip_)
+            SkipTo(want);
+        else if (expired && skip_ > 0)
+            SkipTo(skip_);
+
+    retry:
+        bin_t hint = binmap_t::find_complement(ack_hint_out_, offer, twist_ & ((1<<6)-1));
+        if (hint.is_none())
+            return hint;
+
+        if (!hashtree()->ack_out()->is_empty(hint)) { // unhinted/late data
+            binmap_t::copy(ack_hint_out_, *(hashtree()->ack_out()), hint);
+            if (hint.base_offset() < skip_)
+                SkipTo(skip_);
+            goto retry;
+        }
+        while (hint.base_length()>max_width)
+            hint = hint.left();
+        assert(ack_hint_out_.is_empty(hint));
+        ack_hint_out_.set(hint);
+        hint_out_.push_back(tintbin(NOW,hint));
+        return hint;
+    }
+
+    int Seek(bin_t offbin, int whence)
+    {
+        return -1;
+    }
+};
@@ -28,6 +28,7 @@ class VodPiecePicker : public PiecePicker {
     uint64_t        twist_;
     bin_t           range_;
     int				playback_pos_;		// playback position in KB
+    std::vector<std::pair<int,int> > windows_;	// (pos,size) of consumers' windows, by priority
     int				high_pri_window_;
     bin_t           initseq_;			// Hack by Arno to avoid large hints at startup
 
@@ -40,6 +41,7 @@ public:
         binmap_t::copy(ack_hint_out_, *(hashtree()->ack_out()));
         playback_pos_ = -1;
         high_pri_window_ = HIGHPRIORITYWINDOW;
+        windows_.assign(1,std::make_pair(-1,high_pri_window_));
     }
 
     virtual ~VodPiecePicker() {}
@@ -70,9 +72,9 @@ public:
     }
 
 
-    bin_t pickUrgent (binmap_t& offer, uint64_t max_width, uint64_t size) {
+    bin_t pickUrgent (binmap_t& offer, uint64_t max_width, int pos, uint64_t size) {
 
-    	bin_t curr = bin_t((playback_pos_+1)<<1); // the base bin will be indexed by the double of the value (bin(4) == bin(0,2))
+    	bin_t curr = bin_t((pos+1)<<1); // the base bin will be indexed by the double of the value (bin(4) == bin(0,2))
     	bin_t hint = bin_t::NONE;
     	uint64_t examined = 0;
 		binmap_t binmap;
@@ -80,7 +82,7 @@ public:
     	// report the first bin we find
     	while (hint.is_none() && examined < size)
     	{
-    		curr = getTopBin(curr, (playback_pos_+1)<<1, size-examined);
+    		curr = getTopBin(curr, (pos+1)<<1, size-examined);
     		if (!ack_hint_out_.is_filled(curr))
     		{
     			binmap.fill(offer);
@@ -187,11 +189,16 @@ public:
         }
 
         do {
-        	uint64_t max_size = hashtree()->size_in_chunks() - playback_pos_ - 1;
-        	max_size = high_pri_window_ < max_size ? high_pri_window_ : max_size;
-
-			// check the high priority window for data we r missing
-			hint = pickUrgent(offer, max_width, max_size);
+        	// check the high priority windows for data we r missing,
+        	// in order of priority
+        	hint = bin_t::NONE;
+        	for (int i=0; i<windows_.size() && hint.is_none(); i++)
+        	{
+        		int pos = windows_[i].first;
+        		uint64_t max_size = hashtree()->size_in_chunks() - pos - 1;
+        		max_size = windows_[i].second < max_size ? windows_[i].second : max_size;
+        		hint = pickUrgent(offer, max_width, pos, max_size);
+        	}
 
 			// check the mid priority window
 			uint64_t start = (1 + playback_pos_) + HIGHPRIORITYWINDOW;	// start in KB
@@ -200,7 +207,7 @@ public:
 				int mid = MIDPRIORITYWINDOW;
 				int size = mid * HIGHPRIORITYWINDOW;						// size of window in KB
 				// check boundaries
-				max_size = hashtree()->size_in_chunks() - start;
+				uint64_t max_size = hashtree()->size_in_chunks() - start;
 				max_size = size < max_size ? size : max_size;
 
 				hint = pickRarest(offer, max_width, start, max_size);
@@ -264,6 +271,43 @@ public:
     	if (whence != SEEK_SET)
     		return -1;
 
+    	int cid = bin2pos(offbin);
+    	if (cid < -1)
+    		return -1;
+
+    	playback_pos_ = cid;
+    	windows_.assign(1,std::make_pair(cid,high_pri_window_));
+    	return 0;
+    }
+
+    int SeekMulti(binwindows_t windows)
+    {
+    	std::vector<std::pair<int,int> > wins;
+    	int minpos = -1;
+    	for (int i=0; i<windows.size(); i++)
+    	{
+    		int cid = bin2pos(windows[i].first);
+    		if (cid < -1)
+    			continue;
+    		// high priority window is at most as large as the consumer's
+    		int size = windows[i].second.layer_offset() - cid;
+    		if (size > high_pri_window_)
+    			size = high_pri_window_;
+    		wins.push_back(std::make_pair(cid,size));
+    		if (wins.size() == 1 || cid < minpos)
+    			minpos = cid;
+    	}
+    	if (wins.empty())
+    		return -1;
+
+    	windows_ = wins;
+    	playback_pos_ = minpos; // mid/low windows follow earliest
+    	return 0;
+    }
+
+    /** Playback position in chunks of a bin, -2 if beyond content */
+    int bin2pos(bin_t offbin)
+    {
     	// TODO: convert playback_pos_ to a bin number
     	uint64_t cid = offbin.toUInt()/2;
     	if (cid > 0)
@@ -272,10 +316,8 @@ public:
     	//fprintf(stderr,"vodpp: pos in K %llu size %llu\n", cid, hashtree()->size_in_chunks() );
 
     	if (cid > hashtree()->size_in_chunks())
-    		return -1;
-
-    	playback_pos_ = cid;
-    	return 0;
+    		return -2;
+    	return cid;
     }
 
     void status()
@@ -77,10 +77,12 @@ std::string    Sha1Hash::hex() const {
 /**     H a s h   t r e e       */
 
 
-MmapHashTree::MmapHashTree (Storage *storage, const Sha1Hash& root_hash, uint32_t chunk_size, std::string hash_filename, bool force_check_diskvshash, bool check_netwvshash, std::string binmap_filename) :
+MmapHashTree::MmapHashTree (Storage *storage, const Sha1Hash& root_hash, uint32_t chunk_size, std::string hash_filename, bool force_check_diskvshash, bool check_netwvshash, std::string binmap_filename, tint time) :
  HashTree(), root_hash_(root_hash), hashes_(NULL),
  peak_count_(0), hash_fd_(-1), hash_filename_(hash_filename), size_(0), sizec_(0), complete_(0), completec_(0),
- chunk_size_(chunk_size), storage_(storage), check_netwvshash_(check_netwvshash)
+ chunk_size_(chunk_size), storage_(storage), check_netwvshash_(check_netwvshash),
+ live_window_(0), live_start_(0), live_source_(false), live_peak_in_count_(0),
+ checkpoint_complete_(0), checkpoint_time_(time != 0 ? time : NOW), checkpoint_written_(0)
 {
     // MULTIFILE
     storage_->SetHashTree(this);
@@ -142,17 +144,10 @@ MmapHashTree::MmapHashTree (Storage *storage, const Sha1Hash& root_hash, uint32_
     } else if (mhash_exists && binmap_exists && mhash_size > 0) {
     	// Arno: recreate hash tree without rereading content
     	dprintf("%s hashtree read from checkpoint\n",tintstr());
-    	FILE *fp = fopen_utf8(binmap_filename.c_str(),"rb");
-    	if (!fp) {
-    		 print_error("hashtree: cannot open .mbinmap file");
-    		 SetBroken();
-    		 return;
-    	}
-    	if (deserialize(fp) < 0) {
+    	if (LoadCheckpoint(binmap_filename,true) < 0) {
     		// Try to rebuild hashtree data
     		Submit();
     	}
-    	fclose(fp);
     } else {
     	// Arno: no data on disk, or mhash on disk, but no binmap. In latter
     	// case recreate binmap by reading content again. Historic optimization
@@ -166,18 +161,30 @@ MmapHashTree::MmapHashTree (Storage *storage, const Sha1Hash& root_hash, uint32_
 MmapHashTree::MmapHashTree(bool dummy, std::string binmap_filename) :
 HashTree(), root_hash_(Sha1Hash::ZERO), hashes_(NULL), peak_count_(0), hash_fd_(0),
 hash_filename_(""), filename_(""), size_(0), sizec_(0), complete_(0), completec_(0),
-chunk_size_(0), check_netwvshash_(false)
+chunk_size_(0), check_netwvshash_(false),
+live_window_(0), live_start_(0), live_source_(false), live_peak_in_count_(0),
+ checkpoint_complete_(0), checkpoint_time_(NOW), checkpoint_written_(0)
 {
-	FILE *fp = fopen_utf8(binmap_filename.c_str(),"rb");
-	if (!fp) {
+	if (file_exists_utf8(binmap_filename) != 1) {
 		 SetBroken();
 		 return;
 	}
-	if (partial_deserialize(fp) < 0) {
-	}
-	fclose(fp);
+	LoadCheckpoint(binmap_filename,false);
+}
+
+MmapHashTree::MmapHashTree (Storage *storage, const Sha1Hash& swarm_id, uint32_t chunk_size, uint64_t live_window, bool live_source) :
+ HashTree(), root_hash_(swarm_id), hashes_(NULL),
+ peak_count_(0), hash_fd_(-1), size_(0), sizec_(0), complete_(0), completec_(0),
+ chunk_size_(chunk_size), storage_(storage), check_netwvshash_(true),
+ live_window_(live_window), live_start_(0), live_source_(live_source), live_peak_in_count_(0),
+ checkpoint_complete_(0), checkpoint_time_(NOW), checkpoint_written_(0)
+{
+    storage_->SetHashTree(this);
+    if (live_window_ == 0)
+        SetBroken();
 }
 
+
 int MmapHashTree::OpenHashFile() {
     hash_fd_ = open_utf8(hash_filename_.c_str(),OPENFLAGS,S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
     if (hash_fd_<0) {
@@ -225,8 +232,9 @@ void            MmapHashTree::Submit () {
 
         ssize_t rd = storage_->Read(chunk,chunk_size_,i*chunk_size_);
         if (rd<(chunk_size_) && i!=sizec_-1) {
-            free(hashes_);
+            memory_unmap(hash_fd_,hashes_,hashes_size);
             hashes_=NULL;
+            delete [] chunk;
             SetBroken();
             return;
         }
@@ -240,7 +248,7 @@ void            MmapHashTree::Submit () {
         complete_+=rd;
         completec_++;
     }
-    delete chunk;
+    delete [] chunk;
     for (int p=0; p<peak_count_; p++) {
         peak_hashes_[p] = hashes_[peaks_[p].toUInt()];
     }
@@ -368,6 +376,12 @@ int MmapHashTree::internal_deserialize(FILE *fp,bool contentavail) {
 	root_hash_ = Sha1Hash(true, hexhashstr);
 	chunk_size_ = cs;
 
+	return RestoreCheckpoint(c,cc,contentavail);
+}
+
+
+int MmapHashTree::RestoreCheckpoint(uint64_t c, uint64_t cc, bool contentavail) {
+
 	// Arno, 2012-01-03: Hack to just get root hash
 	if (!contentavail)
 		return 2;
@@ -383,11 +397,101 @@ int MmapHashTree::internal_deserialize(FILE *fp,bool contentavail) {
 	completec_ = cc;
     size_ = storage_->GetReservedSize();
     sizec_ = (size_ + chunk_size_-1) / chunk_size_;
+    // As saved when loaded
+    CheckpointDone(complete_,checkpoint_time_);
 
     return 0;
 }
 
 
+// CHECKPOINT
+/** Version 2 .mbinmap, written in one go and read by mmap without parsing.
+ Fields are in host byte order; byte_order tells a foreign file, which is
+ then ignored like a missing one. */
+#define MBINMAP_MAGIC       "SWIFTMB\n"
+#define MBINMAP_VERSION     2
+#define MBINMAP_BYTE_ORDER  0x01020304
+
+typedef struct {
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    byte_order;
+    uint8_t     root_hash[Sha1Hash::SIZE];
+    uint32_t    chunk_size;
+    uint64_t    complete;
+    uint64_t    completec;
+} mbinmap_header_t;
+
+
+void MmapHashTree::CheckpointImage(std::string &image) {
+	mbinmap_header_t hdr;
+	memset(&hdr,0,sizeof(hdr));
+	memcpy(hdr.magic,MBINMAP_MAGIC,sizeof(hdr.magic));
+	hdr.version = MBINMAP_VERSION;
+	hdr.byte_order = MBINMAP_BYTE_ORDER;
+	memcpy(hdr.root_hash,root_hash_.bits,Sha1Hash::SIZE);
+	hdr.chunk_size = chunk_size_;
+	hdr.complete = complete_;
+	hdr.completec = completec_;
+
+	image.resize(sizeof(hdr)+ack_out_.image_size());
+	memcpy(&image[0],&hdr,sizeof(hdr));
+	ack_out_.write_image(&image[sizeof(hdr)]);
+}
+
+
+int MmapHashTree::Checkpoint(std::string binmap_filename, tint time) {
+	std::string image;
+	CheckpointImage(image);
+	if (hash_fd_ >= 0 && file_sync(hash_fd_) < 0)
+		return -1;
+	if (write_atomic_utf8(binmap_filename,image.data(),image.size()) < 0)
+		return -1;
+	CheckpointDone(complete_,time != 0 ? time : NOW,image.size());
+	return 0;
+}
+
+
+int MmapHashTree::LoadCheckpoint(std::string binmap_filename, bool contentavail) {
+	int fd = open_utf8(binmap_filename.c_str(),ROOPENFLAGS,0);
+	if (fd < 0) {
+		print_error("hashtree: cannot open .mbinmap file");
+		return -1;
+	}
+	int64_t len = file_size(fd);
+	mbinmap_header_t hdr;
+	if (len < (int64_t)sizeof(hdr) || pread(fd,&hdr,sizeof(hdr),0) != sizeof(hdr) ||
+	    memcmp(hdr.magic,MBINMAP_MAGIC,sizeof(hdr.magic))) {
+		// version 1, text
+		close(fd);
+		FILE *fp = fopen_utf8(binmap_filename.c_str(),"rb");
+		if (!fp)
+			return -1;
+		int ret = internal_deserialize(fp,contentavail);
+		fclose(fp);
+		return ret;
+	}
+	if (hdr.version != MBINMAP_VERSION || hdr.byte_order != MBINMAP_BYTE_ORDER) {
+		close(fd);
+		return -1;
+	}
+	char *map = (char *)memory_map(fd,len,true);
+	if (map == NULL) {
+		close(fd);
+		return -1;
+	}
+	int ret = ack_out_.read_image(map+sizeof(hdr),len-sizeof(hdr));
+	memory_unmap(fd,map,len);
+	close(fd);
+	if (ret < 0)
+		return -1;
+
+	memcpy(root_hash_.bits,hdr.root_hash,Sha1Hash::SIZE);
+	chunk_size_ = hdr.chunk_size;
+	return RestoreCheckpoint(hdr.complete,hdr.completec,contentavail);
+}
+
+
 bool            MmapHashTree::OfferPeakHash (bin_t pos, const Sha1Hash& hash) {
     char bin_name_buf[32];
     dprintf("%s hashtree offer peak %s\n",tintstr(),pos.str(bin_name_buf));
@@ -492,24 +596,153 @@ Sha1Hash        MmapHashTree::DeriveRoot () {
 }
 
 
-/** For live streaming: appends the data, adjusts the tree.
-    @ return the number of fresh (tail) peak hashes */
 int         MmapHashTree::AppendData (char* data, int length) {
-    return 0;
+    if (!live_source_ || length < 0)
+        return -1;
+    live_pending_.append(data,length);
+    uint64_t oldsizec = sizec_;
+    size_t used = 0;
+    for (; live_pending_.size()-used >= chunk_size_; used += chunk_size_) {
+        const char *chunk = live_pending_.data()+used;
+        bin_t pos(0,sizec_);
+        if (storage_->Write(chunk,chunk_size_,storage_offset(pos)) < 0) {
+            print_error("pwrite failed");
+            break;
+        }
+        hash_slot(pos) = Sha1Hash(chunk,chunk_size_);
+        set_hash_verified(pos);
+        ack_out_.set(pos);
+        // the right edge of the tree is complete up to pos now
+        while (pos.is_right()) {
+            pos = pos.parent();
+            hash_slot(pos) = Sha1Hash(hash_slot(pos.left()),hash_slot(pos.right()));
+            set_hash_verified(pos);
+        }
+        sizec_++;
+        completec_++;
+        complete_ += chunk_size_;
+    }
+    live_pending_.erase(0,used);
+    if (sizec_ == oldsizec)
+        return 0;
+
+    size_ = sizec_*chunk_size_;
+    peak_count_ = gen_peaks(sizec_,peaks_);
+    for (int i=0; i<peak_count_; i++)
+        peak_hashes_[i] = hash_slot(peaks_[i]);
+    SlideLive();
+    return sizec_-oldsizec;
+}
+
+
+const Sha1Hash& MmapHashTree::live_hash (bin_t pos) const {
+    std::map<bin_t,livehash_t>::const_iterator i = live_hashes_.find(pos);
+    return i!=live_hashes_.end() ? i->second.hash : Sha1Hash::ZERO;
+}
+
+
+bool            MmapHashTree::is_live_peak (bin_t pos) const {
+    if (!live_window_ || live_source_ || pos.is_none() || pos.is_all())
+        return false;
+    // Peaks are announced as a list from offset 0. Its head is one of our
+    // peaks or bigger, its tail reaches past what we know. Uncles do
+    // neither: they lie strictly inside a peak.
+    if (pos.base_offset()+pos.base_length() > sizec_)
+        return true;
+    for (int i=0; i<peak_count_; i++)
+        if (peaks_[i] == pos)
+            return true;
+    return false;
+}
+
+
+/** Live peaks cannot be checked against the root hash, which is just
+ the swarm id, as the tree keeps growing. They are taken from whoever
+ announces them, as long as they agree with the hashes verified so far.
+ NOTE: not signed, so this trusts the swarm. */
+bool            MmapHashTree::OfferLivePeakHash (bin_t pos, const Sha1Hash& hash) {
+    char bin_name_buf[32];
+    dprintf("%s hashtree offer live peak %s\n",tintstr(),pos.str(bin_name_buf));
+
+    if (pos.base_offset() == 0)
+        live_peak_in_count_ = 0;
+    else if (live_peak_in_count_ == 0)
+        return false;
+    else {
+        bin_t last = live_peaks_in_[live_peak_in_count_-1];
+        if (pos.layer()>=last.layer() ||
+            pos.base_offset()!=last.base_offset()+last.base_length()) {
+            live_peak_in_count_ = 0;
+            return false;
+        }
+    }
+    if (is_hash_verified(pos) && live_hash(pos) != hash) {
+        live_peak_in_count_ = 0;
+        return false;
+    }
+    live_peaks_in_[live_peak_in_count_] = pos;
+    live_peak_hashes_in_[live_peak_in_count_] = hash;
+    live_peak_in_count_++;
+
+    // A prefix of the peaks for a length is the peak list of a shorter one
+    uint64_t end = pos.base_offset()+pos.base_length();
+    if (end <= sizec_)
+        return true;
+
+    peak_count_ = live_peak_in_count_;
+    for (int i=0; i<peak_count_; i++) {
+        peaks_[i] = live_peaks_in_[i];
+        peak_hashes_[i] = live_peak_hashes_in_[i];
+        hash_slot(peaks_[i]) = peak_hashes_[i];
+        set_hash_verified(peaks_[i]);
+    }
+    sizec_ = end;
+    size_ = sizec_*chunk_size_;
+    SlideLive();
+    return true;
+}
+
+
+void            MmapHashTree::SlideLive () {
+    uint64_t start = sizec_ > live_window_ ? sizec_-live_window_ : 0;
+    if (start <= live_start_)
+        return;
+    for (;;) {
+        bin_t f = ack_out_.find_filled();
+        if (f.is_none() || f.base_offset() >= start)
+            break;
+        ack_out_.reset(bin_t(0,f.base_offset()));
+        completec_--;
+        complete_ -= chunk_size_;
+    }
+    live_start_ = start;
+
+    // Keep what the uncle paths of the window need: hashes of bins reaching
+    // into it and of their left siblings. All others are in [0,2*start).
+    std::map<bin_t,livehash_t>::iterator i = live_hashes_.begin();
+    while (i != live_hashes_.end() && i->first.toUInt() < 2*start) {
+        bin_t b = i->first;
+        uint64_t bend = b.base_offset()+b.base_length();
+        if (bend > start || (b.is_left() && bend+b.base_length() > start))
+            i++;
+        else
+            live_hashes_.erase(i++);
+    }
 }
 
 
 bin_t         MmapHashTree::peak_for (bin_t pos) const {
-    int pi=0;
-    while (pi<peak_count_ && !peaks_[pi].contains(pos))
-        pi++;
-    return pi==peak_count_ ? bin_t(bin_t::NONE) : peaks_[pi];
+    if (!peak_count_)
+        return bin_t::NONE;
+    return peak_for_length(sizec_,pos);
 }
 
 bool            MmapHashTree::OfferHash (bin_t pos, const Sha1Hash& hash) {
+    if (is_live_peak(pos))
+        return OfferLivePeakHash(pos,hash);
     if (!size_)  // only peak hashes are accepted at this point
-        return OfferPeakHash(pos,hash);
-    if (hashes_ == NULL)
+        return live_window_ ? false : OfferPeakHash(pos,hash);
+    if (hashes_ == NULL && !live_window_)
     {
     	dprintf("%s hashtree never loaded correctly from disk\n",tintstr() );
     	return false;
@@ -523,22 +756,21 @@ bool            MmapHashTree::OfferHash (bin_t pos, const Sha1Hash& hash) {
     if (peak.is_none())
         return false;
     if (peak==pos)
-        return hash == hashes_[pos.toUInt()];
+        return hash == hash_slot(pos);
     if (!ack_out_.is_empty(pos.parent()))
-        return hash==hashes_[pos.toUInt()]; // have this hash already, even accptd data
+        return hash==hash_slot(pos); // have this hash already, even accptd data
     // LESSHASH
     // Arno: if we already verified this hash against the root, don't replace
-    if (!is_hash_verified_.is_empty(bin_t(0,pos.toUInt())))
-    	return hash == hashes_[pos.toUInt()];
+    if (is_hash_verified(pos))
+    	return hash == hash_slot(pos);
 
-    hashes_[pos.toUInt()] = hash;
+    hash_slot(pos) = hash;
     if (!pos.is_base())
         return false; // who cares?
     bin_t p = pos;
     Sha1Hash uphash = hash;
-    // Arno: Note well: bin_t(0,p.toUInt()) is to abuse binmap as bitmap.
-    while ( p!=peak && ack_out_.is_empty(p) && is_hash_verified_.is_empty(bin_t(0,p.toUInt())) ) {
-        hashes_[p.toUInt()] = uphash;
+    while ( p!=peak && (live_window_ || ack_out_.is_empty(p)) && !is_hash_verified(p) ) {
+        hash_slot(p) = uphash;
         p = p.parent();
 		// Arno: Prevent poisoning the tree with bad values:
 		// Left hand hashes should never be zero, and right
@@ -546,30 +778,29 @@ bool            MmapHashTree::OfferHash (bin_t pos, const Sha1Hash& hash) {
 		// layer 0. Higher layers will never have 0 hashes
 		// as SHA1(zero+zero) != zero (but b80de5...)
 		//
-        if (hashes_[p.left().toUInt()] == Sha1Hash::ZERO || hashes_[p.right().toUInt()] == Sha1Hash::ZERO)
+        if (hash_slot(p.left()) == Sha1Hash::ZERO || hash_slot(p.right()) == Sha1Hash::ZERO)
         	break;
-        uphash = Sha1Hash(hashes_[p.left().toUInt()],hashes_[p.right().toUInt()]);
+        uphash = Sha1Hash(hash_slot(p.left()),hash_slot(p.right()));
     }// walk to the nearest proven hash
 
-    bool success = (uphash==hashes_[p.toUInt()]);
+    bool success = (uphash==hash_slot(p));
     // LESSHASH
     if (success) {
     	// Arno: The hash checks out. Mark all hashes on the uncle path as
     	// being verified, so we don't have to go higher than them on a next
     	// check.
     	p = pos;
-    	// Arno: Note well: bin_t(0,p.toUInt()) is to abuse binmap as bitmap.
-    	is_hash_verified_.set(bin_t(0,p.toUInt()));
+    	set_hash_verified(p);
         while (p.layer() != peak.layer()) {
             p = p.parent().sibling();
-        	is_hash_verified_.set(bin_t(0,p.toUInt()));
+        	set_hash_verified(p);
         }
         // Also mark hashes on direct path to root as verified. Doesn't decrease
         // #checks, but does increase the number of verified hashes faster.
     	p = pos;
         while (p != peak) {
             p = p.parent();
-        	is_hash_verified_.set(bin_t(0,p.toUInt()));
+        	set_hash_verified(p);
         }
     }
 
@@ -577,11 +808,83 @@ bool            MmapHashTree::OfferHash (bin_t pos, const Sha1Hash& hash) {
 }
 
 
+void            MmapHashTree::set_hash_verified (bin_t pos) {
+    if (live_window_) {
+        live_hashes_[pos].verified = true;
+        return;
+    }
+    uint64_t i = pos.toUInt();
+    if (i >= is_hash_verified_.size())
+        is_hash_verified_.resize(std::max(i+1,(uint64_t)sizec_*2));
+    is_hash_verified_[i] = true;
+}
+
+
+static const Sha1Hash& find_hash (bin_t pos, const binhashes_t& hashes, const MmapHashTree *tree) {
+    for (int i=0; i<hashes.size(); i++)
+        if (hashes[i].first==pos)
+            return hashes[i].second;
+    return tree->hash(pos);
+}
+
+
+/** Check a chunk hash plus the uncle hashes that came with it. Only
+ the parents up to the nearest proven hash are computed, and nothing is
+ stored unless the whole path checks out (cf. HASH+DATA transaction). */
+bool            MmapHashTree::VerifyPath (bin_t pos, const Sha1Hash& hash, const binhashes_t& uncles) {
+    if (hashes_ == NULL && !live_window_)
+    	return false;
+    //NETWVSHASH
+    if (!check_netwvshash_)
+    	return true;
+    bin_t peak = peak_for(pos);
+    if (peak.is_none())
+        return false;
+
+    Sha1Hash path[64];
+    int n = 0;
+    // LIVE: the hashes joining old peaks to newer ones were never seen,
+    // so having data below p does not mean its hash is known
+    bin_t p = pos;
+    Sha1Hash uphash = hash;
+    while ( p!=peak && (live_window_ || ack_out_.is_empty(p)) && !is_hash_verified(p) ) {
+        const Sha1Hash& sib = find_hash(p.sibling(),uncles,this);
+        // see OfferHash: zero means unknown
+        if (sib == Sha1Hash::ZERO)
+            return false;
+        path[n++] = uphash;
+        uphash = p.is_left() ? Sha1Hash(uphash,sib) : Sha1Hash(sib,uphash);
+        p = p.parent();
+    }
+    if (uphash != this->hash(p))
+        return false;
+
+    p = pos;
+    for (int i=0; i<n; i++) {
+        bin_t s = p.sibling();
+        hash_slot(s) = find_hash(s,uncles,this);
+        hash_slot(p) = path[i];
+        set_hash_verified(s);
+        set_hash_verified(p);
+        p = p.parent();
+    }
+    set_hash_verified(pos);
+    return true;
+}
+
+
 bool            MmapHashTree::OfferData (bin_t pos, const char* data, size_t length) {
+    return OfferData(pos,data,length,binhashes_t());
+}
+
+
+bool            MmapHashTree::OfferData (bin_t pos, const char* data, size_t length, const binhashes_t& hashes) {
     if (!size())
         return false;
     if (!pos.is_base())
         return false;
+    if (live_window_ && (live_source_ || length<chunk_size_ || pos.base_offset()<live_start_))
+        return false;
     if (length<chunk_size_ && pos!=bin_t(0,sizec_-1))
         return false;
     if (ack_out_.is_filled(pos))
@@ -591,7 +894,7 @@ bool            MmapHashTree::OfferData (bin_t pos, const char* data, size_t len
         return false;
 
     Sha1Hash data_hash(data,length);
-    if (!OfferHash(pos, data_hash)) {
+    if (!VerifyPath(pos, data_hash, hashes)) {
         char bin_name_buf[32];
 //        printf("invalid hash for %s: %s\n",pos.str(bin_name_buf),data_hash.hex().c_str()); // paranoid
     	//fprintf(stderr,"INVALID HASH FOR %lli layer %d\n", pos.toUInt(), pos.layer() );
@@ -602,11 +905,11 @@ bool            MmapHashTree::OfferData (bin_t pos, const char* data, size_t len
     //printf("g %lli %s\n",(uint64_t)pos,hash.hex().c_str());
     ack_out_.set(pos);
     // Arno,2011-10-03: appease g++
-    if (storage_->Write(data,length,pos.base_offset()*chunk_size_) < 0)
+    if (storage_->Write(data,length,storage_offset(pos)) < 0)
     	print_error("pwrite failed");
     complete_ += length;
     completec_++;
-    if (pos.base_offset()==sizec_-1) {
+    if (pos.base_offset()==sizec_-1 && !live_window_) {
         size_ = ((sizec_-1)*chunk_size_) + length;
         if (storage_->GetReservedSize()!=size_)
         	storage_->ResizeReserved(size_);
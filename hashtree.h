@@ -10,6 +10,8 @@
 #define SWIFT_SHA1_HASH_TREE_H
 #include <string.h>
 #include <string>
+#include <vector>
+#include <map>
 #include "bin.h"
 #include "binmap.h"
 #include "operational.h"
@@ -35,6 +37,8 @@ struct Sha1Hash {
     bool    operator == (const Sha1Hash& b) const
         { return 0==memcmp(bits,b.bits,SIZE); }
     bool    operator != (const Sha1Hash& b) const { return !(*this==b); }
+    bool    operator < (const Sha1Hash& b) const
+        { return memcmp(bits,b.bits,SIZE)<0; }
     const char* operator * () const { return (char*) bits; }
     
     const static Sha1Hash ZERO;
@@ -50,6 +54,9 @@ struct Sha1Hash {
 
 class Storage;
 
+/** (bin,hash) pairs, e.g. the uncle hashes that came with a chunk */
+typedef std::vector<std::pair<bin_t,Sha1Hash> > binhashes_t;
+
 
 /** This class controls data integrity of some file; hash tree is put to
     an auxilliary file next to it. The hash tree file is mmap'd for
@@ -71,6 +78,13 @@ class HashTree : public Operational {
     /** Offer data; the behavior is the same as with a hash:
      accept or remember or drop. Returns true => ACK is sent. */
     virtual bool            OfferData (bin_t bin, const char* data, size_t length) = 0;
+    /** Offer data together with the hashes that came along with it, as
+     one transaction: the hashes are kept only if the data checks out. */
+    virtual bool            OfferData (bin_t bin, const char* data, size_t length, const binhashes_t& hashes) {
+        for (int i=0; i<hashes.size(); i++)
+            OfferHash(hashes[i].first,hashes[i].second);
+        return OfferData(bin,data,length);
+    }
     /** Returns the number of peaks (read on peak hashes). */
     virtual int             peak_count () const = 0;
     /** Returns the i-th peak's bin number. */
@@ -103,6 +117,17 @@ class HashTree : public Operational {
     //NETWVSHASH
     virtual bool get_check_netwvshash() = 0;
 
+    // LIVE
+    /** Number of chunks kept of a live stream, 0 for static content. */
+    virtual uint64_t        live_window () const { return 0; }
+    /** First chunk of a live stream still kept. */
+    virtual uint64_t        live_start () const { return 0; }
+    /** Whether a HASH for pos announces (new) peaks of a live stream
+     rather than being an uncle hash. */
+    virtual bool            is_live_peak (bin_t pos) const { return false; }
+    /** Where chunk pos lives in the storage, in bytes. */
+    virtual int64_t         storage_offset (bin_t pos) { return pos.base_offset()*chunk_size(); }
+
 
     // for transfertest.cpp
     virtual Storage *       get_storage() = 0;
@@ -141,17 +166,49 @@ class MmapHashTree : public HashTree, Serializable {
     uint32_t			chunk_size_;
 
     // LESSHASH
-    binmap_t		is_hash_verified_; // binmap being abused as bitmap, only layer 0 used
+    /** Dense bitset indexed by bin_t::toUInt(), sized to the tree */
+    std::vector<bool>	is_hash_verified_;
     // FAXME: make is_hash_verified_ part of persistent state?
 
     //MULTIFILE
     Storage *		storage_;
 
     int 			internal_deserialize(FILE *fp,bool contentavail=true);
+    /** Reads a binary .mbinmap via mmap, or a version 1 text one */
+    int             LoadCheckpoint(std::string binmap_filename, bool contentavail);
+    /** Common tail of loading: recover peaks, sizes and progress */
+    int             RestoreCheckpoint(uint64_t complete, uint64_t completec, bool contentavail);
 
     //NETWVSHASH
     bool 			check_netwvshash_;
 
+    // LIVE
+    /** A live tree keeps only the last live_window_ chunks: data
+     in a ring of that many chunks in the storage, hashes in memory
+     (no .mhash). The root hash is the swarm id, peaks grow with the
+     stream and are re-announced, see OfferLivePeakHash. */
+    struct livehash_t {
+        Sha1Hash    hash;
+        bool        verified;
+        livehash_t() : verified(false) {}
+    };
+    uint64_t        live_window_;
+    uint64_t        live_start_;
+    bool            live_source_;
+    std::map<bin_t,livehash_t> live_hashes_;
+    /** Source: tail of the appended data, less than a chunk */
+    std::string     live_pending_;
+    /** Peak hashes being received, a list from offset 0 */
+    bin_t           live_peaks_in_[64];
+    Sha1Hash        live_peak_hashes_in_[64];
+    int             live_peak_in_count_;
+
+    // CHECKPOINT
+    /** Bytes complete in the last checkpoint written or read, and when */
+    uint64_t        checkpoint_complete_;
+    tint            checkpoint_time_;
+    uint64_t        checkpoint_written_;
+
 protected:
     
     int             OpenHashFile();
@@ -160,37 +217,76 @@ protected:
     bool 	    RecoverPeakHashes();
     Sha1Hash        DeriveRoot();
     bool            OfferPeakHash (bin_t pos, const Sha1Hash& hash);
+    bool            VerifyPath (bin_t pos, const Sha1Hash& hash, const binhashes_t& uncles);
+    bool            is_hash_verified (bin_t pos) const {
+        if (live_window_) {
+            std::map<bin_t,livehash_t>::const_iterator i = live_hashes_.find(pos);
+            return i!=live_hashes_.end() && i->second.verified;
+        }
+        uint64_t i = pos.toUInt();
+        return i<is_hash_verified_.size() && is_hash_verified_[i];
+    }
+    void            set_hash_verified (bin_t pos);
+    /** Writable hash slot for pos, in the mmap or the live window */
+    Sha1Hash&       hash_slot (bin_t pos) {
+        return live_window_ ? live_hashes_[pos].hash : hashes_[pos.toUInt()];
+    }
+    const Sha1Hash& live_hash (bin_t pos) const;
+    bool            OfferLivePeakHash (bin_t pos, const Sha1Hash& hash);
+    /** Move the window to the last live_window_ chunks, forgetting data
+     and hashes that are no longer needed. */
+    void            SlideLive ();
 
     
 public:
     
+    /** time is the creation time for the checkpoint policy, 0 for NOW.
+     Off the event loop thread it must be given. */
     MmapHashTree (Storage *storage, const Sha1Hash& root=Sha1Hash::ZERO, uint32_t chunk_size=SWIFT_DEFAULT_CHUNK_SIZE,
-              std::string hash_filename=NULL, bool force_check_diskvshash=true, bool check_netwvshash=true, std::string binmap_filename=NULL);
+              std::string hash_filename=NULL, bool force_check_diskvshash=true, bool check_netwvshash=true, std::string binmap_filename=NULL,
+              tint time=0);
     
     // Arno, 2012-01-03: Hack to quickly learn root hash from a checkpoint
     MmapHashTree (bool dummy, std::string binmap_filename);
 
+    /** Live stream swarm_id, keeping the last live_window chunks. The
+     source appends with AppendData, others learn the peaks from it. */
+    MmapHashTree (Storage *storage, const Sha1Hash& swarm_id, uint32_t chunk_size, uint64_t live_window, bool live_source);
+
     bool            OfferHash (bin_t pos, const Sha1Hash& hash);
     bool            OfferData (bin_t bin, const char* data, size_t length);
-    /** For live streaming. Not implemented yet. */
+    bool            OfferData (bin_t bin, const char* data, size_t length, const binhashes_t& hashes);
+    /** For live streaming: appends the data at the source, chunk by chunk
+     (a tail less than a chunk waits for the next call) and adjusts the
+     tree and peaks. Returns the number of chunks added, or -1. */
     int             AppendData (char* data, int length) ;
     
     int             peak_count () const { return peak_count_; }
     bin_t           peak (int i) const { return peaks_[i]; }
     const Sha1Hash& peak_hash (int i) const { return peak_hashes_[i]; }
     bin_t           peak_for (bin_t pos) const;
-    const Sha1Hash& hash (bin_t pos) const {return hashes_[pos.toUInt()];}
+    const Sha1Hash& hash (bin_t pos) const {return live_window_ ? live_hash(pos) : hashes_[pos.toUInt()];}
     const Sha1Hash& root_hash () const { return root_hash_; }
     uint64_t        size () const { return size_; }
     uint64_t        size_in_chunks () const { return sizec_; }
     uint64_t        complete () const { return complete_; }
     uint64_t        chunks_complete () const { return completec_; }
     uint64_t        seq_complete(int64_t offset); // SEEK
-    bool            is_complete () { return size_ && complete_==size_; }
+    bool            is_complete () { return live_window_ ? live_source_ : size_ && complete_==size_; }
     binmap_t *       ack_out () { return &ack_out_; }
     uint32_t		chunk_size() { return chunk_size_; } // CHUNKSIZE
     ~MmapHashTree ();
 
+    // LIVE
+    uint64_t        live_window () const { return live_window_; }
+    uint64_t        live_start () const { return live_start_; }
+    bool            is_live_peak (bin_t pos) const;
+    int64_t         storage_offset (bin_t pos) {
+        return (live_window_ ? pos.base_offset()%live_window_ : pos.base_offset())*chunk_size_;
+    }
+    /** Number of hashes kept for the live window */
+    size_t          live_hash_count () const { return live_hashes_.size(); }
+
     // for transfertest.cpp
     Storage *       get_storage() { return storage_; }
     void            set_size(uint64_t size) { size_ = size; }
@@ -200,6 +296,28 @@ public:
     int deserialize(FILE *fp);
     int partial_deserialize(FILE *fp);
 
+    // CHECKPOINT
+    /** Binary .mbinmap image: header, then the ack_out_ binmap image */
+    void            CheckpointImage(std::string &image);
+    /** Writes the image to binmap_filename in one go, atomically. time as
+     for the constructor. */
+    int             Checkpoint(std::string binmap_filename, tint time=0);
+    /** Marks the state in an image taken at time as saved */
+    void            CheckpointDone(uint64_t complete, tint time, size_t written=0) {
+        checkpoint_complete_ = complete;
+        checkpoint_time_ = time;
+        checkpoint_written_ += written;
+    }
+    /** Bytes verified since the last checkpoint */
+    uint64_t        checkpoint_unsaved () const {
+        return complete_>checkpoint_complete_ ? complete_-checkpoint_complete_ : 0;
+    }
+    tint            checkpoint_time () const { return checkpoint_time_; }
+    /** Bytes of checkpoints written so far */
+    uint64_t        checkpoint_written () const { return checkpoint_written_; }
+    /** The .mhash file, synced before a checkpoint relies on its hashes */
+    int             hash_fd () const { return hash_fd_; }
+
     //NETWVSHASH
     bool get_check_netwvshash() { return check_netwvshash_; }
 
@@ -249,7 +367,7 @@ public:
 
     bool            OfferHash (bin_t pos, const Sha1Hash& hash);
     bool            OfferData (bin_t bin, const char* data, size_t length);
-    /** For live streaming. Not implemented yet. */
+    /** Zero-state trees serve static content only, returns -1. */
     int             AppendData (char* data, int length) ;
 
     int             peak_count () const { return peak_count_; }
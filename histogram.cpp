@@ -0,0 +1,58 @@
+/*
+ *  histogram.cpp
+ *  Fixed-size log-linear latency histogram for the hot paths.
+ *
+ *  Copyright 2009-2012 TECHNISCHE UNIVERSITEIT DELFT. All rights reserved.
+ *
+ */
+#include "histogram.h"
+#include <string.h>
+#include <algorithm>
+
+using namespace swift;
+
+
+void LatencyHistogram::Reset()
+{
+    memset(counts_,0,sizeof(counts_));
+    count_ = 0;
+    sum_ = 0;
+    max_ = 0;
+}
+
+
+uint64_t LatencyHistogram::BucketLow(int b)
+{
+    if (b < SUB_COUNT)
+        return b;
+    int shift = (b>>SUB_BITS)-1;
+    return (uint64_t)(SUB_COUNT + (b & (SUB_COUNT-1))) << shift;
+}
+
+
+uint64_t LatencyHistogram::BucketHigh(int b)
+{
+    if (b < SUB_COUNT)
+        return b;
+    int shift = (b>>SUB_BITS)-1;
+    return BucketLow(b) + (((uint64_t)1<<shift)-1);
+}
+
+
+uint64_t LatencyHistogram::Percentile(double p) const
+{
+    if (count_ == 0)
+        return 0;
+    uint64_t rank = (uint64_t)((p/100.0)*count_ + 0.5);
+    if (rank < 1)
+        rank = 1;
+    if (rank > count_)
+        rank = count_;
+    uint64_t seen = 0;
+    for (int b=0; b<NBUCKETS; b++) {
+        seen += counts_[b];
+        if (seen >= rank)
+            return std::min(BucketHigh(b),max_);
+    }
+    return max_;
+}
@@ -0,0 +1,79 @@
+/*
+ *  histogram.h
+ *  Fixed-size log-linear latency histogram for the hot paths.
+ *
+ *  Values (usec) are kept in 8 linear sub-buckets per power of two, so the
+ *  relative error of a reported percentile is at most 12.5%. Recording is
+ *  a couple of shifts and an increment: no allocation, no locking.
+ *
+ *  Copyright 2009-2012 TECHNISCHE UNIVERSITEIT DELFT. All rights reserved.
+ *
+ */
+#ifndef SWIFT_HISTOGRAM_H
+#define SWIFT_HISTOGRAM_H
+
+#include "compat.h"
+#include "bin_utils.h"
+
+namespace swift {
+
+
+class LatencyHistogram
+{
+    public:
+        static const int SUB_BITS = 3;
+        static const int SUB_COUNT = 1<<SUB_BITS;
+        static const int NBUCKETS = (64-SUB_BITS+1)*SUB_COUNT;
+
+        LatencyHistogram() { Reset(); }
+
+        void Record(tint usec) {
+            uint64_t v = usec < 0 ? 0 : (uint64_t)usec;
+            counts_[BucketOf(v)]++;
+            count_++;
+            sum_ += v;
+            if (v > max_)
+                max_ = v;
+        }
+
+        void Reset();
+        uint64_t count() const { return count_; }
+        uint64_t sum() const { return sum_; }
+        uint64_t max() const { return max_; }
+        uint64_t bucket_count(int b) const { return counts_[b]; }
+
+        /** Upper bound (inclusive) of the value p percent of the samples
+         *  are at or below. 0 when empty. */
+        uint64_t Percentile(double p) const;
+
+        static int BucketOf(uint64_t v) {
+            if (v < (uint64_t)SUB_COUNT)
+                return (int)v;
+            int shift = bin_highest_bit(v) - SUB_BITS;
+            return ((shift+1)<<SUB_BITS) + (int)((v>>shift) & (SUB_COUNT-1));
+        }
+        static uint64_t BucketLow(int b);
+        static uint64_t BucketHigh(int b);
+
+    protected:
+        uint64_t counts_[NBUCKETS];
+        uint64_t count_;
+        uint64_t sum_;
+        uint64_t max_;
+};
+
+
+/** Records the lifetime of the scope into h. */
+class LatencyTimer
+{
+    public:
+        LatencyTimer(LatencyHistogram &h) : h_(h), start_(usec_mono_time()) {}
+        ~LatencyTimer() { h_.Record(usec_mono_time()-start_); }
+    protected:
+        LatencyHistogram &h_;
+        tint start_;
+};
+
+}
+
+#endif
@@ -25,7 +25,9 @@ using namespace swift;
 // amount at app level.
 #define HTTPGW_MAX_PREBUF_BYTES			(2*1024*1024)
 
-#define HTTPGW_MAX_REQUEST 128
+// Tail of a non-fast-start MP4 to prefetch, should hold the moov box
+#define HTTPGW_TAIL_PREFETCH_BYTES		(1024*1024)
+#define HTTPGW_CONTAINER_HDR_BYTES		64
 
 struct http_gw_t {
     int      id;
@@ -43,11 +45,32 @@ struct http_gw_t {
     int replycode;	     // HTTP status code
     int64_t  rangefirst; // First byte wanted in HTTP GET Range request or -1
     int64_t  rangelast;  // Last byte wanted in HTTP GET Range request (also 99 for 100 byte interval) or -1
+    Sha1Hash roothash;   // index key, transfer may be gone at cleanup
+    bool     activated;  // transfer from swift::Activate, to Release
+    size_t   idx;        // position in http_gw_reqs
 
-} http_requests[HTTPGW_MAX_REQUEST];
+};
 
+/*
+ * Open requests are kept in a growable table, indexed by evhttp
+ * request, transfer and root hash, such that the lookups on every write
+ * event and progress callback do not scan all requests. A transfer may
+ * have several requests.
+ */
+typedef std::vector<http_gw_t *>					httpgwreqs_t;
+typedef std::map<struct evhttp_request *,http_gw_t *>	httpgwevindex_t;
+typedef std::multimap<int,http_gw_t *>				httpgwtransferindex_t;
+typedef std::multimap<Sha1Hash,http_gw_t *>			httpgwhashindex_t;
+
+httpgwreqs_t			http_gw_reqs;
+httpgwevindex_t			http_gw_ev_index;
+httpgwtransferindex_t	http_gw_transfer_index;
+httpgwhashindex_t		http_gw_hash_index;
+std::set<int>			http_gw_progress_transfers; // transfers with HttpGwSwiftProgressCallback
+
+typedef std::map<int,std::pair<int64_t,int64_t> >	httpgwprefetch_t;
+httpgwprefetch_t		http_gw_prefetch;			// tail to prefetch per transfer
 
-int http_gw_reqs_open = 0;
 int http_gw_reqs_count = 0;
 struct evhttp *http_gw_event;
 struct evhttp_bound_socket *http_gw_handle;
@@ -58,35 +81,163 @@ double *httpgw_maxspeed = NULL;						 // Copy of cmdline param
 bool sawhttpconn = false;
 
 
-http_gw_t *HttpGwFindRequestByEV(struct evhttp_request *evreq) {
-	for (int httpc=0; httpc<http_gw_reqs_open; httpc++) {
-		if (http_requests[httpc].sinkevreq==evreq)
-			return &http_requests[httpc];
-    }
-	return NULL;
+void HttpGwAddRequest(http_gw_t *req) {
+	req->idx = http_gw_reqs.size();
+	http_gw_reqs.push_back(req);
+	http_gw_ev_index[req->sinkevreq] = req;
+	http_gw_transfer_index.insert(std::make_pair(req->transfer,req));
+	http_gw_hash_index.insert(std::make_pair(req->roothash,req));
 }
 
-http_gw_t *HttpGwFindRequestByTransfer(int transfer) {
-	for (int httpc=0; httpc<http_gw_reqs_open; httpc++) {
-		if (http_requests[httpc].transfer==transfer) {
-			return &http_requests[httpc];
+template <class M, class K>
+static void HttpGwIndexErase(M &index, const K &key, http_gw_t *req) {
+	std::pair<typename M::iterator,typename M::iterator> range = index.equal_range(key);
+	for (typename M::iterator iter=range.first; iter!=range.second; iter++) {
+		if (iter->second == req) {
+			index.erase(iter);
+			return;
 		}
 	}
-	return NULL;
+}
+
+void HttpGwFirstProgressCallback (int transfer, bin_t bin);
+void HttpGwSwiftProgressCallback (int transfer, bin_t bin);
+
+void HttpGwRemoveRequest(http_gw_t *req) {
+	HttpGwIndexErase(http_gw_transfer_index,req->transfer,req);
+	HttpGwIndexErase(http_gw_hash_index,req->roothash,req);
+
+	if (http_gw_transfer_index.find(req->transfer) == http_gw_transfer_index.end()) {
+		// Last request for transfer, stop reporting
+		swift::RemoveProgressCallback(req->transfer,&HttpGwFirstProgressCallback);
+		swift::RemoveProgressCallback(req->transfer,&HttpGwSwiftProgressCallback);
+		http_gw_progress_transfers.erase(req->transfer);
+		http_gw_prefetch.erase(req->transfer);
+	}
+
+	// Move last into freed slot
+	http_gw_t *last = http_gw_reqs.back();
+	http_gw_reqs[req->idx] = last;
+	last->idx = req->idx;
+	http_gw_reqs.pop_back();
+
+	if (req->sinkevwrite != NULL)
+		event_free(req->sinkevwrite);
+	if (req->activated)
+		swift::Release(req->roothash);
+	delete req;
+}
+
+
+http_gw_t *HttpGwFindRequestByEV(struct evhttp_request *evreq) {
+	httpgwevindex_t::iterator iter = http_gw_ev_index.find(evreq);
+	if (iter == http_gw_ev_index.end())
+		return NULL;
+	return iter->second;
+}
+
+http_gw_t *HttpGwFindRequestByTransfer(int transfer) {
+	httpgwtransferindex_t::iterator iter = http_gw_transfer_index.find(transfer);
+	if (iter == http_gw_transfer_index.end())
+		return NULL;
+	return iter->second;
+}
+
+/** All requests for transfer. Returns a copy, so callers may close requests while iterating */
+httpgwreqs_t HttpGwFindRequestsByTransfer(int transfer) {
+	httpgwreqs_t reqs;
+	std::pair<httpgwtransferindex_t::iterator,httpgwtransferindex_t::iterator> range = http_gw_transfer_index.equal_range(transfer);
+	for (httpgwtransferindex_t::iterator iter=range.first; iter!=range.second; iter++)
+		reqs.push_back(iter->second);
+	return reqs;
 }
 
 http_gw_t *HttpGwFindRequestByRoothash(Sha1Hash &wanthash) {
-	for (int httpc=0; httpc<http_gw_reqs_open; httpc++) {
-		http_gw_t *req = &http_requests[httpc];
-		if (req == NULL)
-			continue;
-		FileTransfer *ft = FileTransfer::file(req->transfer);
-		if (ft == NULL)
-			continue;
-		if (ft->root_hash() == wanthash)
-			return req;
-	}
-	return NULL;
+	httpgwhashindex_t::iterator iter = http_gw_hash_index.find(wanthash);
+	if (iter == http_gw_hash_index.end())
+		return NULL;
+	return iter->second;
+}
+
+
+/** Reply with an error and forget the request. libevent frees the evhttp request */
+void HttpGwSendError(http_gw_t *req, int code, const char *reason) {
+	if (code != 0)
+		evhttp_send_error(req->sinkevreq,code,reason);
+	http_gw_ev_index.erase(req->sinkevreq);
+	req->sinkevreq = NULL;
+	HttpGwRemoveRequest(req);
+}
+
+
+static bool HttpGwWindowShorter(const std::pair<int64_t,int64_t> &a, const std::pair<int64_t,int64_t> &b) {
+	return a.second-a.first < b.second-b.first;
+}
+
+/*
+ * Clients of the same swarm share its FileTransfer. Each has its own
+ * read cursor (offset) and the piece picker follows the union of their
+ * playback windows, so data fetched for one is reused by the others.
+ *
+ * Windows are the unsent part of each request plus an optional tail
+ * prefetch. Shortest remaining window goes first, such that the small
+ * Range requests players issue for container indices are not starved by
+ * a long sequential GET.
+ */
+int HttpGwSeekToClients(int transfer) {
+	bytewindows_t windows;
+	std::pair<httpgwtransferindex_t::iterator,httpgwtransferindex_t::iterator> range = http_gw_transfer_index.equal_range(transfer);
+	for (httpgwtransferindex_t::iterator iter=range.first; iter!=range.second; iter++) {
+		http_gw_t *req = iter->second;
+		if (req->closing || req->tosend == 0 || req->offset > req->endoff)
+			continue; // not started or done
+		windows.push_back(std::make_pair((int64_t)req->offset,(int64_t)req->endoff));
+	}
+
+	httpgwprefetch_t::iterator iter = http_gw_prefetch.find(transfer);
+	if (iter != http_gw_prefetch.end()) {
+		int64_t first = iter->second.first, last = iter->second.second;
+		if (swift::SeqComplete(transfer,first) >= last+1-first)
+			http_gw_prefetch.erase(iter); // tail is in
+		else
+			windows.push_back(iter->second);
+	}
+
+	if (windows.empty())
+		return -1;
+	std::stable_sort(windows.begin(),windows.end(),HttpGwWindowShorter);
+	return swift::SeekMulti(transfer,windows);
+}
+
+
+/*
+ * MP4 files that are not "fast start" have their index (moov box)
+ * after the media data, so players first fetch the tail before they can
+ * play anything. If the first box after the ftyp box is not the moov,
+ * prefetch the tail of the file.
+ */
+void HttpGwDetectContainerIndex(int transfer, int64_t filestart, int64_t fileend) {
+	char hdr[HTTPGW_CONTAINER_HDR_BYTES];
+	int64_t filesize = fileend+1-filestart;
+	if (filesize <= HTTPGW_TAIL_PREFETCH_BYTES)
+		return;
+	if (swift::SeqComplete(transfer,filestart) < HTTPGW_CONTAINER_HDR_BYTES)
+		return; // header not in yet
+	if (swift::Read(transfer,hdr,HTTPGW_CONTAINER_HDR_BYTES,filestart) != HTTPGW_CONTAINER_HDR_BYTES)
+		return;
+	if (memcmp(hdr+4,"ftyp",4))
+		return;
+
+	uint32_t ftypsize;
+	memcpy(&ftypsize,hdr,4); // no unaligned read
+	ftypsize = ntohl(ftypsize);
+	if (ftypsize < 8 || ftypsize > HTTPGW_CONTAINER_HDR_BYTES-8)
+		return;
+	if (!memcmp(hdr+ftypsize+4,"moov",4))
+		return; // fast start
+
+	dprintf("%s T%i http prefetch index at tail\n",tintstr(),transfer);
+	http_gw_prefetch[transfer] = std::make_pair(fileend+1-HTTPGW_TAIL_PREFETCH_BYTES,fileend);
 }
 
 
@@ -101,6 +252,7 @@ void HttpGwCloseConnection (http_gw_t* req) {
 	else
 		evhttp_request_free(req->sinkevreq);
 
+	http_gw_ev_index.erase(req->sinkevreq);
 	req->sinkevreq = NULL;
 
 	// Note: for some reason calling conn_free here prevents the last chunks
@@ -118,11 +270,13 @@ void HttpGwCloseConnection (http_gw_t* req) {
 	// will then no download anything. Better would be to seek to end when
 	// swift partial download is done, not the serving via HTTP.
 	//
-	swift::Seek(req->transfer,swift::Size(req->transfer)-1,SEEK_CUR);
+	// Other clients of the same swarm keep their windows.
+	if (HttpGwSeekToClients(req->transfer) < 0)
+		swift::Seek(req->transfer,swift::Size(req->transfer)-1,SEEK_CUR);
 
 	//swift::Close(req->transfer);
 
-	*req = http_requests[--http_gw_reqs_open];
+	HttpGwRemoveRequest(req);
 }
 
 
@@ -131,6 +285,7 @@ void HttpGwLibeventCloseCallback(struct evhttp_connection *evconn, void *evreqvo
 	// or when we close (because we call evhttp_connection_free()). To prevent
 	// doing cleanup twice, we see if there is a http_gw_req that has the
 	// passed evreqvoid as sinkevreq. If so, clean up, if not, ignore.
+	Channel::Time();
 	// I.e. evhttp_request * is used as sort of request ID
 	//
 	fprintf(stderr,"HttpGwLibeventCloseCallback: called\n");
@@ -152,14 +307,9 @@ void HttpGwLibeventCloseCallback(struct evhttp_connection *evconn, void *evreqvo
 
 
 
-void HttpGwMayWriteCallback (int transfer) {
+void HttpGwMayWriteCallback (http_gw_t* req) {
 	// Write some data to client
-
-	http_gw_t* req = HttpGwFindRequestByTransfer(transfer);
-	if (req == NULL) {
-    	print_error("httpgw: MayWrite: can't find req for transfer");
-        return;
-    }
+	int transfer = req->transfer;
 
 	// SEEKTODO: stop downloading when file complete
 
@@ -168,7 +318,7 @@ void HttpGwMayWriteCallback (int transfer) {
 		req->endoff = swift::Size(req->transfer)-1;
 
     uint64_t relcomplete = swift::SeqComplete(req->transfer,req->startoff);
-    if (relcomplete > req->endoff)
+    if (relcomplete > req->endoff+1-req->startoff)
     	relcomplete = req->endoff+1-req->startoff;
     int64_t avail = relcomplete-(req->offset-req->startoff);
 
@@ -184,28 +334,30 @@ void HttpGwMayWriteCallback (int transfer) {
     if (avail > 0 && evbuffer_get_length(outbuf) < HTTPGW_MAX_PREBUF_BYTES)
     {
     	// Received more than I pushed to player, send data
-        char buf[HTTPGW_MAX_WRITE_BYTES];
 // Arno, 2010-08-16, TODO
 #ifdef WIN32
         uint64_t tosend = min(HTTPGW_MAX_WRITE_BYTES,avail);
 #else
         uint64_t tosend = std::min((int64_t)HTTPGW_MAX_WRITE_BYTES,avail);
 #endif
-        size_t rd = swift::Read(transfer,buf,tosend,req->offset); // hope it is cached
-        if (rd<0) {
-        	print_error("httpgw: MayWrite: error pread");
-            HttpGwCloseConnection(req);
-            return;
-        }
-
-        // Construct evbuffer and send incrementally
+        // Hand the verified range to libevent as file segments, such that
+        // the kernel streams it to the socket without copying via userspace.
         struct evbuffer *evb = evbuffer_new();
-        int ret = evbuffer_add(evb,buf,rd);
-        if (ret < 0) {
-        	print_error("httpgw: MayWrite: error evbuffer_add");
-        	evbuffer_free(evb);
-            HttpGwCloseConnection(req);
-            return;
+        ssize_t rd = swift::ReadToEvbuffer(transfer,evb,tosend,req->offset);
+        if (rd<=0) {
+            // Fallback: copy via buffer
+            dprintf("%s @%i http zero-copy failed, copying\n",tintstr(),req->id);
+            evbuffer_drain(evb,evbuffer_get_length(evb));
+            char *buf = new char[tosend];
+            rd = swift::Read(transfer,buf,tosend,req->offset); // hope it is cached
+            if (rd<0 || evbuffer_add(evb,buf,rd) < 0) {
+                print_error("httpgw: MayWrite: error pread");
+                delete[] buf;
+                evbuffer_free(evb);
+                HttpGwCloseConnection(req);
+                return;
+            }
+            delete[] buf;
         }
 
         if (req->offset == req->startoff) {
@@ -223,7 +375,7 @@ void HttpGwMayWriteCallback (int transfer) {
         req->tosend -= wn;
 
         // PPPLUG
-        swift::Seek(req->transfer,req->offset,SEEK_CUR);
+        HttpGwSeekToClients(transfer);
     }
 
     // Arno, 2010-11-30: tosend is set to fuzzy len, so need extra/other test.
@@ -265,11 +417,16 @@ void HttpGwSubscribeToWrite(http_gw_t * req) {
 void HttpGwLibeventMayWriteCallback(evutil_socket_t fd, short events, void *evreqvoid )
 {
 	//fprintf(stderr,"httpgw: MayWrite: %d events %d evreq is %p\n", fd, events, evreqvoid);
+	Channel::Time();
 
 	http_gw_t * req = HttpGwFindRequestByEV((struct evhttp_request *)evreqvoid);
 	if (req != NULL) {
 		//fprintf(stderr,"httpgw: MayWrite: %d events %d httpreq is %p\n", fd, events, req);
-		HttpGwMayWriteCallback(req->transfer);
+		int transfer = req->transfer;
+		HttpGwMayWriteCallback(req);
+		req = HttpGwFindRequestByEV((struct evhttp_request *)evreqvoid);
+		if (req == NULL) // Conn closed
+			return;
 
 
 		// Arno, 2011-12-20: No autoreschedule, let HttpGwSwiftProgressCallback do that
@@ -278,7 +435,7 @@ void HttpGwLibeventMayWriteCallback(evutil_socket_t fd, short events, void *evre
 
 		//fprintf(stderr,"GOTO WRITE %lli >= %lli\n", swift::Complete(req->transfer)+HTTPGW_MAX_WRITE_BYTES, swift::Size(req->transfer) );
 
-		if (swift::Complete(req->transfer)+HTTPGW_MAX_WRITE_BYTES >= swift::Size(req->transfer)) {
+		if (swift::Complete(transfer)+HTTPGW_MAX_WRITE_BYTES >= swift::Size(transfer)) {
 
         	// We don't get progress callback for last chunk < chunk size, nor
         	// when all data is already on disk. In that case, just keep on
@@ -293,13 +450,14 @@ void HttpGwSwiftProgressCallback (int transfer, bin_t bin) {
 	// Subsequent HTTPGW_PROGRESS_STEP_BYTES available
 
 	dprintf("%s T%i http more progress\n",tintstr(),transfer);
-	http_gw_t* req = HttpGwFindRequestByTransfer(transfer);
-	if (req == NULL)
-		return;
+	httpgwreqs_t reqs = HttpGwFindRequestsByTransfer(transfer);
+	for (int i=0; i<reqs.size(); i++) {
+		http_gw_t* req = reqs[i];
 
-	// Arno, 2011-12-20: We have new data to send, wait for HTTP socket writability
-	if (req->sinkevreq != NULL) { // Conn closed
-		HttpGwSubscribeToWrite(req);
+		// Arno, 2011-12-20: We have new data to send, wait for HTTP socket writability
+		if (req->sinkevreq != NULL && req->tosend > 0) { // Conn closed or not started
+			HttpGwSubscribeToWrite(req);
+		}
 	}
 }
 
@@ -420,6 +578,8 @@ bool HttpGwParseContentRangeHeader(http_gw_t *req,uint64_t filesize)
 }
 
 
+void HttpGwStartRequest(FileTransfer *ft, http_gw_t *req);
+
 void HttpGwFirstProgressCallback (int transfer, bin_t bin) {
 	// First chunk of data available
 	dprintf("%s T%i http first progress\n",tintstr(),transfer);
@@ -431,8 +591,8 @@ void HttpGwFirstProgressCallback (int transfer, bin_t bin) {
         return;
 	}
 
-	http_gw_t* req = HttpGwFindRequestByTransfer(transfer);
-	if (req == NULL)
+	httpgwreqs_t reqs = HttpGwFindRequestsByTransfer(transfer);
+	if (reqs.size() == 0)
 	{
 		dprintf("%s T%i first: req not found\n",tintstr(),transfer );
 		return;
@@ -440,10 +600,11 @@ void HttpGwFirstProgressCallback (int transfer, bin_t bin) {
 
 	// MULTIFILE
 	// Is storage ready?
-	FileTransfer *ft = FileTransfer::file(req->transfer);
+	FileTransfer *ft = FileTransfer::file(transfer);
 	if (ft == NULL) {
 		dprintf("%s T%i first: FileTransfer not found\n",tintstr(),transfer );
-    	evhttp_send_error(req->sinkevreq,500,"Internal error: Content not found although downloading it.");
+		for (int i=0; i<reqs.size(); i++)
+			HttpGwSendError(reqs[i],500,"Internal error: Content not found although downloading it.");
     	return;
 	}
 	if (!ft->GetStorage()->IsReady())
@@ -452,17 +613,28 @@ void HttpGwFirstProgressCallback (int transfer, bin_t bin) {
 		return; // wait for some more data
 	}
 
-	// Protection against spurious callback
-	if (req->tosend > 0)
+	// Good to go. Reconfigure callbacks
+	swift::RemoveProgressCallback(transfer,&HttpGwFirstProgressCallback);
+	if (http_gw_progress_transfers.find(transfer) == http_gw_progress_transfers.end())
 	{
-		dprintf("%s T%i first: already set tosend\n",tintstr(),transfer );
-		return;
+		int progresslayer = bytes2layer(HTTPGW_PROGRESS_STEP_BYTES,swift::ChunkSize(transfer));
+		swift::AddProgressCallback(transfer,&HttpGwSwiftProgressCallback,progresslayer);
+		http_gw_progress_transfers.insert(transfer);
 	}
 
-	// Good to go. Reconfigure callbacks
-	swift::RemoveProgressCallback(transfer,&HttpGwFirstProgressCallback);
-    int progresslayer = bytes2layer(HTTPGW_PROGRESS_STEP_BYTES,swift::ChunkSize(transfer));
-    swift::AddProgressCallback(transfer,&HttpGwSwiftProgressCallback,progresslayer);
+	for (int i=0; i<reqs.size(); i++)
+	{
+		// Protection against spurious callback
+		if (reqs[i]->tosend > 0)
+			dprintf("%s @%i first: already set tosend\n",tintstr(),reqs[i]->id );
+		else
+			HttpGwStartRequest(ft,reqs[i]);
+	}
+}
+
+
+void HttpGwStartRequest(FileTransfer *ft, http_gw_t *req) {
+	int transfer = req->transfer;
 
     // Send header of HTTP reply
 	uint64_t filesize = 0;
@@ -489,7 +661,7 @@ void HttpGwFirstProgressCallback (int transfer, bin_t bin) {
 			}
 		}
 		if (!found) {
-			evhttp_send_error(req->sinkevreq,404,"Individual file not found in multi-file content.");
+			HttpGwSendError(req,404,"Individual file not found in multi-file content.");
 			return;
 		}
 	}
@@ -500,16 +672,20 @@ void HttpGwFirstProgressCallback (int transfer, bin_t bin) {
 		req->endoff = swift::Size(req->transfer)-1;
 		filesize = swift::Size(transfer);
 	}
+	HttpGwDetectContainerIndex(transfer,req->startoff,req->endoff);
 
 	// Handle HTTP GET Range request, i.e. additional offset within content or file
 	if (!HttpGwParseContentRangeHeader(req,filesize))
+	{
+		HttpGwSendError(req,0,NULL); // error reply already sent
 		return;
+	}
 
 	if (req->rangefirst != -1)
 	{
 		// Range request
-		req->startoff += req->rangefirst;
 		req->endoff = req->startoff + req->rangelast;
+		req->startoff += req->rangefirst;
 		req->tosend = req->rangelast+1-req->rangefirst;
 	}
 	else
@@ -518,13 +694,12 @@ void HttpGwFirstProgressCallback (int transfer, bin_t bin) {
 	}
 	req->offset = req->startoff;
 
-	// SEEKTODO: concurrent requests to same resource
+	// Seek to multifile/range start, together with other clients
+	int ret = HttpGwSeekToClients(transfer);
 	if (req->startoff != 0)
 	{
-		// Seek to multifile/range start
-		int ret = swift::Seek(req->transfer,req->startoff,SEEK_SET);
 		if (ret < 0) {
-			evhttp_send_error(req->sinkevreq,500,"Internal error: Cannot seek to file start in range request or multi-file content.");
+			HttpGwSendError(req,500,"Internal error: Cannot seek to file start in range request or multi-file content.");
 			return;
 		}
 	}
@@ -652,6 +827,7 @@ bool swift::ParseURI(std::string uri,parseduri_t &map)
 
 void HttpGwNewRequestCallback (struct evhttp_request *evreq, void *arg) {
 
+    Channel::Time();
     dprintf("%s @%i http new request\n",tintstr(),http_gw_reqs_count+1);
 
     if (evhttp_request_get_command(evreq) != EVHTTP_REQ_GET) {
@@ -690,23 +866,16 @@ void HttpGwNewRequestCallback (struct evhttp_request *evreq, void *arg) {
     mfstr = puri["filename"];
     durstr = puri["durationstr"];
 
-    dprintf("%s @%i demands %s %s %s\n",tintstr(),http_gw_reqs_open+1,hashstr.c_str(),mfstr.c_str(),durstr.c_str() );
+    dprintf("%s @%i demands %s %s %s\n",tintstr(),http_gw_reqs_count+1,hashstr.c_str(),mfstr.c_str(),durstr.c_str() );
 
 
-    // 3. Check for concurrent requests, currently not supported.
+    // 3. Initiate transfer. Concurrent requests to the same swarm share it.
     Sha1Hash root_hash = Sha1Hash(true,hashstr.c_str());
-    http_gw_t *existreq = HttpGwFindRequestByRoothash(root_hash);
-    if (existreq != NULL)
-    {
-    	evhttp_send_error(evreq,409,"Conflict: server does not support concurrent requests to same swarm.");
-    	return;
-    }
-
-    // 4. Initiate transfer
-    int transfer = swift::Find(root_hash);
+    int transfer = swift::Activate(root_hash);
+    bool activated = transfer != -1;
     if (transfer==-1) {
         transfer = swift::Open(hashstr,root_hash,Address(),false,true,httpgw_chunk_size);
-        dprintf("%s @%i trying to HTTP GET swarm %s that has not been STARTed\n",tintstr(),http_gw_reqs_open+1,hashstr.c_str());
+        dprintf("%s @%i trying to HTTP GET swarm %s that has not been STARTed\n",tintstr(),http_gw_reqs_count+1,hashstr.c_str());
 
         // Arno, 2011-12-20: Only on new transfers, otherwise assume that CMD GW
         // controls speed
@@ -715,8 +884,8 @@ void HttpGwNewRequestCallback (struct evhttp_request *evreq, void *arg) {
         ft->SetMaxSpeed(DDIR_UPLOAD,httpgw_maxspeed[DDIR_UPLOAD]);
     }
 
-    // 5. Record request
-    http_gw_t* req = http_requests + http_gw_reqs_open++;
+    // 4. Record request
+    http_gw_t* req = new http_gw_t();
     req->id = ++http_gw_reqs_count;
     req->sinkevreq = evreq;
 
@@ -733,6 +902,9 @@ void HttpGwNewRequestCallback (struct evhttp_request *evreq, void *arg) {
     req->closing = false;
     req->startoff = 0;
     req->endoff = 0;
+    req->roothash = root_hash;
+    req->activated = activated;
+    HttpGwAddRequest(req);
 
     fprintf(stderr,"httpgw: Opened %s\n",hashstr.c_str());
 
@@ -752,7 +924,8 @@ void HttpGwNewRequestCallback (struct evhttp_request *evreq, void *arg) {
 
     if (swift::Size(transfer)) {
         HttpGwFirstProgressCallback(transfer,bin_t(0,0));
-    } else {
+    } else if (HttpGwFindRequestsByTransfer(transfer).size() == 1) {
+        // Others for this transfer already wait for first progress
         swift::AddProgressCallback(transfer,&HttpGwFirstProgressCallback,HTTPGW_FIRST_PROGRESS_BYTE_INTERVAL_AS_LAYER);
     }
 }
@@ -793,13 +966,13 @@ tint test_time = 0;
  */
 bool HTTPIsSending()
 {
-	if (http_gw_reqs_open > 0)
+	if (http_gw_reqs.size() > 0)
 	{
-		FileTransfer *ft = FileTransfer::file(http_requests[http_gw_reqs_open-1].transfer);
+		FileTransfer *ft = FileTransfer::file(http_gw_reqs[http_gw_reqs.size()-1]->transfer);
 		if (ft != NULL) {
 			fprintf(stderr,"httpgw: upload %lf\n",ft->GetCurrentSpeed(DDIR_UPLOAD)/1024.0);
 			fprintf(stderr,"httpgw: dwload %lf\n",ft->GetCurrentSpeed(DDIR_DOWNLOAD)/1024.0);
-			//fprintf(stderr,"httpgw: seqcmp %llu\n", swift::SeqComplete(http_requests[http_gw_reqs_open-1].transfer));
+			//fprintf(stderr,"httpgw: seqcmp %llu\n", swift::SeqComplete(http_gw_reqs[http_gw_reqs.size()-1]->transfer));
 		}
 	}
     return true;
@@ -814,9 +987,9 @@ bool HTTPIsSending()
 
 	if (NOW > test_time+5*1000*1000)
 	{
-		fprintf(stderr,"http alive: httpc count is %d\n", http_gw_reqs_open );
+		fprintf(stderr,"http alive: httpc count is %d\n", (int)http_gw_reqs.size() );
 
-		if (http_gw_reqs_open == 0 && !sawhttpconn)
+		if (http_gw_reqs.size() == 0 && !sawhttpconn)
 		{
 			fprintf(stderr,"http alive: no HTTP activity ever, quiting\n");
 			return false;
@@ -824,18 +997,18 @@ bool HTTPIsSending()
 		else
 			sawhttpconn = true;
 
-	    for (int httpc=0; httpc<http_gw_reqs_open; httpc++)
+	    for (int httpc=0; httpc<http_gw_reqs.size(); httpc++)
 	    {
 
 	    	/*
-	    	if (http_requests[httpc].offset >= 100000)
+	    	if (http_gw_reqs[httpc]->offset >= 100000)
 	    	{
 	    		fprintf(stderr,"http alive: 100K sent, quit\n");
 				return false;
 	    	}
 	    	else
 	    	{
-	    		fprintf(stderr,"http alive: sent %lli\n", http_requests[httpc].offset );
+	    		fprintf(stderr,"http alive: sent %lli\n", http_gw_reqs[httpc]->offset );
 	    		return true;
 	    	}
 	    	*/
@@ -845,11 +1018,11 @@ bool HTTPIsSending()
 			// b. not sending to HTTP client and not at end, and
 			//    not downloading from P2P and not at end
 			// then stop.
-			if ( swift::Size(http_requests[httpc].transfer) == 0 || \
-				 (http_requests[httpc].offset == lastoffset &&
-				 http_requests[httpc].offset != swift::Size(http_requests[httpc].transfer) && \
-			     swift::Complete(http_requests[httpc].transfer) == lastcomplete && \
-			     swift::Complete(http_requests[httpc].transfer) != swift::Size(http_requests[httpc].transfer)))
+			if ( swift::Size(http_gw_reqs[httpc]->transfer) == 0 || \
+				 (http_gw_reqs[httpc]->offset == lastoffset &&
+				 http_gw_reqs[httpc]->offset != swift::Size(http_gw_reqs[httpc]->transfer) && \
+			     swift::Complete(http_gw_reqs[httpc]->transfer) == lastcomplete && \
+			     swift::Complete(http_gw_reqs[httpc]->transfer) != swift::Size(http_gw_reqs[httpc]->transfer)))
 			{
 				fprintf(stderr,"http alive: no progress, quiting\n");
 				//getchar();
@@ -857,7 +1030,7 @@ bool HTTPIsSending()
 			}
 
 			/*
-			if (http_requests[httpc].offset == swift::Size(http_requests[httpc].transfer))
+			if (http_gw_reqs[httpc]->offset == swift::Size(http_gw_reqs[httpc]->transfer))
 			{
 				// TODO: seed for a while.
 				fprintf(stderr,"http alive: data delivered to client, quiting\n");
@@ -865,8 +1038,8 @@ bool HTTPIsSending()
 			}
 			*/
 
-			lastoffset = http_requests[httpc].offset;
-			lastcomplete = swift::Complete(http_requests[httpc].transfer);
+			lastoffset = http_gw_reqs[httpc]->offset;
+			lastcomplete = swift::Complete(http_gw_reqs[httpc]->transfer);
 	    }
 		test_time = NOW;
 
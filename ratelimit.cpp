@@ -0,0 +1,65 @@
+/*
+ *  ratelimit.cpp
+ *  Token bucket for the hierarchical rate limiter, see ratelimit.h.
+ *
+ *  Copyright 2009-2012 TECHNISCHE UNIVERSITEIT DELFT. All rights reserved.
+ *
+ */
+#include "ratelimit.h"
+
+using namespace swift;
+
+const tint TokenBucket::BURST_TIME;
+const tint TokenBucket::MAX_DELAY;
+
+
+void TokenBucket::SetRate(double rate)
+{
+    rate_ = rate;
+    tokens_ = 0;
+    last_ = 0;
+}
+
+
+void TokenBucket::Refill(tint now)
+{
+    if (last_ == 0 || now < last_) {
+        tokens_ = rate_*BURST_TIME/TINT_SEC;
+        last_ = now;
+        return;
+    }
+    tokens_ += rate_*(now-last_)/TINT_SEC;
+    double burst = rate_*BURST_TIME/TINT_SEC;
+    if (tokens_ > burst)
+        tokens_ = burst;
+    last_ = now;
+}
+
+
+tint TokenBucket::Delay(tint now)
+{
+    tint wait = 0;
+    for (TokenBucket *b=this; b!=NULL; b=b->parent_) {
+        if (!b->limited())
+            continue;
+        b->Refill(now);
+        if (b->tokens_ >= 0)
+            continue;
+        // A deficit is allowed, so one chunk can always go out eventually
+        tint w = b->rate_ > 0 ? (tint)(-b->tokens_*TINT_SEC/b->rate_)+1 : MAX_DELAY;
+        if (w > wait)
+            wait = w;
+    }
+    return wait < MAX_DELAY ? wait : MAX_DELAY;
+}
+
+
+void TokenBucket::Consume(uint64_t n, tint now)
+{
+    for (TokenBucket *b=this; b!=NULL; b=b->parent_) {
+        if (!b->limited())
+            continue;
+        b->Refill(now);
+        b->tokens_ -= n;
+    }
+}
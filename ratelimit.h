@@ -0,0 +1,56 @@
+/*
+ *  ratelimit.h
+ *  Token bucket for the hierarchical rate limiter: process > class >
+ *  transfer > channel. A chunk may go out when every bucket on the path to
+ *  the root has no deficit, after which it is charged to all of them. The
+ *  deficit tells the channel how long to wait, so it is paced rather than
+ *  polled.
+ *
+ *  Copyright 2009-2012 TECHNISCHE UNIVERSITEIT DELFT. All rights reserved.
+ *
+ */
+#ifndef SWIFT_RATELIMIT_H
+#define SWIFT_RATELIMIT_H
+
+#include "compat.h"
+#include <float.h>
+
+namespace swift {
+
+
+class TokenBucket
+{
+    public:
+        /** Tokens saved up while idle, as time at the current rate */
+        static const tint BURST_TIME = TINT_SEC/10;
+        /** Longest wait Delay() reports, to stay responsive to rate changes */
+        static const tint MAX_DELAY = TINT_SEC;
+
+        TokenBucket(TokenBucket *parent=NULL) :
+            rate_(DBL_MAX), tokens_(0), last_(0), parent_(parent) {}
+
+        /** Set rate in bytes/s, DBL_MAX is unlimited. Forgets any deficit. */
+        void SetRate(double rate);
+        double rate() const { return rate_; }
+        bool limited() const { return rate_ < DBL_MAX; }
+
+        void SetParent(TokenBucket *parent) { parent_ = parent; }
+        TokenBucket *parent() const { return parent_; }
+
+        /** Time until this bucket and all its ancestors allow sending, 0 if now */
+        tint Delay(tint now);
+        /** Charge n bytes to this bucket and all its ancestors */
+        void Consume(uint64_t n, tint now);
+
+    protected:
+        void Refill(tint now);
+
+        double      rate_;
+        double      tokens_;    // negative means deficit
+        tint        last_;      // 0 = start full at next Refill
+        TokenBucket *parent_;
+};
+
+}
+
+#endif
@@ -0,0 +1,342 @@
+/*
+ *  seeddir.cpp
+ *  Seeding a directory of content, see seeddir.h.
+ *
+ *  Copyright 2009-2012 TECHNISCHE UNIVERSITEIT DELFT. All rights reserved.
+ *
+ */
+#include "seeddir.h"
+
+using namespace swift;
+
+const char *DirSeeder::INDEX_FILENAME = "swift.mindex";
+const int DirSeeder::INDEX_VERSION;
+const tint DirSeeder::TICK;
+const int DirSeeder::OPEN_SLICE;
+const tint DirSeeder::SAVE_INTERVAL;
+const int DirSeeder::DEFAULT_WORKERS;
+
+
+/** A file to hash, the result comes back in root_hash */
+struct dirseed_job_t {
+    std::string filename;
+    std::string path;
+    uint32_t    chunk_size;
+    int64_t     size;
+    int64_t     mtime;
+    bool        force_check_diskvshash;
+    tint        time;       // NOW when queued, workers must not read it
+    Sha1Hash    root_hash;
+    bool        changed;    // modified while being hashed
+};
+
+
+/** Worker: builds the hash tree like a FileTransfer would, leaving .mhash
+ *  and .mbinmap behind, without any transfer state. */
+static void DirSeedHash(void *arg)
+{
+    dirseed_job_t *job = (dirseed_job_t *)arg;
+    std::string destdir = dirname_utf8(job->path);
+    if (destdir == "")
+        destdir = ".";
+    Storage *storage = new Storage(job->path,destdir,-1);
+    if (storage->IsOperational()) {
+        std::string binmap_filename = job->path+".mbinmap";
+        MmapHashTree *ht = new MmapHashTree(storage,Sha1Hash::ZERO,job->chunk_size,
+            job->path+".mhash",job->force_check_diskvshash,true,binmap_filename,job->time);
+        if (ht->IsOperational() && ht->is_complete() &&
+            ht->Checkpoint(binmap_filename,job->time) == 0)
+            job->root_hash = ht->root_hash();
+        delete ht;
+    }
+    delete storage;
+
+    int64_t size, mtime;
+    job->changed = file_stat_utf8(job->path,&size,&mtime) < 0 ||
+        size != job->size || mtime != job->mtime;
+}
+
+
+DirSeeder::DirSeeder(std::string dirname, Address tracker, uint32_t chunk_size, int workers) :
+    dirname_(dirname), tracker_(tracker), chunk_size_(chunk_size), dirty_(false), saved_(0)
+{
+    queue_ = new WorkQueue(DirSeedHash,workers);
+    evtimer_assign(&evtick_,Channel::evbase,&DirSeeder::LibeventTickCallback,this);
+    LoadIndex();
+}
+
+
+DirSeeder::~DirSeeder()
+{
+    evtimer_del(&evtick_);
+    std::deque<void *> cancelled;
+    queue_->Cancel(cancelled);
+    for (int i=0; i<cancelled.size(); i++)
+        delete (dirseed_job_t *)cancelled[i];
+    queue_->Finish();
+    void *job;
+    while ((job = queue_->Pop()) != NULL)
+        Finished(job);
+    delete queue_;
+    if (dirty_)
+        SaveIndex();
+}
+
+
+bool DirSeeder::IsOpen(entry_t &e)
+{
+    if (Dormant() && DormantRegistry::GetInstance()->Has(e.root_hash))
+        return true;
+    if (e.fd < 0)
+        return false;
+    // May have been closed by CleanSwiftDirectory or the user
+    FileTransfer *ft = FileTransfer::file(e.fd);
+    if (ft != NULL && ft->root_hash() == e.root_hash)
+        return true;
+    e.fd = -1;
+    return false;
+}
+
+
+void DirSeeder::Unseed(entry_t &e)
+{
+    if (Dormant())
+        DormantRegistry::GetInstance()->Remove(e.root_hash);
+    if (IsOpen(e))
+        swift::Close(e.fd);
+    e.fd = -1;
+}
+
+
+void DirSeeder::Scan(bool force_check_diskvshash)
+{
+    std::set<std::string> seen;
+    DirEntry *de = opendir_utf8(dirname_);
+    while (de != NULL)
+    {
+        std::string filename = de->filename_;
+        if (!(de->isdir_ || filename.rfind(".mhash") != std::string::npos ||
+              filename.rfind(".mbinmap") != std::string::npos ||
+              filename.rfind(".mindex") != std::string::npos))
+        {
+            // Not dir, or metafile
+            seen.insert(filename);
+            int64_t size, mtime;
+            std::map<std::string,entry_t>::iterator iter = index_.find(filename);
+            if (hashing_.count(filename) || file_stat_utf8(Path(filename),&size,&mtime) < 0)
+                ;
+            else if (iter != index_.end() && !force_check_diskvshash &&
+                iter->second.size == size && iter->second.mtime == mtime)
+            {
+                // Unchanged
+                entry_t &e = iter->second;
+                if (e.root_hash != Sha1Hash::ZERO && !IsOpen(e) && !opening_set_.count(filename)) {
+                    opening_.push_back(filename);
+                    opening_set_.insert(filename);
+                }
+            }
+            else
+            {
+                bool known = iter != index_.end();
+                if (known) {
+                    // Changed: old hashes go, stop serving them
+                    Unseed(iter->second);
+                    index_.erase(iter);
+                    dirty_ = true;
+                }
+                dprintf("%s seeddir hashing %s\n",tintstr(),filename.c_str());
+                dirseed_job_t *job = new dirseed_job_t();
+                job->filename = filename;
+                job->path = Path(filename);
+                job->chunk_size = chunk_size_;
+                job->size = size;
+                job->mtime = mtime;
+                // Checkpoints of files indexed before are stale now, ones
+                // of files never indexed are trusted like Open() does.
+                job->force_check_diskvshash = force_check_diskvshash || known;
+                job->time = NOW;
+                job->root_hash = Sha1Hash::ZERO;
+                job->changed = false;
+                hashing_.insert(filename);
+                queue_->Push(job);
+            }
+        }
+        DirEntry *newde = readdir_utf8(de);
+        delete de;
+        de = newde;
+    }
+
+    // Gone from disk
+    std::map<std::string,entry_t>::iterator iter = index_.begin();
+    while (iter != index_.end()) {
+        if (seen.count(iter->first))
+            iter++;
+        else {
+            Unseed(iter->second);
+            index_.erase(iter++);
+            dirty_ = true;
+        }
+    }
+    Schedule();
+}
+
+
+void DirSeeder::Finished(void *arg)
+{
+    dirseed_job_t *job = (dirseed_job_t *)arg;
+    hashing_.erase(job->filename);
+    // Modified while hashing: left out, the next scan hashes it again
+    if (!job->changed) {
+        entry_t e;
+        e.root_hash = job->root_hash;
+        e.chunk_size = job->chunk_size;
+        e.size = job->size;
+        e.mtime = job->mtime;
+        e.fd = -1;
+        index_[job->filename] = e;
+        dirty_ = true;
+        if (e.root_hash != Sha1Hash::ZERO && !opening_set_.count(job->filename)) {
+            opening_.push_back(job->filename);
+            opening_set_.insert(job->filename);
+        }
+    }
+    delete job;
+}
+
+
+void DirSeeder::Tick()
+{
+    void *job;
+    while ((job = queue_->Pop()) != NULL)
+        Finished(job);
+
+    int opened = 0;
+    while (opened < OPEN_SLICE && !opening_.empty())
+    {
+        std::string filename = opening_.front();
+        opening_.pop_front();
+        opening_set_.erase(filename);
+        std::map<std::string,entry_t>::iterator iter = index_.find(filename);
+        if (iter == index_.end() || IsOpen(iter->second))
+            continue;
+        entry_t &e = iter->second;
+        // Registering is cheap, the first handshake opens it
+        if (Dormant() && swift::Find(e.root_hash) < 0 &&
+            DormantRegistry::GetInstance()->Add(Path(filename),e.root_hash,e.chunk_size) == 0)
+            continue;
+        opened++;
+        // Same content under another name is served once
+        int fd = swift::Find(e.root_hash);
+        if (fd < 0) {
+            dprintf("%s seeddir opening %s\n",tintstr(),filename.c_str());
+            fd = swift::Open(Path(filename),e.root_hash,tracker_,false,true,e.chunk_size);
+        }
+        e.fd = fd;
+    }
+
+    if (dirty_ && (hashing_.empty() || NOW-saved_ >= SAVE_INTERVAL))
+        SaveIndex();
+}
+
+
+void DirSeeder::Wait()
+{
+    void *job;
+    while ((job = queue_->WaitPop()) != NULL)
+        Finished(job);
+    if (dirty_)
+        SaveIndex();
+}
+
+
+void DirSeeder::Schedule()
+{
+    if ((!hashing_.empty() || !opening_.empty() || dirty_) && Channel::evbase != NULL)
+        evtimer_add(&evtick_,tint2tv(TICK));
+}
+
+
+void DirSeeder::LibeventTickCallback(int fd, short event, void *arg)
+{
+    Channel::Time();
+    DirSeeder *ds = (DirSeeder *)arg;
+    ds->Tick();
+    ds->Schedule();
+}
+
+
+Sha1Hash DirSeeder::Lookup(std::string filename)
+{
+    std::map<std::string,entry_t>::iterator iter = index_.find(filename);
+    if (iter == index_.end())
+        return Sha1Hash::ZERO;
+    return iter->second.root_hash;
+}
+
+
+/** Text, a version line then per file: root hash, chunk size, size, mtime
+ *  and the name, which runs to the end of the line. */
+int DirSeeder::LoadIndex()
+{
+    FILE *fp = fopen_utf8(Path(INDEX_FILENAME).c_str(),"rb");
+    if (fp == NULL)
+        return -1;
+    char line[4096];
+    int version = 0;
+    if (fgets(line,sizeof(line),fp) == NULL || sscanf(line,"version %i",&version) != 1 ||
+        version != INDEX_VERSION)
+    {
+        fclose(fp);
+        return -1;
+    }
+    while (fgets(line,sizeof(line),fp) != NULL)
+    {
+        char hexhashstr[41];
+        entry_t e;
+        long long size, mtime;
+        int namepos = 0;
+        if (sscanf(line,"%40s %u %lld %lld %n",hexhashstr,&e.chunk_size,&size,&mtime,&namepos) != 4 ||
+            namepos == 0)
+            continue;
+        std::string filename(line+namepos);
+        if (!filename.empty() && filename[filename.length()-1] == '\n')
+            filename.erase(filename.length()-1);
+        if (filename.empty())
+            continue;
+        e.root_hash = Sha1Hash(true,hexhashstr);
+        e.size = size;
+        e.mtime = mtime;
+        e.fd = -1;
+        index_[filename] = e;
+    }
+    fclose(fp);
+    return 0;
+}
+
+
+int DirSeeder::SaveIndex()
+{
+    std::string text;
+    char line[128];
+    sprintf(line,"version %i\n",INDEX_VERSION);
+    text.append(line);
+    std::map<std::string,entry_t>::iterator iter;
+    for (iter=index_.begin(); iter!=index_.end(); iter++)
+    {
+        if (iter->first.find('\n') != std::string::npos)
+            continue;
+        entry_t &e = iter->second;
+        sprintf(line,"%s %u %lld %lld ",e.root_hash.hex().c_str(),e.chunk_size,
+            (long long)e.size,(long long)e.mtime);
+        text.append(line);
+        text.append(iter->first);
+        text.append("\n");
+    }
+    saved_ = NOW;
+    if (write_atomic_utf8(Path(INDEX_FILENAME),text.data(),text.size()) < 0) {
+        print_error("seeddir: cannot write index");
+        return -1;
+    }
+    dirty_ = false;
+    return 0;
+}
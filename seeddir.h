@@ -0,0 +1,93 @@
+/*
+ *  seeddir.h
+ *  Seeding a directory of content. An index file in the directory maps
+ *  each file's name, size and mtime to its root hash. A scan only hashes
+ *  files that are new or changed since they were indexed, on a pool of
+ *  worker threads that write the .mhash and .mbinmap next to the content.
+ *  Unchanged files are opened from their checkpoint, a slice per tick of
+ *  the event loop, so neither startup nor a rescan stalls serving. Without
+ *  a tracker they are registered with the DormantRegistry instead, and
+ *  only opened when a peer asks for them.
+ *
+ *  Copyright 2009-2012 TECHNISCHE UNIVERSITEIT DELFT. All rights reserved.
+ *
+ */
+#ifndef SWIFT_SEEDDIR_H
+#define SWIFT_SEEDDIR_H
+
+#include "swift.h"
+
+namespace swift {
+
+
+class DirSeeder
+{
+    public:
+        /** In the seeded directory, skipped by scans like .mhash files */
+        static const char *INDEX_FILENAME;
+        static const int INDEX_VERSION = 1;
+        static const tint TICK = TINT_SEC/10;
+        /** Transfers opened per tick */
+        static const int OPEN_SLICE = 64;
+        /** Index saved at most this often while hashing */
+        static const tint SAVE_INTERVAL = 5*TINT_SEC;
+        static const int DEFAULT_WORKERS = 4;
+
+        DirSeeder(std::string dirname, Address tracker, uint32_t chunk_size, int workers=DEFAULT_WORKERS);
+        /** Drops files not hashed yet, saves the index */
+        ~DirSeeder();
+
+        /** Compares the directory to the index. New and changed files, or
+         *  all when force_check_diskvshash, are queued for hashing, unchanged
+         *  ones that are not open yet for opening. */
+        void Scan(bool force_check_diskvshash=false);
+        /** Collects hashed files, opens up to OPEN_SLICE transfers and
+         *  saves the index if due. Runs from a timer while there is work. */
+        void Tick();
+        /** Hashes everything queued and saves the index, without opening */
+        void Wait();
+
+        /** Root hash of a file in the directory per the index, ZERO if unknown */
+        Sha1Hash Lookup(std::string filename);
+        size_t indexed() const { return index_.size(); }
+        size_t hashing() const { return hashing_.size(); }
+        size_t opening() const { return opening_.size(); }
+
+        int LoadIndex();
+        int SaveIndex();
+
+    protected:
+        struct entry_t {
+            Sha1Hash    root_hash;  // ZERO: empty or unreadable, not seeded
+            uint32_t    chunk_size;
+            int64_t     size;
+            int64_t     mtime;
+            int         fd;         // transfer opened for it, -1 if none
+        };
+
+        std::string     Path(std::string filename) { return dirname_+FILE_SEP+filename; }
+        /** Dormant swarms cannot announce themselves to a tracker */
+        bool            Dormant() { return tracker_ == Address(); }
+        /** Open or registered dormant */
+        bool            IsOpen(entry_t &e);
+        void            Unseed(entry_t &e);
+        void            Finished(void *job);
+        void            Schedule();
+        static void     LibeventTickCallback(int fd, short event, void *arg);
+
+        std::string     dirname_;
+        Address         tracker_;
+        uint32_t        chunk_size_;
+        std::map<std::string,entry_t>   index_;
+        std::set<std::string>           hashing_;
+        std::deque<std::string>         opening_;
+        std::set<std::string>           opening_set_;
+        bool            dirty_;
+        tint            saved_;
+        WorkQueue       *queue_;
+        struct event    evtick_;
+};
+
+}
+
+#endif
@@ -15,6 +15,7 @@ using namespace std;
 
 tint Channel::MIN_DEV = 50*TINT_MSEC;
 tint Channel::MAX_SEND_INTERVAL = TINT_SEC*58;
+tint Channel::IDLE_TIMEOUT = TINT_SEC*10;
 tint Channel::LEDBAT_TARGET = TINT_MSEC*25;
 float Channel::LEDBAT_GAIN = 1.0/LEDBAT_TARGET;
 tint Channel::LEDBAT_DELAY_BIN = TINT_SEC*30;
@@ -24,16 +25,25 @@ const char* Channel::SEND_CONTROL_MODES[] = {"keepalive", "pingpong",
 
 
 tint    Channel::NextSendTime () {
+    Inflate();
     TimeoutDataOut(); // precaution to know free cwnd
+    tint next;
     switch (send_control_) {
         case KEEP_ALIVE_CONTROL: return KeepAliveNextSendTime();
         case PING_PONG_CONTROL:  return PingPongNextSendTime();
-        case SLOW_START_CONTROL: return SlowStartNextSendTime();
-        case AIMD_CONTROL:       return AimdNextSendTime();
-        case LEDBAT_CONTROL:     return LedbatNextSendTime();
+        case SLOW_START_CONTROL: next = SlowStartNextSendTime(); break;
+        case AIMD_CONTROL:       next = AimdNextSendTime(); break;
+        case LEDBAT_CONTROL:     next = LedbatNextSendTime(); break;
         case CLOSE_CONTROL:      return TINT_NEVER;
         default:                 fprintf(stderr,"send_control.cpp: unknown control %d\n", send_control_); return TINT_NEVER;
     }
+    // RATELIMIT: in data sending modes, sleep out the upload deficit
+    // instead of waking up to find AddData refusing. Not past due ACKs
+    // though, held ACKs look like loss to the peer's congestion control.
+    tint wait = rate_bucket_[DDIR_UPLOAD].Delay(NOW);
+    if (wait > 0 && next != TINT_NEVER && next < NOW+wait)
+        next = min(NOW+wait,NextAckTime());
+    return next;
 }
 
 tint    Channel::SwitchSendControl (send_control_t control_mode) {
@@ -72,8 +82,9 @@ tint    Channel::KeepAliveNextSendTime () {
         return SwitchSendControl(CLOSE_CONTROL);
     if (ack_rcvd_recent_)
         return SwitchSendControl(SLOW_START_CONTROL);
-    if (data_in_.time!=TINT_NEVER)
-        return NOW;
+    tint ack_time = NextAckTime();
+    if (ack_time!=TINT_NEVER)
+        return ack_time;
 	/* Gertjan fix 5f51e5451e3785a74c058d9651b2d132c5a94557
     "Do not increase send interval in keep-alive mode when previous Reschedule
     was already in the future.
@@ -82,8 +93,8 @@ tint    Channel::KeepAliveNextSendTime () {
     not what we want. The scheduled time for the next packet should be unchanged
     on reception."
     */
-    if (!reverse_pex_out_.empty())
-        return reverse_pex_out_.front().time;
+    if (!act_->reverse_pex_out_.empty())
+        return act_->reverse_pex_out_.front().time;
     if (NOW < next_send_time_)
         return next_send_time_;
 
@@ -123,7 +134,7 @@ tint    Channel::PingPongNextSendTime () { // FIXME INFINITE LOOP
         return SwitchSendControl(KEEP_ALIVE_CONTROL);
     if (ack_rcvd_recent_)
         return SwitchSendControl(SLOW_START_CONTROL);
-    if (data_in_.time!=TINT_NEVER)
+    if (NextAckTime()!=TINT_NEVER)
         return NOW;
     if (last_recv_time_>last_send_time_)
         return NOW;
@@ -133,20 +144,21 @@ tint    Channel::PingPongNextSendTime () { // FIXME INFINITE LOOP
 }
 
 tint    Channel::CwndRateNextSendTime () {
-    if (data_in_.time!=TINT_NEVER)
-        return NOW; // TODO: delayed ACKs
+    tint ack_time = NextAckTime(); // delayed ACKs
+    if (ack_time<=NOW)
+        return NOW;
     //if (last_recv_time_<NOW-rtt_avg_*4)
     //    return SwitchSendControl(KEEP_ALIVE_CONTROL);
     send_interval_ = rtt_avg_/cwnd_;
     if (send_interval_>max(rtt_avg_,TINT_SEC)*4)
         return SwitchSendControl(KEEP_ALIVE_CONTROL);
-    if (data_out_.size()<cwnd_) {
+    if (act_->data_out_.size()<cwnd_) {
         dprintf("%s #%u sendctrl next in %llius (cwnd %.2f, data_out %i)\n",
-                tintstr(),id_,send_interval_,cwnd_,(int)data_out_.size());
-        return last_data_out_time_ + send_interval_;
+                tintstr(),id_,send_interval_,cwnd_,(int)act_->data_out_.size());
+        return min(last_data_out_time_ + send_interval_, ack_time);
     } else {
-        assert(data_out_.front().time!=TINT_NEVER);
-        return data_out_.front().time + ack_timeout();
+        assert(act_->data_out_.front().time!=TINT_NEVER);
+        return min(act_->data_out_.front().time + ack_timeout(), ack_time);
     }
 }
 
@@ -190,10 +202,10 @@ tint Channel::LedbatNextSendTime () {
 
     tint owd_cur(TINT_NEVER), owd_min(TINT_NEVER);
     for(int i=0; i<4; i++) {
-        if (owd_min>owd_min_bins_[i])
-            owd_min = owd_min_bins_[i];
-        if (owd_cur>owd_current_[i])
-            owd_cur = owd_current_[i];
+        if (owd_min>act_->owd_min_bins_[i])
+            owd_min = act_->owd_min_bins_[i];
+        if (owd_cur>act_->owd_current_[i])
+            owd_cur = act_->owd_current_[i];
     }
     if (ack_not_rcvd_recent_)
         BackOffOnLosses(0.8);
@@ -217,8 +229,8 @@ tint Channel::LedbatNextSendTime () {
         dprintf("%s #%u sendctrl ledbat stuck, reset\n",tintstr(),id() );
 	cwnd_count1_ = 0;
         for(int i=0; i<4; i++) {
-            owd_min_bins_[i] = TINT_NEVER;
-            owd_current_[i] = TINT_NEVER;
+            act_->owd_min_bins_[i] = TINT_NEVER;
+            act_->owd_current_[i] = TINT_NEVER;
         }
     }
 
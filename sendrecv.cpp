@@ -48,6 +48,7 @@ struct event Channel::evrecv;
  */
 
 void    Channel::AddPeakHashes (struct evbuffer *evb) {
+    live_peaks_out_ = hashtree()->size_in_chunks();
     for(int i=0; i<hashtree()->peak_count(); i++) {
         bin_t peak = hashtree()->peak(i);
         evbuffer_add_8(evb, SWIFT_HASH);
@@ -64,9 +65,12 @@ void    Channel::AddUncleHashes (struct evbuffer *evb, bin_t pos) {
     char bin_name_buf2[32];
     dprintf("%s #%u +uncle hash for %s\n",tintstr(),id_,pos.str(bin_name_buf2));
 
+    // LIVE: the peer may lack the hashes joining its old peaks to the
+    // current ones, send the whole path
+    bool live = transfer().IsLive();
     bin_t peak = hashtree()->peak_for(pos);
-    while (pos!=peak && ((NOW&3)==3 || !pos.parent().contains(data_out_cap_)) &&
-            ack_in_.is_empty(pos.parent()) ) {
+    while (pos!=peak && (live || (((NOW&3)==3 || !pos.parent().contains(data_out_cap_)) &&
+            act_->ack_in_.is_empty(pos.parent()))) ) {
         bin_t uncle = pos.sibling();
         evbuffer_add_8(evb, SWIFT_HASH);
         evbuffer_add_32be(evb, bin_toUInt32(uncle));
@@ -83,7 +87,7 @@ bin_t           Channel::ImposeHint () {
 
     twist &= hashtree()->peak(0).toUInt(); // FIXME may make it semi-seq here
 
-    bin_t my_pick = binmap_t::find_complement(ack_in_, *(hashtree()->ack_out()), twist);
+    bin_t my_pick = binmap_t::find_complement(act_->ack_in_, *(hashtree()->ack_out()), twist);
 
     my_pick.to_twisted(twist);
     while (my_pick.base_length()>max(1,(int)cwnd_))
@@ -105,10 +109,10 @@ bin_t        Channel::DequeueHint (bool *retransmitptr) {
 
     // Arno, 2012-07-27: Reenable Victor's retransmit, check for ACKs
     *retransmitptr = false;
-	while (!data_out_tmo_.empty()) {
-		tintbin tb = data_out_tmo_.front();
-		data_out_tmo_.pop_front();
-		if (ack_in_.is_filled(tb.bin)) {
+	while (!act_->data_out_tmo_.empty()) {
+		tintbin tb = act_->data_out_tmo_.front();
+		act_->data_out_tmo_.pop_front();
+		if (act_->ack_in_.is_filled(tb.bin)) {
 			// chunk was acknowledged in meantime
 			continue;
 		}
@@ -119,34 +123,32 @@ bin_t        Channel::DequeueHint (bool *retransmitptr) {
 		}
 	}
 
-    if (ENABLE_SENDERSIZE_PUSH && send.is_none() && hint_in_.empty() && last_recv_time_>NOW-rtt_avg_-TINT_SEC) {
+    if (ENABLE_SENDERSIZE_PUSH && send.is_none() && act_->hint_in_.empty() && last_recv_time_>NOW-rtt_avg_-TINT_SEC) {
         bin_t my_pick = ImposeHint(); // FIXME move to the loop
         if (!my_pick.is_none()) {
-            hint_in_.push_back(my_pick);
+            act_->hint_in_.push_back(my_pick);
             char bin_name_buf[32];
             dprintf("%s #%u *hint %s\n",tintstr(),id_,my_pick.str(bin_name_buf));
         }
     }
     
-    while (!hint_in_.empty() && send.is_none()) {
-        bin_t hint = hint_in_.front().bin;
-        tint time = hint_in_.front().time;
-        hint_in_.pop_front();
+    while (!act_->hint_in_.empty() && send.is_none()) {
+        bin_t hint = act_->hint_in_.front().bin;
+        tint time = act_->hint_in_.front().time;
+        act_->hint_in_.pop_front();
         while (!hint.is_base()) { // FIXME optimize; possible attack
-            hint_in_.push_front(tintbin(time,hint.right()));
+            act_->hint_in_.push_front(tintbin(time,hint.right()));
             hint = hint.left();
         }
         //if (time < NOW-TINT_SEC*3/2 )
         //    continue;  bad idea
-        if (!ack_in_.is_filled(hint))
+        // LIVE: chunks that left our window cannot be sent anymore
+        if (transfer().IsLive() && !hashtree()->ack_out()->is_filled(hint))
+            continue;
+        if (!act_->ack_in_.is_filled(hint))
             send = hint;
     }
-    uint64_t mass = 0;
-    // Arno, 2012-03-09: Is mucho expensive on busy server.
-    //for(int i=0; i<hint_in_.size(); i++)
-    //    mass += hint_in_[i].bin.base_length();
-    char bin_name_buf[32];
-    dprintf("%s #%u dequeued %s [%lli]\n",tintstr(),id_,send.str(bin_name_buf),mass);
+    Trace(TRACE_HINT_DEQUEUE,send,0,*retransmitptr);
     return send;
 }
 
@@ -168,13 +170,16 @@ void    Channel::AddHandshake (struct evbuffer *evb) {
     	encoded = EncodeID(id_);
     evbuffer_add_32be(evb, encoded);
     dprintf("%s #%u +hs %x\n",tintstr(),id_,encoded);
-    have_out_.clear();
+    act_->have_out_.clear();
+    have_out_synced_ = false;
+    have_bitmap_offset_ = 0;
+    have_bitmap_done_ = false;
 }
 
 
 void    Channel::Send () {
-
-	dprintf("%s #%u Send called \n",tintstr(),id_);
+    LatencyTimer lt(send_latency);
+    Inflate();
 
     struct evbuffer *evb = evbuffer_new();
     evbuffer_add_32be(evb, peer_channel_id_);
@@ -184,6 +189,7 @@ void    Channel::Send () {
     	if (send_control_!=CLOSE_CONTROL) {
 			// FIXME: seeder check
 			AddHave(evb);
+			AddHaveBitmap(evb);
 			AddAck(evb);
 			if (!hashtree()->is_complete()) {
 				AddHint(evb);
@@ -204,6 +210,8 @@ void    Channel::Send () {
         AddHave(evb); // Arno, 2011-10-28: from AddHandShake. Why double?
         AddHave(evb);
         AddAck(evb);
+        // Last, old peers stop parsing at unknown messages
+        AddHaveBitmap(evb);
     }
 
     lastsendwaskeepalive_ = (evbuffer_get_length(evb) == 4);
@@ -219,6 +227,7 @@ void    Channel::Send () {
         print_error("swift can't send datagram");
     else
     	raw_bytes_up_ += r;
+    Trace(TRACE_SEND,data,r);
     last_send_time_ = NOW;
     sent_since_recv_++;
     dgrams_sent_++;
@@ -229,8 +238,8 @@ void    Channel::Send () {
 void    Channel::AddHint (struct evbuffer *evb) {
 
 	// RATELIMIT
-	// Policy is to not send hints when we are above speed limit
-	if (transfer().GetCurrentSpeed(DDIR_DOWNLOAD) > transfer().GetMaxSpeed(DDIR_DOWNLOAD)) {
+	// Policy is to not send hints when any bucket up the tree is in deficit
+	if (rate_bucket_[DDIR_DOWNLOAD].Delay(NOW) > 0) {
 		if (DEBUGTRAFFIC)
 			fprintf(stderr,"hint: forbidden#");
 		return;
@@ -241,9 +250,15 @@ void    Channel::AddHint (struct evbuffer *evb) {
     tint plan_for = max(TINT_SEC,rtt_avg_*4);
 
     tint timed_out = NOW - plan_for*2;
-    while ( !hint_out_.empty() && hint_out_.front().time < timed_out ) {
-        hint_out_size_ -= hint_out_.front().bin.base_length();
-        hint_out_.pop_front();
+    while ( !act_->hint_out_.empty() && act_->hint_out_.front().time < timed_out ) {
+        hint_out_size_ -= act_->hint_out_.front().bin.base_length();
+        act_->hint_out_.pop_front();
+    }
+    // LIVE: hints for chunks that left the window will not be served
+    while ( transfer().IsLive() && !act_->hint_out_.empty() &&
+            act_->hint_out_.front().bin.base_right().base_offset() < hashtree()->live_start() ) {
+        hint_out_size_ -= act_->hint_out_.front().bin.base_length();
+        act_->hint_out_.pop_front();
     }
 
     int first_plan_pck = max ( (tint)1, plan_for / dip_avg_ );
@@ -282,7 +297,7 @@ void    Channel::AddHint (struct evbuffer *evb) {
     // 4. Ask allowance in blocks of chunks to get pipelining going from serving peer.
     if (hint_out_size_ == 0 || plan_pck > HINT_GRANULARITY)
     {
-        bin_t hint = transfer().picker().Pick(ack_in_,plan_pck,NOW+plan_for*2);
+        bin_t hint = transfer().picker().Pick(act_->ack_in_,plan_pck,NOW+plan_for*2);
         if (!hint.is_none()) {
         	if (DEBUGTRAFFIC)
         	{
@@ -294,7 +309,7 @@ void    Channel::AddHint (struct evbuffer *evb) {
             char bin_name_buf[32];
             dprintf("%s #%u +hint %s [%lli]\n",tintstr(),id_,hint.str(bin_name_buf),hint_out_size_);
             dprintf("%s #%u +hint base %s width %d\n",tintstr(),id_,hint.base_left().str(bin_name_buf), hint.base_length() );
-            hint_out_.push_back(hint);
+            act_->hint_out_.push_back(hint);
             hint_out_size_ += hint.base_length();
             //fprintf(stderr,"send c%d: HINTLEN %i\n", id(), hint.base_length());
             //fprintf(stderr,"HL %i ", hint.base_length());
@@ -308,7 +323,8 @@ void    Channel::AddHint (struct evbuffer *evb) {
 
 bin_t        Channel::AddData (struct evbuffer *evb) {
 	// RATELIMIT
-	if (transfer().GetCurrentSpeed(DDIR_UPLOAD) > transfer().GetMaxSpeed(DDIR_UPLOAD)) {
+	// Checked before building DATA, NextSendTime() waits out the deficit
+	if (rate_bucket_[DDIR_UPLOAD].Delay(NOW) > 0) {
 		transfer().OnSendNoData();
 		return bin_t::NONE;
 	}
@@ -319,7 +335,7 @@ bin_t        Channel::AddData (struct evbuffer *evb) {
     bin_t tosend = bin_t::NONE;
     bool isretransmit = false;
     tint luft = send_interval_>>4; // may wake up a bit earlier
-    if (data_out_.size()<cwnd_ &&
+    if (act_->data_out_.size()<cwnd_ &&
             last_data_out_time_+send_interval_<=NOW+luft) {
         tosend = DequeueHint(&isretransmit);
         if (tosend.is_none()) {
@@ -329,19 +345,22 @@ bin_t        Channel::AddData (struct evbuffer *evb) {
         }
     } else
         dprintf("%s #%u sendctrl wait cwnd %f data_out %i next %s\n",
-                tintstr(),id_,cwnd_,(int)data_out_.size(),tintstr(last_data_out_time_+send_interval_));
+                tintstr(),id_,cwnd_,(int)act_->data_out_.size(),tintstr(last_data_out_time_+send_interval_));
 
-    if (tosend.is_none())// && (last_data_out_time_>NOW-TINT_SEC || data_out_.empty()))
+    if (tosend.is_none())// && (last_data_out_time_>NOW-TINT_SEC || act_->data_out_.empty()))
         return bin_t::NONE; // once in a while, empty data is sent just to check rtt FIXED
 
-    if (ack_in_.is_empty() && hashtree()->size())
+    // LIVE: the peaks grow, resend them when they changed since, so the
+    // uncle path below ends at a peak the peer knows
+    if ((act_->ack_in_.is_empty() && hashtree()->size()) ||
+        (transfer().IsLive() && hashtree()->size_in_chunks() > live_peaks_out_))
         AddPeakHashes(evb);
 
     //NETWVSHASH
     if (hashtree()->get_check_netwvshash())
     	AddUncleHashes(evb,tosend);
 
-    if (!ack_in_.is_empty()) // TODO: cwnd_>1
+    if (!act_->ack_in_.is_empty()) // TODO: cwnd_>1
         data_out_cap_ = tosend;
 
     // Arno, 2011-11-03: May happen when first data packet is sent to empty
@@ -385,8 +404,10 @@ bin_t        Channel::AddData (struct evbuffer *evb) {
 	print_error("error on evbuffer_reserve_space");
 	return bin_t::NONE;
     }
+    tint readstart = usec_mono_time();
     size_t r = transfer().GetStorage()->Read((char *)vec.iov_base,
-		     hashtree()->chunk_size(),tosend.base_offset()*hashtree()->chunk_size());
+		     hashtree()->chunk_size(),hashtree()->storage_offset(tosend));
+    read_latency.Record(usec_mono_time()-readstart);
     // TODO: corrupted data, retries, caching
     if (r<0) {
         print_error("error on reading");
@@ -402,9 +423,12 @@ bin_t        Channel::AddData (struct evbuffer *evb) {
     }
 
     last_data_out_time_ = NOW;
-    data_out_.push_back(tosend);
+    act_->data_out_.push_back(tosend);
+    if (isretransmit)
+        retransmits_++;
     bytes_up_ += r;
     global_bytes_up += r;
+    Trace(TRACE_DATA_OUT,tosend,r,isretransmit);
 
     char bin_name_buf[32];
     dprintf("%s #%u +data %s\n",tintstr(),id_,tosend.str(bin_name_buf));
@@ -412,35 +436,103 @@ bin_t        Channel::AddData (struct evbuffer *evb) {
     // RATELIMIT
     // ARNOSMPTODO: count overhead bytes too? Move to Send() then.
 	transfer_->OnSendData(hashtree()->chunk_size());
+	rate_bucket_[DDIR_UPLOAD].Consume(r,NOW);
 
     return tosend;
 }
 
 
 void    Channel::AddAck (struct evbuffer *evb) {
-    if (data_in_==tintbin())
-	//if (data_in_.bin==bin64_t::NONE)
+    char bin_name_buf[32];
+    if (data_in_!=tintbin()) {
+        // sometimes, we send a HAVE (e.g. in case the peer did repetitive send)
+        evbuffer_add_8(evb, data_in_.time==TINT_NEVER?SWIFT_HAVE:SWIFT_ACK);
+        evbuffer_add_32be(evb, bin_toUInt32(data_in_.bin));
+        if (data_in_.time!=TINT_NEVER)
+            evbuffer_add_64be(evb, data_in_.time);
+        if (DEBUGTRAFFIC)
+            fprintf(stderr,"send c%d: ACK %i\n", id(), bin_toUInt32(data_in_.bin));
+        act_->have_out_.set(data_in_.bin);
+        dprintf("%s #%u +ack %s %s\n",
+            tintstr(),id_,data_in_.bin.str(bin_name_buf),tintstr(data_in_.time));
+        data_in_ = tintbin();
+    }
+    if (act_->ack_pending_.empty())
         return;
-    // sometimes, we send a HAVE (e.g. in case the peer did repetitive send)
-    evbuffer_add_8(evb, data_in_.time==TINT_NEVER?SWIFT_HAVE:SWIFT_ACK);
-    evbuffer_add_32be(evb, bin_toUInt32(data_in_.bin));
+
+    // Aggregate ACKs: merge sibling bins into ranges. A range carries
+    // the arrival time of its latest chunk, which the sender matches with
+    // the latest chunk it sent in that range, so OWD samples stay exact.
+    // Merged ranges keep the position of their earliest chunk, so they go
+    // out in arrival order, as the sender's reordering detection expects.
+    bool merged = true;
+    while (merged) {
+        merged = false;
+        for (int i=0; i<act_->ack_pending_.size() && !merged; i++)
+            for (int j=i+1; j<act_->ack_pending_.size() && !merged; j++)
+                if (act_->ack_pending_[i].bin.sibling()==act_->ack_pending_[j].bin) {
+                    act_->ack_pending_[i].bin.to_parent();
+                    if (act_->ack_pending_[i].time<act_->ack_pending_[j].time)
+                        act_->ack_pending_[i].time = act_->ack_pending_[j].time;
+                    act_->ack_pending_.erase(j);
+                    merged = true;
+                }
+    }
+    for (int i=0; i<act_->ack_pending_.size(); i++) {
+        tintbin& ack = act_->ack_pending_[i];
+        evbuffer_add_8(evb, SWIFT_ACK);
+        evbuffer_add_32be(evb, bin_toUInt32(ack.bin));
+        evbuffer_add_64be(evb, ack.time);
+
+        if (DEBUGTRAFFIC)
+            fprintf(stderr,"send c%d: ACK %i\n", id(), bin_toUInt32(ack.bin));
+
+        act_->have_out_.set(ack.bin);
+        dprintf("%s #%u +ack %s %s\n",
+            tintstr(),id_,ack.bin.str(bin_name_buf),tintstr(ack.time));
+        if (ack.bin.layer()>2)
+            data_in_dbl_ = ack.bin;
+    }
+    act_->ack_pending_.clear();
+}
+
+
+bool    Channel::IsAckPending (bin_t pos) {
+    for (int i=0; i<act_->ack_pending_.size(); i++)
+        if (act_->ack_pending_[i].bin.contains(pos))
+            return true;
+    return false;
+}
+
+
+/** When the pending ACKs should go out: at once when there are
+ * ACK_AGGREGATE_MAX of them, or when the next chunk is not expected
+ * before ACK_DELAY has passed; otherwise wait for more chunks. */
+tint    Channel::NextAckTime () {
     if (data_in_.time!=TINT_NEVER)
-        evbuffer_add_64be(evb, data_in_.time);
+        return NOW;
+    if (act_->ack_pending_.empty())
+        return TINT_NEVER;
+    if (act_->ack_pending_.size()>=ACK_AGGREGATE_MAX)
+        return NOW;
+    tint deadline = act_->ack_pending_.front().time + ACK_DELAY;
+    if (last_data_in_time_+dip_avg_ > deadline)
+        return NOW;
+    return deadline;
+}
 
 
-	if (DEBUGTRAFFIC)
-		fprintf(stderr,"send c%d: ACK %i\n", id(), bin_toUInt32(data_in_.bin));
+void    Channel::AddHaveBin (struct evbuffer *evb, bin_t ack) {
+    act_->have_out_.set(ack);
+    evbuffer_add_8(evb, SWIFT_HAVE);
+    evbuffer_add_32be(evb, bin_toUInt32(ack));
+    Trace(TRACE_HAVE_OUT,ack);
 
-    have_out_.set(data_in_.bin);
-    char bin_name_buf[32];
-    dprintf("%s #%u +ack %s %s\n",
-        tintstr(),id_,data_in_.bin.str(bin_name_buf),tintstr(data_in_.time));
-    if (data_in_.bin.layer()>2)
-        data_in_dbl_ = data_in_.bin;
+    if (DEBUGTRAFFIC)
+        fprintf(stderr," %i", bin_toUInt32(ack));
 
-    //fprintf(stderr,"data_in_ c%d\n", id() );
-    data_in_ = tintbin();
-    //data_in_ = tintbin(NOW,bin64_t::NONE);
+    char bin_name_buf[32];
+    dprintf("%s #%u +have %s\n",tintstr(),id_,ack.str(bin_name_buf));
 }
 
 
@@ -470,20 +562,35 @@ void    Channel::AddHave (struct evbuffer *evb) {
 		return;
 	}
 
-    for(int count=0; count<4; count++) {
-        bin_t ack = binmap_t::find_complement(have_out_, *(hashtree()->ack_out()), 0); // FIXME: do rotating queue
+    // Rolling HAVE queue. Until the peer heard everything we have
+    // (or when we fell behind the queue) scan ack_out; after that only
+    // announce bins completed since, skipping what is ACKed anyway.
+    int count = 0;
+    if (have_out_synced_ && have_out_offset_ < transfer().reveal_start())
+        have_out_synced_ = false;
+    if (!have_out_synced_ && !have_bitmap_pending()) {
+        for(; count<4; count++) {
+            bin_t ack = binmap_t::find_complement(act_->have_out_, *(hashtree()->ack_out()), 0);
+            if (ack.is_none()) {
+                have_out_offset_ = transfer().reveal_end();
+                have_out_synced_ = true;
+                break;
+            }
+            ack = hashtree()->ack_out()->cover(ack);
+            AddHaveBin(evb,ack);
+        }
+    }
+    while (have_out_synced_ && count<4) {
+        bin_t ack = transfer().RevealAck(have_out_offset_);
         if (ack.is_none())
             break;
+        if (act_->have_out_.is_filled(ack) || IsAckPending(ack))
+            continue;
+        if (!hashtree()->ack_out()->is_filled(ack))
+            continue; // LIVE: left the window since
         ack = hashtree()->ack_out()->cover(ack);
-        have_out_.set(ack);
-        evbuffer_add_8(evb, SWIFT_HAVE);
-        evbuffer_add_32be(evb, bin_toUInt32(ack));
-
-    	if (DEBUGTRAFFIC)
-    		fprintf(stderr," %i", bin_toUInt32(ack));
-
-        char bin_name_buf[32];
-        dprintf("%s #%u +have %s\n",tintstr(),id_,ack.str(bin_name_buf));
+        AddHaveBin(evb,ack);
+        count++;
     }
 	if (DEBUGTRAFFIC)
 		fprintf(stderr,"\n");
@@ -491,7 +598,149 @@ void    Channel::AddHave (struct evbuffer *evb) {
 }
 
 
+#define HAVE_BITMAP_MAX_BYTES	256
+
+/*
+ * Compact HAVE snapshot for a joining peer, instead of dribbling
+ * ack_out out 4 HAVEs per datagram. Runs are read off binmap cover()s.
+ * Until the peer sent one itself we only put the first segment in the
+ * handshake datagrams, as the last message, and keep sending HAVEs.
+ */
+void    Channel::AddHaveBitmap (struct evbuffer *evb) {
+    if (have_bitmap_done_ || transfer().IsZeroState())
+        return;
+    bool capable = cap_in_ & (1ULL<<SWIFT_HAVE_BITMAP);
+    if (!capable && is_established()) {
+        have_bitmap_done_ = true; // old peer
+        return;
+    }
+    if (!capable && have_bitmap_offset_ > 0)
+        return;
+
+    binmap_t *ack = hashtree()->ack_out();
+    uint64_t end = hashtree()->size_in_chunks();
+    if (have_bitmap_offset_ == 0)
+        have_out_offset_ = transfer().reveal_end();
+
+    struct evbuffer *runs = evbuffer_new();
+    uint64_t off = have_bitmap_offset_;
+    bool filled = true;
+    while (off<end && evbuffer_get_length(runs)<HAVE_BITMAP_MAX_BYTES) {
+        uint64_t run = 0;
+        while (off+run<end) {
+            bin_t chunk(0,off+run);
+            if (ack->is_filled(chunk) != filled)
+                break;
+            bin_t c = ack->cover(chunk);
+            uint64_t cend = end;
+            if (!c.is_all() && c.contains(chunk))
+                cend = std::min(end,(uint64_t)(c.base_offset()+c.base_length()));
+            run = cend - off;
+        }
+        evbuffer_add_varint(runs,run);
+        off += run;
+        filled = !filled;
+    }
+
+    evbuffer_add_8(evb, SWIFT_HAVE_BITMAP);
+    evbuffer_add_32be(evb, (uint32_t)have_bitmap_offset_);
+    evbuffer_add_16be(evb, evbuffer_get_length(runs));
+    dprintf("%s #%u +have bitmap %llu-%llu %ib\n",tintstr(),id_,
+            (unsigned long long)have_bitmap_offset_,(unsigned long long)off,
+            (int)evbuffer_get_length(runs));
+    evbuffer_add_buffer(evb, runs);
+    evbuffer_free(runs);
+
+    have_bitmap_offset_ = off;
+    if (off>=end && capable)
+        HaveBitmapDone();
+}
+
+
+/** Peer has our complete bitmap; what completed since it was
+ * started goes out as HAVEs via the rotating queue. */
+void    Channel::HaveBitmapDone () {
+    have_bitmap_done_ = true;
+    binmap_t::copy(act_->have_out_, *hashtree()->ack_out());
+    if (have_out_offset_ < transfer().reveal_start()) {
+        act_->have_out_.clear(); // too much happened, rescan
+        have_out_synced_ = false;
+        return;
+    }
+    uint64_t i = have_out_offset_;
+    for (bin_t pos = transfer().RevealAck(i); !pos.is_none(); pos = transfer().RevealAck(i))
+        act_->have_out_.reset(pos);
+    have_out_synced_ = true;
+}
+
+
+/** Varint as written by evbuffer_add_varint, read from at most len bytes
+ *  at buf. Returns the number of bytes used, 0 if malformed. */
+static size_t decode_varint(const uint8_t *buf, size_t len, uint64_t *v) {
+    *v = 0;
+    for (size_t i=0; i<len && i*7<64; i++) {
+        *v |= (uint64_t)(buf[i] & 0x7f) << (i*7);
+        if (!(buf[i] & 0x80))
+            return i+1;
+    }
+    return 0;
+}
+
+
+bool    Channel::OnHaveBitmap (struct evbuffer *evb) {
+    if (evbuffer_get_length(evb) < 6)
+        return false;
+    uint64_t off = evbuffer_remove_32be(evb);
+    uint16_t len = evbuffer_remove_16be(evb);
+    if (evbuffer_get_length(evb) < len)
+        return false;
+    // Runs past the end are bogus. Before the size is known that is
+    // the most chunks a 32-bit bin can address.
+    uint64_t end = hashtree()->size_in_chunks();
+    if (end == 0)
+        end = 1ULL<<31;
+    bool capable = cap_in_ & (1ULL<<SWIFT_HAVE_BITMAP);
+    cap_in_ |= 1ULL<<SWIFT_HAVE_BITMAP;
+    dprintf("%s #%u -have bitmap %llu %ib\n",tintstr(),id_,(unsigned long long)off,(int)len);
+
+    const uint8_t *runs = evbuffer_pullup(evb, len);
+    size_t i = 0;
+    bool filled = true;
+    while (i < len) {
+        uint64_t run;
+        size_t used = decode_varint(runs+i, len-i, &run);
+        if (used == 0 || run > end || off > end-run) {
+            dprintf("%s #%u -have bitmap malformed\n",tintstr(),id_);
+            return false;
+        }
+        i += used;
+        if (filled && !transfer().IsZeroState()) {
+            // split into aligned bins
+            for (uint64_t left=run, pos=off; left>0; ) {
+                int layer = 0;
+                while (!(pos & ((2ULL<<layer)-1)) && (2ULL<<layer)<=left)
+                    layer++;
+                OnHaveBin(bin_t(layer,pos>>layer));
+                pos += 1ULL<<layer;
+                left -= 1ULL<<layer;
+            }
+        }
+        off += run;
+        filled = !filled;
+    }
+    evbuffer_drain(evb, len);
+    // Now known to understand it, and to have the segment we sent
+    if (!capable && !have_bitmap_done_ &&
+        have_bitmap_offset_ >= hashtree()->size_in_chunks())
+        HaveBitmapDone();
+    return true;
+}
+
+
 void    Channel::Recv (struct evbuffer *evb) {
+    LatencyTimer lt(recv_latency);
+    Inflate();
+    Trace(TRACE_RECV,bin_t::NONE,evbuffer_get_length(evb)+4);
     dprintf("%s #%u recvd %ib\n",tintstr(),id_,(int)evbuffer_get_length(evb)+4);
     dgrams_rcvd_++;
 
@@ -518,6 +767,7 @@ void    Channel::Recv (struct evbuffer *evb) {
 	if (DEBUGTRAFFIC)
 		fprintf(stderr,"recv c%d: size %d ", id(), evbuffer_get_length(evb));
 
+	bool abandon = false;
 	while (evbuffer_get_length(evb)) {
         uint8_t type = evbuffer_remove_8(evb);
 
@@ -567,15 +817,29 @@ void    Channel::Recv (struct evbuffer *evb) {
             case SWIFT_RANDOMIZE:
             	OnRandomize(evb);
             	break; //FRAGRAND
+            case SWIFT_HAVE_BITMAP:
+            	if (!OnHaveBitmap(evb))
+            		abandon = true;
+            	break;
             default:
                 dprintf("%s #%u ?msg id unknown %i\n",tintstr(),id_,(int)type);
-                return;
+                abandon = true;
+                break;
+        }
+        if (abandon) {
+            // Rest of the datagram cannot be parsed, nor its hashes trusted
+            act_->hashes_in_.clear();
+            return;
         }
     }
 	if (DEBUGTRAFFIC)
     {
     	fprintf(stderr,"\n");
     }
+    // hashes without DATA
+    for (int i=0; i<act_->hashes_in_.size(); i++)
+        hashtree()->OfferHash(act_->hashes_in_[i].first,act_->hashes_in_[i].second);
+    act_->hashes_in_.clear();
 
     last_recv_time_ = NOW;
     sent_since_recv_ = 0;
@@ -604,13 +868,17 @@ void   Channel::CloseOnError()
 
 
 /*
- * Arno: FAXME: HASH+DATA should be handled as a transaction: only when the
- * hashes check out should they be stored in the hashtree, otherwise revert.
+ * HASH+DATA are handled as a transaction: only when the hashes check
+ * out are they stored in the hashtree, see HashTree::OfferData.
  */
 void    Channel::OnHash (struct evbuffer *evb) {
 	bin_t pos = bin_fromUInt32(evbuffer_remove_32be(evb));
     Sha1Hash hash = evbuffer_remove_hash(evb);
-    hashtree()->OfferHash(pos,hash);
+    // Uncle hashes are checked in one go with the DATA that follows
+    if (hashtree()->size() && !hashtree()->is_live_peak(pos))
+        act_->hashes_in_.push_back(std::make_pair(pos,hash));
+    else
+        hashtree()->OfferHash(pos,hash); // peak hashes
     char bin_name_buf[32];
     dprintf("%s #%u -hash %s\n",tintstr(),id_,pos.str(bin_name_buf));
 
@@ -620,16 +888,16 @@ void    Channel::OnHash (struct evbuffer *evb) {
 
 void    Channel::CleanHintOut (bin_t pos) {
     int hi = 0;
-    while (hi<hint_out_.size() && !hint_out_[hi].bin.contains(pos))
+    while (hi<act_->hint_out_.size() && !act_->hint_out_[hi].bin.contains(pos))
         hi++;
-    if (hi==hint_out_.size())
+    if (hi==act_->hint_out_.size())
         return; // something not hinted or hinted in far past
     while (hi--) { // removing likely snubbed hints
-        hint_out_size_ -= hint_out_.front().bin.base_length();
-        hint_out_.pop_front();
+        hint_out_size_ -= act_->hint_out_.front().bin.base_length();
+        act_->hint_out_.pop_front();
     }
-    while (hint_out_.front().bin!=pos) {
-        tintbin f = hint_out_.front();
+    while (act_->hint_out_.front().bin!=pos) {
+        tintbin f = act_->hint_out_.front();
 
         assert (f.bin.contains(pos));
 
@@ -639,10 +907,10 @@ void    Channel::CleanHintOut (bin_t pos) {
             f.bin.to_right();
         }
 
-        hint_out_.front().bin = f.bin.sibling();
-        hint_out_.push_front(f);
+        act_->hint_out_.front().bin = f.bin.sibling();
+        act_->hint_out_.push_front(f);
     }
-    hint_out_.pop_front();
+    act_->hint_out_.pop_front();
     hint_out_size_--;
 }
 
@@ -672,8 +940,14 @@ bin_t Channel::OnData (struct evbuffer *evb) {  // TODO: HAVE NONE for corrupted
     }
     uint8_t *data = evbuffer_pullup(evb, length);
     data_in_ = tintbin(NOW,bin_t::NONE);
-    if (!hashtree()->OfferData(pos, (char*)data, length)) {
+    tint verifystart = usec_mono_time();
+    bool ok = hashtree()->OfferData(pos, (char*)data, length, act_->hashes_in_);
+    verify_latency.Record(usec_mono_time()-verifystart);
+    act_->hashes_in_.clear();
+    Trace(TRACE_DATA_IN,pos,length,ok);
+    if (!ok) {
     	evbuffer_drain(evb, length);
+        hash_fails_++;
         char bin_name_buf[32];
         dprintf("%s #%u !data %s\n",tintstr(),id_,pos.str(bin_name_buf));
         return bin_t::NONE;
@@ -690,7 +964,10 @@ bin_t Channel::OnData (struct evbuffer *evb) {  // TODO: HAVE NONE for corrupted
             transfer().callbacks[i](transfer().fd(),cover);  // FIXME
     if (cover.layer() >= 5) // Arno: tested with 32K, presently = 2 ** 5 * chunk_size CHUNKSIZE
     	transfer().OnRecvData( pow((double)2,(double)5)*((double)hashtree()->chunk_size()) );
-    data_in_.bin = pos;
+    act_->ack_pending_.push_back(tintbin(data_in_.time,pos));
+    data_in_ = tintbin();
+    transfer().OnDataIn(pos);
+    rate_bucket_[DDIR_DOWNLOAD].Consume(length,NOW);
 
     UpdateDIP(pos);
     CleanHintOut(pos);
@@ -723,80 +1000,92 @@ void    Channel::OnAck (struct evbuffer *evb) {
         eprintf("invalid ack: %s\n",ackd_pos.str(bin_name_buf));
         return;
     }
-    ack_in_.set(ackd_pos);
+    act_->ack_in_.set(ackd_pos);
+    UpdatePeerComplete();
 
     //fprintf(stderr,"OnAck: got bin %s is_complete %d\n", ackd_pos.str(), (int)ack_in_.is_complete_arno( hashtree()->ack_out()->get_height() ));
 
-    int di = 0, ri = 0;
-    // find an entry for the send (data out) event
-    while (  di<data_out_.size() && ( data_out_[di]==tintbin() ||
-           !ackd_pos.contains(data_out_[di].bin) )  )
-        di++;
-    // FUTURE: delayed acks
+    // find the entries for the send (data out) events; an aggregated ACK
+    // may cover several. The latest one sent is the one the peer timestamped.
+    int di = act_->data_out_.size(), dl = act_->data_out_.size(), ri = 0, acked = 0;
+    for (int i=0; i<act_->data_out_.size(); i++) {
+        if (act_->data_out_[i]==tintbin() || !ackd_pos.contains(act_->data_out_[i].bin))
+            continue;
+        if (di==act_->data_out_.size())
+            di = i;
+        if (dl==act_->data_out_.size() || act_->data_out_[i].time>=act_->data_out_[dl].time)
+            dl = i;
+        acked++;
+    }
     // rule out retransmits
-    while (  ri<data_out_tmo_.size() && !ackd_pos.contains(data_out_tmo_[ri].bin) )
-        ri++;
+    if (dl!=act_->data_out_.size())
+        while (  ri<act_->data_out_tmo_.size() && act_->data_out_tmo_[ri].bin!=act_->data_out_[dl].bin )
+            ri++;
     char bin_name_buf[32];
     dprintf("%s #%u %cack %s %lli\n",tintstr(),id_,
-            di==data_out_.size()?'?':'-',ackd_pos.str(bin_name_buf),peer_time);
-    if (di!=data_out_.size() && ri==data_out_tmo_.size()) { // not a retransmit
-            // round trip time calculations
-        tint rtt = NOW-data_out_[di].time;
+            di==act_->data_out_.size()?'?':'-',ackd_pos.str(bin_name_buf),peer_time);
+    tint rtt = -1;
+    if (dl!=act_->data_out_.size() && ri==act_->data_out_tmo_.size()) { // not a retransmit
+            // round trip time calculations, on a fresh clock read: the
+            // cached NOW may be behind by the datagram's earlier messages
+        rtt = Time()-act_->data_out_[dl].time;
         rtt_avg_ = (rtt_avg_*7 + rtt) >> 3;
         dev_avg_ = ( dev_avg_*3 + tintabs(rtt-rtt_avg_) ) >> 2;
-        assert(data_out_[di].time!=TINT_NEVER);
+        assert(act_->data_out_[dl].time!=TINT_NEVER);
             // one-way delay calculations
-        tint owd = peer_time - data_out_[di].time;
-        owd_cur_bin_ = 0;//(owd_cur_bin_+1) & 3;
-        owd_current_[owd_cur_bin_] = owd;
-        if ( owd_min_bin_start_+TINT_SEC*30 < NOW ) {
-            owd_min_bin_start_ = NOW;
-            owd_min_bin_ = (owd_min_bin_+1) & 3;
-            owd_min_bins_[owd_min_bin_] = TINT_NEVER;
+        tint owd = peer_time - act_->data_out_[dl].time;
+        act_->owd_cur_bin_ = 0;//(act_->owd_cur_bin_+1) & 3;
+        act_->owd_current_[act_->owd_cur_bin_] = owd;
+        if ( act_->owd_min_bin_start_+TINT_SEC*30 < NOW ) {
+            act_->owd_min_bin_start_ = NOW;
+            act_->owd_min_bin_ = (act_->owd_min_bin_+1) & 3;
+            act_->owd_min_bins_[act_->owd_min_bin_] = TINT_NEVER;
         }
-        if (owd_min_bins_[owd_min_bin_]>owd)
-            owd_min_bins_[owd_min_bin_] = owd;
+        if (act_->owd_min_bins_[act_->owd_min_bin_]>owd)
+            act_->owd_min_bins_[act_->owd_min_bin_] = owd;
         dprintf("%s #%u sendctrl rtt %lli dev %lli based on %s\n",
-                tintstr(),id_,rtt_avg_,dev_avg_,data_out_[di].bin.str(bin_name_buf));
-        ack_rcvd_recent_++;
+                tintstr(),id_,rtt_avg_,dev_avg_,act_->data_out_[dl].bin.str(bin_name_buf));
+        ack_rcvd_recent_ += acked;
         // early loss detection by packet reordering
         for (int re=0; re<di-MAX_REORDERING; re++) {
-            if (data_out_[re]==tintbin())
+            if (act_->data_out_[re]==tintbin())
                 continue;
             ack_not_rcvd_recent_++;
-            data_out_tmo_.push_back(data_out_[re].bin);
-            dprintf("%s #%u Rdata %s\n",tintstr(),id_,data_out_.front().bin.str(bin_name_buf));
+            act_->data_out_tmo_.push_back(act_->data_out_[re].bin);
+            dprintf("%s #%u Rdata %s\n",tintstr(),id_,act_->data_out_.front().bin.str(bin_name_buf));
             data_out_cap_ = bin_t::ALL;
-            data_out_[re] = tintbin();
+            act_->data_out_[re] = tintbin();
         }
     }
-    if (di!=data_out_.size())
-        data_out_[di]=tintbin();
+    Trace(TRACE_ACK_IN,ackd_pos,rtt);
+    for (int i=di; i<act_->data_out_.size(); i++)
+        if (act_->data_out_[i]!=tintbin() && ackd_pos.contains(act_->data_out_[i].bin))
+            act_->data_out_[i]=tintbin();
     // clear zeroed items
-    while (!data_out_.empty() && ( data_out_.front()==tintbin() ||
-            ack_in_.is_filled(data_out_.front().bin) ) )
-        data_out_.pop_front();
-    assert(data_out_.empty() || data_out_.front().time!=TINT_NEVER);
+    while (!act_->data_out_.empty() && ( act_->data_out_.front()==tintbin() ||
+            act_->ack_in_.is_filled(act_->data_out_.front().bin) ) )
+        act_->data_out_.pop_front();
+    assert(act_->data_out_.empty() || act_->data_out_.front().time!=TINT_NEVER);
 }
 
 
 void Channel::TimeoutDataOut ( ) {
     // losses: timeouted packets
     tint timeout = NOW - ack_timeout();
-    while (!data_out_.empty() &&
-        ( data_out_.front().time<timeout || data_out_.front()==tintbin() ) ) {
-        if (data_out_.front()!=tintbin() && ack_in_.is_empty(data_out_.front().bin)) {
+    while (!act_->data_out_.empty() &&
+        ( act_->data_out_.front().time<timeout || act_->data_out_.front()==tintbin() ) ) {
+        if (act_->data_out_.front()!=tintbin() && act_->ack_in_.is_empty(act_->data_out_.front().bin)) {
             ack_not_rcvd_recent_++;
             data_out_cap_ = bin_t::ALL;
-            data_out_tmo_.push_back(data_out_.front().bin);
+            act_->data_out_tmo_.push_back(act_->data_out_.front().bin);
             char bin_name_buf[32];
-            dprintf("%s #%u Tdata %s\n",tintstr(),id_,data_out_.front().bin.str(bin_name_buf));
+            dprintf("%s #%u Tdata %s\n",tintstr(),id_,act_->data_out_.front().bin.str(bin_name_buf));
         }
-        data_out_.pop_front();
+        act_->data_out_.pop_front();
     }
     // clear retransmit queue of older items
-    while (!data_out_tmo_.empty() && data_out_tmo_.front().time<NOW-MAX_POSSIBLE_RTT)
-        data_out_tmo_.pop_front();
+    while (!act_->data_out_tmo_.empty() && act_->data_out_tmo_.front().time<NOW-MAX_POSSIBLE_RTT)
+        act_->data_out_tmo_.pop_front();
 }
 
 
@@ -804,19 +1093,25 @@ void Channel::OnHave (struct evbuffer *evb) {
     bin_t ackd_pos = bin_fromUInt32(evbuffer_remove_32be(evb));
     if (ackd_pos.is_none())
         return; // wow, peer has hashes
+    OnHaveBin(ackd_pos);
+}
+
+
+void Channel::OnHaveBin (bin_t ackd_pos) {
 
     // PPPLUG
-    if (ENABLE_VOD_PIECEPICKER) {
+    if (ENABLE_VOD_PIECEPICKER && !transfer().IsLive()) {
 		// Ric: check if we should set the size in the file transfer
 		if (transfer().availability().size() <= 0 && hashtree()->size() > 0)
 		{
 			transfer().availability().setSize(hashtree()->size_in_chunks());
 		}
 		// Ric: update the availability if needed
-		transfer().availability().set(id_, ack_in_, ackd_pos);
+		transfer().availability().set(id_, act_->ack_in_, ackd_pos);
     }
 
-    ack_in_.set(ackd_pos);
+    act_->ack_in_.set(ackd_pos);
+    UpdatePeerComplete();
     char bin_name_buf[32];
     dprintf("%s #%u -have %s\n",tintstr(),id_,ackd_pos.str(bin_name_buf));
 
@@ -828,7 +1123,7 @@ void Channel::OnHave (struct evbuffer *evb) {
 void    Channel::OnHint (struct evbuffer *evb) {
     bin_t hint = bin_fromUInt32(evbuffer_remove_32be(evb));
     // FIXME: wake up here
-    hint_in_.push_back(hint);
+    act_->hint_in_.push_back(hint);
     char bin_name_buf[32];
     dprintf("%s #%u -hint %s\n",tintstr(),id_,hint.str(bin_name_buf));
 }
@@ -892,10 +1187,10 @@ void Channel::OnRandomize (struct evbuffer *evb) {
 void    Channel::AddPex (struct evbuffer *evb) {
 	// Gertjan fix: Reverse PEX
     // PEX messages sent to facilitate NAT/FW puncturing get priority
-    if (!reverse_pex_out_.empty()) {
+    if (!act_->reverse_pex_out_.empty()) {
         do {
-            tintbin pex_peer = reverse_pex_out_.front();
-            reverse_pex_out_.pop_front();
+            tintbin pex_peer = act_->reverse_pex_out_.front();
+            act_->reverse_pex_out_.pop_front();
             if (channels[(int) pex_peer.bin.toUInt()] == NULL)
                 continue;
             Address a = channels[(int) pex_peer.bin.toUInt()]->peer();
@@ -907,7 +1202,7 @@ void    Channel::AddPex (struct evbuffer *evb) {
             	evbuffer_add_16be(evb, a.port());
             	dprintf("%s #%u +pex (reverse) %s\n",tintstr(),id_,a.str());
             }
-        } while (!reverse_pex_out_.empty() && (SWIFT_MAX_NONDATA_DGRAM_SIZE-evbuffer_get_length(evb)) >= 7);
+        } while (!act_->reverse_pex_out_.empty() && (SWIFT_MAX_NONDATA_DGRAM_SIZE-evbuffer_get_length(evb)) >= 7);
 
         // Arno: 2012-02-23: Don't think this is right. Bit of DoS thing,
         // that you only get back the addr of people that got your addr.
@@ -943,15 +1238,15 @@ void    Channel::AddPex (struct evbuffer *evb) {
     pex_requested_ = false;
     /* Ensure that we don't add the same id to the reverse_pex_out_ queue
        more than once. */
-    for (tbqueue::iterator i = channels[chid]->reverse_pex_out_.begin();
-            i != channels[chid]->reverse_pex_out_.end(); i++)
-        if ((int) (i->bin.toUInt()) == id_)
+    channels[chid]->Inflate();
+    for (int i=0; i<channels[chid]->act_->reverse_pex_out_.size(); i++)
+        if ((int) (channels[chid]->act_->reverse_pex_out_[i].bin.toUInt()) == id_)
             return;
 
     dprintf("%s #%u adding pex for channel %u at time %s\n", tintstr(), chid,
         id_, tintstr(NOW + 2 * TINT_SEC));
     // Arno, 2011-10-03: should really be a queue of (tint,channel id(= uint32_t)) pairs.
-    channels[chid]->reverse_pex_out_.push_back(tintbin(NOW + 2 * TINT_SEC, bin_t(id_)));
+    channels[chid]->act_->reverse_pex_out_.push_back(tintbin(NOW + 2 * TINT_SEC, bin_t(id_)));
     if (channels[chid]->send_control_ == KEEP_ALIVE_CONTROL &&
             channels[chid]->next_send_time_ > NOW + 2 * TINT_SEC)
         channels[chid]->Reschedule();
@@ -1034,7 +1329,9 @@ void    Channel::RecvDatagram (evutil_socket_t socket) {
         if (!pos.is_all())
             return_log ("%s #0 that is not the root hash %s\n",tintstr(),addr.str());
         hash = evbuffer_remove_hash(evb);
-        FileTransfer* ft = FileTransfer::Find(hash);
+        FileTransfer* ft = FileTransfer::Find(hash,socket);
+        if (!ft)
+            ft = DormantRegistry::GetInstance()->Activate(hash);
         if (!ft)
         {
             ZeroState *zs = ZeroState::GetInstance();
@@ -1138,13 +1435,14 @@ void Channel::CloseChannelByAddress(const Address &addr)
 void Channel::Close () {
 
 	this->SwitchSendControl(CLOSE_CONTROL);
+	Inflate(); // the availability needs ack_in_
 
     if (is_established())
     	this->Send(); // Arno: send explicit close
 
-	if (!transfer().IsZeroState() && ENABLE_VOD_PIECEPICKER) {
+	if (!transfer().IsZeroState() && !transfer().IsLive() && ENABLE_VOD_PIECEPICKER) {
 		// Ric: remove its binmap from the availability
-		transfer().availability().remove(id_, ack_in_);
+		transfer().availability().remove(id_, act_->ack_in_);
     }
 
     // SAFECLOSE
@@ -1157,7 +1455,7 @@ void Channel::Reschedule () {
 
 	// Arno: CAREFUL: direct send depends on diff between next_send_time_ and
 	// NOW to be 0, so any calls to Time in between may put things off. Sigh.
-	Time();
+	// NOW is that of the callback that got us here.
     next_send_time_ = NextSendTime();
     if (next_send_time_!=TINT_NEVER) {
 
@@ -1168,16 +1466,21 @@ void Channel::Reschedule () {
         	// really slow, i.e., timers set for 100 usec from now get called
         	// at least two times later :-( Hence, for sends after receives
         	// perform them directly.
-        	dprintf("%s #%u requeue direct send\n",tintstr(),id_);
+        	Trace(TRACE_RESCHEDULE,bin_t::NONE,0,send_control_);
             direct_sending_ = true;
         	LibeventSendCallback(-1,EV_TIMEOUT,this);
             direct_sending_ = false;
         }
         else {
         	if (evsend_ptr_ != NULL) {
-        		struct timeval duetv = *tint2tv(duein);
-        		evtimer_add(evsend_ptr_,&duetv);
-        		dprintf("%s #%u requeue for %s in %lli\n",tintstr(),id_,tintstr(next_send_time_), duein);
+        		Trace(TRACE_RESCHEDULE,bin_t::NONE,duein,send_control_);
+        		// LIGHTWEIGHT: nothing in flight until the next keep-alive,
+        		// else our own timer
+        		Deflate();
+        		if (evsend_ptr_ != NULL) {
+        			struct timeval duetv = *tint2tv(duein);
+        			evtimer_add(evsend_ptr_,&duetv);
+        		}
         	}
         	else
         		dprintf("%s #%u cannot requeue for %s, closed\n",tintstr(),id_,tintstr(next_send_time_));
@@ -1185,14 +1488,54 @@ void Channel::Reschedule () {
     } else {
     	// SAFECLOSE
         dprintf("%s #%u resched, will close\n",tintstr(),id_);
+        Trace(TRACE_RESCHEDULE,bin_t::NONE,-1,send_control_);
 		this->Schedule4Close();
     }
 }
 
 
+void Channel::Wake () {
+    if (send_control_!=KEEP_ALIVE_CONTROL || !is_established())
+        return;
+    next_send_time_ = NOW;
+    if (evsend_ptr_ != NULL)
+        evtimer_add(evsend_ptr_,tint2tv(0));
+    else if (is_lightweight())
+        ScheduleKeepAlive();
+}
+
+
+void Channel::ScheduleKeepAlive () {
+    if (!event_initialized(&evkeepalive))
+        evtimer_assign(&evkeepalive,evbase,&Channel::LibeventKeepAliveCallback,NULL);
+    keepalive_queue.push(tintbin(next_send_time_,bin_t(id_)));
+    // Rearm only when first now
+    if (keepalive_queue.peek().time == next_send_time_ || !evtimer_pending(&evkeepalive,NULL))
+        evtimer_add(&evkeepalive,tint2tv(max(next_send_time_-NOW,(tint)0)));
+}
+
+
 /*
  * Channel class methods
  */
+void Channel::LibeventKeepAliveCallback(int fd, short event, void *arg) {
+
+	// Called by libevent when the first lightweight channel is due.
+    Time();
+    while (!keepalive_queue.is_empty() && keepalive_queue.peek().time <= NOW) {
+        tintbin due = keepalive_queue.pop();
+        Channel *c = channel(due.bin.toUInt());
+        if (c == NULL || c->next_send_time_ != due.time)
+            continue; // closed, or rescheduled since
+        if (c->evsend_ptr_ != NULL ? evtimer_pending(c->evsend_ptr_,NULL) : !c->is_lightweight())
+            continue; // active again with its own timer, or closed
+        LibeventSendCallback(-1,EV_TIMEOUT,c);
+    }
+    if (!keepalive_queue.is_empty())
+        evtimer_add(&evkeepalive,tint2tv(keepalive_queue.peek().time-NOW));
+}
+
+
 void Channel::LibeventSendCallback(int fd, short event, void *arg) {
 
 	// Called by libevent when it is the requested send time.
@@ -1201,6 +1544,10 @@ void Channel::LibeventSendCallback(int fd, short event, void *arg) {
     if (NOW<sender->next_send_time_-TINT_MSEC)
         dprintf("%s #%u suspicious send %s<%s\n",tintstr(),
                 sender->id(),tintstr(NOW),tintstr(sender->next_send_time_));
+    // Direct sends from Reschedule are not timer firings, nor is the
+    // initial one (next_send_time_ 0), skip those
+    if (!sender->direct_sending_ && sender->next_send_time_ > 0 && sender->next_send_time_ != TINT_NEVER)
+        timer_lateness.Record(NOW-sender->next_send_time_);
     if (sender->next_send_time_ != TINT_NEVER)
     	sender->Send();
 }
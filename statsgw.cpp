@@ -15,6 +15,10 @@ using namespace swift;
 
 int statsgw_reqs_count = 0;
 
+// /metrics output is built this many transfers/channels at a time,
+// yielding to the event loop in between.
+#define STATSGW_METRICS_SLICE		256
+
 
 uint64_t statsgw_last_down;
 uint64_t statsgw_last_up;
@@ -22,6 +26,7 @@ tint statsgw_last_time = 0;
 bool statsgw_quit_process=false;
 struct evhttp *statsgw_event;
 struct evhttp_bound_socket *statsgw_handle;
+struct event_base *statsgw_evbase;
 
 
 const char *top_page = "<!doctype html> \
@@ -120,9 +125,9 @@ void StatsOverviewCallback(struct evhttp_request *evreq)
     //statsgw_last_up = up;
 
 
-	char bodystr[102400];
-    strcpy(bodystr,"");
-    strcat(bodystr,top_page);
+	// Build in evbuffer, a fixed body buffer overflows with many swarms
+	struct evbuffer *evb = evbuffer_new();
+	evbuffer_add(evb,top_page,strlen(top_page));
 
     for (int i=0; i<swift::FileTransfer::files.size(); i++)
     {
@@ -132,35 +137,22 @@ void StatsOverviewCallback(struct evhttp_request *evreq)
     		int fd = ft->fd();
 			uint64_t total = (int)swift::Size(fd);
 			uint64_t down  = (int)swift::Complete(fd);
-			int perc = (int)((down * 100) / total);
-
-			char roothashhexstr[256];
-			sprintf(roothashhexstr,"%s", RootMerkleHash(fd).hex().c_str() );
+			int perc = total > 0 ? (int)((down * 100) / total) : 0;
 
-			char templ[1024];
-			sprintf(templ,swarm_page_templ,roothashhexstr, perc, '%', dspeed, uspeed );
-			strcat(bodystr,templ);
+			evbuffer_add_printf(evb,swarm_page_templ,RootMerkleHash(fd).hex().c_str(), perc, '%', dspeed, uspeed );
     	}
     }
 
-	strcat(bodystr,bottom_page);
+	evbuffer_add(evb,bottom_page,strlen(bottom_page));
 
 	char contlenstr[1024];
-	sprintf(contlenstr,"%i",strlen(bodystr));
+	sprintf(contlenstr,"%i",(int)evbuffer_get_length(evb));
 	struct evkeyvalq *headers = evhttp_request_get_output_headers(evreq);
 	evhttp_add_header(headers, "Connection", "close" );
 	evhttp_add_header(headers, "Content-Type", "text/html" );
 	evhttp_add_header(headers, "Content-Length", contlenstr );
 	evhttp_add_header(headers, "Accept-Ranges", "none" );
 
-	// Construct evbuffer and send via chunked encoding
-	struct evbuffer *evb = evbuffer_new();
-	int ret = evbuffer_add(evb,bodystr,strlen(bodystr));
-	if (ret < 0) {
-		print_error("statsgw: OverviewCallback: error evbuffer_add");
-		return;
-	}
-
 	evhttp_send_reply(evreq, 200, "OK", evb);
 	evbuffer_free(evb);
 }
@@ -228,8 +220,323 @@ void StatsGetSpeedCallback(struct evhttp_request *evreq)
 }
 
 
+/*
+ * /metrics: machine-readable per-transfer and per-channel metrics, in
+ * Prometheus text format or as JSON (/metrics?format=json). The reply is
+ * chunked and built in slices of STATSGW_METRICS_SLICE entries from
+ * event_base_once() callbacks, so thousands of channels don't stall the
+ * event loop.
+ */
+
+typedef double (*transfer_metric_t)(FileTransfer *ft);
+typedef double (*channel_metric_t)(Channel *c);
+
+struct metric_family_t {
+	const char *name;
+	const char *type;
+	const char *help;
+	transfer_metric_t tget;
+	channel_metric_t  cget;
+};
+
+static double MetricTransferSize(FileTransfer *ft) { return swift::Size(ft->fd()); }
+static double MetricTransferComplete(FileTransfer *ft) { return swift::Complete(ft->fd()); }
+static double MetricTransferSeqComplete(FileTransfer *ft) { return swift::SeqComplete(ft->fd()); }
+static double MetricTransferLeechers(FileTransfer *ft) { return ft->GetNumLeechers(); }
+static double MetricTransferSeeders(FileTransfer *ft) { return ft->GetNumSeeders(); }
+static double MetricTransferDownSpeed(FileTransfer *ft) { return ft->GetCurrentSpeed(DDIR_DOWNLOAD); }
+static double MetricTransferUpSpeed(FileTransfer *ft) { return ft->GetCurrentSpeed(DDIR_UPLOAD); }
+static double MetricTransferCheckpointBytes(FileTransfer *ft)
+{
+	if (ft->IsZeroState() || ft->IsLive())
+		return 0;
+	return ((MmapHashTree *)ft->hashtree())->checkpoint_written();
+}
+
+static double MetricChannelRTT(Channel *c) { return (double)c->rtt_avg()/TINT_SEC; }
+static double MetricChannelCwnd(Channel *c) { return c->cwnd(); }
+static double MetricChannelSendInterval(Channel *c) { return (double)c->send_interval()/TINT_SEC; }
+static double MetricChannelDataOut(Channel *c) { return c->data_out_size(); }
+static double MetricChannelRetransmits(Channel *c) { return c->retransmits(); }
+static double MetricChannelDgramsSent(Channel *c) { return c->dgrams_sent(); }
+static double MetricChannelDgramsRcvd(Channel *c) { return c->dgrams_rcvd(); }
+static double MetricChannelBytesUp(Channel *c) { return c->raw_bytes_up(); }
+static double MetricChannelBytesDown(Channel *c) { return c->raw_bytes_down(); }
+static double MetricChannelHashFails(Channel *c) { return c->hash_fails(); }
+static double MetricChannelMemory(Channel *c) { return c->memory_usage(); }
+static double MetricChannelLightweight(Channel *c) { return c->is_lightweight() ? 1 : 0; }
+
+static metric_family_t metric_families[] = {
+	{ "swift_transfer_size_bytes", "gauge", "Content size", MetricTransferSize, NULL },
+	{ "swift_transfer_complete_bytes", "gauge", "Bytes downloaded and verified", MetricTransferComplete, NULL },
+	{ "swift_transfer_seqcomplete_bytes", "gauge", "Bytes sequentially complete from start", MetricTransferSeqComplete, NULL },
+	{ "swift_transfer_leechers", "gauge", "Channels to incomplete peers", MetricTransferLeechers, NULL },
+	{ "swift_transfer_seeders", "gauge", "Channels to complete peers", MetricTransferSeeders, NULL },
+	{ "swift_transfer_down_speed_bytes", "gauge", "Current download speed in bytes/s", MetricTransferDownSpeed, NULL },
+	{ "swift_transfer_up_speed_bytes", "gauge", "Current upload speed in bytes/s", MetricTransferUpSpeed, NULL },
+	{ "swift_transfer_checkpoint_bytes_total", "counter", "Bytes of .mbinmap checkpoints written", MetricTransferCheckpointBytes, NULL },
+	{ "swift_channel_rtt_seconds", "gauge", "Smoothed round-trip time", NULL, MetricChannelRTT },
+	{ "swift_channel_cwnd", "gauge", "Congestion window in chunks", NULL, MetricChannelCwnd },
+	{ "swift_channel_send_interval_seconds", "gauge", "Data sending interval", NULL, MetricChannelSendInterval },
+	{ "swift_channel_data_out", "gauge", "Chunks sent and not yet acknowledged", NULL, MetricChannelDataOut },
+	{ "swift_channel_retransmits_total", "counter", "Chunks retransmitted", NULL, MetricChannelRetransmits },
+	{ "swift_channel_dgrams_sent_total", "counter", "Datagrams sent", NULL, MetricChannelDgramsSent },
+	{ "swift_channel_dgrams_received_total", "counter", "Datagrams received", NULL, MetricChannelDgramsRcvd },
+	{ "swift_channel_bytes_up_total", "counter", "Raw bytes sent", NULL, MetricChannelBytesUp },
+	{ "swift_channel_bytes_down_total", "counter", "Raw bytes received", NULL, MetricChannelBytesDown },
+	{ "swift_channel_hash_failures_total", "counter", "Chunks that failed the hash check", NULL, MetricChannelHashFails },
+	{ "swift_channel_memory_bytes", "gauge", "Memory held by the channel", NULL, MetricChannelMemory },
+	{ "swift_channel_lightweight", "gauge", "1 if the idle channel dropped its data path state", NULL, MetricChannelLightweight },
+};
+#define STATSGW_METRIC_FAMILIES	(sizeof(metric_families)/sizeof(metric_family_t))
+
+struct latency_family_t {
+	const char *name;
+	const char *json;
+	const char *help;
+	LatencyHistogram *hist;
+};
+
+static latency_family_t latency_families[] = {
+	{ "swift_send_latency_seconds", "send", "Time spent in Channel::Send", &Channel::send_latency },
+	{ "swift_recv_latency_seconds", "recv", "Time spent in Channel::Recv", &Channel::recv_latency },
+	{ "swift_read_latency_seconds", "read", "Storage read of an outgoing chunk", &Channel::read_latency },
+	{ "swift_verify_latency_seconds", "verify", "Hash check and write of an incoming chunk", &Channel::verify_latency },
+	{ "swift_timer_lateness_seconds", "timer", "Send timer firing after its due time", &Channel::timer_lateness },
+	{ "swift_checkpoint_latency_seconds", "checkpoint", "Snapshot of a transfer to its checkpoint on disk", &Checkpointer::latency },
+};
+#define STATSGW_LATENCY_FAMILIES	(sizeof(latency_families)/sizeof(latency_family_t))
+
+struct metrics_job_t {
+	struct evhttp_request *evreq;
+	bool	json;
+	int		family;	// Prometheus: family being written. JSON: 0 transfers, 1 channels
+	int		cursor;	// index in FileTransfer::files or Channel::channels
+	bool	first;	// JSON: next element is first in array
+	bool	closed;	// connection gone, evreq freed by libevent
+};
+
+
+static void StatsMetricsPrometheusLabels(struct evbuffer *evb, FileTransfer *ft, Channel *c)
+{
+	if (c == NULL)
+		evbuffer_add_printf(evb,"{roothash=\"%s\"}", ft->root_hash().hex().c_str() );
+	else
+		evbuffer_add_printf(evb,"{roothash=\"%s\",channel=\"%u\",peer=\"%s\"}", ft->root_hash().hex().c_str(), c->id(), c->peer().str() );
+}
+
+
+/** Histograms are process-wide and small: written in one go, only
+ *  non-empty buckets plus +Inf. */
+static void StatsMetricsLatencyPrometheus(struct evbuffer *evb)
+{
+	for (int i=0; i<STATSGW_LATENCY_FAMILIES; i++)
+	{
+		latency_family_t *lf = &latency_families[i];
+		LatencyHistogram *h = lf->hist;
+		evbuffer_add_printf(evb,"# HELP %s %s\n# TYPE %s histogram\n", lf->name, lf->help, lf->name );
+		uint64_t cum = 0;
+		for (int b=0; b<LatencyHistogram::NBUCKETS && cum<h->count(); b++)
+		{
+			if (h->bucket_count(b) == 0)
+				continue;
+			cum += h->bucket_count(b);
+			evbuffer_add_printf(evb,"%s_bucket{le=\"%.15g\"} %.15g\n", lf->name, (double)LatencyHistogram::BucketHigh(b)/TINT_SEC, (double)cum );
+		}
+		evbuffer_add_printf(evb,"%s_bucket{le=\"+Inf\"} %.15g\n", lf->name, (double)h->count() );
+		evbuffer_add_printf(evb,"%s_sum %.15g\n", lf->name, (double)h->sum()/TINT_SEC );
+		evbuffer_add_printf(evb,"%s_count %.15g\n", lf->name, (double)h->count() );
+	}
+}
+
+
+static void StatsMetricsLatencyJSON(struct evbuffer *evb)
+{
+	evbuffer_add_printf(evb,"\"latency\": {");
+	for (int i=0; i<STATSGW_LATENCY_FAMILIES; i++)
+	{
+		latency_family_t *lf = &latency_families[i];
+		LatencyHistogram *h = lf->hist;
+		evbuffer_add_printf(evb,"%s\"%s\": {\"count\": %.15g, \"sum_us\": %.15g, \"p50_us\": %.15g, \"p90_us\": %.15g, \"p99_us\": %.15g, \"max_us\": %.15g}",
+			i ? ", " : "", lf->json, (double)h->count(), (double)h->sum(), (double)h->Percentile(50),
+			(double)h->Percentile(90), (double)h->Percentile(99), (double)h->max() );
+	}
+	evbuffer_add_printf(evb,"}");
+}
+
+
+/** Write next slice in Prometheus format, returns true when done */
+static bool StatsMetricsPrometheus(metrics_job_t *job, struct evbuffer *evb)
+{
+	int budget = STATSGW_METRICS_SLICE;
+	while (job->family < STATSGW_METRIC_FAMILIES && budget > 0)
+	{
+		metric_family_t *mf = &metric_families[job->family];
+		int count = mf->tget != NULL ? FileTransfer::files.size() : Channel::channel_count();
+		if (job->cursor == 0)
+			evbuffer_add_printf(evb,"# HELP %s %s\n# TYPE %s %s\n", mf->name, mf->help, mf->name, mf->type );
+
+		for ( ; job->cursor<count && budget>0; job->cursor++, budget--)
+		{
+			double val;
+			if (mf->tget != NULL)
+			{
+				FileTransfer *ft = FileTransfer::file(job->cursor);
+				if (ft == NULL || ft->IsZeroState())
+					continue;
+				evbuffer_add_printf(evb,"%s",mf->name);
+				StatsMetricsPrometheusLabels(evb,ft,NULL);
+				val = mf->tget(ft);
+			}
+			else
+			{
+				Channel *c = Channel::channel(job->cursor);
+				if (c == NULL || c->IsScheduled4Close())
+					continue;
+				evbuffer_add_printf(evb,"%s",mf->name);
+				StatsMetricsPrometheusLabels(evb,&c->transfer(),c);
+				val = mf->cget(c);
+			}
+			evbuffer_add_printf(evb," %.15g\n", val );
+		}
+		if (job->cursor >= count)
+		{
+			job->family++;
+			job->cursor = 0;
+		}
+	}
+	if (job->family == STATSGW_METRIC_FAMILIES && budget > 0)
+	{
+		StatsMetricsLatencyPrometheus(evb);
+		job->family++;
+	}
+	return job->family > STATSGW_METRIC_FAMILIES;
+}
+
+
+/** Write next slice as JSON, returns true when done */
+static bool StatsMetricsJSON(metrics_job_t *job, struct evbuffer *evb)
+{
+	int budget = STATSGW_METRICS_SLICE;
+	if (job->family == 0 && job->cursor == 0)
+		evbuffer_add_printf(evb,"{\"transfers\": [");
+	while (job->family < 2 && budget > 0)
+	{
+		bool transfers = job->family == 0;
+		int count = transfers ? FileTransfer::files.size() : Channel::channel_count();
+		for ( ; job->cursor<count && budget>0; job->cursor++, budget--)
+		{
+			FileTransfer *ft = NULL;
+			Channel *c = NULL;
+			if (transfers)
+			{
+				ft = FileTransfer::file(job->cursor);
+				if (ft == NULL || ft->IsZeroState())
+					continue;
+			}
+			else
+			{
+				c = Channel::channel(job->cursor);
+				if (c == NULL || c->IsScheduled4Close())
+					continue;
+				ft = &c->transfer();
+			}
+			evbuffer_add_printf(evb,"%s{\"roothash\": \"%s\"", job->first ? "" : ", ", ft->root_hash().hex().c_str() );
+			job->first = false;
+			if (c != NULL)
+				evbuffer_add_printf(evb,", \"channel\": %u, \"peer\": \"%s\", \"sendctrl\": \"%s\"", c->id(), c->peer().str(), c->send_control_mode() );
+			for (int i=0; i<STATSGW_METRIC_FAMILIES; i++)
+			{
+				metric_family_t *mf = &metric_families[i];
+				if (transfers && mf->tget != NULL)
+					evbuffer_add_printf(evb,", \"%s\": %.15g", mf->name, mf->tget(ft) );
+				else if (!transfers && mf->cget != NULL)
+					evbuffer_add_printf(evb,", \"%s\": %.15g", mf->name, mf->cget(c) );
+			}
+			evbuffer_add_printf(evb,"}");
+		}
+		if (job->cursor >= count)
+		{
+			if (transfers)
+				evbuffer_add_printf(evb,"], \"channels\": [");
+			else
+			{
+				evbuffer_add_printf(evb,"], ");
+				StatsMetricsLatencyJSON(evb);
+				evbuffer_add_printf(evb,"}\n");
+			}
+			job->first = true;
+			job->family++;
+			job->cursor = 0;
+		}
+	}
+	return job->family >= 2;
+}
+
+
+static void StatsMetricsCloseCallback(struct evhttp_connection *evconn, void *jobvoid)
+{
+	((metrics_job_t *)jobvoid)->closed = true;
+}
+
+
+static void StatsMetricsSliceCallback(evutil_socket_t fd, short event, void *jobvoid)
+{
+	Channel::Time();
+	metrics_job_t *job = (metrics_job_t *)jobvoid;
+	if (job->closed)
+	{
+		delete job;
+		return;
+	}
+
+	struct evbuffer *evb = evbuffer_new();
+	bool done = job->json ? StatsMetricsJSON(job,evb) : StatsMetricsPrometheus(job,evb);
+	if (evbuffer_get_length(evb) > 0)
+		evhttp_send_reply_chunk(job->evreq,evb);
+	evbuffer_free(evb);
+
+	if (done)
+	{
+		struct evhttp_connection *evconn = evhttp_request_get_connection(job->evreq);
+		evhttp_connection_set_closecb(evconn,NULL,NULL);
+		evhttp_send_reply_end(job->evreq);
+		delete job;
+	}
+	else
+	{
+		struct timeval now = {0,0};
+		event_base_once(statsgw_evbase,-1,EV_TIMEOUT,StatsMetricsSliceCallback,job,&now);
+	}
+}
+
+
+void StatsMetricsCallback(struct evhttp_request *evreq, bool json)
+{
+	metrics_job_t *job = new metrics_job_t();
+	job->evreq = evreq;
+	job->json = json;
+	job->family = 0;
+	job->cursor = 0;
+	job->first = true;
+	job->closed = false;
+
+	struct evkeyvalq *headers = evhttp_request_get_output_headers(evreq);
+	evhttp_add_header(headers, "Connection", "close" );
+	evhttp_add_header(headers, "Content-Type", json ? "application/json" : "text/plain; version=0.0.4" );
+	evhttp_add_header(headers, "Accept-Ranges", "none" );
+
+	struct evhttp_connection *evconn = evhttp_request_get_connection(evreq);
+	evhttp_connection_set_closecb(evconn,StatsMetricsCloseCallback,job);
+
+	evhttp_send_reply_start(evreq, 200, "OK");
+	StatsMetricsSliceCallback(-1,EV_TIMEOUT,job);
+}
+
+
 void StatsGwNewRequestCallback (struct evhttp_request *evreq, void *arg) {
 
+    Channel::Time();
     dprintf("%s @%i http new request\n",tintstr(),statsgw_reqs_count);
     statsgw_reqs_count++;
 
@@ -248,6 +555,10 @@ void StatsGwNewRequestCallback (struct evhttp_request *evreq, void *arg) {
     {
     	StatsGetSpeedCallback(evreq);
     }
+    else if (!strncmp(uri,"/metrics",strlen("/metrics")))
+    {
+    	StatsMetricsCallback(evreq,strstr(uri,"format=json") != NULL);
+    }
     else if (!strncmp(uri,"/webUI/exit",strlen("/webUI/exit")) || statsgw_quit_process)
     {
     	statsgw_quit_process = true;
@@ -263,6 +574,8 @@ void StatsGwNewRequestCallback (struct evhttp_request *evreq, void *arg) {
 bool InstallStatsGateway (struct event_base *evbase,Address bindaddr) {
 	// Arno, 2011-10-04: From libevent's http-server.c example
 
+	statsgw_evbase = evbase;
+
 	/* Create a new evhttp object to handle requests. */
 	statsgw_event = evhttp_new(evbase);
 	if (!statsgw_event) {
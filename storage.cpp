@@ -486,6 +486,81 @@ ssize_t  Storage::Read(void *buf, size_t nbyte, int64_t offset)
 }
 
 
+/*
+ * Zero-copy read. The range is handed to libevent as a file segment,
+ * which it sends with sendfile() or an mmap. The segment owns a dup of the
+ * fd, so queued data stays valid when the transfer is closed meanwhile.
+ * File segments are libevent 2.1, before that evbuffer_add_file() does the
+ * same for a single range.
+ */
+static int evbuffer_add_fd_segment(struct evbuffer *evb, int fd, int64_t offset, size_t nbyte)
+{
+	int dupfd = dup(fd);
+	if (dupfd < 0)
+		return -1;
+#if LIBEVENT_VERSION_NUMBER < 0x02010100
+	return evbuffer_add_file(evb,dupfd,offset,nbyte); // closes dupfd
+#else
+	struct evbuffer_file_segment *seg = evbuffer_file_segment_new(dupfd,offset,nbyte,EVBUF_FS_CLOSE_ON_FREE);
+	if (seg == NULL)
+	{
+		close(dupfd);
+		return -1;
+	}
+	int ret = evbuffer_add_file_segment(evb,seg,0,nbyte);
+	evbuffer_file_segment_free(seg); // evb holds its own reference
+	return ret;
+#endif
+}
+
+
+ssize_t StorageFile::ReadToEvbuffer(struct evbuffer *evb, size_t nbyte, int64_t offset)
+{
+	if (offset >= GetSize())
+		return 0;
+	if (offset+nbyte > GetSize())
+		nbyte = GetSize()-offset;
+	if (evbuffer_add_fd_segment(evb,fd_,offset,nbyte) < 0)
+		return -1;
+	return nbyte;
+}
+
+
+ssize_t  Storage::ReadToEvbuffer(struct evbuffer *evb, size_t nbyte, int64_t offset)
+{
+	if (state_ == STOR_STATE_SINGLE_FILE)
+	{
+		if (evbuffer_add_fd_segment(evb,single_fd_,offset,nbyte) < 0)
+			return -1;
+		return nbyte;
+	}
+
+	// MULTIFILE: one segment per file the range spans
+	if (state_ == STOR_STATE_INIT)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	size_t done = 0;
+	while (done < nbyte && offset+done < ht_->size())
+	{
+		StorageFile *sf = FindStorageFile(offset+done);
+		if (sf == NULL)
+		{
+			errno = EINVAL;
+			return -1;
+		}
+		ssize_t ret = sf->ReadToEvbuffer(evb,nbyte-done,offset+done-sf->GetStart());
+		if (ret < 0)
+			return ret;
+		if (ret == 0)
+			break;
+		done += ret;
+	}
+	return done;
+}
+
+
 int64_t Storage::GetSizeFromSpec()
 {
 	if (state_ == STOR_STATE_SINGLE_FILE)
@@ -10,6 +10,7 @@
 #include <stdlib.h>
 #include "compat.h"
 #include "swift.h"
+#include "seeddir.h"
 #include "svn-revision.h"
 #include <cfloat>
 #include <sstream>
@@ -55,6 +56,7 @@ bool do_nat_test = false;
 bool generate_multifile=false;
 
 std::string scan_dirname="";
+DirSeeder *dir_seeder = NULL;
 uint32_t chunk_size = SWIFT_DEFAULT_CHUNK_SIZE;
 Address tracker;
 
@@ -354,7 +356,7 @@ int utf8main (int argc, char** argv)
 			fprintf(stderr,"  -u, --uprate\tupload rate limit in KiB/s (default: unlimited)\n");
 			fprintf(stderr,"  -y, --downrate\tdownload rate limit in KiB/s (default: unlimited)\n");
 			fprintf(stderr,"  -w, --wait\tlimit running time, e.g. 1[DHMs] (default: infinite with -l, -g)\n");
-			fprintf(stderr,"  -H, --checkpoint\tcreate checkpoint of file when complete for fast restart\n");
+			fprintf(stderr,"  -H, --checkpoint\tcheckpoint all transfers in the background while downloading and when complete for fast restart\n");
 			fprintf(stderr,"  -z, --chunksize\tchunk size in bytes (default: %d)\n", SWIFT_DEFAULT_CHUNK_SIZE);
 			fprintf(stderr,"  -m, --printurl\tcompose URL from tracker, file and chunksize\n");
 			fprintf(stderr,"  -M, --multifile\tcreate multi-file spec with given files\n");
@@ -382,6 +384,10 @@ int utf8main (int argc, char** argv)
 		evtimer_add(&evreport, tint2tv(REPORT_INTERVAL*TINT_SEC));
 
 
+		// CHECKPOINT
+		if (file_enable_checkpoint)
+			swift::StartCheckpointing();
+
 		// Arno:
 		if (scan_dirname != "") {
 			evtimer_assign(&evrescan, Channel::evbase, RescanDirCallback, NULL);
@@ -395,6 +401,10 @@ int utf8main (int argc, char** argv)
 
 		// event_base_loopexit() was called, shutting down
     }
+    else if (dir_seeder != NULL)
+    	// SEEDDIR: just preparing .m* files, wait for them
+    	dir_seeder->Wait();
+    delete dir_seeder;
 
     // Arno, 2012-01-03: Close all transfers
 	for (int i=0; i<FileTransfer::files.size(); i++) {
@@ -504,29 +514,12 @@ int OpenSwiftFile(std::string filename, const Sha1Hash& hash, Address tracker, b
 
 int OpenSwiftDirectory(std::string dirname, Address tracker, bool force_check_diskvshash, uint32_t chunk_size)
 {
-	DirEntry *de = opendir_utf8(dirname);
-	if (de == NULL)
+	// SEEDDIR: hashing and opening happen in the background
+	if (file_exists_utf8(dirname) != 2)
 		return -1;
-
-	while(1)
-	{
-		if (!(de->isdir_ || de->filename_.rfind(".mhash") != std::string::npos || de->filename_.rfind(".mbinmap") != std::string::npos))
-		{
-			// Not dir, or metafile
-			std::string path = dirname;
-			path.append(FILE_SEP);
-			path.append(de->filename_);
-			int fd = OpenSwiftFile(path,Sha1Hash::ZERO,tracker,force_check_diskvshash,chunk_size);
-			if (fd >= 0)
-				Checkpoint(fd);
-		}
-
-		DirEntry *newde = readdir_utf8(de);
-		delete de;
-		de = newde;
-		if (de == NULL)
-			break;
-	}
+	if (dir_seeder == NULL)
+		dir_seeder = new DirSeeder(dirname,tracker,chunk_size);
+	dir_seeder->Scan(force_check_diskvshash);
 	return 1;
 }
 
@@ -541,7 +534,6 @@ int CleanSwiftDirectory(std::string dirname)
 		FileTransfer *ft = *iter;
 		if (ft != NULL) {
 			std::string filename = ft->GetStorage()->GetOSPathName();
-			fprintf(stderr,"swift: clean: Checking %s\n", filename.c_str() );
 			int res = file_exists_utf8( filename );
 			if (res == 0) {
 				fprintf(stderr,"swift: clean: Missing %s\n", filename.c_str() );
@@ -650,10 +642,12 @@ void EndCallback(int fd, short event, void *arg) {
 
 void RescanDirCallback(int fd, short event, void *arg) {
 
+	Channel::Time();
+
 	// SEEDDIR
-	// Rescan dir: CAREFUL: this is blocking, better prepare .m* files first
-	// by running swift separately and then copy content + *.m* to scanned dir,
-	// such that a fast restore from checkpoint is done.
+	// Rescan dir: only stats files, new or changed ones are hashed by
+	// workers. Preparing .m* files by running swift separately and copying
+	// content + *.m* to the scanned dir still saves the hashing.
 	//
 	OpenSwiftDirectory(scan_dirname,tracker,false,chunk_size);
 
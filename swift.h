@@ -23,7 +23,17 @@
   ACK        02, bin_32, timestamp_32
   HAVE       03, bin_32
   Confirms successfull delivery of data. Used for
-  congestion control, as well.
+  congestion control, as well. ACKs are delayed a little
+  and aggregated: one ACK may cover several chunks, its
+  timestamp is the arrival time of the latest of them.
+
+  HAVE_BITMAP 0c, offset_32, length_16, runs
+  Compact snapshot of the sender's HAVEs, sent once after
+  the handshake, possibly split over several datagrams.
+  The runs are varint chunk counts, alternately have and
+  have-not, starting with have at chunk offset_32. Also
+  tells the peer we understand the message; otherwise
+  plain HAVEs are used.
 
   HINT        08, bin_32
   Practical value of "hints" is to avoid overlap, mostly.
@@ -65,6 +75,10 @@
 #include "binmap.h"
 #include "hashtree.h"
 #include "avgspeed.h"
+#include "histogram.h"
+#include "trace.h"
+#include "ratelimit.h"
+#include "checkpoint.h"
 // Arno, 2012-05-21: MacOS X has an Availability.h :-(
 #include "avail.h"
 
@@ -79,6 +93,13 @@ namespace swift {
 // Arno: Maximum size of a UDP packet we are willing to accept. Note: depends on CHUNKSIZE 8192
 #define SWIFT_MAX_RECV_DGRAM_SIZE			(SWIFT_MAX_SEND_DGRAM_SIZE*2)
 
+// LIVE: chunks a live stream keeps on disk and in the hash tree
+#define SWIFT_LIVE_DEFAULT_WINDOW			1024
+
+// CHECKPOINT: default policy, see SetCheckpointPolicy()
+#define SWIFT_CHECKPOINT_DEFAULT_BYTES		(16*1024*1024)
+#define SWIFT_CHECKPOINT_DEFAULT_INTERVAL	(60*TINT_SEC)
+
 #define layer2bytes(ln,cs)	(uint64_t)( ((double)cs)*pow(2.0,(double)ln))
 #define bytes2layer(bn,cs)  (int)log2(  ((double)bn)/((double)cs) )
 
@@ -227,6 +248,82 @@ namespace swift {
         }
     };
 
+    /** A ring of tintbins for the per-channel queues. The first N (a power
+        of 2) entries are stored inline, so an idle channel allocates
+        nothing, where a std::deque takes a 512-byte block up front. Beyond
+        N the ring moves to the heap, doubling, and moves back inline once
+        it drains. */
+    template<uint32_t N>
+    class tbring {
+        typedef char n_is_power_of_2[(N&(N-1))==0 ? 1 : -1];
+        tintbin     *buf_;
+        uint32_t    cap_, head_, size_;
+        tintbin     inline_[N];
+
+        tbring (const tbring&);
+        tbring& operator= (const tbring&);
+        void        grow () {
+            uint32_t ncap = cap_*2;
+            tintbin *nbuf = new tintbin[ncap];
+            for (uint32_t i=0; i<size_; i++)
+                nbuf[i] = (*this)[i];
+            release();
+            buf_ = nbuf;
+            cap_ = ncap;
+            head_ = 0;
+        }
+        void        release () {
+            if (buf_ != inline_)
+                delete [] buf_;
+            buf_ = inline_;
+            cap_ = N;
+        }
+        void        drained () {
+            head_ = 0;
+            if (buf_ != inline_)
+                release();
+        }
+    public:
+        tbring () : buf_(inline_), cap_(N), head_(0), size_(0) {}
+        ~tbring () { release(); }
+        int             size () const { return size_; }
+        bool            empty () const { return size_==0; }
+        tintbin&        operator[] (int i) { return buf_[(head_+i)&(cap_-1)]; }
+        const tintbin&  operator[] (int i) const { return buf_[(head_+i)&(cap_-1)]; }
+        tintbin&        front () { return buf_[head_]; }
+        tintbin&        back () { return (*this)[size_-1]; }
+        void            push_back (const tintbin& tb) {
+            if (size_==cap_)
+                grow();
+            buf_[(head_+size_++)&(cap_-1)] = tb;
+        }
+        void            push_front (const tintbin& tb) {
+            if (size_==cap_)
+                grow();
+            head_ = (head_-1)&(cap_-1);
+            buf_[head_] = tb;
+            size_++;
+        }
+        void            pop_front () {
+            head_ = (head_+1)&(cap_-1);
+            if (--size_==0)
+                drained();
+        }
+        void            pop_back () {
+            if (--size_==0)
+                drained();
+        }
+        /** Removes entry i, keeping the order of the others */
+        void            erase (int i) {
+            for (; i+1<size_; i++)
+                (*this)[i] = (*this)[i+1];
+            pop_back();
+        }
+        void            clear () { size_ = 0; drained(); }
+        /** Bytes allocated outside the object */
+        size_t          heap_bytes () const { return buf_!=inline_ ? cap_*sizeof(tintbin) : 0; }
+    };
+
     typedef std::pair<std::string,std::string> stringpair;
     typedef std::map<std::string,std::string>  parseduri_t;
     bool ParseURI(std::string uri,parseduri_t &map);
@@ -245,7 +342,8 @@ namespace swift {
         SWIFT_MSGTYPE_RCVD = 9,
         SWIFT_RANDOMIZE = 10, //FRAGRAND
         SWIFT_VERSION = 11, // Arno, 2011-10-19: TODO to match RFC-rev-03
-        SWIFT_MESSAGE_COUNT = 12
+        SWIFT_HAVE_BITMAP = 12,
+        SWIFT_MESSAGE_COUNT = 13
     } messageid_t;
 
     typedef enum {
@@ -259,6 +357,9 @@ namespace swift {
     class Channel;
     typedef std::vector<Channel *>	channels_t;
     typedef void (*ProgressCallback) (int transfer, bin_t bin);
+    /** Windows of interest as (first,last) base bins, or byte offsets */
+    typedef std::vector<std::pair<bin_t,bin_t> >	binwindows_t;
+    typedef std::vector<std::pair<int64_t,int64_t> >	bytewindows_t;
     class Storage;
 
     /** A class representing single file transfer. */
@@ -274,8 +375,11 @@ namespace swift {
 	 	 *  @param check_netwvshash			whether to hash check chunk on receipt
 	 	 *  @param chunk_size				size of chunk to use
 	 	 *  @param zerostate				whether to serve the hashes + content directly from disk
+	 	 *  @param live_window				if not 0, a live stream with root_hash as swarm id,
+	 	 *  								keeping this many chunks
+	 	 *  @param live_source				whether we append to the live stream
 	 	 */
-        FileTransfer(std::string file_name, const Sha1Hash& root_hash=Sha1Hash::ZERO, bool force_check_diskvshash=true, bool check_netwvshash=true, uint32_t chunk_size=SWIFT_DEFAULT_CHUNK_SIZE, bool zerostate=false);
+        FileTransfer(std::string file_name, const Sha1Hash& root_hash=Sha1Hash::ZERO, bool force_check_diskvshash=true, bool check_netwvshash=true, uint32_t chunk_size=SWIFT_DEFAULT_CHUNK_SIZE, bool zerostate=false, uint64_t live_window=0, bool live_source=false);
 
         /**    Close everything. */
         ~FileTransfer();
@@ -284,7 +388,12 @@ namespace swift {
         /** While we need to feed ACKs to every peer, we try (1) avoid
             unnecessary duplication and (2) keep minimum state. Thus,
             we use a rotating queue of bin completion events. */
-        //bin64_t         RevealAck (uint64_t& offset);
+        bin_t           RevealAck (uint64_t& offset);
+        /** Offset of the oldest completion event still in the queue;
+            readers that fell behind must rescan ack_out(). */
+        uint64_t        reveal_start () const { return have_log_start_; }
+        /** Offset just past the latest completion event. */
+        uint64_t        reveal_end () const { return have_log_start_+have_log_.size(); }
         /** Rotating queue read for channels of this transmission. */
         // Jori
         int             RevealChannel (int& i);
@@ -292,8 +401,9 @@ namespace swift {
         int             RandomChannel (int own_id);
 
 
-        /** Find transfer by the root hash. */
-        static FileTransfer* Find (const Sha1Hash& hash);
+        /** Find transfer by the root hash. If sock is given, prefer the
+         *  transfer bound to it, then an unbound one (SOCKMGMT). */
+        static FileTransfer* Find (const Sha1Hash& hash, evutil_socket_t sock=INVALID_SOCKET);
         /** Find transfer by the file descriptor. */
         static FileTransfer* file (int fd) {
             return fd<files.size() ? files[fd] : NULL;
@@ -327,12 +437,22 @@ namespace swift {
 		double			GetMaxSpeed(data_direction_t ddir);
 		/** Arno: Set maximum speed for the given direction in bytes/s */
 		void			SetMaxSpeed(data_direction_t ddir, double m);
-		/** Arno: Return the number of non-seeders current channeled with. */
+		/** Token bucket for this transfer, child of its class bucket */
+		TokenBucket*	GetRateBucket(data_direction_t ddir) { return &rate_bucket_[ddir]; }
+		/** Move this transfer to rate class cls, 0 is the default class */
+		void			SetRateClass(int cls);
+		int				GetRateClass() { return rate_class_; }
+		/** Root of the rate limiter tree: limits the whole process */
+		static TokenBucket* GetProcessRateBucket(data_direction_t ddir) { return &process_rate_bucket_[ddir]; }
+		/** Bucket shared by all transfers in class cls, created on first use */
+		static TokenBucket* GetClassRateBucket(int cls, data_direction_t ddir);
+		/** Arno: Return the number of non-seeders current channeled with.
+		 * Both counts are kept incrementally by the channels, no scan. */
 		uint32_t		GetNumLeechers();
 		/** Arno: Return the number of seeders current channeled with. */
 		uint32_t		GetNumSeeders();
 		/** Arno: Return the set of Channels for this transfer. MORESTATS */
-		channels_t GetChannels() { return mychannels_; }
+		const channels_t& GetChannels() { return mychannels_; }
 
 		/** Arno: set the tracker for this transfer. Reseting it won't kill
 		 * any existing connections.
@@ -353,6 +473,13 @@ namespace swift {
 		// MULTIFILE
 		Storage * GetStorage() { return storage_; }
 
+		// SOCKMGMT
+		/** Bind this transfer to a socket: outgoing channels use it, and
+		 * incoming handshakes on it are matched to this transfer first. Lets
+		 * several peers of one swarm live in one process. */
+		void SetSocket(evutil_socket_t sock) { socket_ = sock; }
+		evutil_socket_t GetSocket() { return socket_; }
+
 		// SAFECLOSE
 		static void LibeventCleanCallback(int fd, short event, void *arg);
 
@@ -363,6 +490,10 @@ namespace swift {
 		 */
 		bool IsZeroState() { return zerostate_; }
 
+		// LIVE
+		/** Returns whether this is a live stream, see MmapHashTree */
+		bool IsLive() { return hashtree_->live_window() > 0; }
+
 		/** Add a peer to the set of addresses to connect to */
 		void AddPeer(Address &peer);
 
@@ -395,8 +526,15 @@ namespace swift {
 
 		// RATELIMIT
         channels_t			mychannels_; // Arno, 2012-01-31: May be duplicate of hs_in_
+        /** Channels with peer_complete(). Recounted when the number of peaks
+         * changes, as IsComplete() is fuzzy before the peaks are known. */
+        uint32_t			numseeders_;
+        int					numseeders_peaks_;
         MovingAverageSpeed	cur_speed_[2];
-        double				max_speed_[2];
+        TokenBucket			rate_bucket_[2];	// rate is the max speed
+        int					rate_class_;
+        static TokenBucket	process_rate_bucket_[2];
+        static std::map<int,TokenBucket>	class_rate_buckets_[2];
         int					speedzerocount_;
 
         // SAFECLOSE
@@ -410,10 +548,18 @@ namespace swift {
         Storage				*storage_;
         int					fd_;
 
+        // SOCKMGMT
+        evutil_socket_t		socket_;	// INVALID_SOCKET = default socket
+
         //ZEROSTATE
         bool				zerostate_;
 
+        /** Rotating queue of completed bins, see RevealAck() */
+        binqueue			have_log_;
+        uint64_t			have_log_start_;
+
     public:
+        /** Call when bin pos has been retrieved and checked. */
         void            OnDataIn (bin_t pos);
         // Gertjan fix: return bool
         bool            OnPexAddIn (const Address& addr);
@@ -455,6 +601,20 @@ namespace swift {
          *  @param  offbin		bin number of new playback pos
          *  @param  whence      only SEEK_CUR supported */
         virtual int Seek(bin_t offbin, int whence) = 0;
+        /** updates the playback windows of several consumers of the same
+         *  content, e.g. HTTP clients. Pieces are picked for the union of
+         *  the windows. Default: seek to the earliest position.
+         *  @param  windows		first and last base bin of each window,
+         *  					highest priority first */
+        virtual int SeekMulti(binwindows_t windows) {
+            if (windows.empty())
+                return -1;
+            bin_t first = windows.front().first;
+            for (int i=1; i<windows.size(); i++)
+                if (windows[i].first < first)
+                    first = windows[i].first;
+            return Seek(first,SEEK_SET);
+        }
     };
 
 
@@ -486,13 +646,15 @@ namespace swift {
         } send_control_t;
 
         static Address  tracker; // Global tracker for all transfers
-        struct event *evsend_ptr_; // Arno: timer per channel // SAFECLOSE
+        struct event *evsend_ptr_; // Arno: timer per channel // SAFECLOSE; NULL while lightweight
         static struct event_base *evbase;
         static struct event evrecv;
         static const char* SEND_CONTROL_MODES[];
 
 	    static tint epoch, start;
 	    static uint64_t global_dgrams_up, global_dgrams_down, global_raw_bytes_up, global_raw_bytes_down, global_bytes_up, global_bytes_down;
+	    // Latencies of the hot paths, usec. Process-wide like the counters above.
+	    static LatencyHistogram send_latency, recv_latency, read_latency, verify_latency, timer_lateness;
         static void CloseChannelByAddress(const Address &addr);
 
         // SOCKMGMT
@@ -503,6 +665,12 @@ namespace swift {
         static void RecvDatagram (evutil_socket_t socket); // Called by LibeventReceiveCallback
 	    static int RecvFrom(evutil_socket_t sock, Address& addr, struct evbuffer *evb); // Called by RecvDatagram
 	    static int SendTo(evutil_socket_t sock, const Address& addr, struct evbuffer *evb); // Called by Channel::Send()
+	    /** Replace the sendto()/recvfrom() calls of the above, e.g. by a
+	     * simulated network (tests/swarmsim.cpp). NULL = real sockets. */
+	    typedef int (*sendto_hook_t)(evutil_socket_t sock, const Address& addr, const char *buf, int len);
+	    typedef int (*recvfrom_hook_t)(evutil_socket_t sock, Address& addr, char *buf, int len);
+	    static sendto_hook_t sendto_hook;
+	    static recvfrom_hook_t recvfrom_hook;
 	    static evutil_socket_t Bind(Address address, sckrwecb_t callbacks=sckrwecb_t());
 	    static Address BoundAddress(evutil_socket_t sock);
 	    static evutil_socket_t default_socket()
@@ -511,16 +679,23 @@ namespace swift {
 	    /** close the port */
 	    static void CloseSocket(evutil_socket_t sock);
 	    static void Shutdown ();
-	    /** the current time */
+	    /** Reads the monotonic clock into NOW. Called once on entry of each
+	     *  libevent callback; code in between uses the cached NOW, except
+	     *  RTT sampling, which reads again. */
 	    static tint Time();
 
 	    // Arno: Per instance methods
         void        Recv (struct evbuffer *evb);
         void        Send ();  // Called by LibeventSendCallback
         void        Close ();
+        /** Send now rather than at the next keep-alive, to announce fresh
+            live data to an idle peer. */
+        void        Wake ();
 
         void        OnAck (struct evbuffer *evb);
         void        OnHave (struct evbuffer *evb);
+        void        OnHaveBin (bin_t ackd_pos);
+        bool        OnHaveBitmap (struct evbuffer *evb);
         bin_t       OnData (struct evbuffer *evb);
         void        OnHint (struct evbuffer *evb);
         void        OnHash (struct evbuffer *evb);
@@ -531,6 +706,12 @@ namespace swift {
         bin_t       AddData (struct evbuffer *evb);
         void        AddAck (struct evbuffer *evb);
         void        AddHave (struct evbuffer *evb);
+        void        AddHaveBin (struct evbuffer *evb, bin_t ack);
+        void        AddHaveBitmap (struct evbuffer *evb);
+        void        HaveBitmapDone ();
+        bool        have_bitmap_pending () {
+            return !have_bitmap_done_ && (cap_in_ & (1ULL<<SWIFT_HAVE_BITMAP));
+        }
         void        AddHint (struct evbuffer *evb);
         void        AddUncleHashes (struct evbuffer *evb, bin_t pos);
         void        AddPeakHashes (struct evbuffer *evb);
@@ -546,16 +727,28 @@ namespace swift {
         tint        SlowStartNextSendTime ();
         tint        AimdNextSendTime ();
         tint        LedbatNextSendTime ();
+        tint        NextAckTime ();
+        bool        IsAckPending (bin_t pos);
         /** Arno: return true if this peer has complete file. May be fuzzy if Peak Hashes not in */
         bool		IsComplete();
+        /** Peer's completeness as last counted in FileTransfer's seeder count */
+        bool		peer_complete() { return peer_complete_; }
+        /** Re-evaluate IsComplete() after ack_in_ grew, updating the seeder count */
+        void		UpdatePeerComplete();
+        /** Re-evaluate IsComplete() from scratch, for FileTransfer's recount */
+        bool		RecountPeerComplete() { peer_complete_ = IsComplete(); return peer_complete_; }
         /** Arno: return (UDP) port for this channel */
         uint16_t 	GetMyPort();
         bool 		IsDiffSenderOrDuplicate(Address addr, uint32_t chid);
 
         static int  MAX_REORDERING;
+        static int  ACK_AGGREGATE_MAX;
+        static tint ACK_DELAY;
         static tint TIMEOUT;
         static tint MIN_DEV;
         static tint MAX_SEND_INTERVAL;
+        /** Data-idle time in keep-alive mode before a channel goes lightweight */
+        static tint IDLE_TIMEOUT;
         static tint LEDBAT_TARGET;
         static float LEDBAT_GAIN;
         static tint LEDBAT_DELAY_BIN;
@@ -577,18 +770,37 @@ namespace swift {
         	return tmo < 30*TINT_SEC ? tmo : 30*TINT_SEC;
         }
         uint32_t    id () const { return id_; }
+        void        Trace (trace_event_t ev, bin_t bin, int64_t value=0, uint16_t aux=0) {
+            TraceRing::Record(ev,NOW,id_,bin.toUInt(),value,aux);
+        }
 
         // MORESTATS
         uint64_t raw_bytes_up() { return raw_bytes_up_; }
         uint64_t raw_bytes_down() { return raw_bytes_down_; }
         uint64_t bytes_up() { return bytes_up_; }
         uint64_t bytes_down() { return bytes_down_; }
+        tint     rtt_avg() { return rtt_avg_; }
+        tint     send_interval() { return send_interval_; }
+        float    cwnd() { return cwnd_; }
+        int      data_out_size() { return act_ ? act_->data_out_.size() : 0; }
+        bool     is_lightweight() const { return act_==NULL; }
+        const char *send_control_mode() { return SEND_CONTROL_MODES[send_control_]; }
+        int      dgrams_sent() { return dgrams_sent_; }
+        int      dgrams_rcvd() { return dgrams_rcvd_; }
+        uint32_t retransmits() { return retransmits_; }
+        uint32_t hash_fails() { return hash_fails_; }
+        /** Bytes held by this channel: the object plus its heap state. */
+        size_t   memory_usage();
+        /** Per-peer limit, child of the transfer's bucket */
+        TokenBucket* GetRateBucket(data_direction_t ddir) { return &rate_bucket_[ddir]; }
 
         static int  DecodeID(int scrambled);
         static int  EncodeID(int unscrambled);
         static Channel* channel(int i) {
             return i<channels.size()?channels[i]:NULL;
         }
+        /** Upper bound of channel ids, for iterating with channel() */
+        static int  channel_count() { return channels.size(); }
         static void CloseTransfer (FileTransfer* trans);
 
         // SAFECLOSE
@@ -614,82 +826,124 @@ namespace swift {
 	    static sckrwecb_t sock_open[DGRAM_MAX_SOCK_OPEN];
 
 
+        /** State only needed while data flows. An idle channel in keep-alive
+            mode drops it, and its timer (lightweight channel), and gets a
+            fresh one when traffic resumes, so memory scales with active
+            peers. */
+        struct active_t {
+            /** Data received but not acked yet (delayed, aggregated ACKs). */
+            tbring<8>   ack_pending_;
+            /** The history of data sent and still unacknowledged. */
+            tbring<8>   data_out_;
+            /** Timeouted data (potentially to be retransmitted). */
+            tbring<4>   data_out_tmo_;
+            /**    Transmit schedule: in most cases filled with the peer's hints */
+            tbring<8>   hint_in_;
+            /** Hints sent (to detect and reschedule ignored hints). */
+            tbring<4>   hint_out_;
+            /** Uncle hashes received, offered together with the DATA they came with. */
+            binhashes_t hashes_in_;
+            /** LEDBAT one-way delay machinery */
+            tint        owd_min_bins_[4];
+            int         owd_min_bin_;
+            tint        owd_min_bin_start_;
+            tint        owd_current_[4];
+            int         owd_cur_bin_;
+            /** PEX of other channels to send, (time, channel id) */
+            tbring<2>   reverse_pex_out_;
+            /**    Peer's progress, based on acknowledgements. */
+            binmap_t    ack_in_;
+            /** Bins announced to the peer (HAVE or ACK). */
+            binmap_t    have_out_;
+
+            active_t ();
+        };
+
+        /** What a lightweight channel keeps of ack_in_ and have_out_: their
+            filled bins, in order. Few for a complete or nearly idle peer. */
+        struct idle_t {
+            /** ack_in_'s bins, then have_out_'s */
+            std::vector<bin_t>  bins_;
+            uint32_t            ack_in_count_;
+        };
+
+        // Hot state, touched for (nearly) every datagram, kept together at
+        // the start of the object; per-hop queues are inline rings.
         /** Channel id: index in the channel array. */
         uint32_t    id_;
-        /**    Socket address of the peer. */
-        Address     peer_;
+        /**    Peer channel id; zero if we are trying to open a channel. */
+        uint32_t    peer_channel_id_;
         /**    The UDP socket fd. */
         evutil_socket_t      socket_;
+        bool        own_id_mentioned_;
+        /** Arno: Fix for KEEP_ALIVE_CONTROL */
+        bool 		lastrecvwaskeepalive_;
+        bool 		lastsendwaskeepalive_;
+		bool		direct_sending_;
         /**    Descriptor of the file in question. */
         FileTransfer*    transfer_;
-        /**    Peer channel id; zero if we are trying to open a channel. */
-        uint32_t    peer_channel_id_;
-        bool        own_id_mentioned_;
-        /**    Peer's progress, based on acknowledgements. */
-        binmap_t    ack_in_;
-        /**    Last data received; needs to be acked immediately. */
-        tintbin     data_in_;
-        bin_t       data_in_dbl_;
-        /** The history of data sent and still unacknowledged. */
-        tbqueue     data_out_;
-        /** Timeouted data (potentially to be retransmitted). */
-        tbqueue     data_out_tmo_;
-        bin_t       data_out_cap_;
-        /** Index in the history array. */
-        binmap_t    have_out_;
-        /**    Transmit schedule: in most cases filled with the peer's hints */
-        tbqueue     hint_in_;
-        /** Hints sent (to detect and reschedule ignored hints). */
-        tbqueue     hint_out_;
-        uint64_t    hint_out_size_;
-        /** Types of messages the peer accepts. */
-        uint64_t    cap_in_;
-        /** PEX progress */
-        bool        pex_requested_;
-        tint        last_pex_request_time_;
-        tint        next_pex_request_time_;
-        bool        pex_request_outstanding_;
-        tbqueue     reverse_pex_out_;		// Arno, 2011-10-03: should really be a queue of (tint,channel id(= uint32_t)) pairs.
-        int         useless_pex_count_;
+        /**    Socket address of the peer. */
+        Address     peer_;
+        /** The congestion control strategy. */
+        send_control_t         send_control_;
+        /** Datagrams (not data) sent since last recv.    */
+        int         sent_since_recv_;
+        /** Congestion window; TODO: int, bytes. */
+        float       cwnd_;
+        int         cwnd_count1_;
+        /** Data sending interval. */
+        tint        send_interval_;
         /** Smoothed averages for RTT, RTT deviation and data interarrival periods. */
         tint        rtt_avg_, dev_avg_, dip_avg_;
         tint        last_send_time_;
         tint        last_recv_time_;
         tint        last_data_out_time_;
         tint        last_data_in_time_;
-        tint        last_loss_time_;
         tint        next_send_time_;
-        tint		open_time_;
-        /** Congestion window; TODO: int, bytes. */
-        float       cwnd_;
-        int         cwnd_count1_;
-        /** Data sending interval. */
-        tint        send_interval_;
-        /** The congestion control strategy. */
-        send_control_t         send_control_;
-        /** Datagrams (not data) sent since last recv.    */
-        int         sent_since_recv_;
-
-        /** Arno: Fix for KEEP_ALIVE_CONTROL */
-        bool 		lastrecvwaskeepalive_;
-        bool 		lastsendwaskeepalive_;
-
         /** Recent acknowlegements for data previously sent.    */
         int         ack_rcvd_recent_;
         /** Recent non-acknowlegements (losses) of data previously sent.    */
         int         ack_not_rcvd_recent_;
-        /** LEDBAT one-way delay machinery */
-        tint        owd_min_bins_[4];
-        int         owd_min_bin_;
-        tint        owd_min_bin_start_;
-        tint        owd_current_[4];
-        int         owd_cur_bin_;
+        uint64_t    hint_out_size_;
+        /**    Duplicate or broken data received; acked with the next datagram. */
+        tintbin     data_in_;
+        bin_t       data_in_dbl_;
+        bin_t       data_out_cap_;
         /** Stats */
         int         dgrams_sent_;
         int         dgrams_rcvd_;
         // Arno, 2011-11-28: for detailed, per-peer stats. MORESTATS
         uint64_t raw_bytes_up_, raw_bytes_down_, bytes_up_, bytes_down_;
-
+        /** Data path state; NULL while the channel is lightweight. */
+        active_t    *act_;
+        /** Its summary while lightweight, NULL otherwise. */
+        idle_t      *idle_;
+        // RATELIMIT
+        TokenBucket	rate_bucket_[2];
+
+        // Cold state: handshake, HAVE sync, PEX, rare stats.
+        /** Types of messages the peer accepts. */
+        uint64_t    cap_in_;
+        /** Offset in the transfer's rotating HAVE queue; have_out_ is
+            complete up to there once have_out_synced_. */
+        uint64_t    have_out_offset_;
+        bool        have_out_synced_;
+        /** Chunk offset of the next HAVE_BITMAP segment to send. */
+        uint64_t    have_bitmap_offset_;
+        bool        have_bitmap_done_;
+        /** LIVE: stream length in chunks when we last sent our peaks. */
+        uint64_t    live_peaks_out_;
+        /** PEX progress */
+        bool        pex_requested_;
+        tint        last_pex_request_time_;
+        tint        next_pex_request_time_;
+        bool        pex_request_outstanding_;
+        int         useless_pex_count_;
+        tint        last_loss_time_;
+        tint		open_time_;
+        uint32_t retransmits_, hash_fails_;
+        /** Counted as seeder in transfer().numseeders_ */
+        bool		peer_complete_;
         // SAFECLOSE
         bool		scheduled4close_;
         /** Arno: Socket address of the peer where packets are received from,
@@ -697,8 +951,6 @@ namespace swift {
          * May not be equal to peer_. 2PEERSBEHINDSAMENAT */
         Address     recv_peer_;
 
-		bool		direct_sending_;
-
         int         PeerBPS() const {
             return TINT_SEC / dip_avg_ * 1024;
         }
@@ -710,12 +962,27 @@ namespace swift {
         void        CleanHintOut(bin_t pos);
         void        Reschedule();
         void 		UpdateDIP(bin_t pos); // RETRANSMIT
+        /** Recreate the data path state and timer of a lightweight channel. */
+        void        Inflate() { if (act_==NULL) Reactivate(); }
+        void        Reactivate();
+        /** Drop the data path state and timer if the channel is idle. */
+        void        Deflate();
+        /** Whether the peer acked pos, also while lightweight. */
+        bool        IsAcked(bin_t pos);
+        /** Wake up a lightweight channel at next_send_time_, through the
+            shared keep-alive timer. */
+        void        ScheduleKeepAlive();
+        static void LibeventKeepAliveCallback(int fd, short event, void *arg);
 
 
         static PeerSelector* peer_selector;
 
         static tint     last_tick;
         //static tbheap   send_queue;
+        /** Keep-alives of lightweight channels: (time, channel id). Entries
+            of channels woken otherwise since are skipped when due. */
+        static tbheap   keepalive_queue;
+        static struct event evkeepalive;
 
         static channels_t channels;
 
@@ -745,6 +1012,8 @@ namespace swift {
     	 std::string GetOSPathName() { return os_pathname_; }
     	 ssize_t  Write(const void *buf, size_t nbyte, int64_t offset) { return pwrite(fd_,buf,nbyte,offset); }
     	 ssize_t  Read(void *buf, size_t nbyte, int64_t offset) {  return pread(fd_,buf,nbyte,offset); }
+    	 /** Zero-copy Read: append a file segment to evb, see Storage::ReadToEvbuffer */
+    	 ssize_t  ReadToEvbuffer(struct evbuffer *evb, size_t nbyte, int64_t offset);
     	 int ResizeReserved() { return file_resize(fd_,GetSize()); }
 
        protected:
@@ -804,6 +1073,10 @@ namespace swift {
 		/** UNIX pread approximation. Does change file pointer. Thread-safe if no concurrent writes */
 		ssize_t  Read(void *buf, size_t nbyte, int64_t offset); // off_t not 64-bit dynamically on Win32
 
+		/** Zero-copy Read: append nbyte from offset to evb as file segments
+		 * that libevent sends via sendfile/mmap. Returns bytes added or -1. */
+		ssize_t  ReadToEvbuffer(struct evbuffer *evb, size_t nbyte, int64_t offset);
+
 		/** UNIX pwrite approximation. Does change file pointer. Is not thread-safe */
 		ssize_t  Write(const void *buf, size_t nbyte, int64_t offset);
 
@@ -897,6 +1170,60 @@ namespace swift {
 	};
 
 
+	/** Swarms known by root hash whose transfers are not open: no storage,
+	    hashes or channels, just the name of the content. A handshake for
+	    one opens its FileTransfer from the .mhash and .mbinmap next to the
+	    content, and it is closed again once it had no channels for
+	    IDLE_TIMEOUT. Like ZeroState, but for regular transfers. Dormant
+	    swarms do not contact their tracker. */
+	class DormantRegistry
+	{
+	  public:
+    	static const tint IDLE_TIMEOUT = 60*TINT_SEC;
+    	static const tint CLEANUP_INTERVAL = 10*TINT_SEC;
+
+    	DormantRegistry();
+    	~DormantRegistry();
+    	static DormantRegistry *GetInstance();
+
+    	/** Registers content and its metafiles. Returns -1 if one is missing. */
+    	int Add(std::string filename, const Sha1Hash &root_hash, uint32_t chunk_size=SWIFT_DEFAULT_CHUNK_SIZE, Address tracker=Address());
+    	/** Forgets the swarm, closing its transfer if active */
+    	void Remove(const Sha1Hash &root_hash);
+    	bool Has(const Sha1Hash &root_hash) { return swarms_.count(root_hash) > 0; }
+    	/** The transfer of a registered swarm, opened if dormant. NULL if not
+    	    registered or it fails to open. A pin keeps it from being closed
+    	    when idle until Unpin, for users other than channels (gateways). */
+    	FileTransfer *Activate(const Sha1Hash &root_hash, bool pin=false);
+    	void Unpin(const Sha1Hash &root_hash);
+    	/** Closes active transfers without channels for idle_timeout */
+    	void Deactivate(tint idle_timeout=IDLE_TIMEOUT);
+
+    	size_t size() { return swarms_.size(); }
+    	size_t active() { return active_.size(); }
+
+    	static void LibeventCleanCallback(int fd, short event, void *arg);
+
+	  protected:
+    	static DormantRegistry *__singleton;
+
+    	struct dormant_t {
+    	    std::string filename;
+    	    uint32_t    chunk_size;
+    	    Address     tracker;
+    	    int         fd;         // -1 while dormant
+    	    int         pins;
+    	    tint        idle_since; // 0 while it has channels
+    	};
+    	FileTransfer *Transfer(dormant_t &d);
+    	void Close(dormant_t &d);
+
+    	std::map<Sha1Hash,dormant_t> swarms_;
+    	std::set<Sha1Hash> active_;
+    	struct event evclean_;
+	};
+
+
     /*************** The top-level API ****************/
     /** Start listening a port. Returns socket descriptor. */
     int     Listen (Address addr);
@@ -917,6 +1244,16 @@ namespace swift {
         no longer works on restarts, unless checkpoints are used.
         */
     int     Open (std::string filename, const Sha1Hash& hash=Sha1Hash::ZERO,Address tracker=Address(), bool force_check_diskvshash=true, bool check_netwvshash=true, uint32_t chunk_size=SWIFT_DEFAULT_CHUNK_SIZE);
+    /** LIVE: Create a live stream identified by swarmid. Data appended with
+        LiveWrite is kept in filename as a ring of window chunks; older chunks
+        leave the swarm. */
+    int     LiveCreate (std::string filename, const Sha1Hash& swarmid, uint64_t window=SWIFT_LIVE_DEFAULT_WINDOW, uint32_t chunk_size=SWIFT_DEFAULT_CHUNK_SIZE);
+    /** LIVE: Append to a stream made with LiveCreate and announce the new
+        chunks. A partial chunk is held back till it fills up. Returns the
+        number of chunks added or -1. */
+    int     LiveWrite (int fd, const void *buf, size_t nbyte);
+    /** LIVE: Join the live stream swarmid, starting near its newest data. */
+    int     LiveOpen (std::string filename, const Sha1Hash& swarmid, Address tracker=Address(), uint64_t window=SWIFT_LIVE_DEFAULT_WINDOW, uint32_t chunk_size=SWIFT_DEFAULT_CHUNK_SIZE);
     /** Get the root hash for the transmission. */
     const Sha1Hash& RootMerkleHash (int file) ;
     /** Close a file and a transmission. */
@@ -929,11 +1266,17 @@ namespace swift {
 	/** UNIX pread approximation. Does change file pointer. Thread-safe if no concurrent writes */
 	ssize_t  Read(int fd, void *buf, size_t nbyte, int64_t offset); // off_t not 64-bit dynamically on Win32
 
+	/** Zero-copy Read, appends the range to evb as file segments */
+	ssize_t  ReadToEvbuffer(int fd, struct evbuffer *evb, size_t nbyte, int64_t offset);
+
 	/** UNIX pwrite approximation. Does change file pointer. Is not thread-safe */
 	ssize_t  Write(int fd, const void *buf, size_t nbyte, int64_t offset);
 
     /** Seek, i.e., move start of interest window */
     int Seek(int fd, int64_t offset, int whence);
+    /** Seek to several byte ranges [first,last] at once, highest priority
+        first, i.e., interest window is union of the ranges */
+    int SeekMulti(int fd, bytewindows_t windows);
 
 	void    SetTracker(const Address& tracker);
     /** Set the default tracker that is used when Open is not passed a tracker
@@ -951,6 +1294,11 @@ namespace swift {
     uint64_t  SeqComplete(int fdes, int64_t offset=0);
     /***/
     int       Find (Sha1Hash hash);
+    /** Like Find, but opens the transfer of a dormant swarm and keeps it
+        open until Release, see DormantRegistry */
+    int       Activate (Sha1Hash hash);
+    /** Undoes an Activate */
+    void      Release (Sha1Hash hash);
     /** Returns the number of bytes in a chunk for this transmission */
     uint32_t	  ChunkSize(int fdes);
 
@@ -971,6 +1319,7 @@ namespace swift {
     int evbuffer_add_32be(struct evbuffer *evb, uint32_t i);
     int evbuffer_add_64be(struct evbuffer *evb, uint64_t l);
     int evbuffer_add_hash(struct evbuffer *evb, const Sha1Hash& hash);
+    int evbuffer_add_varint(struct evbuffer *evb, uint64_t v);
 
     uint8_t evbuffer_remove_8(struct evbuffer *evb);
     uint16_t evbuffer_remove_16be(struct evbuffer *evb);
@@ -986,6 +1335,17 @@ namespace swift {
 
     // Arno: Save transfer's binmap for zero-hashcheck restart
     int Checkpoint(int fdes);
+    /** Checkpoint a transfer again once bytes more have been verified, or
+        interval after the last one if it made any progress at all, and
+        when it completes. 0 disables that trigger. */
+    void SetCheckpointPolicy(uint64_t bytes, tint interval);
+    /** Checkpoints the transfer if the policy says so. Returns 1 if it
+        did, 0 if nothing was due, -1 on error. */
+    int CheckpointIfDue(int fdes);
+    /** Checkpoints all transfers in the background, following the policy.
+        Stopping writes what is still queued. */
+    void StartCheckpointing();
+    void StopCheckpointing();
 
     // SOCKTUNNEL
     void CmdGwTunnelUDPDataCameIn(Address srcaddr, uint32_t srcchan, struct evbuffer* evb);
@@ -996,7 +1356,7 @@ namespace swift {
 // #define SWIFT_MUTE
 
 #ifndef SWIFT_MUTE
-#define dprintf(...) do { if (Channel::debug_file) fprintf(Channel::debug_file,__VA_ARGS__); } while (0)
+#define dprintf(...) do { if (Channel::debug_file && !WorkQueue::InWorker()) fprintf(Channel::debug_file,__VA_ARGS__); } while (0)
 #define dflush() fflush(Channel::debug_file)
 #else
 #define dprintf(...) do {} while(0)
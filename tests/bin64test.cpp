@@ -65,6 +65,26 @@ TEST(Bin64Test, Advanced) {
 
 }
 
+TEST(Bin64Test, PeakFor) {
+    bin_t peaks[64];
+    for (uint64_t length=1; length<300; length++) {
+        int peak_count = gen_peaks(length,peaks);
+        for (int layer=0; layer<10; layer++)
+            for (uint64_t off=0; off<(320>>layer); off++) {
+                bin_t pos(layer,off);
+                int pi = 0;
+                while (pi<peak_count && !peaks[pi].contains(pos))
+                    pi++;
+                bin_t expect = pi==peak_count ? bin_t(bin_t::NONE) : peaks[pi];
+                EXPECT_EQ(expect,peak_for_length(length,pos));
+            }
+        EXPECT_EQ(bin_t::NONE,peak_for_length(length,bin_t::ALL));
+    }
+    EXPECT_EQ(bin_t(40,0),peak_for_length((1ULL<<40)+3,bin_t(0,12345)));
+    EXPECT_EQ(bin_t(1,1ULL<<39),peak_for_length((1ULL<<40)+3,bin_t(0,(1ULL<<40)+1)));
+    EXPECT_EQ(bin_t(0,(1ULL<<40)+2),peak_for_length((1ULL<<40)+3,bin_t(0,(1ULL<<40)+2)));
+}
+
 TEST(Bin64Test, Bits) {
     bin_t all = bin_t::ALL, none = bin_t::NONE, big = bin_t(40,18);
     uint32_t a32 = bin_toUInt32(all), n32 = bin_toUInt32(none), b32 = bin_toUInt32(big);
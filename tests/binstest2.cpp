@@ -194,6 +194,24 @@ TEST(BinsTest,Alloc) {
 
 }
 
+TEST(BinsTest,Compact) {
+
+    binmap_t b;
+    for (int i=0; i<1<<16; i+=64)
+        b.set(bin_t(0,i));
+    size_t fragmented = b.total_size();
+    b.set(bin_t(16,0));
+    b.set(bin_t(0,100000));
+    EXPECT_EQ(fragmented,b.total_size());
+    b.compact();
+    EXPECT_LT(b.total_size(),fragmented);
+    EXPECT_TRUE(b.is_filled(bin_t(16,0)));
+    EXPECT_TRUE(b.is_filled(bin_t(0,100000)));
+    EXPECT_TRUE(b.is_empty(bin_t(0,100001)));
+    EXPECT_TRUE(b.is_empty(bin_t(0,1<<16)));
+
+}
+
 /*
 TEST(BinsTest,Remove) {
     
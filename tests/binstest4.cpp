@@ -34,6 +34,22 @@ TEST(BinsTest,FindEmptyStart1){
 }
 
 
+TEST(BinsTest,FindEmptyStartSkipsLeftHoles){
+
+    binmap_t hole;
+    hole.set(bin_t(5,0));
+    hole.reset(bin_t(0,1));
+    hole.reset(bin_t(0,2));
+    hole.reset(bin_t(0,9));
+
+    // Holes left of start must not be returned
+    EXPECT_EQ(bin_t(0,9),hole.find_empty(bin_t(0,3)));
+    EXPECT_EQ(bin_t(0,9),hole.find_empty(bin_t(0,8)));
+    EXPECT_EQ(bin_t(0,2),hole.find_empty(bin_t(0,2)));
+    EXPECT_EQ(bin_t(0,32),hole.find_empty(bin_t(0,10)));
+}
+
+
 uint64_t seqcomp(binmap_t *ack_out_,uint32_t chunk_size_,uint64_t size_, int64_t offset)
 {
 	bin_t binoff = bin_t(0,(offset - (offset % chunk_size_)) / chunk_size_);
@@ -0,0 +1,176 @@
+/*
+ *  checkpointtest.cpp
+ *  Binary .mbinmap checkpoints: binmap images, writing and reloading a
+ *  hash tree, and reading version 1 text checkpoints.
+ *
+ *  Copyright 2009-2012 TECHNISCHE UNIVERSITEIT DELFT. All rights reserved.
+ *
+ */
+#include <gtest/gtest.h>
+#include "swift.h"
+
+using namespace swift;
+
+#define CP_CS       1024
+#define CP_CHUNKS   100
+
+
+TEST(CheckpointTest, BinmapImage) {
+    binmap_t b;
+    for (int i=0; i<1<<16; i+=3)
+        b.set(bin_t(0,i));
+    b.set(bin_t(0,1000000));
+    std::string image(b.image_size(),'\0');
+    b.write_image(&image[0]);
+
+    binmap_t c;
+    ASSERT_EQ(0,c.read_image(image.data(),image.size()));
+    EXPECT_EQ(b.cells_number(),c.cells_number());
+    for (int i=0; i<1<<16; i++)
+        ASSERT_EQ(i%3==0,c.is_filled(bin_t(0,i))) << i;
+    EXPECT_TRUE(c.is_filled(bin_t(0,1000000)));
+    c.set(bin_t(0,1));  // still a working binmap
+    EXPECT_TRUE(c.is_filled(bin_t(1,0)));
+
+    EXPECT_EQ(-1,c.read_image(image.data(),image.size()-1));
+    EXPECT_TRUE(c.is_filled(bin_t(1,0)));
+}
+
+
+static void WriteContent(const char *filename)
+{
+    FILE *fp = fopen(filename,"wb");
+    char buf[CP_CS];
+    for (int c=0; c<CP_CHUNKS; c++) {
+        memset(buf,c,sizeof(buf));
+        fwrite(buf,1,sizeof(buf),fp);
+    }
+    fclose(fp);
+}
+
+
+static void Cleanup()
+{
+    unlink("checkpointtest.dat");
+    unlink("checkpointtest.dat.mhash");
+    unlink("checkpointtest.dat.mbinmap");
+}
+
+
+static MmapHashTree *OpenTree(Storage *storage, const Sha1Hash &root)
+{
+    return new MmapHashTree(storage,root,CP_CS,"checkpointtest.dat.mhash",
+        false,true,"checkpointtest.dat.mbinmap");
+}
+
+
+TEST(CheckpointTest, Reload) {
+    Cleanup();
+    WriteContent("checkpointtest.dat");
+    Storage *storage = new Storage("checkpointtest.dat",".",0);
+    MmapHashTree *ht = OpenTree(storage,Sha1Hash::ZERO);
+    ASSERT_TRUE(ht->is_complete());
+    Sha1Hash root = ht->root_hash();
+    // pretend some chunks are still missing
+    ht->ack_out()->reset(bin_t(0,7));
+    ht->ack_out()->reset(bin_t(2,10));
+    ASSERT_EQ(0,ht->Checkpoint("checkpointtest.dat.mbinmap"));
+    EXPECT_EQ(0,ht->checkpoint_unsaved());
+    EXPECT_EQ(0,file_exists_utf8("checkpointtest.dat.mbinmap.part"));
+    delete ht;
+    delete storage;
+
+    FILE *fp = fopen("checkpointtest.dat.mbinmap","rb");
+    char magic[8];
+    ASSERT_EQ(8,fread(magic,1,8,fp));
+    fclose(fp);
+    EXPECT_EQ(0,memcmp(magic,"SWIFTMB\n",8));
+
+    storage = new Storage("checkpointtest.dat",".",0);
+    ht = OpenTree(storage,root);
+    EXPECT_EQ(root,ht->root_hash());
+    EXPECT_EQ(CP_CHUNKS*CP_CS,ht->size());
+    EXPECT_TRUE(ht->ack_out()->is_empty(bin_t(0,7)));
+    EXPECT_TRUE(ht->ack_out()->is_empty(bin_t(2,10)));
+    EXPECT_TRUE(ht->ack_out()->is_filled(bin_t(0,6)));
+    EXPECT_TRUE(ht->ack_out()->is_filled(bin_t(0,CP_CHUNKS-1)));
+    delete ht;
+    delete storage;
+
+    // the quick root hash lookup reads it too
+    ht = new MmapHashTree(true,"checkpointtest.dat.mbinmap");
+    EXPECT_EQ(root,ht->root_hash());
+    delete ht;
+    Cleanup();
+}
+
+
+TEST(CheckpointTest, TextVersion1) {
+    Cleanup();
+    WriteContent("checkpointtest.dat");
+    Storage *storage = new Storage("checkpointtest.dat",".",0);
+    MmapHashTree *ht = OpenTree(storage,Sha1Hash::ZERO);
+    Sha1Hash root = ht->root_hash();
+    ht->ack_out()->reset(bin_t(0,3));
+    FILE *fp = fopen("checkpointtest.dat.mbinmap","wb");
+    ASSERT_EQ(0,ht->serialize(fp));
+    fclose(fp);
+    delete ht;
+    delete storage;
+
+    storage = new Storage("checkpointtest.dat",".",0);
+    ht = OpenTree(storage,root);
+    EXPECT_EQ(root,ht->root_hash());
+    EXPECT_TRUE(ht->ack_out()->is_empty(bin_t(0,3)));
+    EXPECT_TRUE(ht->ack_out()->is_filled(bin_t(0,4)));
+    delete ht;
+    delete storage;
+    Cleanup();
+}
+
+
+TEST(CheckpointTest, Background) {
+    Cleanup();
+    WriteContent("checkpointtest.dat");
+    if (Channel::evbase == NULL)
+        Channel::evbase = event_base_new();
+    int fd = swift::Open("checkpointtest.dat",Sha1Hash::ZERO,Address(),true,true,CP_CS);
+    ASSERT_GE(fd,0);
+    MmapHashTree *ht = (MmapHashTree *)FileTransfer::file(fd)->hashtree();
+    ASSERT_TRUE(ht->is_complete());
+    unlink("checkpointtest.dat.mbinmap");
+    uint64_t written = Checkpointer::written;
+    uint64_t count = Checkpointer::latency.count();
+
+    Checkpointer::Start();
+    Checkpointer::Tick();
+    EXPECT_EQ(1,Checkpointer::pending());
+    Checkpointer::Wait(fd);
+    EXPECT_EQ(0,Checkpointer::pending());
+    EXPECT_EQ(written+1,Checkpointer::written);
+    EXPECT_EQ(count+1,Checkpointer::latency.count());
+    EXPECT_EQ(0,ht->checkpoint_unsaved());
+    EXPECT_GT(ht->checkpoint_written(),0);
+    EXPECT_EQ(ht->checkpoint_written(),file_size_by_path_utf8("checkpointtest.dat.mbinmap"));
+
+    // clean now, nothing to do
+    Checkpointer::Tick();
+    EXPECT_EQ(0,Checkpointer::pending());
+    Checkpointer::Stop();
+    swift::Close(fd);
+
+    Storage *storage = new Storage("checkpointtest.dat",".",0);
+    ht = OpenTree(storage,Sha1Hash::ZERO);
+    EXPECT_TRUE(ht->is_complete());
+    delete ht;
+    delete storage;
+    Cleanup();
+}
+
+
+int main (int argc, char** argv) {
+
+	testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+
+}
@@ -0,0 +1,109 @@
+/*
+ *  dormanttest.cpp
+ *  Dormant swarms: registered without a transfer, opened on activation
+ *  and closed again when idle.
+ *
+ *  Copyright 2009-2012 TECHNISCHE UNIVERSITEIT DELFT. All rights reserved.
+ *
+ */
+#include <gtest/gtest.h>
+#include "swift.h"
+
+using namespace swift;
+
+#define DT_FILE     "dormanttest.dat"
+#define DT_CS       1024
+#define DT_CHUNKS   50
+
+
+static void Cleanup()
+{
+    unlink(DT_FILE);
+    unlink(DT_FILE ".mhash");
+    unlink(DT_FILE ".mbinmap");
+}
+
+
+/** Content plus the metafiles a dormant swarm needs */
+static Sha1Hash Seed()
+{
+    FILE *fp = fopen(DT_FILE,"wb");
+    char buf[DT_CS];
+    for (int c=0; c<DT_CHUNKS; c++) {
+        memset(buf,c,sizeof(buf));
+        fwrite(buf,1,sizeof(buf),fp);
+    }
+    fclose(fp);
+    int fd = swift::Open(DT_FILE,Sha1Hash::ZERO,Address(),false,true,DT_CS);
+    EXPECT_GE(fd,0);
+    Sha1Hash root = swift::RootMerkleHash(fd);
+    EXPECT_EQ(0,swift::Checkpoint(fd));
+    swift::Close(fd);
+    return root;
+}
+
+
+TEST(DormantTest, ActivateAndDeactivate) {
+    Cleanup();
+    if (Channel::evbase == NULL)
+        Channel::evbase = event_base_new();
+    Sha1Hash root = Seed();
+    ASSERT_LT(swift::Find(root),0);
+
+    DormantRegistry *dr = new DormantRegistry();
+    EXPECT_EQ(-1,dr->Add("dormanttest-missing.dat",root,DT_CS));
+    ASSERT_EQ(0,dr->Add(DT_FILE,root,DT_CS));
+    EXPECT_TRUE(dr->Has(root));
+    EXPECT_EQ(1,dr->size());
+    EXPECT_EQ(0,dr->active());
+    EXPECT_LT(swift::Find(root),0);
+    EXPECT_TRUE(dr->Activate(Sha1Hash(true,"0123456789abcdef0123456789abcdef01234567")) == NULL);
+
+    FileTransfer *ft = dr->Activate(root);
+    ASSERT_TRUE(ft != NULL);
+    EXPECT_TRUE(ft->hashtree()->is_complete());
+    EXPECT_EQ(DT_CHUNKS*DT_CS,ft->hashtree()->size());
+    EXPECT_EQ(ft->fd(),swift::Find(root));
+    EXPECT_EQ(1,dr->active());
+    EXPECT_EQ(ft,dr->Activate(root));
+
+    // idle: no channels
+    Channel::Time();
+    dr->Deactivate(TINT_SEC);
+    EXPECT_EQ(1,dr->active());
+    dr->Deactivate(0);
+    EXPECT_EQ(0,dr->active());
+    EXPECT_LT(swift::Find(root),0);
+    EXPECT_TRUE(dr->Has(root));
+
+    // pinned ones stay until the last Unpin
+    ft = dr->Activate(root,true);
+    ASSERT_TRUE(ft != NULL);
+    EXPECT_EQ(ft,dr->Activate(root,true));
+    dr->Deactivate(0);
+    EXPECT_EQ(1,dr->active());
+    dr->Unpin(root);
+    dr->Deactivate(0);
+    EXPECT_EQ(1,dr->active());
+    dr->Unpin(root);
+    dr->Deactivate(0);
+    EXPECT_EQ(0,dr->active());
+
+    // Remove closes pinned ones
+    ASSERT_TRUE(dr->Activate(root,true) != NULL);
+    dr->Remove(root);
+    EXPECT_FALSE(dr->Has(root));
+    EXPECT_EQ(0,dr->active());
+    EXPECT_LT(swift::Find(root),0);
+
+    delete dr;
+    Cleanup();
+}
+
+
+int main (int argc, char** argv) {
+
+	testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+
+}
@@ -0,0 +1,57 @@
+/*
+ *  histogramtest.cpp
+ *  Bucket math and percentiles of the latency histogram.
+ *
+ *  Copyright 2009-2012 TECHNISCHE UNIVERSITEIT DELFT. All rights reserved.
+ *
+ */
+#include <gtest/gtest.h>
+#include "histogram.h"
+
+using namespace swift;
+
+
+TEST(HistogramTest, Buckets) {
+    for (uint64_t v=0; v<100000; v++) {
+        int b = LatencyHistogram::BucketOf(v);
+        ASSERT_LE(LatencyHistogram::BucketLow(b),v);
+        ASSERT_GE(LatencyHistogram::BucketHigh(b),v);
+    }
+    // adjacent buckets tile the value space
+    for (int b=1; b<LatencyHistogram::NBUCKETS; b++)
+        EXPECT_EQ(LatencyHistogram::BucketHigh(b-1)+1,LatencyHistogram::BucketLow(b));
+    EXPECT_EQ(LatencyHistogram::NBUCKETS-1,LatencyHistogram::BucketOf(~(uint64_t)0));
+    EXPECT_EQ(~(uint64_t)0,LatencyHistogram::BucketHigh(LatencyHistogram::NBUCKETS-1));
+    // relative width at most 1/SUB_COUNT
+    int b = LatencyHistogram::BucketOf(1000000);
+    EXPECT_LE(LatencyHistogram::BucketHigh(b)-LatencyHistogram::BucketLow(b),
+              LatencyHistogram::BucketLow(b)/LatencyHistogram::SUB_COUNT);
+}
+
+
+TEST(HistogramTest, Percentiles) {
+    LatencyHistogram h;
+    EXPECT_EQ(0,h.Percentile(50));
+    h.Record(-5);
+    EXPECT_EQ(0,h.max());
+    h.Reset();
+    for (int i=1; i<=1000; i++)
+        h.Record(i);
+    EXPECT_EQ(1000,h.count());
+    EXPECT_EQ(500500,h.sum());
+    EXPECT_EQ(1000,h.max());
+    uint64_t p50 = h.Percentile(50), p99 = h.Percentile(99);
+    EXPECT_GE(p50,500);
+    EXPECT_LE(p50,500+500/LatencyHistogram::SUB_COUNT);
+    EXPECT_GE(p99,990);
+    EXPECT_LE(p99,1000);
+    EXPECT_EQ(1000,h.Percentile(100));
+}
+
+
+int main (int argc, char** argv) {
+
+	testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+
+}
@@ -0,0 +1,160 @@
+/*
+ *  livetest.cpp
+ *  Live hash trees: appending at the source, peaks and data at a leecher,
+ *  and the sliding window.
+ *
+ *  Copyright 2009-2012 TECHNISCHE UNIVERSITEIT DELFT. All rights reserved.
+ *
+ */
+#include <gtest/gtest.h>
+#include "swift.h"
+
+using namespace swift;
+
+#define LIVE_CS     1024
+
+
+static void MakeChunk(int c, char *buf)
+{
+    for (int i=0; i<LIVE_CS; i++)
+        buf[i] = (char)(c*7+i);
+}
+
+
+static Storage *EmptyStorage(const char *filename)
+{
+    FILE *fp = fopen(filename,"wb");
+    fclose(fp);
+    return new Storage(filename,".",0);
+}
+
+
+TEST(LiveTest, SourcePeaks) {
+    // Same data as a static file, written in uneven pieces
+    FILE *fp = fopen("livetest-static.dat","wb");
+    char buf[LIVE_CS];
+    std::string all;
+    for (int c=0; c<13; c++) {
+        MakeChunk(c,buf);
+        fwrite(buf,1,LIVE_CS,fp);
+        all.append(buf,LIVE_CS);
+    }
+    fclose(fp);
+    unlink("livetest-static.dat.mhash");
+    Storage *sstorage = new Storage("livetest-static.dat",".",0);
+    MmapHashTree *stat = new MmapHashTree(sstorage,Sha1Hash::ZERO,LIVE_CS,
+        "livetest-static.dat.mhash",true,true,"livetest-static.dat.mbinmap");
+
+    Storage *lstorage = EmptyStorage("livetest-source.dat");
+    MmapHashTree *live = new MmapHashTree(lstorage,Sha1Hash(true,"0123456789abcdef0123456789abcdef01234567"),LIVE_CS,1024,true);
+    EXPECT_EQ(0,live->AppendData(&all[0],LIVE_CS/2));
+    EXPECT_EQ(0,live->size_in_chunks());
+    EXPECT_EQ(3,live->AppendData(&all[LIVE_CS/2],3*LIVE_CS));
+    EXPECT_EQ(10,live->AppendData(&all[LIVE_CS/2+3*LIVE_CS],all.size()-LIVE_CS/2-3*LIVE_CS));
+    EXPECT_EQ(13,live->size_in_chunks());
+    EXPECT_TRUE(live->is_complete());
+
+    ASSERT_EQ(stat->peak_count(),live->peak_count());
+    for (int i=0; i<stat->peak_count(); i++) {
+        EXPECT_EQ(stat->peak(i),live->peak(i));
+        EXPECT_EQ(stat->peak_hash(i),live->peak_hash(i));
+    }
+    for (int c=0; c<13; c++)
+        EXPECT_EQ(stat->hash(bin_t(0,c)),live->hash(bin_t(0,c)));
+
+    delete live;
+    delete lstorage;
+    delete stat;
+    delete sstorage;
+    unlink("livetest-static.dat");
+    unlink("livetest-static.dat.mhash");
+    unlink("livetest-source.dat");
+}
+
+
+TEST(LiveTest, LeecherWindow) {
+    Sha1Hash swarmid(true,"0123456789abcdef0123456789abcdef01234567");
+    Storage *sstorage = EmptyStorage("livetest-source.dat");
+    MmapHashTree *src = new MmapHashTree(sstorage,swarmid,LIVE_CS,8,true);
+    char buf[LIVE_CS];
+    for (int c=0; c<13; c++) {
+        MakeChunk(c,buf);
+        ASSERT_EQ(1,src->AppendData(buf,LIVE_CS));
+    }
+    EXPECT_EQ(5,src->live_start());
+    EXPECT_EQ((12%8)*LIVE_CS,src->storage_offset(bin_t(0,12)));
+
+    Storage *lstorage = EmptyStorage("livetest-leech.dat");
+    MmapHashTree *leech = new MmapHashTree(lstorage,swarmid,LIVE_CS,8,false);
+    for (int i=0; i<src->peak_count(); i++)
+        EXPECT_TRUE(leech->OfferHash(src->peak(i),src->peak_hash(i)));
+    EXPECT_EQ(13,leech->size_in_chunks());
+    EXPECT_EQ(5,leech->live_start());
+    EXPECT_FALSE(leech->is_complete());
+
+    for (int c=0; c<13; c++) {
+        bin_t pos(0,c);
+        binhashes_t uncles;
+        bin_t peak = src->peak_for(pos);
+        for (bin_t p=pos; p!=peak; p=p.parent())
+            uncles.push_back(std::make_pair(p.sibling(),src->hash(p.sibling())));
+        MakeChunk(c,buf);
+        EXPECT_EQ(c>=5,leech->OfferData(pos,buf,LIVE_CS,uncles)) << "chunk " << c;
+    }
+    EXPECT_EQ(8,leech->chunks_complete());
+
+    // A bad peak is refused, a longer stream is adopted
+    EXPECT_FALSE(leech->OfferHash(src->peak(0),Sha1Hash::ZERO));
+    MakeChunk(13,buf);
+    src->AppendData(buf,LIVE_CS);
+    for (int i=0; i<src->peak_count(); i++)
+        EXPECT_TRUE(leech->OfferHash(src->peak(i),src->peak_hash(i)));
+    EXPECT_EQ(14,leech->size_in_chunks());
+    EXPECT_EQ(6,leech->live_start());
+    EXPECT_EQ(7,leech->chunks_complete());
+    EXPECT_TRUE(leech->ack_out()->is_empty(bin_t(0,5)));
+
+    delete leech;
+    delete lstorage;
+    delete src;
+    delete sstorage;
+    unlink("livetest-source.dat");
+    unlink("livetest-leech.dat");
+}
+
+
+TEST(LiveTest, SlidePrunes) {
+    Storage *storage = EmptyStorage("livetest-source.dat");
+    MmapHashTree *src = new MmapHashTree(storage,Sha1Hash::ZERO,LIVE_CS,4,true);
+    char buf[LIVE_CS];
+    for (int c=0; c<1000; c++) {
+        MakeChunk(c,buf);
+        ASSERT_EQ(1,src->AppendData(buf,LIVE_CS));
+    }
+    EXPECT_EQ(996,src->live_start());
+    EXPECT_EQ(4,src->chunks_complete());
+    EXPECT_TRUE(src->ack_out()->is_empty(bin_t(0,995)));
+    EXPECT_TRUE(src->ack_out()->is_filled(bin_t(0,999)));
+    EXPECT_LT(src->live_hash_count(),64);
+    // the window is still served with full uncle paths
+    for (int c=996; c<1000; c++) {
+        bin_t pos(0,c);
+        bin_t peak = src->peak_for(pos);
+        for (bin_t p=pos; p!=peak; p=p.parent())
+            EXPECT_NE(Sha1Hash::ZERO,src->hash(p.sibling()));
+    }
+    // and the ring file does not grow
+    EXPECT_EQ(4*LIVE_CS,file_size_by_path_utf8("livetest-source.dat"));
+
+    delete src;
+    delete storage;
+    unlink("livetest-source.dat");
+}
+
+
+int main (int argc, char** argv) {
+
+	testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+
+}
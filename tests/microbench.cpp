@@ -0,0 +1,353 @@
+/*
+ *  microbench.cpp
+ *  Microbenchmarks for the core data structures: bin_t, binmap_t set/reset
+ *  and find_complement, Availability::set, Sha1Hash and
+ *  MmapHashTree::OfferHash, binmap checkpoints (text and binary image,
+ *  save and load) and the cost of a clock read. Binmaps are filled sequentially, randomly or
+ *  fragmented (every stride-th chunk, holes across the whole range), at
+ *  sizes up to 2^32 chunks.
+ *
+ *  Output is one JSON object per line, for tracking across versions:
+ *    {"bench":..,"pattern":..,"chunks":..,"ops":..,"ns_per_op":..,
+ *     "alloc_bytes":..,"mem_bytes":..}
+ *  alloc_bytes counts operator new during the timed loop; mem_bytes is the
+ *  resulting size of the structure, where it has one (binmap cells are
+ *  realloc()ed, so they only show up there).
+ *
+ *  Usage: microbench [filter]   runs the benches whose name contains filter
+ *
+ *  Copyright 2009-2012 TECHNISCHE UNIVERSITEIT DELFT. All rights reserved.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include "swift.h"
+
+using namespace swift;
+
+#define BENCH_OPS		(1<<20)
+#define BENCH_HASH_OPS	(1<<16)
+#define BENCH_AVAIL_MAX	(1ULL<<20)	// Availability is a dense array
+#define BENCH_TREE_CHUNKS	4096
+#define BENCH_TREE_CS	1024
+
+
+static uint64_t alloc_bytes = 0;
+
+void* operator new(size_t n) {
+    alloc_bytes += n;
+    void *p = malloc(n ? n : 1);
+    if (p == NULL)
+        throw std::bad_alloc();
+    return p;
+}
+void* operator new[](size_t n) { return operator new(n); }
+void operator delete(void *p) throw() { free(p); }
+void operator delete[](void *p) throw() { free(p); }
+void operator delete(void *p, size_t n) throw() { free(p); }
+void operator delete[](void *p, size_t n) throw() { free(p); }
+
+
+static const char *filter = NULL;
+static uint64_t rng = 88172645463325252ULL;
+static volatile uint64_t sink;  // keeps results alive
+
+static uint64_t BenchRandom() {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+
+static bool Wanted(const char *name) {
+    return filter == NULL || strstr(name,filter) != NULL;
+}
+
+
+static void Report(const char *name, const char *pattern, uint64_t chunks, uint64_t ops,
+                   tint usec, uint64_t alloc, uint64_t mem)
+{
+    printf("{\"bench\":\"%s\",\"pattern\":\"%s\",\"chunks\":%llu,\"ops\":%llu,"
+           "\"ns_per_op\":%.2f,\"alloc_bytes\":%llu,\"mem_bytes\":%llu}\n",
+           name,pattern,(unsigned long long)chunks,(unsigned long long)ops,
+           ops ? usec*1000.0/ops : 0.0,(unsigned long long)alloc,(unsigned long long)mem);
+    fflush(stdout);
+}
+
+
+/** Chunk offsets to set for a pattern on a binmap of size chunks */
+static void Pattern(const char *pattern, uint64_t chunks, std::vector<uint64_t> &offs)
+{
+    uint64_t ops = std::min(chunks,(uint64_t)BENCH_OPS);
+    offs.resize(ops);
+    rng = 88172645463325252ULL;
+    uint64_t stride = std::max((uint64_t)2,chunks/ops);
+    for (uint64_t i=0; i<ops; i++) {
+        if (!strcmp(pattern,"seq"))
+            offs[i] = i;
+        else if (!strcmp(pattern,"random"))
+            offs[i] = BenchRandom() % chunks;
+        else
+            offs[i] = (i*stride) % chunks;
+    }
+}
+
+
+static void BenchBinmap(const char *pattern, uint64_t chunks)
+{
+    std::vector<uint64_t> offs;
+    Pattern(pattern,chunks,offs);
+
+    binmap_t b;
+    uint64_t a = alloc_bytes;
+    tint start = usec_time();
+    for (size_t i=0; i<offs.size(); i++)
+        b.set(bin_t(0,offs[i]));
+    tint t = usec_time()-start;
+    if (Wanted("binmap_set"))
+        Report("binmap_set",pattern,chunks,offs.size(),t,alloc_bytes-a,b.total_size());
+
+    // find_complement against a full source, as the piece picker does,
+    // with the first half of the pattern already present
+    if (Wanted("find_complement")) {
+        binmap_t dst;
+        for (size_t i=0; i<offs.size()/2; i++)
+            dst.set(bin_t(0,offs[i]));
+        binmap_t full;
+        int layer = 0;
+        while (((uint64_t)1<<layer) < chunks)
+            layer++;
+        full.set(bin_t(layer,0));
+        uint64_t ops = 0;
+        a = alloc_bytes;
+        start = usec_time();
+        for (; ops<offs.size(); ops++) {
+            bin_t f = binmap_t::find_complement(dst,full,0);
+            if (f.is_none())
+                break;
+            dst.set(bin_t(0,f.base_offset()));
+        }
+        t = usec_time()-start;
+        Report("find_complement",pattern,chunks,ops,t,alloc_bytes-a,dst.total_size());
+    }
+
+    // checkpoint the fragmented state: text (version 1) and binary image
+    if (Wanted("checkpoint")) {
+        const char *cpname = "microbench.mbinmap";
+        std::string image;
+        a = alloc_bytes;
+        start = usec_time();
+        FILE *fp = fopen(cpname,"wb");
+        b.serialize(fp);
+        fclose(fp);
+        t = usec_time()-start;
+        Report("checkpoint_text_save",pattern,chunks,b.cells_number(),t,alloc_bytes-a,file_size_by_path_utf8(cpname));
+        binmap_t c;
+        start = usec_time();
+        fp = fopen(cpname,"rb");
+        c.deserialize(fp);
+        fclose(fp);
+        t = usec_time()-start;
+        Report("checkpoint_text_load",pattern,chunks,b.cells_number(),t,0,c.total_size());
+
+        a = alloc_bytes;
+        start = usec_time();
+        image.resize(b.image_size());
+        b.write_image(&image[0]);
+        write_atomic_utf8(cpname,image.data(),image.size());
+        t = usec_time()-start;
+        Report("checkpoint_bin_save",pattern,chunks,b.cells_number(),t,alloc_bytes-a,file_size_by_path_utf8(cpname));
+        binmap_t d;
+        start = usec_time();
+        int fd = open_utf8(cpname,ROOPENFLAGS,0);
+        int64_t len = file_size(fd);
+        char *map = (char *)memory_map(fd,len,true);
+        d.read_image(map,len);
+        memory_unmap(fd,map,len);
+        close(fd);
+        t = usec_time()-start;
+        Report("checkpoint_bin_load",pattern,chunks,b.cells_number(),t,0,d.total_size());
+        unlink(cpname);
+    }
+
+    if (Wanted("binmap_reset")) {
+        a = alloc_bytes;
+        start = usec_time();
+        for (size_t i=0; i<offs.size(); i++)
+            b.reset(bin_t(0,offs[i]));
+        t = usec_time()-start;
+        Report("binmap_reset",pattern,chunks,offs.size(),t,alloc_bytes-a,b.total_size());
+    }
+}
+
+
+static void BenchAvailability(const char *pattern, uint64_t chunks)
+{
+    std::vector<uint64_t> offs;
+    Pattern(pattern,chunks,offs);
+
+    uint64_t a = alloc_bytes;
+    Availability *av = new Availability();
+    av->setSize(chunks);
+    binmap_t peers[4];
+    tint start = usec_time();
+    for (size_t i=0; i<offs.size(); i++) {
+        bin_t pos(0,offs[i]);
+        av->set(i&3,peers[i&3],pos);
+        peers[i&3].set(pos);
+    }
+    tint t = usec_time()-start;
+    Report("avail_set",pattern,chunks,offs.size(),t,alloc_bytes-a,av->size());
+    delete av;
+}
+
+
+static void BenchSha1()
+{
+    char buf[8192];
+    for (int i=0; i<sizeof(buf); i++)
+        buf[i] = (char)BenchRandom();
+    int sizes[2] = { 1024, 8192 };
+    for (int s=0; s<2; s++) {
+        uint64_t a = alloc_bytes;
+        tint start = usec_time();
+        for (int i=0; i<BENCH_HASH_OPS; i++) {
+            buf[0] = (char)i;
+            Sha1Hash h(buf,sizes[s]);
+            sink += h.bits[0];
+        }
+        tint t = usec_time()-start;
+        Report("sha1_chunk",sizes[s]==1024?"1k":"8k",1,BENCH_HASH_OPS,t,alloc_bytes-a,0);
+    }
+    Sha1Hash left(buf,20), right(buf+20,20);
+    uint64_t a = alloc_bytes;
+    tint start = usec_time();
+    for (int i=0; i<BENCH_HASH_OPS; i++) {
+        left = Sha1Hash(left,right);
+        sink += left.bits[0];
+    }
+    tint t = usec_time()-start;
+    Report("sha1_pair","pair",1,BENCH_HASH_OPS,t,alloc_bytes-a,0);
+}
+
+
+static void BenchBin()
+{
+    uint64_t a = alloc_bytes;
+    tint start = usec_time();
+    uint64_t acc = 0;
+    for (uint64_t i=0; i<BENCH_OPS; i++) {
+        bin_t b(0,BenchRandom() & 0xffffffffULL);
+        for (int l=0; l<8; l++)
+            b = b.parent();
+        acc += b.base_offset() + b.base_left().toUInt() + (b.contains(bin_t(0,i)) ? 1 : 0);
+    }
+    sink += acc;
+    tint t = usec_time()-start;
+    Report("bin_ops","random",1ULL<<32,BENCH_OPS,t,alloc_bytes-a,0);
+}
+
+
+static void BenchClock()
+{
+    tint (*clocks[2])() = { usec_time, usec_mono_time };
+    const char *names[2] = { "wall", "mono" };
+    for (int c=0; c<2; c++) {
+        tint start = usec_mono_time();
+        for (int i=0; i<BENCH_OPS; i++)
+            sink += clocks[c]();
+        tint t = usec_mono_time()-start;
+        Report("clock_read",names[c],1,BENCH_OPS,t,0,0);
+    }
+}
+
+
+/** Uncle paths offered in pattern order to a tree that only knows the root */
+static void BenchOfferHash(const char *pattern)
+{
+    const char *seedname = "microbench-seed.dat", *leechname = "microbench-leech.dat";
+    FILE *fp = fopen(seedname,"wb");
+    if (fp == NULL) {
+        perror(seedname);
+        return;
+    }
+    char buf[BENCH_TREE_CS];
+    for (int c=0; c<BENCH_TREE_CHUNKS; c++) {
+        for (int i=0; i<sizeof(buf); i++)
+            buf[i] = (char)BenchRandom();
+        fwrite(buf,1,sizeof(buf),fp);
+    }
+    fclose(fp);
+    unlink((std::string(seedname)+".mhash").c_str());
+    unlink(leechname);
+    unlink((std::string(leechname)+".mhash").c_str());
+
+    Storage *seedstorage = new Storage(seedname,".",0);
+    MmapHashTree *seed = new MmapHashTree(seedstorage,Sha1Hash::ZERO,BENCH_TREE_CS,
+        std::string(seedname)+".mhash",true,true,std::string(seedname)+".mbinmap");
+    Storage *leechstorage = new Storage(leechname,".",0);
+    MmapHashTree *leech = new MmapHashTree(leechstorage,seed->root_hash(),BENCH_TREE_CS,
+        std::string(leechname)+".mhash",true,true,std::string(leechname)+".mbinmap");
+
+    for (int p=0; p<seed->peak_count(); p++)
+        leech->OfferHash(seed->peak(p),seed->hash(seed->peak(p)));
+
+    std::vector<uint64_t> offs;
+    Pattern(pattern,BENCH_TREE_CHUNKS,offs);
+    uint64_t ops = 0;
+    uint64_t a = alloc_bytes;
+    tint start = usec_time();
+    for (size_t i=0; i<offs.size(); i++) {
+        bin_t pos(0,offs[i]);
+        bin_t peak = seed->peak_for(pos);
+        for (bin_t p=pos; p!=peak; p=p.parent()) {
+            leech->OfferHash(p.sibling(),seed->hash(p.sibling()));
+            ops++;
+        }
+        leech->OfferHash(pos,seed->hash(pos));
+        ops++;
+    }
+    tint t = usec_time()-start;
+    Report("offer_hash",pattern,BENCH_TREE_CHUNKS,ops,t,alloc_bytes-a,0);
+
+    delete leech;
+    delete leechstorage;
+    delete seed;
+    delete seedstorage;
+    unlink(seedname);
+    unlink(leechname);
+    unlink((std::string(seedname)+".mhash").c_str());
+    unlink((std::string(leechname)+".mhash").c_str());
+}
+
+
+int main (int argc, char** argv) {
+
+    filter = argc > 1 ? argv[1] : NULL;
+    LibraryInit();
+
+    const char *patterns[3] = { "seq", "random", "frag" };
+    uint64_t sizes[3] = { 1ULL<<10, 1ULL<<20, 1ULL<<32 };
+
+    if (Wanted("bin_ops"))
+        BenchBin();
+    if (Wanted("sha1"))
+        BenchSha1();
+    if (Wanted("clock_read"))
+        BenchClock();
+    for (int s=0; s<3; s++)
+        for (int p=0; p<3; p++) {
+            if (Wanted("binmap_set") || Wanted("binmap_reset") || Wanted("find_complement") ||
+                Wanted("checkpoint"))
+                BenchBinmap(patterns[p],sizes[s]);
+            if (Wanted("avail_set") && sizes[s] <= BENCH_AVAIL_MAX)
+                BenchAvailability(patterns[p],sizes[s]);
+        }
+    if (Wanted("offer_hash"))
+        for (int p=0; p<3; p++)
+            BenchOfferHash(patterns[p]);
+    return 0;
+}
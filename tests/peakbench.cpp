@@ -0,0 +1,55 @@
+/*
+ *  peakbench.cpp
+ *  microbenchmark: linear peak search vs. peak_for_length()
+ *
+ *  Copyright 2012 TECHNISCHE UNIVERSITEIT DELFT. All rights reserved.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "bin_utils.h"
+#include "compat.h"
+
+using namespace swift;
+
+#define BENCH_LOOKUPS	10000000
+
+
+static bin_t linear_peak_for(bin_t *peaks, int peak_count, bin_t pos) {
+    int pi=0;
+    while (pi<peak_count && !peaks[pi].contains(pos))
+        pi++;
+    return pi==peak_count ? bin_t(bin_t::NONE) : peaks[pi];
+}
+
+
+int main (int argc, char** argv) {
+
+    // Worst case for the scan: many peaks
+    uint64_t length = argc > 1 ? strtoull(argv[1],NULL,10) : (1ULL<<30)-1;
+    bin_t peaks[65];
+    int peak_count = gen_peaks(length,peaks);
+
+    bin_t *bins = new bin_t[BENCH_LOOKUPS];
+    srand(1);
+    for (int i=0; i<BENCH_LOOKUPS; i++)
+        bins[i] = bin_t(0,(((uint64_t)rand()<<31)|rand()) % length);
+
+    uint64_t check = 0;
+    tint start = usec_time();
+    for (int i=0; i<BENCH_LOOKUPS; i++)
+        check += linear_peak_for(peaks,peak_count,bins[i]).toUInt();
+    tint linear = usec_time()-start;
+
+    start = usec_time();
+    for (int i=0; i<BENCH_LOOKUPS; i++)
+        check -= peak_for_length(length,bins[i]).toUInt();
+    tint bits = usec_time()-start;
+
+    printf("peak_for length %llu peaks %d: linear %.2f ns/op, bits %.2f ns/op%s\n",
+           (unsigned long long)length, peak_count,
+           linear*1000.0/BENCH_LOOKUPS, bits*1000.0/BENCH_LOOKUPS,
+           check ? " MISMATCH" : "");
+    delete[] bins;
+    return check ? 1 : 0;
+}
@@ -0,0 +1,113 @@
+/*
+ *  ratelimittest.cpp
+ *  Pacing and hierarchy of the token-bucket rate limiter.
+ *
+ *  Copyright 2009-2012 TECHNISCHE UNIVERSITEIT DELFT. All rights reserved.
+ *
+ */
+#include <gtest/gtest.h>
+#include "ratelimit.h"
+#include "swift.h"
+
+using namespace swift;
+
+#define RL_FILE     "ratelimittest.dat"
+#define RL_CS       1024
+
+
+TEST(RateLimitTest, Pacing) {
+    TokenBucket b;
+    EXPECT_FALSE(b.limited());
+    b.Consume(1000000,TINT_SEC);
+    EXPECT_EQ(0,b.Delay(TINT_SEC));
+
+    // 100 KB/s, 10 KB chunks: one chunk per 100 ms once the burst is gone
+    b.SetRate(100000);
+    tint now = TINT_SEC;
+    uint64_t sent = 0;
+    while (now < 11*TINT_SEC) {
+        tint wait = b.Delay(now);
+        ASSERT_LE(wait,TokenBucket::MAX_DELAY);
+        if (wait > 0) {
+            now += wait;
+            continue;
+        }
+        b.Consume(10000,now);
+        sent += 10000;
+    }
+    EXPECT_GE(sent,990000);
+    EXPECT_LE(sent,1030000);
+}
+
+
+TEST(RateLimitTest, Hierarchy) {
+    TokenBucket process, cls(&process), transfer(&cls), channel(&transfer);
+    tint now = TINT_SEC;
+    // unlimited levels are skipped, the tightest limited one decides
+    cls.SetRate(10000);
+    channel.Consume(20000,now);
+    tint wait = channel.Delay(now);
+    EXPECT_GT(wait,TINT_SEC/2);
+    EXPECT_LE(wait,TINT_SEC);
+    // a sibling under the same class waits too
+    TokenBucket other(&cls);
+    EXPECT_EQ(wait,other.Delay(now));
+    // but not one in another class
+    TokenBucket cls2(&process), other2(&cls2);
+    EXPECT_EQ(0,other2.Delay(now));
+    process.SetRate(1000);
+    other2.Consume(5000,now);
+    EXPECT_EQ(TokenBucket::MAX_DELAY,other2.Delay(now));
+}
+
+
+/** A channel sending data, with a say in its pending ACKs */
+class PacedChannel : public Channel {
+    public:
+        PacedChannel(FileTransfer *ft) : Channel(ft) {
+            send_control_ = SLOW_START_CONTROL;
+        }
+        void AckPending(bin_t pos) {
+            act_->ack_pending_.push_back(tintbin(NOW,pos));
+        }
+};
+
+
+TEST(RateLimitTest, AcksNotPaced) {
+    if (Channel::evbase == NULL)
+        Channel::evbase = event_base_new();
+    FILE *fp = fopen(RL_FILE,"wb");
+    ASSERT_TRUE(fp != NULL);
+    char buf[RL_CS];
+    memset(buf,1,sizeof(buf));
+    for (int c=0; c<16; c++)
+        fwrite(buf,1,sizeof(buf),fp);
+    fclose(fp);
+    int fd = swift::Open(RL_FILE,Sha1Hash::ZERO,Address(),false,true,RL_CS);
+    ASSERT_GE(fd,0);
+
+    Channel::Time();
+    PacedChannel *c = new PacedChannel(FileTransfer::file(fd));
+    c->GetRateBucket(DDIR_UPLOAD)->SetRate(10000);
+    c->GetRateBucket(DDIR_UPLOAD)->Consume(100000,NOW);
+    // data waits for the deficit
+    EXPECT_GE(c->NextSendTime(),NOW+TokenBucket::MAX_DELAY);
+    // due ACKs do not
+    for (int i=0; i<Channel::ACK_AGGREGATE_MAX; i++)
+        c->AckPending(bin_t(0,i));
+    EXPECT_EQ(NOW,c->NextSendTime());
+
+    delete c;
+    swift::Close(fd);
+    unlink(RL_FILE);
+    unlink(RL_FILE ".mhash");
+    unlink(RL_FILE ".mbinmap");
+}
+
+
+int main (int argc, char** argv) {
+
+	testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+
+}
@@ -0,0 +1,139 @@
+/*
+ *  seeddirtest.cpp
+ *  Directory seeding: hashing new files on the workers, the persistent
+ *  index and rescans that only hash what changed.
+ *
+ *  Copyright 2009-2012 TECHNISCHE UNIVERSITEIT DELFT. All rights reserved.
+ *
+ */
+#include <gtest/gtest.h>
+#include "swift.h"
+#include "seeddir.h"
+
+using namespace swift;
+
+#define SD_DIR      "seeddirtest.d"   // not the binary's name
+#define SD_CS       1024
+#define SD_FILES    3
+
+
+static std::string SeedPath(int i)
+{
+    char name[32];
+    sprintf(name,"%s%sfile%d",SD_DIR,FILE_SEP,i);
+    return name;
+}
+
+
+static void WriteContent(int i, int chunks)
+{
+    FILE *fp = fopen(SeedPath(i).c_str(),"wb");
+    ASSERT_TRUE(fp != NULL);
+    char buf[SD_CS];
+    for (int c=0; c<chunks; c++) {
+        memset(buf,i*16+c,sizeof(buf));
+        fwrite(buf,1,sizeof(buf),fp);
+    }
+    fclose(fp);
+}
+
+
+static void Cleanup()
+{
+    for (int i=0; i<SD_FILES; i++) {
+        unlink(SeedPath(i).c_str());
+        unlink((SeedPath(i)+".mhash").c_str());
+        unlink((SeedPath(i)+".mbinmap").c_str());
+    }
+    unlink((std::string(SD_DIR)+FILE_SEP+DirSeeder::INDEX_FILENAME).c_str());
+    rmdir(SD_DIR);
+}
+
+
+/** Runs ticks until everything is hashed and opened */
+static void Settle(DirSeeder *ds)
+{
+    for (int i=0; i<1000 && (ds->hashing() || ds->opening()); i++) {
+        ds->Tick();
+        usleep(1000);
+    }
+}
+
+
+TEST(SeedDirTest, IndexAndRescan) {
+    Cleanup();
+    if (Channel::evbase == NULL)
+        Channel::evbase = event_base_new();
+    mkdir_utf8(SD_DIR);
+    for (int i=0; i<SD_FILES; i++)
+        WriteContent(i,10+i);
+
+    // No tracker: seeded dormant
+    DormantRegistry *dr = DormantRegistry::GetInstance();
+    DirSeeder *ds = new DirSeeder(SD_DIR,Address(),SD_CS,2);
+    ds->Scan();
+    EXPECT_EQ(SD_FILES,ds->hashing());
+    Settle(ds);
+    ASSERT_EQ(0,ds->hashing());
+    EXPECT_EQ(SD_FILES,ds->indexed());
+    Sha1Hash roots[SD_FILES];
+    for (int i=0; i<SD_FILES; i++) {
+        roots[i] = ds->Lookup("file"+std::string(1,'0'+i));
+        ASSERT_NE(Sha1Hash::ZERO,roots[i]);
+        EXPECT_TRUE(dr->Has(roots[i]));
+        EXPECT_LT(swift::Find(roots[i]),0);
+        int fd = swift::Activate(roots[i]);
+        ASSERT_GE(fd,0);
+        EXPECT_TRUE(swift::IsComplete(fd));
+        EXPECT_EQ((10+i)*SD_CS,swift::Size(fd));
+    }
+    // nothing changed
+    ds->Scan();
+    EXPECT_EQ(0,ds->hashing());
+    EXPECT_EQ(0,ds->opening());
+    delete ds;
+    for (int i=0; i<SD_FILES; i++) {
+        dr->Remove(roots[i]);
+        EXPECT_LT(swift::Find(roots[i]),0);
+    }
+
+    // restart: everything from the index, only the changed file is hashed
+    WriteContent(1,20);
+    int64_t size, mtime;
+    ASSERT_EQ(0,file_stat_utf8(SeedPath(1),&size,&mtime));
+    ds = new DirSeeder(SD_DIR,Address(),SD_CS,2);
+    EXPECT_EQ(SD_FILES,ds->indexed());
+    EXPECT_EQ(roots[0],ds->Lookup("file0"));
+    ds->Scan();
+    EXPECT_EQ(1,ds->hashing());
+    EXPECT_EQ(SD_FILES-1,ds->opening());
+    Settle(ds);
+    EXPECT_NE(roots[1],ds->Lookup("file1"));
+    EXPECT_TRUE(dr->Has(roots[0]));
+    EXPECT_FALSE(dr->Has(roots[1]));
+    int fd = swift::Activate(ds->Lookup("file1"));
+    ASSERT_GE(fd,0);
+    EXPECT_EQ(20*SD_CS,swift::Size(fd));
+
+    // gone from disk
+    unlink(SeedPath(2).c_str());
+    ds->Scan();
+    EXPECT_EQ(SD_FILES-1,ds->indexed());
+    EXPECT_FALSE(dr->Has(roots[2]));
+    dr->Remove(roots[0]);
+    dr->Remove(ds->Lookup("file1"));
+    delete ds;
+
+    for (int i=0; i<FileTransfer::files.size(); i++)
+        if (FileTransfer::files[i] != NULL)
+            swift::Close(i);
+    Cleanup();
+}
+
+
+int main (int argc, char** argv) {
+
+	testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+
+}
@@ -0,0 +1,419 @@
+/*
+ *  swarmsim.cpp
+ *  In-process swarm simulator and throughput benchmark. One seeder and N
+ *  leechers run in this process, each with its own socket and transfer
+ *  (FileTransfer::SetSocket), talking over a simulated network instead of
+ *  UDP (Channel::sendto_hook). Every peer has an uplink with bandwidth,
+ *  latency, jitter (which also reorders) and loss. All random draws come
+ *  from per-peer generators seeded from the command line, so runs with the
+ *  same seed see the same network; timers are still libevent's real clock.
+ *
+ *  Scenarios:
+ *    star    all leechers start at once from the seeder
+ *    flash   leechers arrive spread over SIM_FLASH_WINDOW
+ *    churn   like star, but every SIM_CHURN_INTERVAL a random unfinished
+ *            leecher leaves and comes back SIM_CHURN_DOWNTIME later
+ *    live    the seeder is a live source producing size-kb at SIM_LIVE_RATE,
+ *            leechers are done when they have its last chunk
+ *    idle    like star, then all peers stay connected for SIM_IDLE_LINGER
+ *            doing nothing; reports channel memory before and after
+ *
+ *  Reports completion times, goodput and CPU time per byte delivered; for
+ *  live, the delay of the last chunk at each leecher.
+ *
+ *  Usage: swarmsim [star|flash|churn|live|idle [leechers [seed [size-kb]]]]
+ *
+ *  Copyright 2009-2012 TECHNISCHE UNIVERSITEIT DELFT. All rights reserved.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include "swift.h"
+
+using namespace swift;
+
+#define SIM_SEEDER_BW		(4*1024*1024.0)	// uplink, bytes/s
+#define SIM_LEECHER_BW		(1024*1024.0)
+#define SIM_LATENCY			(20*TINT_MSEC)	// one way
+#define SIM_JITTER			(5*TINT_MSEC)
+#define SIM_LOSS			0.005
+#define SIM_MAX_QUEUE		(250*TINT_MSEC)	// uplink tail drop
+#define SIM_FLASH_WINDOW	(2*TINT_SEC)
+#define SIM_CHURN_INTERVAL	(2*TINT_SEC)
+#define SIM_CHURN_DOWNTIME	(TINT_SEC)
+#define SIM_TIMEOUT			(120*TINT_SEC)
+#define SIM_CHECK_INTERVAL	(50*TINT_MSEC)
+#define SIM_LIVE_RATE		(64*1024.0)		// bytes/s from the live source
+#define SIM_LIVE_TICK		(100*TINT_MSEC)
+#define SIM_IDLE_LINGER		(Channel::IDLE_TIMEOUT+Channel::MAX_SEND_INTERVAL)
+
+
+struct simpkt_t {
+    int         dst;
+    Address     src;
+    std::string data;
+    struct event *ev;
+};
+
+struct simnode_t {
+    evutil_socket_t sock;
+    Address     addr;
+    double      bw;
+    tint        busy_until;
+    uint64_t    rng;
+    std::deque<simpkt_t *> inbox;
+    std::string filename;
+    int         fd;
+    tint        start, done;
+    int         leaves;
+};
+
+std::vector<simnode_t> nodes;   // 0 = seeder
+std::map<evutil_socket_t,int> nodebysock;
+std::map<uint16_t,int> nodebyport;
+Sha1Hash roothash;
+uint64_t size;
+std::string scenario;
+uint64_t dgrams, lost, dropped;
+tint simstart;
+struct event evcheck, evchurn, evlive;
+uint64_t livesent;
+tint liveend, idlestart;
+
+
+double SimRandom(simnode_t &n)
+{
+    // xorshift64*, one stream per node
+    n.rng ^= n.rng >> 12;
+    n.rng ^= n.rng << 25;
+    n.rng ^= n.rng >> 27;
+    return (double)((n.rng * 2685821657736338717ULL) >> 11) / (double)(1ULL<<53);
+}
+
+
+void SimDeliverCallback(int fd, short event, void *arg)
+{
+    simpkt_t *p = (simpkt_t *)arg;
+    event_free(p->ev);
+    p->ev = NULL;
+    nodes[p->dst].inbox.push_back(p);
+    Channel::RecvDatagram(nodes[p->dst].sock);
+}
+
+
+int SimSendTo(evutil_socket_t sock, const Address& addr, const char *buf, int len)
+{
+    dgrams++;
+    std::map<evutil_socket_t,int>::iterator si = nodebysock.find(sock);
+    std::map<uint16_t,int>::iterator di = nodebyport.find(addr.port());
+    if (si == nodebysock.end() || di == nodebyport.end())
+        return len;
+    simnode_t &n = nodes[si->second];
+
+    if (SimRandom(n) < SIM_LOSS) {
+        lost++;
+        return len;
+    }
+    tint now = usec_time();
+    tint depart = std::max(now,n.busy_until);
+    if (depart-now > SIM_MAX_QUEUE) {
+        dropped++;
+        return len;
+    }
+    depart += (tint)(len*TINT_SEC/n.bw);
+    n.busy_until = depart;
+    tint arrive = depart + SIM_LATENCY + (tint)(SimRandom(n)*SIM_JITTER);
+
+    simpkt_t *p = new simpkt_t;
+    p->dst = di->second;
+    p->src = n.addr;
+    p->data.assign(buf,len);
+    p->ev = event_new(Channel::evbase,-1,0,SimDeliverCallback,p);
+    evtimer_add(p->ev,tint2tv(arrive-now));
+    return len;
+}
+
+
+int SimRecvFrom(evutil_socket_t sock, Address& addr, char *buf, int len)
+{
+    simnode_t &n = nodes[nodebysock[sock]];
+    if (n.inbox.empty())
+        return -1;
+    simpkt_t *p = n.inbox.front();
+    n.inbox.pop_front();
+    int r = std::min(len,(int)p->data.size());
+    memcpy(buf,p->data.data(),r);
+    addr = p->src;
+    delete p;
+    return r;
+}
+
+
+void SimStartLeecher(int i)
+{
+    simnode_t &n = nodes[i];
+    // After churn, resume from the checkpoint instead of rehashing
+    if (scenario == "live")
+        n.fd = swift::LiveOpen(n.filename,roothash);
+    else
+        n.fd = swift::Open(n.filename,roothash,Address(),n.leaves == 0);
+    if (n.fd < 0) {
+        fprintf(stderr,"swarmsim: cannot open %s\n",n.filename.c_str());
+        exit(1);
+    }
+    FileTransfer *ft = FileTransfer::file(n.fd);
+    ft->SetSocket(n.sock);
+    ft->SetTracker(nodes[0].addr);
+    ft->ConnectToTracker();
+}
+
+
+void SimJoinCallback(int fd, short event, void *arg)
+{
+    SimStartLeecher((int)(intptr_t)arg);
+}
+
+
+void SimChurnCallback(int fd, short event, void *arg)
+{
+    std::vector<int> up;
+    for (int i=1; i<nodes.size(); i++)
+        if (nodes[i].fd >= 0 && nodes[i].done == 0)
+            up.push_back(i);
+    if (up.empty())
+        return;
+    int i = up[(int)(SimRandom(nodes[0])*up.size())];
+    swift::Checkpoint(nodes[i].fd);
+    swift::Close(nodes[i].fd);
+    nodes[i].fd = -1;
+    nodes[i].leaves++;
+    event_base_once(Channel::evbase,-1,EV_TIMEOUT,SimJoinCallback,(void *)(intptr_t)i,
+                    tint2tv(SIM_CHURN_DOWNTIME));
+    evtimer_add(&evchurn,tint2tv(SIM_CHURN_INTERVAL));
+}
+
+
+void SimLiveCallback(int fd, short event, void *arg)
+{
+    char buf[(int)(SIM_LIVE_RATE*SIM_LIVE_TICK/TINT_SEC)];
+    int len = (int)std::min((uint64_t)sizeof(buf),size-livesent);
+    for (int i=0; i<len; i++)
+        buf[i] = (char)(SimRandom(nodes[0])*256);
+    if (swift::LiveWrite(nodes[0].fd,buf,len) < 0) {
+        fprintf(stderr,"swarmsim: live write failed\n");
+        exit(1);
+    }
+    livesent += len;
+    if (livesent < size)
+        evtimer_add(&evlive,tint2tv(SIM_LIVE_TICK));
+    else
+        liveend = usec_time();
+}
+
+
+void SimReportMemory(const char *when)
+{
+    size_t mem = 0;
+    int count = 0, light = 0;
+    for (int i=0; i<nodes.size(); i++) {
+        if (nodes[i].fd < 0)
+            continue;
+        const channels_t &cs = FileTransfer::file(nodes[i].fd)->GetChannels();
+        for (int j=0; j<cs.size(); j++) {
+            mem += cs[j]->memory_usage();
+            count++;
+            if (cs[j]->is_lightweight())
+                light++;
+        }
+    }
+    printf("channels %s: %d, %d lightweight, %llu bytes, %llu per channel\n",when,count,light,
+           (unsigned long long)mem,(unsigned long long)(count ? mem/count : 0));
+}
+
+
+bool SimDone(simnode_t &n)
+{
+    if (n.fd < 0)
+        return false;
+    if (scenario != "live")
+        return swift::Complete(n.fd) == size;
+    return liveend != 0 && FileTransfer::file(n.fd)->hashtree()->ack_out()->is_filled(
+        bin_t(0,size/SWIFT_DEFAULT_CHUNK_SIZE-1));
+}
+
+
+void SimCheckCallback(int fd, short event, void *arg)
+{
+    tint now = usec_time();
+    bool alldone = true;
+    for (int i=1; i<nodes.size(); i++) {
+        simnode_t &n = nodes[i];
+        if (n.done == 0 && SimDone(n))
+            n.done = now;
+        if (n.done == 0)
+            alldone = false;
+    }
+    if (alldone && scenario == "idle" && idlestart == 0) {
+        idlestart = now;
+        SimReportMemory("done");
+    }
+    if (idlestart != 0 && now-idlestart > SIM_IDLE_LINGER) {
+        SimReportMemory("idle");
+        event_base_loopexit(Channel::evbase,NULL);
+    }
+    else if ((alldone && idlestart == 0) || now-simstart > SIM_TIMEOUT)
+        event_base_loopexit(Channel::evbase,NULL);
+    else
+        evtimer_add(&evcheck,tint2tv(SIM_CHECK_INTERVAL));
+}
+
+
+void SimWriteContent(const char *filename, uint64_t size, simnode_t &n)
+{
+    FILE *fp = fopen(filename,"wb");
+    if (fp == NULL) {
+        perror(filename);
+        exit(1);
+    }
+    char buf[4096];
+    for (uint64_t off=0; off<size; off+=sizeof(buf)) {
+        for (int i=0; i<sizeof(buf); i++)
+            buf[i] = (char)(SimRandom(n)*256);
+        fwrite(buf,1,std::min((uint64_t)sizeof(buf),size-off),fp);
+    }
+    fclose(fp);
+}
+
+
+void SimUnlink(std::string filename)
+{
+    unlink(filename.c_str());
+    unlink((filename+".mhash").c_str());
+    unlink((filename+".mbinmap").c_str());
+}
+
+
+int main (int argc, char** argv) {
+
+    scenario = argc > 1 ? argv[1] : "star";
+    int leechers = argc > 2 ? atoi(argv[2]) : 8;
+    uint32_t seed = argc > 3 ? strtoul(argv[3],NULL,10) : 1;
+    size = argc > 4 ? strtoull(argv[4],NULL,10)*1024 : 2*1024*1024;
+    if ((scenario != "star" && scenario != "flash" && scenario != "churn" && scenario != "live"
+        && scenario != "idle")
+        || leechers < 1 || leechers+1 > DGRAM_MAX_SOCK_OPEN) {
+        fprintf(stderr,"Usage: %s [star|flash|churn|live|idle [leechers [seed [size-kb]]]]\n",argv[0]);
+        return 1;
+    }
+    if (scenario == "live") // whole chunks only, a partial one is held back
+        size = std::max((uint64_t)1,size/SWIFT_DEFAULT_CHUNK_SIZE)*SWIFT_DEFAULT_CHUNK_SIZE;
+
+    LibraryInit();
+    Channel::evbase = event_base_new();
+    Channel::SELF_CONN_OK = true; // all channel ids live in one table here
+    Channel::sendto_hook = SimSendTo;
+    Channel::recvfrom_hook = SimRecvFrom;
+
+    nodes.resize(leechers+1);
+    for (int i=0; i<nodes.size(); i++) {
+        simnode_t &n = nodes[i];
+        n.sock = Channel::Bind(Address("127.0.0.1",0));
+        if (n.sock == INVALID_SOCKET)
+            return 1;
+        n.addr = Address("127.0.0.1",Channel::BoundAddress(n.sock).port());
+        n.bw = i ? SIM_LEECHER_BW : SIM_SEEDER_BW;
+        n.busy_until = 0;
+        n.rng = ((uint64_t)seed << 32) + i*0x9E3779B97F4A7C15ULL + 1;
+        char name[64];
+        sprintf(name,"swarmsim-%d.dat",i);
+        n.filename = name;
+        n.fd = -1;
+        n.start = n.done = 0;
+        n.leaves = 0;
+        nodebysock[n.sock] = i;
+        nodebyport[n.addr.port()] = i;
+        SimUnlink(n.filename);
+    }
+
+    if (scenario == "live") {
+        roothash = Sha1Hash("swarmsim live",13);
+        nodes[0].fd = swift::LiveCreate(nodes[0].filename,roothash);
+    } else {
+        SimWriteContent(nodes[0].filename.c_str(),size,nodes[0]);
+        nodes[0].fd = swift::Open(nodes[0].filename);
+    }
+    if (nodes[0].fd < 0)
+        return 1;
+    FileTransfer::file(nodes[0].fd)->SetSocket(nodes[0].sock);
+    roothash = swift::RootMerkleHash(nodes[0].fd);
+
+    simstart = usec_time();
+    clock_t cpustart = clock();
+    for (int i=1; i<nodes.size(); i++) {
+        tint delay = scenario == "flash" ? (tint)(SimRandom(nodes[0])*SIM_FLASH_WINDOW) : 0;
+        nodes[i].start = simstart + delay;
+        event_base_once(Channel::evbase,-1,EV_TIMEOUT,SimJoinCallback,(void *)(intptr_t)i,
+                        tint2tv(delay));
+    }
+    evtimer_assign(&evcheck,Channel::evbase,SimCheckCallback,NULL);
+    evtimer_add(&evcheck,tint2tv(SIM_CHECK_INTERVAL));
+    if (scenario == "churn") {
+        evtimer_assign(&evchurn,Channel::evbase,SimChurnCallback,NULL);
+        evtimer_add(&evchurn,tint2tv(SIM_CHURN_INTERVAL));
+    }
+    if (scenario == "live") {
+        evtimer_assign(&evlive,Channel::evbase,SimLiveCallback,NULL);
+        evtimer_add(&evlive,tint2tv(0));
+    }
+
+    event_base_dispatch(Channel::evbase);
+
+    double cpu = (double)(clock()-cpustart)/CLOCKS_PER_SEC;
+    tint last = 0;
+    std::vector<tint> times;
+    int unfinished = 0;
+    printf("scenario %s leechers %d seed %u size %llu\n",scenario.c_str(),leechers,seed,
+           (unsigned long long)size);
+    for (int i=1; i<nodes.size(); i++) {
+        simnode_t &n = nodes[i];
+        if (n.done == 0) {
+            printf("leecher %d: unfinished, left %d times\n",i,n.leaves);
+            unfinished++;
+            continue;
+        }
+        if (scenario == "live") {
+            times.push_back(n.done-liveend);
+            printf("leecher %d: last chunk after %.3f s\n",i,(double)(n.done-liveend)/TINT_SEC);
+            continue;
+        }
+        times.push_back(n.done-n.start);
+        last = std::max(last,n.done);
+        printf("leecher %d: %.3f s, left %d times\n",i,(double)(n.done-n.start)/TINT_SEC,n.leaves);
+    }
+    if (!times.empty() && scenario == "live") {
+        std::sort(times.begin(),times.end());
+        printf("live delay s: min %.3f median %.3f max %.3f\n",(double)times.front()/TINT_SEC,
+               (double)times[times.size()/2]/TINT_SEC,(double)times.back()/TINT_SEC);
+        printf("cpu: %.3f s\n",cpu);
+    }
+    else if (!times.empty()) {
+        std::sort(times.begin(),times.end());
+        double bytes = (double)size*times.size();
+        printf("completion s: min %.3f median %.3f max %.3f\n",(double)times.front()/TINT_SEC,
+               (double)times[times.size()/2]/TINT_SEC,(double)times.back()/TINT_SEC);
+        printf("goodput: %.1f KB/s\n",bytes/1024/((double)(last-simstart)/TINT_SEC));
+        printf("cpu: %.3f s, %.1f ns/byte\n",cpu,cpu*1e9/bytes);
+    }
+    printf("network: %llu dgrams, %llu lost, %llu queue drops\n",(unsigned long long)dgrams,
+           (unsigned long long)lost,(unsigned long long)dropped);
+
+    for (int i=0; i<nodes.size(); i++) {
+        if (nodes[i].fd >= 0)
+            swift::Close(nodes[i].fd);
+        SimUnlink(nodes[i].filename);
+    }
+    return unfinished ? 2 : 0;
+}
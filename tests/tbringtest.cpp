@@ -0,0 +1,61 @@
+/*
+ *  tbringtest.cpp
+ *  Inline ring queue used for the per-channel tintbin queues.
+ *
+ *  Copyright 2009-2012 TECHNISCHE UNIVERSITEIT DELFT. All rights reserved.
+ *
+ */
+#include <gtest/gtest.h>
+#include "swift.h"
+
+using namespace swift;
+
+
+TEST(TbRingTest, Fifo) {
+    tbring<4> q;
+    EXPECT_TRUE(q.empty());
+    for (int r=0; r<10; r++) {  // wraps around the inline buffer
+        for (int i=0; i<3; i++)
+            q.push_back(tintbin(r*3+i,bin_t(0,r*3+i)));
+        for (int i=0; i<3; i++) {
+            EXPECT_EQ(r*3+i,q.front().time);
+            q.pop_front();
+        }
+    }
+    EXPECT_TRUE(q.empty());
+    EXPECT_EQ(0,q.heap_bytes());
+}
+
+
+TEST(TbRingTest, GrowAndShrink) {
+    tbring<2> q;
+    q.push_back(tintbin(1,bin_t(0,1)));
+    q.push_front(tintbin(0,bin_t(0,0)));
+    EXPECT_EQ(0,q.heap_bytes());
+    for (int i=2; i<100; i++)
+        q.push_back(tintbin(i,bin_t(0,i)));
+    EXPECT_EQ(100,q.size());
+    EXPECT_LT(0,q.heap_bytes());
+    for (int i=0; i<100; i++)
+        EXPECT_EQ(i,q[i].time);
+    EXPECT_EQ(99,q.back().time);
+
+    q.erase(50);
+    EXPECT_EQ(99,q.size());
+    EXPECT_EQ(49,q[49].time);
+    EXPECT_EQ(51,q[50].time);
+    q.pop_back();
+    EXPECT_EQ(98,q.back().time);
+
+    while (!q.empty())
+        q.pop_front();
+    EXPECT_EQ(0,q.heap_bytes());  // back to the inline buffer
+}
+
+
+int main (int argc, char** argv) {
+
+	testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+
+}
@@ -0,0 +1,78 @@
+/*
+ *  tracetest.cpp
+ *  Binary trace ring: recording, wraparound and dump file layout.
+ *
+ *  Copyright 2009-2012 TECHNISCHE UNIVERSITEIT DELFT. All rights reserved.
+ *
+ */
+#include <gtest/gtest.h>
+#include <stdio.h>
+#include "trace.h"
+
+using namespace swift;
+
+
+static void ReadDump(const char *path, trace_file_hdr_t *hdr, std::vector<trace_rec_t> &recs)
+{
+    FILE *fp = fopen(path,"rb");
+    ASSERT_TRUE(fp != NULL);
+    ASSERT_EQ(1,fread(hdr,sizeof(*hdr),1,fp));
+    recs.resize(hdr->count);
+    if (hdr->count > 0)
+        ASSERT_EQ(hdr->count,fread(&recs[0],sizeof(trace_rec_t),hdr->count,fp));
+    fclose(fp);
+}
+
+
+TEST(TraceTest, Dump) {
+    TraceRing::Clear();
+    for (int i=0; i<10; i++)
+        TraceRing::Record(TRACE_DATA_OUT,1000+i,7,i,-i,1);
+    ASSERT_EQ(10,TraceRing::Dump("tracetest.dump",1000));
+
+    trace_file_hdr_t hdr;
+    std::vector<trace_rec_t> recs;
+    ReadDump("tracetest.dump",&hdr,recs);
+    EXPECT_STREQ(TRACE_FILE_MAGIC,hdr.magic);
+    EXPECT_EQ(sizeof(trace_rec_t),hdr.recsize);
+    EXPECT_EQ(0,hdr.lost);
+    EXPECT_EQ(1000,hdr.epoch);
+    for (int i=0; i<10; i++) {
+        EXPECT_EQ(1000+i,recs[i].time);
+        EXPECT_EQ(i,recs[i].bin);
+        EXPECT_EQ(-i,recs[i].value);
+        EXPECT_EQ(TRACE_DATA_OUT,recs[i].event);
+    }
+    remove("tracetest.dump");
+}
+
+
+TEST(TraceTest, Wraparound) {
+    TraceRing::Clear();
+    uint64_t n = TraceRing::SIZE + 100;
+    for (uint64_t i=0; i<n; i++)
+        TraceRing::Record(TRACE_SEND,i,1,i);
+    ASSERT_EQ(TraceRing::SIZE,TraceRing::Dump("tracetest.dump",0));
+
+    trace_file_hdr_t hdr;
+    std::vector<trace_rec_t> recs;
+    ReadDump("tracetest.dump",&hdr,recs);
+    EXPECT_EQ(100,hdr.lost);
+    // oldest first, contiguous
+    for (uint64_t i=0; i<hdr.count; i++)
+        ASSERT_EQ(100+i,recs[i].bin);
+    remove("tracetest.dump");
+
+    TraceRing::enabled = false;
+    TraceRing::Record(TRACE_SEND,0,1,0);
+    EXPECT_EQ(n,TraceRing::recorded());
+    TraceRing::enabled = true;
+}
+
+
+int main (int argc, char** argv) {
+
+	testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+
+}
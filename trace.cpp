@@ -0,0 +1,51 @@
+/*
+ *  trace.cpp
+ *  Binary event trace ring, see trace.h.
+ *
+ *  Copyright 2009-2012 TECHNISCHE UNIVERSITEIT DELFT. All rights reserved.
+ *
+ */
+#include "trace.h"
+#include <stdio.h>
+#include <string.h>
+
+using namespace swift;
+
+const uint32_t TraceRing::SIZE;
+bool TraceRing::enabled = true;
+trace_rec_t TraceRing::ring_[TraceRing::SIZE];
+uint64_t TraceRing::head_ = 0;
+
+
+int64_t TraceRing::Dump(const char *path, tint epoch)
+{
+    FILE *fp = fopen(path,"wb");
+    if (fp == NULL) {
+        print_error("trace: cannot open dump file");
+        return -1;
+    }
+    trace_file_hdr_t hdr;
+    memset(&hdr,0,sizeof(hdr));
+    strncpy(hdr.magic,TRACE_FILE_MAGIC,sizeof(hdr.magic));
+    hdr.version = TRACE_FILE_VERSION;
+    hdr.recsize = sizeof(trace_rec_t);
+    hdr.count = head_ < SIZE ? head_ : SIZE;
+    hdr.lost = head_ - hdr.count;
+    hdr.epoch = epoch;
+
+    // Oldest first: the ring wraps at head_
+    uint32_t start = (uint32_t)(hdr.lost & (SIZE-1));
+    uint32_t first = hdr.count < SIZE ? hdr.count : SIZE - start;
+    bool ok = fwrite(&hdr,sizeof(hdr),1,fp) == 1;
+    if (ok && first > 0)
+        ok = fwrite(&ring_[start],sizeof(trace_rec_t),first,fp) == first;
+    if (ok && hdr.count > first)
+        ok = fwrite(&ring_[0],sizeof(trace_rec_t),hdr.count-first,fp) == hdr.count-first;
+    if (fclose(fp) != 0)
+        ok = false;
+    if (!ok) {
+        print_error("trace: cannot write dump file");
+        return -1;
+    }
+    return hdr.count;
+}
@@ -0,0 +1,99 @@
+/*
+ *  trace.h
+ *  Binary event trace: a fixed ring of typed records filled from the hot
+ *  paths, dumped on demand (cmdgw TRACEDUMP) and decoded offline with
+ *  tracedecode. Unlike dprintf it formats nothing at record time, so it
+ *  stays enabled in release builds.
+ *
+ *  All protocol work happens on the libevent thread, so there is one ring
+ *  and no locking.
+ *
+ *  Copyright 2009-2012 TECHNISCHE UNIVERSITEIT DELFT. All rights reserved.
+ *
+ */
+#ifndef SWIFT_TRACE_H
+#define SWIFT_TRACE_H
+
+#include "compat.h"
+
+namespace swift {
+
+
+typedef enum {
+    TRACE_NONE = 0,
+    TRACE_SEND,         // datagram sent, bin=data chunk, value=bytes
+    TRACE_RECV,         // datagram received, value=bytes
+    TRACE_HINT_DEQUEUE, // bin=chunk to send, aux=1 if retransmit
+    TRACE_DATA_OUT,     // bin=chunk, aux=1 if retransmit
+    TRACE_DATA_IN,      // bin=chunk, aux=1 if hash check passed
+    TRACE_HAVE_OUT,     // bin=range announced
+    TRACE_ACK_IN,       // bin=range acked, value=rtt usec
+    TRACE_RESCHEDULE,   // value=usec till next send (-1 never), aux=send control
+    TRACE_EVENT_COUNT
+} trace_event_t;
+
+struct trace_rec_t {
+    int64_t     time;
+    uint64_t    bin;
+    uint32_t    channel;
+    int32_t     value;
+    uint16_t    event;
+    uint16_t    aux;
+    uint32_t    pad;
+};
+
+#define TRACE_FILE_MAGIC    "SWTRACE"
+#define TRACE_FILE_VERSION  1
+
+/** Dump file: this header, then count trace_rec_t oldest first, both in
+ *  host byte order. */
+struct trace_file_hdr_t {
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    recsize;
+    uint64_t    count;
+    uint64_t    lost;   // records overwritten before the dump
+    int64_t     epoch;  // Channel::epoch, for tintstr-style times
+};
+
+
+class TraceRing
+{
+    public:
+        static const int BITS = 16;
+        static const uint32_t SIZE = 1<<BITS;
+
+        static void Record(trace_event_t ev, tint time, uint32_t channel, uint64_t bin, int64_t value=0, uint16_t aux=0) {
+            if (!enabled)
+                return;
+            trace_rec_t &r = ring_[head_ & (SIZE-1)];
+            r.time = time;
+            r.bin = bin;
+            r.channel = channel;
+            r.value = value > INT32_MAX ? INT32_MAX : (value < INT32_MIN ? INT32_MIN : (int32_t)value);
+            r.event = ev;
+            r.aux = aux;
+            head_++;
+        }
+
+        /** Writes the ring to path, returns number of records or -1 */
+        static int64_t Dump(const char *path, tint epoch);
+        static void Clear() { head_ = 0; }
+        static uint64_t recorded() { return head_; }
+        static const char *EventName(int ev) {
+            static const char *names[TRACE_EVENT_COUNT] = {
+                "NONE", "SEND", "RECV", "DEQUEUE", "DATA_OUT", "DATA_IN",
+                "HAVE_OUT", "ACK_IN", "RESCHED" };
+            return ev >= 0 && ev < TRACE_EVENT_COUNT ? names[ev] : "?";
+        }
+
+        static bool enabled;
+
+    protected:
+        static trace_rec_t ring_[SIZE];
+        static uint64_t head_;
+};
+
+}
+
+#endif
@@ -0,0 +1,77 @@
+/*
+ *  tracedecode.cpp
+ *  Prints a binary trace dump (cmdgw TRACEDUMP) as text, one record per
+ *  line, in the same time format as the dprintf debug log.
+ *
+ *  Usage: tracedecode dumpfile [channel]
+ *
+ *  Copyright 2009-2012 TECHNISCHE UNIVERSITEIT DELFT. All rights reserved.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bin.h"
+#include "trace.h"
+
+using namespace swift;
+
+
+static const char *timestr(int64_t t, int64_t epoch)
+{
+    static char ret[32];
+    t -= epoch;
+    if (t < 0)
+        t = 0;
+    int hours = t/TINT_HOUR;
+    t %= TINT_HOUR;
+    int mins = t/TINT_MIN;
+    t %= TINT_MIN;
+    int secs = t/TINT_SEC;
+    t %= TINT_SEC;
+    sprintf(ret,"%i_%02i_%02i_%03i_%03i",hours,mins,secs,(int)(t/TINT_MSEC),(int)(t%TINT_MSEC));
+    return ret;
+}
+
+
+int main (int argc, char** argv) {
+
+    if (argc < 2) {
+        fprintf(stderr,"Usage: %s dumpfile [channel]\n",argv[0]);
+        return 1;
+    }
+    FILE *fp = fopen(argv[1],"rb");
+    if (fp == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+    bool filter = argc > 2;
+    uint32_t onlych = filter ? strtoul(argv[2],NULL,10) : 0;
+
+    trace_file_hdr_t hdr;
+    if (fread(&hdr,sizeof(hdr),1,fp) != 1 || strncmp(hdr.magic,TRACE_FILE_MAGIC,sizeof(hdr.magic))) {
+        fprintf(stderr,"%s: not a trace dump\n",argv[1]);
+        return 1;
+    }
+    if (hdr.version != TRACE_FILE_VERSION || hdr.recsize != sizeof(trace_rec_t)) {
+        fprintf(stderr,"%s: unsupported version %u recsize %u\n",argv[1],hdr.version,hdr.recsize);
+        return 1;
+    }
+    printf("# %llu records, %llu lost\n",(unsigned long long)hdr.count,(unsigned long long)hdr.lost);
+
+    trace_rec_t r;
+    char binstr[32];
+    for (uint64_t i=0; i<hdr.count; i++) {
+        if (fread(&r,sizeof(r),1,fp) != 1) {
+            fprintf(stderr,"%s: truncated at record %llu\n",argv[1],(unsigned long long)i);
+            return 1;
+        }
+        if (filter && r.channel != onlych)
+            continue;
+        bin_t b(r.bin);
+        printf("%s #%u %s %s %d %u\n",timestr(r.time,hdr.epoch),r.channel,
+               TraceRing::EventName(r.event),b.str(binstr),r.value,r.aux);
+    }
+    fclose(fp);
+    return 0;
+}
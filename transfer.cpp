@@ -14,10 +14,13 @@
 
 #include "ext/seq_picker.cpp" // FIXME FIXME FIXME FIXME
 #include "ext/vod_picker.cpp"
+#include "ext/live_picker.cpp"
 
 using namespace swift;
 
 std::vector<FileTransfer*> FileTransfer::files(20);
+TokenBucket FileTransfer::process_rate_bucket_[2];
+std::map<int,TokenBucket> FileTransfer::class_rate_buckets_[2];
 
 #define BINHASHSIZE (sizeof(bin64_t)+sizeof(Sha1Hash))
 
@@ -26,16 +29,20 @@ std::vector<FileTransfer*> FileTransfer::files(20);
 #define TRACKER_RETRY_INTERVAL_EXP		1.1				// exponent used to increase INTERVAL_START
 #define TRACKER_RETRY_INTERVAL_MAX		(1800*TINT_SEC) // 30 minutes
 
+#define HAVE_LOG_MAX					4096	// completion events kept for HAVEs
+
 // FIXME: separate Bootstrap() and Download(), then Size(), Progress(), SeqProgress()
 
-FileTransfer::FileTransfer(std::string filename, const Sha1Hash& root_hash, bool force_check_diskvshash, bool check_netwvshash, uint32_t chunk_size, bool zerostate) :
+FileTransfer::FileTransfer(std::string filename, const Sha1Hash& root_hash, bool force_check_diskvshash, bool check_netwvshash, uint32_t chunk_size, bool zerostate, uint64_t live_window, bool live_source) :
 	Operational(), fd_(files.size()+1), cb_installed(0), mychannels_(),
+    numseeders_(0), numseeders_peaks_(0),
     speedzerocount_(0), tracker_(), tracker_retry_interval_(TRACKER_RETRY_INTERVAL_START),
-    tracker_retry_time_(NOW), zerostate_(zerostate)
+    tracker_retry_time_(NOW), socket_(INVALID_SOCKET), zerostate_(zerostate), have_log_(), have_log_start_(0)
 {
     if (files.size()<fd()+1)
         files.resize(fd()+1);
     files[fd()] = this;
+    availability_ = NULL;
 
     std::string destdir;
 	int ret = file_exists_utf8(filename);
@@ -49,6 +56,14 @@ FileTransfer::FileTransfer(std::string filename, const Sha1Hash& root_hash, bool
 			destdir = ".";
 	}
 
+	// LIVE: the data file is a ring, start from an empty one, which also
+	// makes Storage treat it as a single file
+	if (live_window > 0) {
+		FILE *fp = fopen_utf8(filename.c_str(),"wb");
+		if (fp != NULL)
+			fclose(fp);
+	}
+
 	// MULTIFILE
     storage_ = new Storage(filename,destdir,fd());
 
@@ -60,7 +75,13 @@ FileTransfer::FileTransfer(std::string filename, const Sha1Hash& root_hash, bool
 	binmap_filename.assign(filename);
 	binmap_filename.append(".mbinmap");
 
-	if (!zerostate_)
+	if (live_window > 0)
+	{
+		hashtree_ = (HashTree *)new MmapHashTree(storage_,root_hash,chunk_size,live_window,live_source);
+		picker_ = new LivePiecePicker(this);
+		picker_->Randomize(rand()&63);
+	}
+	else if (!zerostate_)
 	{
 		hashtree_ = (HashTree *)new MmapHashTree(storage_,root_hash,chunk_size,hash_filename,force_check_diskvshash,check_netwvshash,binmap_filename);
 
@@ -83,8 +104,7 @@ FileTransfer::FileTransfer(std::string filename, const Sha1Hash& root_hash, bool
     init_time_ = Channel::Time();
     cur_speed_[DDIR_UPLOAD] = MovingAverageSpeed();
     cur_speed_[DDIR_DOWNLOAD] = MovingAverageSpeed();
-    max_speed_[DDIR_UPLOAD] = DBL_MAX;
-    max_speed_[DDIR_DOWNLOAD] = DBL_MAX;
+    SetRateClass(0);
 
     // SAFECLOSE
     evtimer_assign(&evclean_,Channel::evbase,&FileTransfer::LibeventCleanCallback,this);
@@ -168,9 +188,9 @@ void FileTransfer::ConnectToTracker()
 
 	Channel *c = NULL;
     if (tracker_ != Address())
-    	c = new Channel(this,INVALID_SOCKET,tracker_);
+    	c = new Channel(this,socket_,tracker_);
     else if (Channel::tracker!=Address())
-    	c = new Channel(this);
+    	c = new Channel(this,socket_);
 }
 
 
@@ -229,6 +249,29 @@ void swift::ExternallyRetrieved (int transfer,bin_t piece) {
     if (!trans)
         return;
     trans->ack_out()->set(piece); // that easy
+    trans->OnDataIn(piece);
+}
+
+
+void FileTransfer::OnDataIn (bin_t pos) {
+    have_log_.push_back(pos);
+    if (have_log_.size() > HAVE_LOG_MAX) {
+        // Drop oldest half, lagging channels rescan
+        have_log_.erase(have_log_.begin(),have_log_.begin()+HAVE_LOG_MAX/2);
+        have_log_start_ += HAVE_LOG_MAX/2;
+    }
+    // LIVE: peers idling in keep-alive should hear of it now
+    if (IsLive())
+        for (channels_t::iterator i=mychannels_.begin(); i!=mychannels_.end(); i++)
+            if (*i != NULL)
+                (*i)->Wake();
+}
+
+
+bin_t FileTransfer::RevealAck (uint64_t& offset) {
+    if (offset < have_log_start_ || offset >= reveal_end())
+        return bin_t::NONE;
+    return have_log_[offset++ - have_log_start_];
 }
 
 
@@ -243,8 +286,12 @@ void swift::RemoveProgressCallback (int transfer, ProgressCallback cb) {
     //fprintf(stderr,"swift::RemoveProgressCallback: transfer %i ft obj %p %p\n", transfer, trans, cb );
 
     for(int i=0; i<trans->cb_installed; i++)
-        if (trans->callbacks[i]==cb)
-            trans->callbacks[i]=trans->callbacks[--trans->cb_installed];
+        if (trans->callbacks[i]==cb) {
+            trans->cb_installed--;
+            trans->callbacks[i]=trans->callbacks[trans->cb_installed];
+            trans->cb_agg[i]=trans->cb_agg[trans->cb_installed];
+            i--;
+        }
 
     for(int i=0; i<trans->cb_installed; i++)
     {
@@ -270,11 +317,17 @@ FileTransfer::~FileTransfer ()
 }
 
 
-FileTransfer* FileTransfer::Find (const Sha1Hash& root_hash) {
+FileTransfer* FileTransfer::Find (const Sha1Hash& root_hash, evutil_socket_t sock) {
+    // SOCKMGMT: prefer the transfer bound to sock, then an unbound one
+    FileTransfer *unbound = NULL;
     for(int i=0; i<files.size(); i++)
-        if (files[i] && files[i]->root_hash()==root_hash)
-            return files[i];
-    return NULL;
+        if (files[i] && files[i]->root_hash()==root_hash) {
+            if (sock==INVALID_SOCKET || files[i]->socket_==sock)
+                return files[i];
+            if (unbound==NULL && files[i]->socket_==INVALID_SOCKET)
+                unbound = files[i];
+        }
+    return unbound;
 }
 
 
@@ -286,6 +339,23 @@ int swift:: Find (Sha1Hash hash) {
 }
 
 
+int swift:: Activate (Sha1Hash hash) {
+    DormantRegistry *dr = DormantRegistry::GetInstance();
+    if (!dr->Has(hash))
+        return swift::Find(hash);
+    FileTransfer* t = dr->Activate(hash,true);
+    if (t)
+        return t->fd();
+    dr->Unpin(hash);
+    return -1;
+}
+
+
+void swift:: Release (Sha1Hash hash) {
+    DormantRegistry::GetInstance()->Unpin(hash);
+}
+
+
 
 bool FileTransfer::OnPexAddIn (const Address& addr) {
 
@@ -300,7 +370,7 @@ bool FileTransfer::OnPexAddIn (const Address& addr) {
     	// Arno, 2012-02-27: Check if already connected to this peer.
 		Channel *c = FindChannel(addr,NULL);
 		if (c == NULL)
-			new Channel(this,Channel::default_socket(),addr);
+			new Channel(this,socket_,addr);
 		else
 			return false;
     }
@@ -367,7 +437,7 @@ double		FileTransfer::GetCurrentSpeed(data_direction_t ddir)
 
 void		FileTransfer::SetMaxSpeed(data_direction_t ddir, double m)
 {
-	max_speed_[ddir] = m;
+	rate_bucket_[ddir].SetRate(m);
 	// Arno, 2012-01-04: Be optimistic, forget history.
 	cur_speed_[ddir].Reset();
 }
@@ -375,41 +445,54 @@ void		FileTransfer::SetMaxSpeed(data_direction_t ddir, double m)
 
 double		FileTransfer::GetMaxSpeed(data_direction_t ddir)
 {
-	return max_speed_[ddir];
+	return rate_bucket_[ddir].rate();
+}
+
+
+void		FileTransfer::SetRateClass(int cls)
+{
+	rate_class_ = cls;
+	rate_bucket_[DDIR_UPLOAD].SetParent(GetClassRateBucket(cls,DDIR_UPLOAD));
+	rate_bucket_[DDIR_DOWNLOAD].SetParent(GetClassRateBucket(cls,DDIR_DOWNLOAD));
+}
+
+
+TokenBucket* FileTransfer::GetClassRateBucket(int cls, data_direction_t ddir)
+{
+	// std::map nodes don't move, so transfers can keep pointers to them
+	std::map<int,TokenBucket>::iterator iter = class_rate_buckets_[ddir].find(cls);
+	if (iter == class_rate_buckets_[ddir].end())
+		iter = class_rate_buckets_[ddir].insert(std::make_pair(cls,TokenBucket(&process_rate_bucket_[ddir]))).first;
+	return &iter->second;
 }
 
 
 uint32_t	FileTransfer::GetNumLeechers()
 {
-	uint32_t count = 0;
-	channels_t::iterator iter;
-    for (iter=mychannels_.begin(); iter!=mychannels_.end(); iter++)
-    {
-	    Channel *c = *iter;
-	    if (c != NULL)
-		    if (!c->IsComplete()) // incomplete?
-			    count++;
-    }
-    return count;
+    return mychannels_.size() - GetNumSeeders();
 }
 
 
 uint32_t	FileTransfer::GetNumSeeders()
 {
-	uint32_t count = 0;
-	channels_t::iterator iter;
-    for (iter=mychannels_.begin(); iter!=mychannels_.end(); iter++)
+    if (hashtree()->peak_count() != numseeders_peaks_)
     {
-	    Channel *c = *iter;
-	    if (c != NULL)
-		    if (c->IsComplete()) // complete?
-			    count++;
+        // Peaks came in (or changed), peers' completeness may have too
+        numseeders_ = 0;
+        channels_t::iterator iter;
+        for (iter=mychannels_.begin(); iter!=mychannels_.end(); iter++)
+        {
+            Channel *c = *iter;
+            if (c->RecountPeerComplete())
+                numseeders_++;
+        }
+        numseeders_peaks_ = hashtree()->peak_count();
     }
-    return count;
+    return numseeders_;
 }
 
 
 void FileTransfer::AddPeer(Address &peer)
 {
-	Channel *c = new Channel(this,INVALID_SOCKET,peer);
+	Channel *c = new Channel(this,socket_,peer);
 }
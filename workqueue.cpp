@@ -0,0 +1,174 @@
+/*
+ *  workqueue.cpp
+ *  Worker threads for blocking disk work, see workqueue.h.
+ *
+ *  Copyright 2009-2012 TECHNISCHE UNIVERSITEIT DELFT. All rights reserved.
+ *
+ */
+#include "workqueue.h"
+
+using namespace swift;
+
+#ifndef _WIN32
+pthread_key_t  WorkQueue::worker_key_;
+pthread_once_t WorkQueue::worker_once_ = PTHREAD_ONCE_INIT;
+#endif
+
+
+WorkQueue::WorkQueue(work_t work, int nthreads) : work_(work), outstanding_(0)
+{
+#ifndef _WIN32
+    stop_ = false;
+    pthread_once(&worker_once_,MakeKey);
+    pthread_mutex_init(&lock_,NULL);
+    pthread_cond_init(&work_cond_,NULL);
+    pthread_cond_init(&done_cond_,NULL);
+    for (int i=0; i<nthreads; i++) {
+        pthread_t t;
+        if (pthread_create(&t,NULL,Worker,this) != 0) {
+            print_error("workqueue: cannot start worker");
+            break;
+        }
+        threads_.push_back(t);
+    }
+#endif
+}
+
+
+WorkQueue::~WorkQueue()
+{
+    Finish();
+#ifndef _WIN32
+    pthread_cond_destroy(&done_cond_);
+    pthread_cond_destroy(&work_cond_);
+    pthread_mutex_destroy(&lock_);
+#endif
+}
+
+
+#ifndef _WIN32
+void WorkQueue::MakeKey()
+{
+    pthread_key_create(&worker_key_,NULL);
+}
+
+
+void *WorkQueue::Worker(void *arg)
+{
+    WorkQueue *wq = (WorkQueue *)arg;
+    pthread_setspecific(worker_key_,wq);
+    pthread_mutex_lock(&wq->lock_);
+    while (true) {
+        while (wq->queue_.empty() && !wq->stop_)
+            pthread_cond_wait(&wq->work_cond_,&wq->lock_);
+        if (wq->queue_.empty())
+            break;
+        void *item = wq->queue_.front();
+        wq->queue_.pop_front();
+        pthread_mutex_unlock(&wq->lock_);
+
+        wq->work_(item);
+
+        pthread_mutex_lock(&wq->lock_);
+        wq->done_.push_back(item);
+        pthread_cond_broadcast(&wq->done_cond_);
+    }
+    pthread_mutex_unlock(&wq->lock_);
+    return NULL;
+}
+#endif
+
+
+bool WorkQueue::InWorker()
+{
+#ifndef _WIN32
+    pthread_once(&worker_once_,MakeKey);
+    return pthread_getspecific(worker_key_) != NULL;
+#else
+    return false;
+#endif
+}
+
+
+void WorkQueue::Push(void *item)
+{
+    outstanding_++;
+#ifndef _WIN32
+    pthread_mutex_lock(&lock_);
+    if (!threads_.empty()) {
+        queue_.push_back(item);
+        pthread_cond_signal(&work_cond_);
+        pthread_mutex_unlock(&lock_);
+        return;
+    }
+    pthread_mutex_unlock(&lock_);
+#endif
+    work_(item);
+#ifndef _WIN32
+    pthread_mutex_lock(&lock_);
+#endif
+    done_.push_back(item);
+#ifndef _WIN32
+    pthread_mutex_unlock(&lock_);
+#endif
+}
+
+
+void *WorkQueue::Pop()
+{
+    void *item = NULL;
+#ifndef _WIN32
+    pthread_mutex_lock(&lock_);
+#endif
+    if (!done_.empty()) {
+        item = done_.front();
+        done_.pop_front();
+        outstanding_--;
+    }
+#ifndef _WIN32
+    pthread_mutex_unlock(&lock_);
+#endif
+    return item;
+}
+
+
+void *WorkQueue::WaitPop()
+{
+    if (outstanding_ == 0)
+        return NULL;
+#ifndef _WIN32
+    pthread_mutex_lock(&lock_);
+    while (done_.empty())
+        pthread_cond_wait(&done_cond_,&lock_);
+    pthread_mutex_unlock(&lock_);
+#endif
+    return Pop();
+}
+
+
+void WorkQueue::Cancel(std::deque<void *> &items)
+{
+#ifndef _WIN32
+    pthread_mutex_lock(&lock_);
+    items.insert(items.end(),queue_.begin(),queue_.end());
+    outstanding_ -= queue_.size();
+    queue_.clear();
+    pthread_mutex_unlock(&lock_);
+#endif
+}
+
+
+void WorkQueue::Finish()
+{
+#ifndef _WIN32
+    if (threads_.empty())
+        return;
+    pthread_mutex_lock(&lock_);
+    stop_ = true;
+    pthread_cond_broadcast(&work_cond_);
+    pthread_mutex_unlock(&lock_);
+    for (int i=0; i<threads_.size(); i++)
+        pthread_join(threads_[i],NULL);
+    threads_.clear();
+#endif
+}
@@ -0,0 +1,77 @@
+/*
+ *  workqueue.h
+ *  Worker threads for blocking disk work: checkpoint writes, hashing new
+ *  content. Items are handed to the workers with Push() and come back
+ *  through Pop() on the event loop thread, so whoever owns the items only
+ *  touches transfers from the loop. Work must not read NOW or log through
+ *  dprintf/tintstr(), dprintf is muted on workers. Win32 has no workers,
+ *  Push() does the work right away.
+ *
+ *  Copyright 2009-2012 TECHNISCHE UNIVERSITEIT DELFT. All rights reserved.
+ *
+ */
+#ifndef SWIFT_WORKQUEUE_H
+#define SWIFT_WORKQUEUE_H
+
+#include "compat.h"
+#include <deque>
+#include <vector>
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+namespace swift {
+
+
+class WorkQueue
+{
+    public:
+        typedef void (*work_t)(void *item);
+
+        WorkQueue(work_t work, int nthreads=1);
+        /** Finishes queued items. Items not popped are dropped, not freed. */
+        ~WorkQueue();
+
+        void Push(void *item);
+        /** A finished item, NULL if none */
+        void *Pop();
+        /** Waits for a finished item, NULL if nothing is outstanding */
+        void *WaitPop();
+        /** Takes back the items no worker has started on */
+        void Cancel(std::deque<void *> &items);
+        /** Finishes queued items and stops the workers. Finished items
+         *  can still be popped, new ones are done by Push() itself. */
+        void Finish();
+
+        /** Items pushed and not popped yet */
+        size_t outstanding() const { return outstanding_; }
+        int threads() const { return threads_.size(); }
+
+        /** Whether the calling thread is a worker */
+        static bool InWorker();
+
+    protected:
+        work_t              work_;
+        size_t              outstanding_;   // loop thread only
+        std::deque<void *>  queue_;
+        std::deque<void *>  done_;
+#ifndef _WIN32
+        static void *Worker(void *arg);
+        static void MakeKey();
+
+        static pthread_key_t    worker_key_;
+        static pthread_once_t   worker_once_;
+
+        bool                stop_;
+        pthread_mutex_t     lock_;
+        pthread_cond_t      work_cond_;
+        pthread_cond_t      done_cond_;
+        std::vector<pthread_t> threads_;
+#else
+        std::vector<int>    threads_;
+#endif
+};
+
+}
+
+#endif
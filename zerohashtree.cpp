@@ -167,10 +167,9 @@ const Sha1Hash& ZeroHashTree::hash (bin_t pos) const
 
 bin_t         ZeroHashTree::peak_for (bin_t pos) const
 {
-    int pi=0;
-    while (pi<peak_count_ && !peaks_[pi].contains(pos))
-        pi++;
-    return pi==peak_count_ ? bin_t(bin_t::NONE) : peaks_[pi];
+    if (!peak_count_)
+        return bin_t::NONE;
+    return peak_for_length(sizec_,pos);
 }
 
 bool            ZeroHashTree::OfferHash (bin_t pos, const Sha1Hash& hash)
@@ -185,6 +184,12 @@ bool            ZeroHashTree::OfferData (bin_t pos, const char* data, size_t len
 }
 
 
+int             ZeroHashTree::AppendData (char* data, int length)
+{
+	return -1;
+}
+
+
 uint64_t      ZeroHashTree::seq_complete (int64_t offset)
 {
 	fprintf(stderr,"ZeroHashTree: seq_complete returns %llu\n", size_ ); 